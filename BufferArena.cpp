@@ -0,0 +1,100 @@
+#include "BufferArena.h"
+
+#include <cstdlib>
+
+static const size_t kHostAlignment = 64;
+
+static void* AllocateBuffer(const BufferLocation location, const size_t bytes)
+{
+	void* ptr = NULL;
+	if (location == BUFFER_DEVICE) {
+		if (cudaMalloc(&ptr, bytes) != cudaSuccess) {
+			ptr = NULL;
+		}
+	}
+	else {
+		// aligned_alloc needs a multiple of the alignment
+		ptr = std::aligned_alloc(kHostAlignment, (bytes + kHostAlignment - 1) / kHostAlignment * kHostAlignment);
+	}
+	return ptr;
+}
+
+static void FreeBuffer(const BufferLocation location, void* ptr)
+{
+	if (location == BUFFER_DEVICE) {
+		cudaFree(ptr);
+	}
+	else {
+		std::free(ptr);
+	}
+}
+
+BufferArena& BufferArena::Instance()
+{
+	static BufferArena arena;
+	return arena;
+}
+
+BufferArena::~BufferArena()
+{
+	Trim();
+}
+
+void* BufferArena::Acquire(const BufferLocation location, const size_t bytes)
+{
+	if (bytes == 0) {
+		return NULL;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = free_lists[location].find(bytes);
+		if (it != free_lists[location].end()) {
+			void* ptr = it->second;
+			free_lists[location].erase(it);
+			pooled_bytes[location] -= bytes;
+			MemoryAdd(MEMORY_POOLED, location, -(long long)bytes);
+			return ptr;
+		}
+	}
+
+	void* ptr = AllocateBuffer(location, bytes);
+	if (ptr == NULL) {
+		// Retry once with the pool emptied
+		Trim();
+		ptr = AllocateBuffer(location, bytes);
+	}
+	if (ptr == NULL) {
+		std::cout << "BufferArena: failed to allocate " << bytes << " bytes on the " << (location == BUFFER_DEVICE ? "device" : "host") << std::endl;
+	}
+	return ptr;
+}
+
+void BufferArena::Release(const BufferLocation location, void* ptr, const size_t bytes)
+{
+	if (ptr == NULL) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(mutex);
+	free_lists[location].insert(std::make_pair(bytes, ptr));
+	pooled_bytes[location] += bytes;
+	MemoryAdd(MEMORY_POOLED, location, (long long)bytes);
+}
+
+void BufferArena::Trim()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	for (int location = 0; location < 2; ++location) {
+		for (auto& entry : free_lists[location]) {
+			FreeBuffer((BufferLocation)location, entry.second);
+		}
+		free_lists[location].clear();
+		MemoryAdd(MEMORY_POOLED, (BufferLocation)location, -(long long)pooled_bytes[location]);
+		pooled_bytes[location] = 0;
+	}
+}
+
+size_t BufferArena::PooledBytes(const BufferLocation location)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return pooled_bytes[location];
+}
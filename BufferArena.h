@@ -0,0 +1,78 @@
+#ifndef _BUFFER_ARENA_H_
+#define _BUFFER_ARENA_H_
+
+#include "main.h"
+#include "MemoryAccounting.h"
+
+#include <mutex>
+
+// Process-wide pool of host and device buffers. Released buffers are kept on
+// a free list keyed by their exact byte size, so successive problems at the
+// same resolution reuse them instead of reallocating. Trim() frees everything
+// pooled, e.g. when the pipeline moves to another scale. Pooled bytes are
+// charged to MEMORY_POOLED.
+class BufferArena {
+public:
+    static BufferArena &Instance();
+
+    void *Acquire(const BufferLocation location, const size_t bytes);
+    void Release(const BufferLocation location, void *ptr, const size_t bytes);
+    void Trim();
+    size_t PooledBytes(const BufferLocation location);
+
+private:
+    BufferArena() {}
+    ~BufferArena();
+
+    std::mutex mutex;
+    std::multimap<size_t, void *> free_lists[2];
+    size_t pooled_bytes[2] = { 0, 0 };
+};
+
+// Owning handle to count elements of T from the arena, charged to subsystem
+// while held. The buffer goes back to the pool when the handle is reset,
+// reallocated or destroyed. Converts to T* so it can be passed to kernels and
+// cudaMemcpy directly.
+template <typename T>
+class PooledBuffer {
+public:
+    explicit PooledBuffer(const BufferLocation _location = BUFFER_DEVICE, const MemorySubsystem _subsystem = MEMORY_OTHER) : ptr(NULL), count(0), location(_location), subsystem(_subsystem) {}
+    ~PooledBuffer() { Reset(); }
+    PooledBuffer(const PooledBuffer &) = delete;
+    PooledBuffer &operator=(const PooledBuffer &) = delete;
+
+    T *Allocate(const size_t _count)
+    {
+        if (ptr != NULL && count == _count) {
+            return ptr;
+        }
+        Reset();
+        ptr = (T *)BufferArena::Instance().Acquire(location, sizeof(T) * _count);
+        count = ptr != NULL ? _count : 0;
+        MemoryAdd(subsystem, location, (long long)(sizeof(T) * count));
+        return ptr;
+    }
+
+    void Reset()
+    {
+        if (ptr != NULL) {
+            // Uncharge first; the arena charges MEMORY_POOLED and samples the peaks
+            MemoryAdd(subsystem, location, -(long long)(sizeof(T) * count));
+            BufferArena::Instance().Release(location, ptr, sizeof(T) * count);
+        }
+        ptr = NULL;
+        count = 0;
+    }
+
+    T *get() const { return ptr; }
+    size_t size() const { return count; }
+    operator T *() const { return ptr; }
+
+private:
+    T *ptr;
+    size_t count;
+    BufferLocation location;
+    MemorySubsystem subsystem;
+};
+
+#endif // _BUFFER_ARENA_H_
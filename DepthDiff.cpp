@@ -0,0 +1,101 @@
+#include "DepthDiff.h"
+
+int DiffViewFolder(const std::string& old_folder, const std::string& new_folder, const DepthDiffOptions& options, DepthDiffStats& stats)
+{
+	cv::Mat_<float> old_depth, new_depth;
+	if (readDepthDmb(old_folder + "/" + options.depth_file, old_depth) != 0 || readDepthDmb(new_folder + "/" + options.depth_file, new_depth) != 0) {
+		return -1;
+	}
+	if (old_depth.size() != new_depth.size()) {
+		std::cout << "Depth sizes differ: " << old_folder << " " << old_depth.cols << "x" << old_depth.rows << ", " << new_folder << " " << new_depth.cols << "x" << new_depth.rows << std::endl;
+		return -1;
+	}
+
+	// Octahedral normal files are decoded on read, so both trees may use different encodings
+	cv::Mat_<cv::Vec3f> old_normals, new_normals;
+	const bool compare_normals = !options.normal_file.empty();
+	if (compare_normals) {
+		if (readNormalDmb(old_folder + "/" + options.normal_file, old_normals) != 0 || readNormalDmb(new_folder + "/" + options.normal_file, new_normals) != 0) {
+			return -1;
+		}
+		if (old_normals.size() != old_depth.size() || new_normals.size() != old_depth.size()) {
+			std::cout << "Normal and depth sizes differ in " << old_folder << " or " << new_folder << std::endl;
+			return -1;
+		}
+		stats.angle_histogram.assign(DEPTH_DIFF_ANGLE_BINS, 0);
+	}
+
+	stats.pixels = (long long)old_depth.rows * old_depth.cols;
+	for (int r = 0; r < old_depth.rows; ++r) {
+		for (int c = 0; c < old_depth.cols; ++c) {
+			const float d_old = old_depth(r, c);
+			const float d_new = new_depth(r, c);
+			const bool old_valid = d_old > 0.0f;
+			const bool new_valid = d_new > 0.0f;
+			stats.old_valid += old_valid;
+			stats.new_valid += new_valid;
+			stats.valid_agree += old_valid == new_valid;
+			if (!old_valid || !new_valid) {
+				continue;
+			}
+			++stats.both_valid;
+
+			const float abs_error = fabsf(d_new - d_old);
+			const float rel_error = abs_error / d_old;
+			stats.sum_abs_error += abs_error;
+			stats.sum_rel_error += rel_error;
+			stats.max_abs_error = std::max(stats.max_abs_error, abs_error);
+			stats.max_rel_error = std::max(stats.max_rel_error, rel_error);
+			stats.above_tolerance += rel_error > options.relative_tolerance;
+
+			if (compare_normals) {
+				// Same angle as the fusion normal test
+				const float angle = GetAngle(old_normals(r, c), new_normals(r, c)) * 180.0f / M_PI;
+				stats.sum_angle += angle;
+				++stats.normal_pixels;
+				const int bin = std::max(0, std::min(DEPTH_DIFF_ANGLE_BINS - 1, (int)(angle * DEPTH_DIFF_ANGLE_BINS_PER_DEGREE)));
+				++stats.angle_histogram[bin];
+			}
+		}
+	}
+	return 0;
+}
+
+void MergeDepthDiff(DepthDiffStats& total, const DepthDiffStats& stats)
+{
+	total.pixels += stats.pixels;
+	total.old_valid += stats.old_valid;
+	total.new_valid += stats.new_valid;
+	total.both_valid += stats.both_valid;
+	total.valid_agree += stats.valid_agree;
+	total.above_tolerance += stats.above_tolerance;
+	total.sum_abs_error += stats.sum_abs_error;
+	total.sum_rel_error += stats.sum_rel_error;
+	total.max_abs_error = std::max(total.max_abs_error, stats.max_abs_error);
+	total.max_rel_error = std::max(total.max_rel_error, stats.max_rel_error);
+	total.normal_pixels += stats.normal_pixels;
+	total.sum_angle += stats.sum_angle;
+	if (!stats.angle_histogram.empty()) {
+		total.angle_histogram.resize(DEPTH_DIFF_ANGLE_BINS, 0);
+		for (int i = 0; i < DEPTH_DIFF_ANGLE_BINS; ++i) {
+			total.angle_histogram[i] += stats.angle_histogram[i];
+		}
+	}
+}
+
+float DepthDiffAnglePercentile(const DepthDiffStats& stats, const float p)
+{
+	if (stats.normal_pixels == 0) {
+		return 0.0f;
+	}
+	const long long rank = std::max(1LL, (long long)ceil(p * stats.normal_pixels));
+	long long count = 0;
+	for (int i = 0; i < DEPTH_DIFF_ANGLE_BINS; ++i) {
+		count += stats.angle_histogram[i];
+		if (count >= rank) {
+			// Upper edge of the bin, so the percentile never understates the error
+			return std::min(180.0f, (float)(i + 1) / DEPTH_DIFF_ANGLE_BINS_PER_DEGREE);
+		}
+	}
+	return 180.0f;
+}
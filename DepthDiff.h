@@ -0,0 +1,41 @@
+#ifndef _DEPTH_DIFF_H_
+#define _DEPTH_DIFF_H_
+
+#include "HPM.h"
+
+// Normal angle histogram resolution; the last bin holds 180 degrees
+#define DEPTH_DIFF_ANGLE_BINS_PER_DEGREE 100
+#define DEPTH_DIFF_ANGLE_BINS (180 * DEPTH_DIFF_ANGLE_BINS_PER_DEGREE + 1)
+
+struct DepthDiffOptions {
+    std::string depth_file = "depths_geom.dmb";
+    std::string normal_file = "normals.dmb"; // float or octahedral, empty to skip normals
+    float relative_tolerance = 0.01f;        // per-pixel |new - old| / old counted as above tolerance
+};
+
+// Error statistics of one view, or summed over views. Depth and normal
+// errors cover pixels valid (depth > 0) in both maps.
+struct DepthDiffStats {
+    long long pixels = 0;
+    long long old_valid = 0;
+    long long new_valid = 0;
+    long long both_valid = 0;
+    long long valid_agree = 0; // valid in both or in neither
+    long long above_tolerance = 0;
+    double sum_abs_error = 0.0;
+    double sum_rel_error = 0.0;
+    float max_abs_error = 0.0f;
+    float max_rel_error = 0.0f;
+    long long normal_pixels = 0;
+    double sum_angle = 0.0;
+    std::vector<long long> angle_histogram; // DEPTH_DIFF_ANGLE_BINS bins, empty without normals
+};
+
+// Compares the maps of one view folder (2333_xxxxxxxx). Returns -1 if a file
+// is missing or the sizes differ.
+int DiffViewFolder(const std::string &old_folder, const std::string &new_folder, const DepthDiffOptions &options, DepthDiffStats &stats);
+void MergeDepthDiff(DepthDiffStats &total, const DepthDiffStats &stats);
+// Normal angle in degrees below which a fraction p of the compared normals lie
+float DepthDiffAnglePercentile(const DepthDiffStats &stats, const float p);
+
+#endif // _DEPTH_DIFF_H_
@@ -0,0 +1,48 @@
+#include "GeomConsistency.h"
+
+// Candidates moved through one phase together so the reprojections vectorize;
+// only the depth lookups between the phases are scattered
+#define GEOM_CONSISTENCY_BATCH 64
+
+// The kernels read the depth texture at ((int)x + 0.5, (int)y + 0.5), i.e. the
+// texel that truncation selects, with clamped addressing
+static float GeomDepthTexel(const cv::Mat_<float>& depth, const float x, const float y)
+{
+	const int col = (int)fminf(fmaxf(x, 0.0f), (float)(depth.cols - 1));
+	const int row = (int)fminf(fmaxf(y, 0.0f), (float)(depth.rows - 1));
+	return depth(row, col);
+}
+
+void ComputeInverseViewPairHomographies(const std::vector<Camera>& cameras, std::vector<ViewPairHomography>& pairs)
+{
+	pairs.resize(cameras.size());
+	for (size_t i = 0; i < cameras.size(); ++i) {
+		ComputeViewPairHomography(cameras[i], cameras[0], pairs[i]);
+	}
+}
+
+void ComputeGeomConsistencyCostsHost(const cv::Mat_<float>& src_depth, const ViewPairHomography& forward, const ViewPairHomography& backward, const int2* pixels, const float4* planes, const int num_candidates, float* costs)
+{
+	const int num_batches = (num_candidates + GEOM_CONSISTENCY_BATCH - 1) / GEOM_CONSISTENCY_BATCH;
+#pragma omp parallel for schedule(static)
+	for (int b = 0; b < num_batches; ++b) {
+		const int first = b * GEOM_CONSISTENCY_BATCH;
+		const int count = std::min(GEOM_CONSISTENCY_BATCH, num_candidates - first);
+		float2 src_pts[GEOM_CONSISTENCY_BATCH];
+		float src_depths[GEOM_CONSISTENCY_BATCH];
+
+#pragma omp simd
+		for (int k = 0; k < count; ++k) {
+			const int2 p = pixels[first + k];
+			const float depth = GeomPlaneDepth(forward, planes[first + k], p.x, p.y);
+			src_pts[k] = GeomReprojectPixel(forward, p.x, p.y, depth);
+		}
+		for (int k = 0; k < count; ++k) {
+			src_depths[k] = GeomDepthTexel(src_depth, src_pts[k].x, src_pts[k].y);
+		}
+#pragma omp simd
+		for (int k = 0; k < count; ++k) {
+			costs[first + k] = GeomBackwardCost(backward, pixels[first + k], src_pts[k], src_depths[k]);
+		}
+	}
+}
@@ -0,0 +1,66 @@
+#ifndef _GEOM_CONSISTENCY_H_
+#define _GEOM_CONSISTENCY_H_
+
+#include "HPM.h"
+
+#include <cmath>
+
+// Geometric consistency cost of the geometric passes: the reference pixel p
+// at the depth of a plane is moved into a source view, lifted with the source
+// depth found there and moved back; the cost is the distance to p in pixels,
+// capped at GEOM_CONSISTENCY_MAX_COST, which is also the cost when the source
+// has no depth. Both moves use the pair terms of ViewPairHomography, since a
+// pixel (x, y) at depth d lands at d A (x, y, 1)^T + b: forward is the
+// reference-to-source pair, backward the source-to-reference pair.
+#define GEOM_CONSISTENCY_MAX_COST 3.0f
+
+// Depth of the plane at pixel (x, y) of the pair's first view
+__host__ __device__ inline float GeomPlaneDepth(const ViewPairHomography &pair, const float4 plane_hypothesis, const float x, const float y)
+{
+    const float ray_x = x * pair.ref_K_inv[0] - pair.ref_K_inv[2];
+    const float ray_y = y * pair.ref_K_inv[1] - pair.ref_K_inv[3];
+    return -plane_hypothesis.w / (plane_hypothesis.x * ray_x + plane_hypothesis.y * ray_y + plane_hypothesis.z);
+}
+
+// Pixel (x, y) at depth of the pair's first view in its second view
+__host__ __device__ inline float2 GeomReprojectPixel(const ViewPairHomography &pair, const float x, const float y, const float depth)
+{
+    const float u = depth * (pair.A[0] * x + pair.A[1] * y + pair.A[2]) + pair.b[0];
+    const float v = depth * (pair.A[3] * x + pair.A[4] * y + pair.A[5]) + pair.b[1];
+    const float w = depth * (pair.A[6] * x + pair.A[7] * y + pair.A[8]) + pair.b[2];
+    return make_float2(u / w, v / w);
+}
+
+// Reprojection error of p once the source pixel src_pt with src_depth is moved back
+__host__ __device__ inline float GeomBackwardCost(const ViewPairHomography &backward, const int2 p, const float2 src_pt, const float src_depth)
+{
+    if (src_depth == 0.0f) {
+        return GEOM_CONSISTENCY_MAX_COST;
+    }
+    const float2 backward_point = GeomReprojectPixel(backward, src_pt.x, src_pt.y, src_depth);
+    const float diff_col = p.x - backward_point.x;
+    const float diff_row = p.y - backward_point.y;
+    return fminf(GEOM_CONSISTENCY_MAX_COST, sqrtf(diff_col * diff_col + diff_row * diff_row));
+}
+
+// Cost of one candidate; depth_at(x, y) reads the source depth map at the
+// texel holding the projected point
+#ifdef __CUDACC__
+#pragma nv_exec_check_disable
+#endif
+template <typename DepthAt>
+__host__ __device__ inline float GeomConsistencyCost(const ViewPairHomography &forward, const ViewPairHomography &backward, const DepthAt &depth_at, const float4 plane_hypothesis, const int2 p)
+{
+    const float depth = GeomPlaneDepth(forward, plane_hypothesis, p.x, p.y);
+    const float2 src_pt = GeomReprojectPixel(forward, p.x, p.y, depth);
+    return GeomBackwardCost(backward, p, src_pt, depth_at(src_pt.x, src_pt.y));
+}
+
+// Source-to-reference pairs, entry i for cameras[i] (entry 0 maps the reference onto itself)
+void ComputeInverseViewPairHomographies(const std::vector<Camera> &cameras, std::vector<ViewPairHomography> &pairs);
+
+// Geometric costs of num_candidates planes, planes[k] at pixels[k], against
+// one source view's depth map; same values as the kernels' per-candidate cost
+void ComputeGeomConsistencyCostsHost(const cv::Mat_<float> &src_depth, const ViewPairHomography &forward, const ViewPairHomography &backward, const int2 *pixels, const float4 *planes, const int num_candidates, float *costs);
+
+#endif // _GEOM_CONSISTENCY_H_
@@ -1,4 +1,7 @@
 #include "HPM.h"
+#include "Upsampling.h"
+#include "ImageLayout.h"
+#include "GeomConsistency.h"
 
 #include <cstdarg>
 #include <filesystem>
@@ -97,50 +100,62 @@ void CudaCheckError(const char* file, const int line) {
 	}
 }
 
+bool CudaDeviceAvailable()
+{
+	static const bool available = [] {
+		int device_count = 0;
+		return cudaGetDeviceCount(&device_count) == cudaSuccess && device_count > 0;
+	}();
+	return available;
+}
+
 HPM::HPM() {}
 
 HPM::~HPM()
 {
-	delete[] plane_hypotheses_host;
-	delete[] costs_host;
-
+	// Pooled buffers return to the BufferArena on destruction
 	for (int i = 0; i < num_images; ++i) {
 		cudaDestroyTextureObject(texture_objects_host.images[i]);
 		cudaFreeArray(cuArray[i]);
 	}
-	cudaFree(texture_objects_cuda);
-	cudaFree(cameras_cuda);
-	cudaFree(plane_hypotheses_cuda);
-	cudaFree(costs_cuda);
-	cudaFree(pre_costs_cuda);
-	cudaFree(rand_states_cuda);
-	cudaFree(selected_views_cuda);
-	cudaFree(depths_cuda);
 
 	if (params.geom_consistency) {
 		for (int i = 0; i < num_images; ++i) {
 			cudaDestroyTextureObject(texture_depths_host.images[i]);
 			cudaFreeArray(cuDepthArray[i]);
 		}
-		cudaFree(texture_depths_cuda);
 	}
+}
 
-	if (params.hierarchy) {
-		delete[] scaled_plane_hypotheses_host;
-		delete[] pre_costs_host;
+void GenerateSampleList(const std::string& dense_folder, std::vector<Problem>& problems)
+{
+	std::string cluster_list_path = dense_folder + std::string("/pair.txt");
 
-		cudaFree(scaled_plane_hypotheses_cuda);
-		cudaFree(pre_costs_cuda);
-	}
+	problems.clear();
 
-	if (params.prior_consistency) {
-		delete[] prior_planes_host;
-		delete[] plane_masks_host;
+	std::ifstream file(cluster_list_path);
 
-		cudaFree(prior_planes_cuda);
-		cudaFree(plane_masks_cuda);
-	}
+	int num_images;
+	file >> num_images;
 
+	for (int i = 0; i < num_images; ++i) {
+		Problem problem;
+		problem.src_image_ids.clear();
+		file >> problem.ref_image_id;
+
+		int num_src_images;
+		file >> num_src_images;
+		for (int j = 0; j < num_src_images; ++j) {
+			int id;
+			float score;
+			file >> id >> score;
+			if (score <= 0.0f) {
+				continue;
+			}
+			problem.src_image_ids.push_back(id);
+		}
+		problems.push_back(problem);
+	}
 }
 
 Camera ReadCamera(const std::string& cam_path)
@@ -170,6 +185,29 @@ Camera ReadCamera(const std::string& cam_path)
 	return camera;
 }
 
+int WriteCamera(const std::string& cam_path, const Camera& camera)
+{
+	std::ofstream file(cam_path);
+	if (!file.is_open()) {
+		std::cout << "Can not open camera file " << cam_path << std::endl;
+		return -1;
+	}
+	file << std::setprecision(9);
+	file << "extrinsic" << std::endl;
+	for (int i = 0; i < 3; ++i) {
+		file << camera.R[3 * i + 0] << " " << camera.R[3 * i + 1] << " " << camera.R[3 * i + 2] << " " << camera.t[i] << std::endl;
+	}
+	file << "0 0 0 1" << std::endl << std::endl;
+	file << "intrinsic" << std::endl;
+	for (int i = 0; i < 3; ++i) {
+		file << camera.K[3 * i + 0] << " " << camera.K[3 * i + 1] << " " << camera.K[3 * i + 2] << std::endl;
+	}
+	file << std::endl;
+	const int depth_num = 192;
+	file << camera.depth_min << " " << (camera.depth_max - camera.depth_min) / depth_num << " " << depth_num << " " << camera.depth_max << std::endl;
+	return 0;
+}
+
 void  RescaleImageAndCamera(cv::Mat_<cv::Vec3b>& src, cv::Mat_<cv::Vec3b>& dst, cv::Mat_<float>& depth, Camera& camera)
 {
 	const int cols = depth.cols;
@@ -268,15 +306,56 @@ void ProjectonCamera(const float3 PointX, const Camera camera, float2& point, fl
 float GetAngle(const cv::Vec3f& v1, const cv::Vec3f& v2)
 {
 	float dot_product = v1[0] * v2[0] + v1[1] * v2[1] + v1[2] * v2[2];
-	float angle = acosf(dot_product);
-	//if angle is not a number the dot product was 1 and thus the two vectors should be identical --> return 0
-	if (angle != angle)
-		return 0.0f;
+	// Rounding can push the dot product of unit vectors past +-1, where acosf
+	// is NaN; -ffast-math folds a NaN test away, so clamp instead
+	dot_product = std::max(-1.0f, std::min(1.0f, dot_product));
+	return acosf(dot_product);
+}
 
-	return angle;
+int CheckFusionConsistency(const std::vector<Camera>& cameras, const std::vector<cv::Mat_<float> >& depths, const std::vector<NormalMap>& normals, const std::vector<cv::Mat>& masks, const std::vector<int>& src_ids, const int ref_id, const int r, const int c, const float3 PointX, const float ref_depth, const cv::Vec3f& ref_normal, std::vector<int2>& used_list, float& dynamic_consistency)
+{
+	int num_consistent = 0;
+	const int num_ngb = (int)src_ids.size();
+	for (int j = 0; j < num_ngb; ++j) {
+		int src_id = src_ids[j];
+		const int src_cols = depths[src_id].cols;
+		const int src_rows = depths[src_id].rows;
+		float2 point;
+		float proj_depth;
+		ProjectonCamera(PointX, cameras[src_id], point, proj_depth);
+		int src_r = int(point.y + 0.5f);
+		int src_c = int(point.x + 0.5f);
+		if (src_c >= 0 && src_c < src_cols && src_r >= 0 && src_r < src_rows) {
+			if (masks[src_id].at<uchar>(src_r, src_c) == 1)
+				continue;
+
+			float src_depth = depths[src_id].at<float>(src_r, src_c);
+			cv::Vec3f src_normal = normals[src_id].At(src_r, src_c);
+			if (src_depth <= 0.0)
+				continue;
+
+			float3 tmp_X = Get3DPointonWorld(src_c, src_r, src_depth, cameras[src_id]);
+			float2 tmp_pt;
+			ProjectonCamera(tmp_X, cameras[ref_id], tmp_pt, proj_depth);
+			float reproj_error = sqrt(pow(c - tmp_pt.x, 2) + pow(r - tmp_pt.y, 2));
+			float relative_depth_diff = fabs(proj_depth - ref_depth) / ref_depth;
+			float angle = GetAngle(ref_normal, src_normal);
+
+			if (reproj_error < 2.0f && relative_depth_diff < 0.01f && angle < 0.174533f) {
+				used_list[j].x = src_c;
+				used_list[j].y = src_r;
+
+				float tmp_index = reproj_error + 200 * relative_depth_diff + angle * 10;
+				dynamic_consistency += exp(-tmp_index);
+				num_consistent++;
+			}
+		}
+	}
+	return num_consistent;
 }
 int readDepthDmb(const std::string file_path, cv::Mat_<float>& depth)
 {
+	HPM_TRACE_SCOPE("ReadDmb");
 	FILE* inimage;
 	inimage = fopen(file_path.c_str(), "rb");
 	if (!inimage) {
@@ -309,6 +388,7 @@ int readDepthDmb(const std::string file_path, cv::Mat_<float>& depth)
 
 int writeDepthDmb(const std::string file_path, const cv::Mat_<float> depth)
 {
+	HPM_TRACE_SCOPE("WriteDmb");
 	FILE* outimage;
 	outimage = fopen(file_path.c_str(), "wb");
 	if (!outimage) {
@@ -334,8 +414,27 @@ int writeDepthDmb(const std::string file_path, const cv::Mat_<float> depth)
 	return 0;
 }
 
-int readNormalDmb(const std::string file_path, cv::Mat_<cv::Vec3f>& normal)
+static size_t DmbElementSize(const int type)
 {
+	switch (type) {
+	case DMB_TYPE_OCT16: return sizeof(short);
+	case DMB_TYPE_OCT8: return sizeof(schar);
+	default: return sizeof(float);
+	}
+}
+
+static int DmbTypeOfEncoding(const NormalEncoding encoding)
+{
+	switch (encoding) {
+	case NORMAL_OCT16: return DMB_TYPE_OCT16;
+	case NORMAL_OCT8: return DMB_TYPE_OCT8;
+	default: return DMB_TYPE_FLOAT;
+	}
+}
+
+int readNormalDmb(const std::string file_path, NormalMap& normal, const NormalEncoding storage)
+{
+	HPM_TRACE_SCOPE("ReadNormalDmb");
 	FILE* inimage;
 	inimage = fopen(file_path.c_str(), "rb");
 	if (!inimage) {
@@ -352,46 +451,167 @@ int readNormalDmb(const std::string file_path, cv::Mat_<cv::Vec3f>& normal)
 	fread(&w, sizeof(int32_t), 1, inimage);
 	fread(&nb, sizeof(int32_t), 1, inimage);
 
-	if (type != 1) {
+	NormalEncoding file_encoding;
+	cv::Mat data;
+	if (type == DMB_TYPE_FLOAT && nb == 3) {
+		file_encoding = NORMAL_FLOAT;
+		data = cv::Mat::zeros(h, w, CV_32FC3);
+	}
+	else if (type == DMB_TYPE_OCT16 && nb == 2) {
+		file_encoding = NORMAL_OCT16;
+		data = cv::Mat::zeros(h, w, CV_16SC2);
+	}
+	else if (type == DMB_TYPE_OCT8 && nb == 2) {
+		file_encoding = NORMAL_OCT8;
+		data = cv::Mat::zeros(h, w, CV_8SC2);
+	}
+	else {
 		fclose(inimage);
 		return -1;
 	}
 
 	int32_t dataSize = h * w * nb;
+	fread(data.data, DmbElementSize(type), dataSize, inimage);
+	fclose(inimage);
 
-	normal = cv::Mat::zeros(h, w, CV_32FC3);
-	fread(normal.data, sizeof(float), dataSize, inimage);
+	if (file_encoding == storage) {
+		normal.encoding = storage;
+		normal.data = data;
+	}
+	else {
+		cv::Mat_<cv::Vec3f> decoded;
+		DecodeNormals(data, file_encoding, decoded);
+		normal.Set(decoded, storage);
+	}
+	return 0;
+}
 
-	fclose(inimage);
+int readNormalDmb(const std::string file_path, cv::Mat_<cv::Vec3f>& normal)
+{
+	NormalMap normal_map;
+	if (readNormalDmb(file_path, normal_map, NORMAL_FLOAT) != 0) {
+		return -1;
+	}
+	normal = normal_map.data;
 	return 0;
 }
 
-int writeNormalDmb(const std::string file_path, const cv::Mat_<cv::Vec3f> normal)
+int writeNormalDmb(const std::string file_path, const cv::Mat_<cv::Vec3f> normal, const NormalEncoding encoding)
 {
+	HPM_TRACE_SCOPE("WriteNormalDmb");
 	FILE* outimage;
 	outimage = fopen(file_path.c_str(), "wb");
 	if (!outimage) {
 		std::cout << "Error opening file " << file_path << std::endl;
+		return -1;
 	}
 
-	int32_t type = 1; //float
+	cv::Mat data;
+	EncodeNormals(normal, encoding, data);
+
+	int32_t type = DmbTypeOfEncoding(encoding);
 	int32_t h = normal.rows;
 	int32_t w = normal.cols;
-	int32_t nb = 3;
+	int32_t nb = data.channels();
 
 	fwrite(&type, sizeof(int32_t), 1, outimage);
 	fwrite(&h, sizeof(int32_t), 1, outimage);
 	fwrite(&w, sizeof(int32_t), 1, outimage);
 	fwrite(&nb, sizeof(int32_t), 1, outimage);
 
-	float* data = (float*)normal.data;
-
 	int32_t datasize = w * h * nb;
-	fwrite(data, sizeof(float), datasize, outimage);
+	fwrite(data.data, DmbElementSize(type), datasize, outimage);
 
 	fclose(outimage);
 	return 0;
 }
+
+int writeNormalDmb(const std::string file_path, const cv::Mat_<float>& nx, const cv::Mat_<float>& ny, const cv::Mat_<float>& nz, const NormalEncoding encoding)
+{
+	HPM_TRACE_SCOPE("WriteNormalDmb");
+	DmbStreamWriter writer;
+	const int nb = encoding == NORMAL_FLOAT ? 3 : 2;
+	if (writer.Open(file_path, nx.rows, nx.cols, nb, DmbTypeOfEncoding(encoding)) != 0) {
+		return -1;
+	}
+
+	// Interleave and encode one row at a time
+	cv::Mat_<cv::Vec3f> row(1, nx.cols);
+	cv::Mat codes;
+	for (int i = 0; i < nx.rows; ++i) {
+		const float* px = nx.ptr<float>(i);
+		const float* py = ny.ptr<float>(i);
+		const float* pz = nz.ptr<float>(i);
+		cv::Vec3f* n = row.ptr<cv::Vec3f>(0);
+		for (int j = 0; j < nx.cols; ++j) {
+			n[j] = cv::Vec3f(px[j], py[j], pz[j]);
+		}
+		EncodeNormals(row, encoding, codes);
+		writer.WriteRows(codes);
+	}
+	return writer.Close();
+}
+
+DmbStreamWriter::DmbStreamWriter() : outimage(NULL), height(0), width(0), channels(0), elem_size(sizeof(float)), rows_written(0) {}
+
+DmbStreamWriter::~DmbStreamWriter()
+{
+	if (outimage) {
+		fclose(outimage);
+	}
+}
+
+int DmbStreamWriter::Open(const std::string file_path, const int _height, const int _width, const int _channels, const int _type)
+{
+	outimage = fopen(file_path.c_str(), "wb");
+	if (!outimage) {
+		std::cout << "Error opening file " << file_path << std::endl;
+		return -1;
+	}
+	height = _height;
+	width = _width;
+	channels = _channels;
+	elem_size = DmbElementSize(_type);
+	rows_written = 0;
+
+	int32_t type = _type;
+	int32_t h = height;
+	int32_t w = width;
+	int32_t nb = channels;
+
+	fwrite(&type, sizeof(int32_t), 1, outimage);
+	fwrite(&h, sizeof(int32_t), 1, outimage);
+	fwrite(&w, sizeof(int32_t), 1, outimage);
+	fwrite(&nb, sizeof(int32_t), 1, outimage);
+	return 0;
+}
+
+int DmbStreamWriter::WriteRows(const cv::Mat& rows)
+{
+	if (!outimage || rows.cols != width || rows.channels() != channels || rows.elemSize1() != elem_size || rows_written + rows.rows > height) {
+		return -1;
+	}
+	for (int i = 0; i < rows.rows; ++i) {
+		fwrite(rows.ptr(i), elem_size, width * channels, outimage);
+	}
+	rows_written += rows.rows;
+	return 0;
+}
+
+int DmbStreamWriter::Close()
+{
+	if (!outimage) {
+		return -1;
+	}
+	fclose(outimage);
+	outimage = NULL;
+	if (rows_written != height) {
+		std::cout << "Incomplete DMB file: " << rows_written << " of " << height << " rows written" << std::endl;
+		return -1;
+	}
+	return 0;
+}
+
 void ExportPointCloud(const std::string& plyFilePath, const std::vector<PointList>& pc)
 {
 	std::cout << "store 3D points to ply file" << std::endl;
@@ -537,40 +757,82 @@ void HPM::SetMandConsistencyParams(bool flag)
 	params.mand_consistency = flag;
 }
 
+void HPM::SetUpsampleParams(const PipelineOptions& options)
+{
+	prior_upsample = options.prior_upsample;
+	hierarchy_upsample = options.hierarchy_upsample;
+	upsample_tile_rows = options.upsample_tile_rows;
+}
+
+void HPM::SetStatsParams(bool collect)
+{
+	collect_stats = collect;
+}
+
+void HPM::SetTuningParams(const PipelineOptions& options)
+{
+	params.patch_size = options.patch_size;
+	params.radius_increment = options.radius_increment;
+	params.top_k = options.top_k;
+	patchmatch_iterations = options.patchmatch_iterations;
+	use_cost_cache = options.cost_cache;
+}
+
 void HPM::CudaPlanarPriorRelease() {
-	cudaFree(prior_planes_cuda);
-	cudaFree(plane_masks_cuda);
-	cudaFree(Canny_cuda);
+	prior_planes_cuda.Reset();
+	plane_masks_cuda.Reset();
+	prior_planes_host.Release();
+	plane_masks_host.Reset();
 	//updated by ChunLin Ren 2023-3-30
 }
 
 void HPM::CudaSpaceRelease(bool geom_consistency)
 {
-	cudaFree(texture_objects_cuda);
-	cudaFree(cameras_cuda);
-	cudaFree(plane_hypotheses_cuda);
-	cudaFree(costs_cuda);
-	cudaFree(rand_states_cuda);
-	cudaFree(selected_views_cuda);
-	cudaFree(depths_cuda);
-	cudaFree(texture_cuda);
+	texture_objects_cuda.Reset();
+	cameras_cuda.Reset();
+	view_pairs_cuda.Reset();
+	params.view_pairs = NULL;
+	inverse_view_pairs_cuda.Reset();
+	params.inverse_view_pairs = NULL;
+	cost_cache_cuda.Reset();
+	cost_cache_planes_cuda.Reset();
+	plane_hypotheses_cuda.Reset();
+	scaled_plane_hypotheses_cuda.Reset();
+	costs_cuda.Reset();
+	pre_costs_cuda.Reset();
+	rand_states_cuda.Reset();
+	selected_views_cuda.Reset();
+	depths_cuda.Reset();
+	texture_cuda.Reset();
+	confidences_cuda.Reset();
+	confidences_host.Reset();
 
 	if (geom_consistency) {
-		cudaFree(texture_depths_cuda);
+		texture_depths_cuda.Reset();
 	}
 }
 
 void HPM::ReleaseProblemHostMemory() {
-	//delete(plane_hypotheses_host);
-	//delete(costs_host);
 	images = std::vector<cv::Mat>();
 	cameras = std::vector<Camera>();
 	depths = std::vector<cv::Mat>();
 	std::cout << "Releasing Host memory..." << std::endl;
 }
 
+// Images stay 8-bit (16-bit for HDR sources) on the host and in the
+// textures; the kernels read them as normalized floats
+static cv::Mat ReadGrayImage(const std::string& image_path)
+{
+	cv::Mat image = cv::imread(image_path, cv::IMREAD_GRAYSCALE | cv::IMREAD_ANYDEPTH);
+	if (image.depth() != CV_8U && image.depth() != CV_16U) {
+		image.convertTo(image, CV_8U);
+	}
+	return image;
+}
+
 void HPM::InuputInitialization(const std::string& dense_folder, const std::vector<Problem>& problems, const int idx)
 {
+	HPM_TRACE_SCOPE("LoadImages");
 	images.clear();
 	cameras.clear();
 	const Problem problem = problems[idx];
@@ -580,30 +842,26 @@ void HPM::InuputInitialization(const std::string& dense_folder, const std::vecto
 
 	std::stringstream image_path;
 	image_path << image_folder << "/" << std::setw(8) << std::setfill('0') << problem.ref_image_id << ".jpg";
-	cv::Mat_<uint8_t> image_uint = cv::imread(image_path.str(), cv::IMREAD_GRAYSCALE);
-	cv::Mat image_float;
-	image_uint.convertTo(image_float, CV_32FC1);
-	images.push_back(image_float);
+	cv::Mat image = ReadGrayImage(image_path.str());
+	images.push_back(image);
 	std::stringstream cam_path;
 	cam_path << cam_folder << "/" << std::setw(8) << std::setfill('0') << problem.ref_image_id << "_cam.txt";
 	Camera camera = ReadCamera(cam_path.str());
-	camera.height = image_float.rows;
-	camera.width = image_float.cols;
+	camera.height = image.rows;
+	camera.width = image.cols;
 	cameras.push_back(camera);
 
 	size_t num_src_images = problem.src_image_ids.size();
 	for (size_t i = 0; i < num_src_images; ++i) {
 		std::stringstream image_path;
 		image_path << image_folder << "/" << std::setw(8) << std::setfill('0') << problem.src_image_ids[i] << ".jpg";
-		cv::Mat_<uint8_t> image_uint = cv::imread(image_path.str(), cv::IMREAD_GRAYSCALE);
-		cv::Mat image_float;
-		image_uint.convertTo(image_float, CV_32FC1);
-		images.push_back(image_float);
+		cv::Mat image = ReadGrayImage(image_path.str());
+		images.push_back(image);
 		std::stringstream cam_path;
 		cam_path << cam_folder << "/" << std::setw(8) << std::setfill('0') << problem.src_image_ids[i] << "_cam.txt";
 		Camera camera = ReadCamera(cam_path.str());
-		camera.height = image_float.rows;
-		camera.width = image_float.cols;
+		camera.height = image.rows;
+		camera.width = image.cols;
 		cameras.push_back(camera);
 	}
 
@@ -628,16 +886,16 @@ void HPM::InuputInitialization(const std::string& dense_folder, const std::vecto
 		const float scale_x = new_cols / static_cast<float>(images[i].cols);
 		const float scale_y = new_rows / static_cast<float>(images[i].rows);
 
-		cv::Mat_<float> scaled_image_float;
-		cv::resize(images[i], scaled_image_float, cv::Size(new_cols, new_rows), 0, 0, cv::INTER_LINEAR);
-		images[i] = scaled_image_float.clone();
+		cv::Mat scaled_image;
+		cv::resize(images[i], scaled_image, cv::Size(new_cols, new_rows), 0, 0, cv::INTER_LINEAR);
+		images[i] = scaled_image;
 
 		cameras[i].K[0] *= scale_x;
 		cameras[i].K[2] *= scale_x;
 		cameras[i].K[4] *= scale_y;
 		cameras[i].K[5] *= scale_y;
-		cameras[i].height = scaled_image_float.rows;
-		cameras[i].width = scaled_image_float.cols;
+		cameras[i].height = scaled_image.rows;
+		cameras[i].width = scaled_image.cols;
 	}
 
 	params.depth_min = cameras[0].depth_min * 0.6f;
@@ -688,58 +946,85 @@ void HPM::InuputInitialization(const std::string& dense_folder, const std::vecto
 			depths.push_back(depth);
 		}
 	}
+
+	size_t image_bytes = 0;
+	for (size_t i = 0; i < images.size(); ++i) {
+		image_bytes += MatBytes(images[i]);
+	}
+	for (size_t i = 0; i < depths.size(); ++i) {
+		image_bytes += MatBytes(depths[i]);
+	}
+	images_charge.Set(image_bytes);
 }
 
-void HPM::TextureInformationInitialization()
+void HPM::BenchmarkImageLayouts()
 {
-	texture_host = new float[cameras[0].height * cameras[0].width];
-	cudaMalloc((void**)&texture_cuda, sizeof(float) * (cameras[0].height * cameras[0].width));
+	::BenchmarkImageLayouts(images, cameras, params);
 }
 
 void HPM::CudaSpaceInitialization(const std::string& dense_folder, const Problem& problem)
 {
+	HPM_TRACE_SCOPE("CudaSpaceInitialization");
 	num_images = (int)images.size();
 
 	for (int i = 0; i < num_images; ++i) {
 		int rows = images[i].rows;
 		int cols = images[i].cols;
 
-		cudaChannelFormatDesc channelDesc = cudaCreateChannelDesc(32, 0, 0, 0, cudaChannelFormatKindFloat);
+		const int bits = (int)images[i].elemSize1() * 8;
+
+		cudaChannelFormatDesc channelDesc = cudaCreateChannelDesc(bits, 0, 0, 0, cudaChannelFormatKindUnsigned);
 		cudaMallocArray(&cuArray[i], &channelDesc, cols, rows);
-		cudaMemcpy2DToArray(cuArray[i], 0, 0, images[i].ptr<float>(), images[i].step[0], cols * sizeof(float), rows, cudaMemcpyHostToDevice);
+		cudaMemcpy2DToArray(cuArray[i], 0, 0, images[i].ptr(), images[i].step[0], cols * images[i].elemSize(), rows, cudaMemcpyHostToDevice);
 
 		struct cudaResourceDesc resDesc;
 		memset(&resDesc, 0, sizeof(cudaResourceDesc));
 		resDesc.resType = cudaResourceTypeArray;
 		resDesc.res.array.array = cuArray[i];
 
+		// Samples come back in [0, 1]; the kernels rescale by params.image_scale
 		struct cudaTextureDesc texDesc;
 		memset(&texDesc, 0, sizeof(cudaTextureDesc));
 		texDesc.addressMode[0] = cudaAddressModeWrap;
 		texDesc.addressMode[1] = cudaAddressModeWrap;
 		texDesc.filterMode = cudaFilterModeLinear;
-		texDesc.readMode = cudaReadModeElementType;
+		texDesc.readMode = cudaReadModeNormalizedFloat;
 		texDesc.normalizedCoords = 0;
 
 		cudaCreateTextureObject(&(texture_objects_host.images[i]), &resDesc, &texDesc, NULL);
 	}
-	cudaMalloc((void**)&texture_objects_cuda, sizeof(cudaTextureObjects));
+	texture_objects_cuda.Allocate(1);
 	cudaMemcpy(texture_objects_cuda, &texture_objects_host, sizeof(cudaTextureObjects), cudaMemcpyHostToDevice);
+	size_t array_bytes = 0;
+	for (int i = 0; i < num_images; ++i) {
+		array_bytes += MatBytes(images[i]);
+	}
+	image_arrays_charge.Set(array_bytes);
 
-	cudaMalloc((void**)&cameras_cuda, sizeof(Camera) * (num_images));
+	cameras_cuda.Allocate(num_images);
 	cudaMemcpy(cameras_cuda, &cameras[0], sizeof(Camera) * (num_images), cudaMemcpyHostToDevice);
 
-	plane_hypotheses_host = new float4[cameras[0].height * cameras[0].width];
-	cudaMalloc((void**)&plane_hypotheses_cuda, sizeof(float4) * (cameras[0].height * cameras[0].width));
+	// Homography terms that only depend on the view pair, built once per problem
+	std::vector<ViewPairHomography> view_pairs;
+	ComputeViewPairHomographies(cameras, view_pairs);
+	view_pairs_cuda.Allocate(num_images);
+	cudaMemcpy(view_pairs_cuda, &view_pairs[0], sizeof(ViewPairHomography) * (num_images), cudaMemcpyHostToDevice);
+	params.view_pairs = view_pairs_cuda;
+	ComputeInverseViewPairHomographies(cameras, view_pairs);
+	inverse_view_pairs_cuda.Allocate(num_images);
+	cudaMemcpy(inverse_view_pairs_cuda, &view_pairs[0], sizeof(ViewPairHomography) * (num_images), cudaMemcpyHostToDevice);
+	params.inverse_view_pairs = inverse_view_pairs_cuda;
 
-	costs_host = new float[cameras[0].height * cameras[0].width];
-	cudaMalloc((void**)&costs_cuda, sizeof(float) * (cameras[0].height * cameras[0].width));
-	cudaMalloc((void**)&pre_costs_cuda, sizeof(float) * (cameras[0].height * cameras[0].width));
+	hypotheses_host.Allocate(cameras[0].height, cameras[0].width);
+	plane_hypotheses_cuda.Allocate(cameras[0].height * cameras[0].width);
 
-	cudaMalloc((void**)&rand_states_cuda, sizeof(curandState) * (cameras[0].height * cameras[0].width));
-	cudaMalloc((void**)&selected_views_cuda, sizeof(unsigned int) * (cameras[0].height * cameras[0].width));
+	costs_cuda.Allocate(cameras[0].height * cameras[0].width);
+	pre_costs_cuda.Allocate(cameras[0].height * cameras[0].width);
 
-	cudaMalloc((void**)&depths_cuda, sizeof(float) * (cameras[0].height * cameras[0].width));
+	rand_states_cuda.Allocate(cameras[0].height * cameras[0].width);
+	selected_views_cuda.Allocate(cameras[0].height * cameras[0].width);
+
+	depths_cuda.Allocate(cameras[0].height * cameras[0].width);
 
 	if (params.geom_consistency) {
 		for (int i = 0; i < num_images; ++i) {
@@ -765,8 +1050,11 @@ void HPM::CudaSpaceInitialization(const std::string& dense_folder, const Problem
 
 			cudaCreateTextureObject(&(texture_depths_host.images[i]), &resDesc, &texDesc, NULL);
 		}
-		cudaMalloc((void**)&texture_depths_cuda, sizeof(cudaTextureObjects));
+		texture_depths_cuda.Allocate(1);
 		cudaMemcpy(texture_depths_cuda, &texture_depths_host, sizeof(cudaTextureObjects), cudaMemcpyHostToDevice);
+		for (int i = 0; i < num_images; ++i) {
+			image_arrays_charge.Add(MatBytes(depths[i]));
+		}
 
 		std::stringstream result_path;
 		result_path << dense_folder << "/HPM_MVS_plusplus" << "/2333_" << std::setw(8) << std::setfill('0') << problem.ref_image_id;
@@ -786,22 +1074,10 @@ void HPM::CudaSpaceInitialization(const std::string& dense_folder, const Problem
 		depths.push_back(ref_depth);
 		readNormalDmb(normal_path, ref_normal);
 		readDepthDmb(cost_path, ref_cost);
-		int width = ref_depth.cols;
-		int height = ref_depth.rows;
-		for (int col = 0; col < width; ++col) {
-			for (int row = 0; row < height; ++row) {
-				int center = row * width + col;
-				float4 plane_hypothesis;
-				plane_hypothesis.x = ref_normal(row, col)[0];
-				plane_hypothesis.y = ref_normal(row, col)[1];
-				plane_hypothesis.z = ref_normal(row, col)[2];
-				plane_hypothesis.w = ref_depth(row, col);
-				plane_hypotheses_host[center] = plane_hypothesis;
-				costs_host[center] = ref_cost(row, col);
-			}
-		}
-		cudaMemcpy(plane_hypotheses_cuda, plane_hypotheses_host, sizeof(float4) * width * height, cudaMemcpyHostToDevice);
-		cudaMemcpy(costs_cuda, costs_host, sizeof(float) * width * height, cudaMemcpyHostToDevice);
+		hypotheses_host.SetNormals(ref_normal);
+		hypotheses_host.SetPlane(HypothesisField::D, ref_depth);
+		hypotheses_host.SetPlane(HypothesisField::COST, ref_cost);
+		UploadHypothesisField(hypotheses_host, HypothesisField::D, plane_hypotheses_cuda, costs_cuda);
 	}
 
 	if (params.hierarchy) {
@@ -820,124 +1096,121 @@ void HPM::CudaSpaceInitialization(const std::string& dense_folder, const Problem
 		readDepthDmb(cost_path, ref_cost);
 		int width = ref_normal.cols;
 		int height = ref_normal.rows;
-		scaled_plane_hypotheses_host = new float4[height * width];
-		cudaMalloc((void**)&scaled_plane_hypotheses_cuda, sizeof(float4) * height * width);
-		pre_costs_host = new float[height * width];
-		cudaMalloc((void**)&pre_costs_cuda, sizeof(float) * cameras[0].height * cameras[0].width);
-		if (width != images[0].rows || height != images[0].cols) {
-			params.upsample = true;
-			params.scaled_cols = width;
-			params.scaled_rows = height;
+		// The hierarchy always starts from the previous scale, so the kernel
+		// takes its upsample branch. JointBilateralUpsampling normally writes
+		// the normals at full resolution already; older results are
+		// upsampled here or in the kernel.
+		params.upsample = true;
+		params.scaled_cols = width;
+		params.scaled_rows = height;
+		if (width == images[0].cols && height == images[0].rows) {
+			params.upsample_on_host = true;
 		}
-		else {
-			params.upsample = false;
+		else if (hierarchy_upsample == UPSAMPLE_GUIDED) {
+			// Upsample normals and costs here; the kernel then reads them per pixel
+			cv::Mat_<cv::Vec3f> upsampled_normal;
+			cv::Mat_<float> upsampled_cost;
+			cv::Mat_<float> guide;
+			images[0].convertTo(guide, CV_32F, 255.0 / (images[0].depth() == CV_16U ? 65535.0 : 255.0));
+			GuidedUpsampleHost(guide, ref_cost, ref_normal, upsampled_cost, upsampled_normal);
+			ref_normal = upsampled_normal;
+			ref_cost = upsampled_cost;
+			width = ref_normal.cols;
+			height = ref_normal.rows;
+			params.upsample_on_host = true;
 		}
-		for (int col = 0; col < width; ++col) {
-			for (int row = 0; row < height; ++row) {
-				int center = row * width + col;
-				float4 plane_hypothesis;
-				plane_hypothesis.x = ref_normal(row, col)[0];
-				plane_hypothesis.y = ref_normal(row, col)[1];
-				plane_hypothesis.z = ref_normal(row, col)[2];
-				if (params.upsample) {
-					plane_hypothesis.w = ref_cost(row, col);
-				}
-				else {
-					plane_hypothesis.w = ref_depth(row, col);
-				}
-				scaled_plane_hypotheses_host[center] = plane_hypothesis;
-			}
+		scaled_plane_hypotheses_cuda.Allocate(height * width);
+		scaled_hypotheses_host.Allocate(height, width);
+		scaled_hypotheses_host.SetNormals(ref_normal);
+		// The costs stay at the previous scale; the kernel overwrites the
+		// averaged cost, so .w is left at zero when the sizes differ
+		if (ref_cost.size() == ref_normal.size()) {
+			scaled_hypotheses_host.SetPlane(HypothesisField::COST, ref_cost);
 		}
+		UploadHypothesisField(scaled_hypotheses_host, HypothesisField::COST, scaled_plane_hypotheses_cuda, NULL);
 
-		for (int col = 0; col < cameras[0].width; ++col) {
-			for (int row = 0; row < cameras[0].height; ++row) {
-				int center = row * cameras[0].width + col;
-				float4 plane_hypothesis;
-				plane_hypothesis.w = ref_depth(row, col);
-				plane_hypotheses_host[center] = plane_hypothesis;
-			}
-		}
+		hypotheses_host.SetPlane(HypothesisField::D, ref_depth);
+		UploadHypothesisField(hypotheses_host, HypothesisField::D, plane_hypotheses_cuda, NULL);
+	}
+}
 
-		cudaMemcpy(scaled_plane_hypotheses_cuda, scaled_plane_hypotheses_host, sizeof(float4) * height * width, cudaMemcpyHostToDevice);
-		cudaMemcpy(plane_hypotheses_cuda, plane_hypotheses_host, sizeof(float4) * cameras[0].width * cameras[0].height, cudaMemcpyHostToDevice);
+// Copies a whole map into a row-major buffer of the same size, one row per
+// iteration so the inner loop is contiguous on both sides
+template <typename T, typename S>
+static void ImportMap(const cv::Mat_<S>& src, T* dst)
+{
+	const int cols = src.cols;
+#pragma omp parallel for
+	for (int row = 0; row < src.rows; ++row) {
+		const S* src_row = src[row];
+		T* dst_row = dst + (size_t)row * cols;
+#pragma omp simd
+		for (int col = 0; col < cols; ++col) {
+			dst_row[col] = (T)src_row[col];
+		}
 	}
 }
 
-void HPM::CudaCannyInitialization(const cv::Mat_<int>& Canny) {
-	unsigned int* Canny_host = new unsigned int[cameras[0].height * cameras[0].width];
-	cudaMalloc((void**)&Canny_cuda, sizeof(unsigned int) * (cameras[0].height * cameras[0].width));
-	for (int i = 0; i < cameras[0].width; ++i) {
-		for (int j = 0; j < cameras[0].height; ++j) {
-			int center = j * cameras[0].width + i;
-			Canny_host[center] = (unsigned int)Canny(j, i);
+// Fills the plane masks and, for masked pixels, the prior planes given by
+// plane_of(row, col, label)
+template <typename PlaneLookup>
+static void ImportPriorPlanes(const cv::Mat_<float>& masks, unsigned int* plane_masks, HypothesisField& prior_planes, const PlaneLookup& plane_of)
+{
+	ImportMap(masks, plane_masks);
+	const int cols = masks.cols;
+#pragma omp parallel for
+	for (int row = 0; row < masks.rows; ++row) {
+		const float* mask_row = masks[row];
+		for (int col = 0; col < cols; ++col) {
+			if (mask_row[col] > 0) {
+				prior_planes.SetHypothesis(row * cols + col, plane_of(row, col, (int)mask_row[col]));
+			}
 		}
 	}
-	cudaMemcpy(Canny_cuda, Canny_host, sizeof(unsigned int) * (cameras[0].height * cameras[0].width), cudaMemcpyHostToDevice);
-	delete[] Canny_host;
-	Canny_host = NULL;
+}
+
+void HPM::CudaTextureInitialization(const cv::Mat_<float>& texture) {
+	HPM_TRACE_SCOPE("UploadTexture");
+	texture_cuda.Allocate(cameras[0].height * cameras[0].width);
+	cudaMemcpy(texture_cuda, texture.ptr<float>(), sizeof(float) * (cameras[0].height * cameras[0].width), cudaMemcpyHostToDevice);
 }
 
 void HPM::CudaConfidenceInitialization(const std::string& dense_folder, const std::vector<Problem>& problems, const int idx) {
+	HPM_TRACE_SCOPE("LoadConfidence");
 	const Problem problem = problems[idx];
 	std::stringstream result_path;
 	result_path << dense_folder << "/HPM_MVS_plusplus" << "/2333_" << std::setw(8) << std::setfill('0') << problem.ref_image_id;
 	std::string result_folder = result_path.str();
 	std::string confidence_path = result_folder + "/confidence.dmb";
 	cv::Mat_<float>confidences;
-	confidences_host = new float[cameras[0].height * cameras[0].width];
+	confidences_host.Allocate(cameras[0].height * cameras[0].width);
 	readDepthDmb(confidence_path, confidences);
-	for (int i = 0; i < cameras[0].width; ++i) {
-		for (int j = 0; j < cameras[0].height; ++j) {
-			int center = j * cameras[0].width + i;
-			confidences_host[center] = confidences(j, i);
-		}
-	}
-	cudaMalloc((void**)&confidences_cuda, sizeof(float) * (cameras[0].height * cameras[0].width));
+	ImportMap(confidences, confidences_host.get());
+	confidences_cuda.Allocate(cameras[0].height * cameras[0].width);
 	cudaMemcpy(confidences_cuda, confidences_host, sizeof(float) * cameras[0].width * cameras[0].height, cudaMemcpyHostToDevice);
 	confidences.release();
 }
 
 void HPM::CudaHypothesesReload(cv::Mat_ <float>depths, cv::Mat_<float>costs, cv::Mat_<cv::Vec3f>normals) {
-	int width = cameras[0].width;
-	int height = cameras[0].height;
-	for (int col = 0; col < width; col++) {
-		for (int row = 0; row < height; row++) {
-			int center = row * width + col;
-			float4 plane_hypotheses;
-			plane_hypotheses.x = normals(row, col)[0];
-			plane_hypotheses.y = normals(row, col)[1];
-			plane_hypotheses.z = normals(row, col)[2];
-			plane_hypotheses.w = depths(row, col);
-			plane_hypotheses_host[center] = plane_hypotheses;
-			costs_host[center] = costs(row, col);
-			//if (costs_host[center] < 0.1) {
-			//    std::cout << costs_host[center] << std::endl;
-			//}
-		}
-	}
-	cudaMemcpy(plane_hypotheses_cuda, plane_hypotheses_host, sizeof(float4) * width * height, cudaMemcpyHostToDevice);
-	cudaMemcpy(costs_cuda, costs_host, sizeof(float) * width * height, cudaMemcpyHostToDevice);
+	HPM_TRACE_SCOPE("ReloadHypotheses");
+	hypotheses_host.SetNormals(normals);
+	hypotheses_host.SetPlane(HypothesisField::D, depths);
+	hypotheses_host.SetPlane(HypothesisField::COST, costs);
+	UploadHypothesisField(hypotheses_host, HypothesisField::D, plane_hypotheses_cuda, costs_cuda);
 }
 
 void HPM::CudaPlanarPriorInitialization(const std::vector<float4>& PlaneParams, const cv::Mat_<float>& masks)
 {
-	prior_planes_host = new float4[cameras[0].height * cameras[0].width];
-	cudaMalloc((void**)&prior_planes_cuda, sizeof(float4) * (cameras[0].height * cameras[0].width));
+	HPM_TRACE_SCOPE("PlanarPriorInitialization");
+	prior_planes_host.Allocate(cameras[0].height, cameras[0].width);
+	prior_planes_cuda.Allocate(cameras[0].height * cameras[0].width);
 
-	plane_masks_host = new unsigned int[cameras[0].height * cameras[0].width];
-	cudaMalloc((void**)&plane_masks_cuda, sizeof(unsigned int) * (cameras[0].height * cameras[0].width));
+	plane_masks_host.Allocate(cameras[0].height * cameras[0].width);
+	plane_masks_cuda.Allocate(cameras[0].height * cameras[0].width);
 
-	for (int i = 0; i < cameras[0].width; ++i) {
-		for (int j = 0; j < cameras[0].height; ++j) {
-			int center = j * cameras[0].width + i;
-			plane_masks_host[center] = (unsigned int)masks(j, i);
-			if (masks(j, i) > 0) {
-				prior_planes_host[center] = PlaneParams[masks(j, i) - 1];
-			}
-		}
-	}
+	ImportPriorPlanes(masks, plane_masks_host.get(), prior_planes_host, [&](const int, const int, const int label) { return PlaneParams[label - 1]; });
 
-	cudaMemcpy(prior_planes_cuda, prior_planes_host, sizeof(float4) * (cameras[0].height * cameras[0].width), cudaMemcpyHostToDevice);
+	UploadHypothesisField(prior_planes_host, HypothesisField::D, prior_planes_cuda, NULL);
 	cudaMemcpy(plane_masks_cuda, plane_masks_host, sizeof(unsigned int) * (cameras[0].height * cameras[0].width), cudaMemcpyHostToDevice);
 }
 
@@ -956,19 +1229,14 @@ cv::Mat HPM::GetReferenceImage()
 	return images[0];
 }
 
-float4 HPM::GetPlaneHypothesis(const int index)
+const HypothesisField& HPM::GetHypotheses() const
 {
-	return plane_hypotheses_host[index];
+	return hypotheses_host;
 }
 
-float HPM::GetTexture(const int index)
+const std::vector<PatchMatchSweepStats>& HPM::GetSweepStats() const
 {
-	return texture_host[index];
-}
-
-float HPM::GetCost(const int index)
-{
-	return costs_host[index];
+	return sweep_stats;
 }
 
 float HPM::GetMinDepth()
@@ -983,6 +1251,7 @@ float HPM::GetMaxDepth()
 
 void HPM::GetSupportPoints_Classify_Check(std::vector<cv::Point>& support2DPoints, const cv::Mat_<float>& costs, const cv::Mat_<float>& confidences, const cv::Mat_<float>& texture, float hpm_factor)
 {
+	HPM_TRACE_SCOPE("SupportPoints");
 	support2DPoints.clear();
 	const int step_size = 5;
 	const int width = GetReferenceImageWidth() * hpm_factor;
@@ -1032,6 +1301,7 @@ void HPM::GetSupportPoints_Classify_Check(std::vector<cv::Point>& support2DPoint
 
 std::vector<Triangle> HPM::DelaunayTriangulation(const cv::Rect boundRC, const std::vector<cv::Point>& points)
 {
+	HPM_TRACE_SCOPE("Delaunay");
 	if (points.empty()) {
 		return std::vector<Triangle>();
 	}
@@ -1196,22 +1466,28 @@ void JBUAddImageToTextureFloatGray(std::vector<cv::Mat_<float>>& imgs, cudaTextu
 	return;
 }
 
-JBU::JBU() {}
+JBU::JBU() : jt_d(NULL), jp_d(NULL) {}
 
 JBU::~JBU()
 {
-	free(depth_h);
-
-	cudaFree(depth_d);
 	cudaFree(jp_d);
 	cudaFree(jt_d);
 }
 
-void JBU::InitializeParameters(int n)
+void JBU::InitializeParameters(const std::vector<cv::Mat_<float> >& src_channels)
 {
-	depth_h = (float*)malloc(sizeof(float) * n);
-
-	cudaMalloc((void**)&depth_d, sizeof(float) * n);
+	const int num_channels = jp_h.num_channels;
+	const int n = jp_h.band_rows * jp_h.width;
+	const int src_n = jp_h.s_band_rows * jp_h.s_width;
+	// Bands of the same size reuse the pooled buffers of the previous band
+	values_h.Allocate(n * num_channels);
+
+	values_d.Allocate(n * num_channels);
+	src_d.Allocate(src_n * num_channels);
+	// One plane per channel holding the band's source rows
+	for (int c = 0; c < num_channels; ++c) {
+		cudaMemcpy2D(src_d + c * src_n, sizeof(float) * jp_h.s_width, src_channels[c].ptr<float>(jp_h.src_y0), src_channels[c].step[0], sizeof(float) * jp_h.s_width, jp_h.s_band_rows, cudaMemcpyHostToDevice);
+	}
 
 	cudaMalloc((void**)&jp_d, sizeof(JBUParameters) * 1);
 	cudaMemcpy(jp_d, &jp_h, sizeof(JBUParameters) * 1, cudaMemcpyHostToDevice);
@@ -1221,64 +1497,169 @@ void JBU::InitializeParameters(int n)
 	cudaDeviceSynchronize();
 }
 
-void RunJBU(const cv::Mat_<float>& scaled_image_float, const cv::Mat_<float>& src_depthmap, const std::string& dense_folder, const Problem& problem)
+// Replaces pixels the upsampler left undefined by the nearest source sample
+static void FillInvalidUpsampledRows(std::vector<cv::Mat_<float> >& dst_rows, const int y0, const std::vector<cv::Mat_<float> >& src_channels)
 {
-	uint32_t rows = scaled_image_float.rows;
-	uint32_t cols = scaled_image_float.cols;
-	int Imagescale = std::max(scaled_image_float.rows / src_depthmap.rows, scaled_image_float.cols / src_depthmap.cols);
-
-	if (Imagescale == 1) {
-		std::cout << "Image.rows = Depthmap.rows" << std::endl;
-		return;
+	for (size_t c = 0; c < dst_rows.size(); ++c) {
+		cv::Mat_<float>& rows = dst_rows[c];
+		const cv::Mat_<float>& src = src_channels[c];
+#pragma omp parallel for
+		for (int j = 0; j < rows.rows; ++j) {
+			for (int i = 0; i < rows.cols; ++i) {
+				if (rows(j, i) != rows(j, i)) {
+					rows(j, i) = src(int((y0 + j) / 2), int(i / 2));
+				}
+			}
+		}
 	}
+}
 
-	std::vector<cv::Mat_<float> > imgs(JBU_NUM);
-	imgs[0] = scaled_image_float.clone();
-	imgs[1] = src_depthmap.clone();
+// Uploads one band's guide rows and source planes to jbu
+static void PrepareJBUBandCuda(JBU& jbu, const cv::Mat_<float>& guide_rows, const std::vector<cv::Mat_<float> >& src_channels, const JBUBand& band, const int Imagescale, const int rows, const int cols)
+{
+	// Only the guide lives in a texture; sources are read as plain planes
+	std::vector<cv::Mat_<float> > imgs(1, guide_rows);
 
-	JBU jbu;
 	jbu.jp_h.height = rows;
 	jbu.jp_h.width = cols;
-	jbu.jp_h.s_height = src_depthmap.rows;
-	jbu.jp_h.s_width = src_depthmap.cols;
+	jbu.jp_h.s_height = src_channels[0].rows;
+	jbu.jp_h.s_width = src_channels[0].cols;
 	jbu.jp_h.Imagescale = Imagescale;
-	JBUAddImageToTextureFloatGray(imgs, jbu.jt_h.imgs, jbu.cuArray, JBU_NUM);
+	jbu.jp_h.y_offset = band.y0;
+	jbu.jp_h.band_rows = band.y1 - band.y0;
+	jbu.jp_h.guide_y0 = band.guide_y0;
+	jbu.jp_h.src_y0 = band.src_y0;
+	jbu.jp_h.s_band_rows = band.src_y1 - band.src_y0;
+	jbu.jp_h.num_channels = (int)src_channels.size();
+	JBUAddImageToTextureFloatGray(imgs, jbu.jt_h.imgs, jbu.cuArray, 1);
+
+	jbu.InitializeParameters(src_channels);
+}
 
-	jbu.InitializeParameters(rows * cols);
+static void RunJBUBandCuda(const cv::Mat_<float>& guide_rows, const std::vector<cv::Mat_<float> >& src_channels, const JBUBand& band, const int Imagescale, const int rows, const int cols, std::vector<cv::Mat_<float> >& dst_rows)
+{
+	JBU jbu;
+	PrepareJBUBandCuda(jbu, guide_rows, src_channels, band, Imagescale, rows, cols);
 	jbu.CudaRun();
 
-	cv::Mat_<float> depthmap = cv::Mat::zeros(rows, cols, CV_32FC1);
-
-	for (uint32_t i = 0; i < cols; ++i) {
-		for (uint32_t j = 0; j < rows; ++j) {
-			int center = i + cols * j;
-			if (jbu.depth_h[center] != jbu.depth_h[center]) {
-				//std::cout << "wrong!" << std::endl;
-				jbu.depth_h[center] = src_depthmap(int(j / 2), int(i / 2));
-			}
-			depthmap(j, i) = jbu.depth_h[center];
+	const int band_rows = jbu.jp_h.band_rows;
+	dst_rows.resize(src_channels.size());
+	for (int c = 0; c < jbu.jp_h.num_channels; ++c) {
+		dst_rows[c].create(band_rows, cols);
+		const float* plane = jbu.values_h + (size_t)c * band_rows * cols;
+		for (int j = 0; j < band_rows; ++j) {
+			memcpy(dst_rows[c].ptr<float>(j), plane + j * cols, sizeof(float) * cols);
 		}
 	}
 
-	cv::Mat_<float> disp0 = depthmap.clone();
+	CUDA_SAFE_CALL(cudaDestroyTextureObject(jbu.jt_h.imgs[0]));
+	CUDA_SAFE_CALL(cudaFreeArray(jbu.cuArray[0]));
+	cudaDeviceSynchronize();
+}
+
+float TimeJBU(const cv::Mat_<float>& guide, const cv::Mat_<float>& src_depth, const int Imagescale, const int repeats)
+{
+	const JBUBand band = ComputeJBUBand(0, guide.rows, guide.rows, guide.cols, src_depth.rows, src_depth.cols, Imagescale);
+	JBU jbu;
+	PrepareJBUBandCuda(jbu, guide, std::vector<cv::Mat_<float> >(1, src_depth), band, Imagescale, guide.rows, guide.cols);
+	const float milliseconds = jbu.TimeKernel(repeats);
+	CUDA_SAFE_CALL(cudaDestroyTextureObject(jbu.jt_h.imgs[0]));
+	CUDA_SAFE_CALL(cudaFreeArray(jbu.cuArray[0]));
+	return milliseconds;
+}
+
+void RunJBU(const cv::Mat_<uint8_t>& image, const int rows, const int cols, const cv::Mat_<float>& src_depthmap, const cv::Mat_<cv::Vec3f>& src_normal, const std::string& dense_folder, const Problem& problem, const PipelineOptions& options)
+{
+	HPM_TRACE_SCOPE("JBU");
+	int Imagescale = std::max(rows / src_depthmap.rows, cols / src_depthmap.cols);
+
+	if (Imagescale == 1) {
+		std::cout << "Image.rows = Depthmap.rows" << std::endl;
+		return;
+	}
+
 	std::stringstream result_path;
 	result_path << dense_folder << "/HPM_MVS_plusplus" << "/2333_" << std::setw(8) << std::setfill('0') << problem.ref_image_id;
 	std::string result_folder = result_path.str();
 	std::filesystem::create_directories(result_folder);
-	std::string depth_path = result_folder + "/depths.dmb";
-	writeDepthDmb(depth_path, disp0);
 
-	for (int i = 0; i < JBU_NUM; i++) {
-		CUDA_SAFE_CALL(cudaDestroyTextureObject(jbu.jt_h.imgs[i]));
-		CUDA_SAFE_CALL(cudaFreeArray(jbu.cuArray[i]));
+	// Channel layout: depth, then nx, ny, nz when present
+	const bool with_normal = !src_normal.empty() && src_normal.size() == src_depthmap.size();
+	std::vector<cv::Mat_<float> > src_channels(1, src_depthmap);
+	if (with_normal) {
+		std::vector<cv::Mat_<float> > normal_planes;
+		SplitNormalPlanes(src_normal, normal_planes);
+		src_channels.insert(src_channels.end(), normal_planes.begin(), normal_planes.end());
+	}
+
+	DmbStreamWriter depth_writer, normal_writer;
+	if (depth_writer.Open(result_folder + "/depths.dmb", rows, cols, 1) != 0) {
+		return;
+	}
+	const int normal_nb = options.normal_dmb == NORMAL_FLOAT ? 3 : 2;
+	if (with_normal && normal_writer.Open(result_folder + "/normals.dmb", rows, cols, normal_nb, DmbTypeOfEncoding(options.normal_dmb)) != 0) {
+		return;
+	}
+
+	auto write_rows = [&](std::vector<cv::Mat_<float> >& dst_rows, const int y0) {
+		FillInvalidUpsampledRows(dst_rows, y0, src_channels);
+		depth_writer.WriteRows(dst_rows[0]);
+		if (with_normal) {
+			cv::Mat_<cv::Vec3f> normal_rows;
+			MergeNormalPlanes(dst_rows[1], dst_rows[2], dst_rows[3], normal_rows);
+			cv::Mat normal_codes;
+			EncodeNormals(normal_rows, options.normal_dmb, normal_codes);
+			normal_writer.WriteRows(normal_codes);
+		}
+	};
+
+	if (options.depth_upsample == UPSAMPLE_GUIDED) {
+		cv::Mat_<float> guide;
+		ResizeGuideRows(image, rows, cols, 0, rows, guide);
+		std::vector<cv::Mat_<float> > dst_channels;
+		GuidedUpsampleHost(guide, src_channels, dst_channels);
+		write_rows(dst_channels, 0);
+	}
+	else {
+		// The output is produced in bands of rows; only the guide rows of the
+		// current band (plus the window halo) are resized to float from the
+		// 8-bit image and uploaded
+		const int tile_rows = options.upsample_tile_rows > 0 ? options.upsample_tile_rows : rows;
+		const bool use_cuda = CudaDeviceAvailable();
+		JBUWeightTables tables;
+		if (!use_cuda) {
+			tables.Initialize(cols, rows, src_depthmap.cols, src_depthmap.rows, Imagescale);
+		}
+
+		for (int y0 = 0; y0 < rows; y0 += tile_rows) {
+			const int y1 = std::min(y0 + tile_rows, rows);
+			const JBUBand band = ComputeJBUBand(y0, y1, rows, cols, src_depthmap.rows, src_depthmap.cols, Imagescale);
+
+			cv::Mat_<float> guide_rows;
+			ResizeGuideRows(image, rows, cols, band.guide_y0, band.guide_y1, guide_rows);
+
+			std::vector<cv::Mat_<float> > dst_rows;
+			if (use_cuda) {
+				RunJBUBandCuda(guide_rows, src_channels, band, Imagescale, rows, cols, dst_rows);
+			}
+			else {
+				JBUHostChannels(tables, guide_rows, src_channels, band, dst_rows);
+			}
+			write_rows(dst_rows, y0);
+		}
+	}
+
+	depth_writer.Close();
+	if (with_normal) {
+		normal_writer.Close();
 	}
-	cudaDeviceSynchronize();
 }
 
 
 
 void HPM::JointBilateralUpsampling_prior(const cv::Mat_<float>& scaled_image_float, const cv::Mat_<float>& src_depthmap, cv::Mat_<float>& upsample_depthmap, const cv::Mat_<cv::Vec3f>& src_normal, cv::Mat_<cv::Vec3f>& upsample_normal)
 {
+	HPM_TRACE_SCOPE("JBUPrior");
 	uint32_t rows = scaled_image_float.rows;
 	uint32_t cols = scaled_image_float.cols;
 	int Imagescale = std::max(scaled_image_float.rows / src_depthmap.rows, scaled_image_float.cols / src_depthmap.cols);
@@ -1286,89 +1667,86 @@ void HPM::JointBilateralUpsampling_prior(const cv::Mat_<float>& scaled_image_flo
 		std::cout << "Image.rows = Depthmap.rows" << std::endl;
 		return;
 	}
-	std::vector<cv::Mat_<float> > imgs(JBU_NUM);
-	imgs[0] = scaled_image_float.clone();
-	imgs[1] = src_depthmap.clone();
-
-	JBU_prior jbu_prior;
-	jbu_prior.jp_h.height = rows;
-	jbu_prior.jp_h.width = cols;
-	jbu_prior.jp_h.s_height = src_depthmap.rows;
-	jbu_prior.jp_h.s_width = src_depthmap.cols;
-	jbu_prior.jp_h.Imagescale = Imagescale;
-
-	JBUAddImageToTextureFloatGray(imgs, jbu_prior.jt_h.imgs, jbu_prior.cuArray, JBU_NUM);
-	jbu_prior.normal_origin_host = new float4[src_depthmap.rows * src_depthmap.cols];
-	for (int i = 0; i < src_depthmap.rows; i++) {
-		for (int j = 0; j < src_depthmap.cols; j++) {
-			int center = i * src_depthmap.cols + j;
-			jbu_prior.normal_origin_host[center].x = src_normal(i, j)[0];
-			jbu_prior.normal_origin_host[center].y = src_normal(i, j)[1];
-			jbu_prior.normal_origin_host[center].z = src_normal(i, j)[2];
-			jbu_prior.normal_origin_host[center].w = src_depthmap(i, j);
-			//std::cout << jbu.normal_origin_host[center].x << " " << jbu.normal_origin_host[center].y << " " << jbu.normal_origin_host[center].z << " " << jbu.normal_origin_host[center].w << std::endl;
-		}
+	if (prior_upsample == UPSAMPLE_GUIDED) {
+		GuidedUpsampleHost(scaled_image_float, src_depthmap, src_normal, upsample_depthmap, upsample_normal);
+		return;
 	}
-	jbu_prior.InitializeParameters_prior(rows * cols, src_depthmap.rows * src_depthmap.cols);
-	jbu_prior.CudaRun_prior();
-
-
-	for (uint32_t i = 0; i < cols; ++i) {
-		for (uint32_t j = 0; j < rows; ++j) {
-			int center = i + cols * j;
-			if (jbu_prior.depth_h[center] != jbu_prior.depth_h[center]) {
-				//std::cout << "wrong!" << std::endl;
-				upsample_depthmap(j, i) = src_depthmap(j / 2, i / 2);
-				upsample_normal(j, i)[0] = src_normal(j / 2, i / 2)[0];
-				upsample_normal(j, i)[1] = src_normal(j / 2, i / 2)[1];
-				upsample_normal(j, i)[2] = src_normal(j / 2, i / 2)[2];
+	if (!CudaDeviceAvailable()) {
+		JBUHost_prior(scaled_image_float, src_depthmap, src_normal, upsample_depthmap, upsample_normal, Imagescale, upsample_tile_rows);
+		return;
+	}
+	const int tile_rows = upsample_tile_rows > 0 ? upsample_tile_rows : (int)rows;
+	for (int y0 = 0; y0 < (int)rows; y0 += tile_rows) {
+		const int y1 = std::min(y0 + tile_rows, (int)rows);
+		const JBUBand band = ComputeJBUBand(y0, y1, rows, cols, src_depthmap.rows, src_depthmap.cols, Imagescale);
+
+		std::vector<cv::Mat_<float> > imgs(JBU_NUM);
+		imgs[0] = scaled_image_float.rowRange(band.guide_y0, band.guide_y1);
+		imgs[1] = src_depthmap.rowRange(band.src_y0, band.src_y1);
+
+		JBU_prior jbu_prior;
+		jbu_prior.jp_h.height = rows;
+		jbu_prior.jp_h.width = cols;
+		jbu_prior.jp_h.s_height = src_depthmap.rows;
+		jbu_prior.jp_h.s_width = src_depthmap.cols;
+		jbu_prior.jp_h.Imagescale = Imagescale;
+		jbu_prior.jp_h.y_offset = band.y0;
+		jbu_prior.jp_h.band_rows = band.y1 - band.y0;
+		jbu_prior.jp_h.guide_y0 = band.guide_y0;
+		jbu_prior.jp_h.src_y0 = band.src_y0;
+
+		JBUAddImageToTextureFloatGray(imgs, jbu_prior.jt_h.imgs, jbu_prior.cuArray, JBU_NUM);
+		const int src_band_rows = band.src_y1 - band.src_y0;
+		jbu_prior.normal_origin_host.Allocate(src_band_rows * src_depthmap.cols);
+		for (int i = 0; i < src_band_rows; i++) {
+			for (int j = 0; j < src_depthmap.cols; j++) {
+				int center = i * src_depthmap.cols + j;
+				jbu_prior.normal_origin_host[center].x = src_normal(band.src_y0 + i, j)[0];
+				jbu_prior.normal_origin_host[center].y = src_normal(band.src_y0 + i, j)[1];
+				jbu_prior.normal_origin_host[center].z = src_normal(band.src_y0 + i, j)[2];
+				jbu_prior.normal_origin_host[center].w = src_depthmap(band.src_y0 + i, j);
+			}
+		}
+		jbu_prior.InitializeParameters_prior(jbu_prior.jp_h.band_rows * cols, src_band_rows * src_depthmap.cols);
+		jbu_prior.CudaRun_prior();
+
+		for (int j = y0; j < y1; ++j) {
+			for (uint32_t i = 0; i < cols; ++i) {
+				int center = i + cols * (j - y0);
+				upsample_depthmap(j, i) = jbu_prior.depth_h[center];
+				upsample_normal(j, i)[0] = jbu_prior.normal_h[center].x;
+				upsample_normal(j, i)[1] = jbu_prior.normal_h[center].y;
+				upsample_normal(j, i)[2] = jbu_prior.normal_h[center].z;
 			}
-			upsample_depthmap(j, i) = jbu_prior.depth_h[center];
-			upsample_normal(j, i)[0] = jbu_prior.normal_h[center].x;
-			upsample_normal(j, i)[1] = jbu_prior.normal_h[center].y;
-			upsample_normal(j, i)[2] = jbu_prior.normal_h[center].z;
 		}
-	}
 
-	for (int i = 0; i < JBU_NUM; i++) {
-		CUDA_SAFE_CALL(cudaDestroyTextureObject(jbu_prior.jt_h.imgs[i]));
-		CUDA_SAFE_CALL(cudaFreeArray(jbu_prior.cuArray[i]));
-	}
-	//jbu.~JBU();
-	jbu_prior.ReleaseJBUCudaMemory_prior();
-	imgs[0].release();
-	imgs[1].release();
-	//delete(jbu.depth_h);
-	//delete(jbu.normal_h);
-	//free(jbu.depth_h);
-	//free(jbu.normal_h);
-	imgs.clear();
-	imgs.shrink_to_fit();
-	delete(jbu_prior.normal_origin_host);
+		for (int i = 0; i < JBU_NUM; i++) {
+			CUDA_SAFE_CALL(cudaDestroyTextureObject(jbu_prior.jt_h.imgs[i]));
+			CUDA_SAFE_CALL(cudaFreeArray(jbu_prior.cuArray[i]));
+		}
+		jbu_prior.ReleaseJBUCudaMemory_prior();
+	}
 	cudaDeviceSynchronize();
 }
 
 
-JBU_prior::JBU_prior() {}
+JBU_prior::JBU_prior() : jt_d(NULL), jp_d(NULL) {}
 
 JBU_prior::~JBU_prior()
 {
-	free(depth_h);
-
-	cudaFree(depth_d);
+	// Pooled buffers return to the BufferArena on destruction
 	cudaFree(jp_d);
 	cudaFree(jt_d);
 }
 
 void JBU_prior::InitializeParameters_prior(int n, int origin_n)
 {
-	depth_h = (float*)malloc(sizeof(float) * n);
-	normal_h = new float4[n];
+	depth_h.Allocate(n);
+	normal_h.Allocate(n);
 
-
-	cudaMalloc((void**)&depth_d, sizeof(float) * n);
-	cudaMalloc((void**)&normal_d, sizeof(float4) * n);
-	cudaMalloc((void**)&normal_origin_cuda, sizeof(float4) * origin_n);
+	depth_d.Allocate(n);
+	normal_d.Allocate(n);
+	normal_origin_cuda.Allocate(origin_n);
 	cudaMemcpy(normal_origin_cuda, normal_origin_host, sizeof(float4) * origin_n, cudaMemcpyHostToDevice);
 
 	cudaMalloc((void**)&jp_d, sizeof(JBUParameters) * 1);
@@ -1380,31 +1758,26 @@ void JBU_prior::InitializeParameters_prior(int n, int origin_n)
 }
 
 void JBU_prior::ReleaseJBUCudaMemory_prior() {
-	cudaFree(depth_d);
-	cudaFree(normal_d);
-	cudaFree(normal_origin_cuda);
+	depth_d.Reset();
+	normal_d.Reset();
+	normal_origin_cuda.Reset();
 	cudaFree(jp_d);
 	cudaFree(jt_d);
+	jp_d = NULL;
+	jt_d = NULL;
 }
 
 void HPM::ReloadPlanarPriorInitialization(const cv::Mat_<float>& masks, float4* prior_plane_parameters)
 {
-	prior_planes_host = new float4[cameras[0].height * cameras[0].width];
-	cudaMalloc((void**)&prior_planes_cuda, sizeof(float4) * (cameras[0].height * cameras[0].width));
-
-	plane_masks_host = new unsigned int[cameras[0].height * cameras[0].width];
-	cudaMalloc((void**)&plane_masks_cuda, sizeof(unsigned int) * (cameras[0].height * cameras[0].width));
+	HPM_TRACE_SCOPE("PlanarPriorInitialization");
+	prior_planes_host.Allocate(cameras[0].height, cameras[0].width);
+	prior_planes_cuda.Allocate(cameras[0].height * cameras[0].width);
 
+	plane_masks_host.Allocate(cameras[0].height * cameras[0].width);
+	plane_masks_cuda.Allocate(cameras[0].height * cameras[0].width);
 
-	for (int i = 0; i < cameras[0].width; ++i) {
-		for (int j = 0; j < cameras[0].height; ++j) {
-			int center = j * cameras[0].width + i;
-			plane_masks_host[center] = (unsigned int)masks(j, i);
-			if (masks(j, i) > 0) {
-				prior_planes_host[center] = prior_plane_parameters[center];
-			}
-		}
-	}
-	cudaMemcpy(prior_planes_cuda, prior_planes_host, sizeof(float4) * (cameras[0].height * cameras[0].width), cudaMemcpyHostToDevice);
+	const int width = cameras[0].width;
+	ImportPriorPlanes(masks, plane_masks_host.get(), prior_planes_host, [&](const int row, const int col, const int) { return prior_plane_parameters[row * width + col]; });
+	UploadHypothesisField(prior_planes_host, HypothesisField::D, prior_planes_cuda, NULL);
 	cudaMemcpy(plane_masks_cuda, plane_masks_host, sizeof(unsigned int) * (cameras[0].height * cameras[0].width), cudaMemcpyHostToDevice);
 }
\ No newline at end of file
@@ -1,4 +1,9 @@
 #include "HPM.h"
+#include "MedianFilter.h"
+#include "TopKSelector.h"
+#include "GeomConsistency.h"
+
+#include <cuda_fp16.h>
 
 #define mul4(v,k) { \
     v->x = v->x * k; \
@@ -12,16 +17,13 @@
     v->z = v->z / k;\
 }
 
-__device__  void sort_small(float* d, const int n)
-{
-    int j;
-    for (int i = 1; i < n; i++) {
-        float tmp = d[i];
-        for (j = i; j >= 1 && tmp < d[j - 1]; j--)
-            d[j] = d[j - 1];
-        d[j] = tmp;
-    }
-}
+// Adds n to a PatchMatchCounters field when statistics are collected
+#define PM_COUNT(params, field, n) \
+    do { \
+        if ((params).stats != NULL) { \
+            atomicAdd(&(params).stats->field, (unsigned long long)(n)); \
+        } \
+    } while (0)
 
 __device__ void sort_small_weighted(float* d, float* w, int n)
 {
@@ -248,7 +250,7 @@ __device__ float4 GeneratePertubedPlaneHypothesis(const Camera camera, const int
     return plane_hypothesis;
 }
 
-__device__ void ComputeHomography(const Camera ref_camera, const Camera src_camera, const float4 plane_hypothesis, float* H)
+__host__ __device__ void ComputeViewPairHomography(const Camera ref_camera, const Camera src_camera, ViewPairHomography& pair)
 {
     float ref_C[3];
     float src_C[3];
@@ -278,39 +280,61 @@ __device__ void ComputeHomography(const Camera ref_camera, const Camera src_came
     t_relative[1] = src_camera.R[3] * C_relative[0] + src_camera.R[4] * C_relative[1] + src_camera.R[5] * C_relative[2];
     t_relative[2] = src_camera.R[6] * C_relative[0] + src_camera.R[7] * C_relative[1] + src_camera.R[8] * C_relative[2];
 
-    H[0] = R_relative[0] - t_relative[0] * plane_hypothesis.x / plane_hypothesis.w;
-    H[1] = R_relative[1] - t_relative[0] * plane_hypothesis.y / plane_hypothesis.w;
-    H[2] = R_relative[2] - t_relative[0] * plane_hypothesis.z / plane_hypothesis.w;
-    H[3] = R_relative[3] - t_relative[1] * plane_hypothesis.x / plane_hypothesis.w;
-    H[4] = R_relative[4] - t_relative[1] * plane_hypothesis.y / plane_hypothesis.w;
-    H[5] = R_relative[5] - t_relative[1] * plane_hypothesis.z / plane_hypothesis.w;
-    H[6] = R_relative[6] - t_relative[2] * plane_hypothesis.x / plane_hypothesis.w;
-    H[7] = R_relative[7] - t_relative[2] * plane_hypothesis.y / plane_hypothesis.w;
-    H[8] = R_relative[8] - t_relative[2] * plane_hypothesis.z / plane_hypothesis.w;
-
+    // R_relative K_ref^-1, then K_src on the left; K_ref and K_src are taken
+    // as [fx 0 cx; 0 fy cy; 0 0 k8] like the former per-call products
     float tmp[9];
-    tmp[0] = H[0] / ref_camera.K[0];
-    tmp[1] = H[1] / ref_camera.K[4];
-    tmp[2] = -H[0] * ref_camera.K[2] / ref_camera.K[0] - H[1] * ref_camera.K[5] / ref_camera.K[4] + H[2];
-    tmp[3] = H[3] / ref_camera.K[0];
-    tmp[4] = H[4] / ref_camera.K[4];
-    tmp[5] = -H[3] * ref_camera.K[2] / ref_camera.K[0] - H[4] * ref_camera.K[5] / ref_camera.K[4] + H[5];
-    tmp[6] = H[6] / ref_camera.K[0];
-    tmp[7] = H[7] / ref_camera.K[4];
-    tmp[8] = -H[6] * ref_camera.K[2] / ref_camera.K[0] - H[7] * ref_camera.K[5] / ref_camera.K[4] + H[8];
-
-    H[0] = src_camera.K[0] * tmp[0] + src_camera.K[2] * tmp[6];
-    H[1] = src_camera.K[0] * tmp[1] + src_camera.K[2] * tmp[7];
-    H[2] = src_camera.K[0] * tmp[2] + src_camera.K[2] * tmp[8];
-    H[3] = src_camera.K[4] * tmp[3] + src_camera.K[5] * tmp[6];
-    H[4] = src_camera.K[4] * tmp[4] + src_camera.K[5] * tmp[7];
-    H[5] = src_camera.K[4] * tmp[5] + src_camera.K[5] * tmp[8];
-    H[6] = src_camera.K[8] * tmp[6];
-    H[7] = src_camera.K[8] * tmp[7];
-    H[8] = src_camera.K[8] * tmp[8];
-}
-
-__device__ float2 ComputeCorrespondingPoint(const float* H, const int2 p)
+    for (int r = 0; r < 3; ++r) {
+        tmp[r * 3 + 0] = R_relative[r * 3 + 0] / ref_camera.K[0];
+        tmp[r * 3 + 1] = R_relative[r * 3 + 1] / ref_camera.K[4];
+        tmp[r * 3 + 2] = -R_relative[r * 3 + 0] * ref_camera.K[2] / ref_camera.K[0] - R_relative[r * 3 + 1] * ref_camera.K[5] / ref_camera.K[4] + R_relative[r * 3 + 2];
+    }
+    for (int c = 0; c < 3; ++c) {
+        pair.A[c] = src_camera.K[0] * tmp[c] + src_camera.K[2] * tmp[6 + c];
+        pair.A[3 + c] = src_camera.K[4] * tmp[3 + c] + src_camera.K[5] * tmp[6 + c];
+        pair.A[6 + c] = src_camera.K[8] * tmp[6 + c];
+    }
+    pair.b[0] = src_camera.K[0] * t_relative[0] + src_camera.K[2] * t_relative[2];
+    pair.b[1] = src_camera.K[4] * t_relative[1] + src_camera.K[5] * t_relative[2];
+    pair.b[2] = src_camera.K[8] * t_relative[2];
+
+    pair.ref_K_inv[0] = 1.0f / ref_camera.K[0];
+    pair.ref_K_inv[1] = 1.0f / ref_camera.K[4];
+    pair.ref_K_inv[2] = ref_camera.K[2] / ref_camera.K[0];
+    pair.ref_K_inv[3] = ref_camera.K[5] / ref_camera.K[4];
+}
+
+void ComputeViewPairHomographies(const std::vector<Camera>& cameras, std::vector<ViewPairHomography>& pairs)
+{
+    pairs.resize(cameras.size());
+    for (size_t i = 0; i < cameras.size(); ++i) {
+        ComputeViewPairHomography(cameras[0], cameras[i], pairs[i]);
+    }
+}
+
+__host__ __device__ void ComputeHomography(const ViewPairHomography& pair, const float4 plane_hypothesis, float* H)
+{
+    // n^T K_ref^-1 / d
+    const float inv_d = 1.0f / plane_hypothesis.w;
+    const float m[3] = {
+        plane_hypothesis.x * pair.ref_K_inv[0] * inv_d,
+        plane_hypothesis.y * pair.ref_K_inv[1] * inv_d,
+        (plane_hypothesis.z - plane_hypothesis.x * pair.ref_K_inv[2] - plane_hypothesis.y * pair.ref_K_inv[3]) * inv_d
+    };
+    for (int r = 0; r < 3; ++r) {
+        H[r * 3 + 0] = pair.A[r * 3 + 0] - pair.b[r] * m[0];
+        H[r * 3 + 1] = pair.A[r * 3 + 1] - pair.b[r] * m[1];
+        H[r * 3 + 2] = pair.A[r * 3 + 2] - pair.b[r] * m[2];
+    }
+}
+
+__host__ __device__ void ComputeHomography(const Camera ref_camera, const Camera src_camera, const float4 plane_hypothesis, float* H)
+{
+    ViewPairHomography pair;
+    ComputeViewPairHomography(ref_camera, src_camera, pair);
+    ComputeHomography(pair, plane_hypothesis, H);
+}
+
+__host__ __device__ float2 ComputeCorrespondingPoint(const float* H, const int2 p)
 {
     float3 pt;
     pt.x = H[0] * p.x + H[1] * p.y + H[2];
@@ -346,39 +370,19 @@ __device__ float ComputeBilateralWeight(const float x_dist, const float y_dist,
     return exp(-spatial_dist / (2.0f * sigma_spatial * sigma_spatial) - color_dist / (2.0f * sigma_color * sigma_color));
 }
 
-__device__ float ComputeTexture(const unsigned int* Canny, const Camera* cameras, const int2 p) {
-    int width = cameras[0].width;
-    int height = cameras[0].height;
-    if (p.x >= width || p.y >= height) {
-        return;
-    }
-    int total_pixels = 0;
-    int edge_pixels = 0;
-    const int center = p.y * width + p.x;
-    for (int i = -5; i < 6; i = i + 2) {
-        for (int j = -5; j < 6; j = j + 2) {
-            int tmp_x = p.x + j;
-            int tmp_y = p.y + i;
-            if (tmp_x >= 0 && tmp_x < width && tmp_y >= 0 && tmp_y < height) {
-                int tmp_position = tmp_y * width + tmp_x;
-                total_pixels++;
-                if (Canny[tmp_position] >= 1) {
-                    edge_pixels++;
-                }
-            }
-        }
-    }
-    float texture = ((edge_pixels * 1.0f / total_pixels) + 0.00005) / ((edge_pixels * 1.0f / total_pixels) + 0.0001);//0.00005 0.00001
-    return texture;
+// Image textures hold 8/16-bit intensities read as normalized floats
+__device__ __forceinline__ float FetchImage(const cudaTextureObject_t image, const float x, const float y, const float image_scale)
+{
+    return tex2D<float>(image, x, y) * image_scale;
 }
 
-__device__ float ComputeBilateralNCC(const cudaTextureObject_t ref_image, const Camera ref_camera, const cudaTextureObject_t src_image, const Camera src_camera, const int2 p, const float4 plane_hypothesis, const PatchMatchParams params)
+__device__ float ComputeBilateralNCC(const cudaTextureObject_t ref_image, const cudaTextureObject_t src_image, const Camera src_camera, const ViewPairHomography& view_pair, const int2 p, const float4 plane_hypothesis, const PatchMatchParams params)
 {
     const float cost_max = 2.0f;
     int radius = params.patch_size / 2;
 
     float H[9];
-    ComputeHomography(ref_camera, src_camera, plane_hypothesis, H);
+    ComputeHomography(view_pair, plane_hypothesis, H);
     float2 pt = ComputeCorrespondingPoint(H, p);
     if (pt.x >= src_camera.width || pt.x < 0.0f || pt.y >= src_camera.height || pt.y < 0.0f) {
         return cost_max;
@@ -392,7 +396,7 @@ __device__ float ComputeBilateralNCC(const cudaTextureObject_t ref_image, const
         float sum_src_src = 0.0f;
         float sum_ref_src = 0.0f;
         float bilateral_weight_sum = 0.0f;
-        const float ref_center_pix = tex2D<float>(ref_image, p.x + 0.5f, p.y + 0.5f);
+        const float ref_center_pix = FetchImage(ref_image, p.x + 0.5f, p.y + 0.5f, params.image_scale);
 
         for (int i = -radius; i < radius + 1; i += params.radius_increment) {
             float sum_ref_row = 0.0f;
@@ -404,9 +408,9 @@ __device__ float ComputeBilateralNCC(const cudaTextureObject_t ref_image, const
 
             for (int j = -radius; j < radius + 1; j += params.radius_increment) {
                 const int2 ref_pt = make_int2(p.x + i, p.y + j);
-                const float ref_pix = tex2D<float>(ref_image, ref_pt.x + 0.5f, ref_pt.y + 0.5f);
+                const float ref_pix = FetchImage(ref_image, ref_pt.x + 0.5f, ref_pt.y + 0.5f, params.image_scale);
                 float2 src_pt = ComputeCorrespondingPoint(H, ref_pt);
-                const float src_pix = tex2D<float>(src_image, src_pt.x + 0.5f, src_pt.y + 0.5f);
+                const float src_pix = FetchImage(src_image, src_pt.x + 0.5f, src_pt.y + 0.5f, params.image_scale);
 
                 float weight = ComputeBilateralWeight(i, j, ref_pix, ref_center_pix, params.sigma_spatial, params.sigma_color);
 
@@ -447,124 +451,100 @@ __device__ float ComputeBilateralNCC(const cudaTextureObject_t ref_image, const
     }
 }
 
-__device__ float ComputeMultiViewInitialCostandSelectedViews(const cudaTextureObject_t* images, const Camera* cameras, const int2 p, const float4 plane_hypothesis, unsigned int* selected_views, const PatchMatchParams params)
+template <int K>
+__device__ float SelectTopKViews(const cudaTextureObject_t* images, const Camera* cameras, const int2 p, const float4 plane_hypothesis, unsigned int* selected_views, const PatchMatchParams params)
 {
-    float cost_max = 2.0f;
-    float cost_vector[32] = { 2.0f };
-    float cost_vector_copy[32] = { 2.0f };
-    int cost_count = 0;
+    const float cost_max = 2.0f;
+    TopKSelector<K> selector;
+    selector.Reset();
     int num_valid_views = 0;
-
     for (int i = 1; i < params.num_images; ++i) {
-        float c = ComputeBilateralNCC(images[0], cameras[0], images[i], cameras[i], p, plane_hypothesis, params);
-        cost_vector[i - 1] = c;
-        cost_vector_copy[i - 1] = c;
-        cost_count++;
+        const float c = ComputeBilateralNCC(images[0], images[i], cameras[i], params.view_pairs[i], p, plane_hypothesis, params);
+        selector.Push(c, i - 1);
         if (c < cost_max) {
             num_valid_views++;
         }
     }
 
-    sort_small(cost_vector, cost_count);
     *selected_views = 0;
-
-    int top_k = min(num_valid_views, params.top_k);
+    const int top_k = min(num_valid_views, params.top_k);
     if (top_k > 0) {
-        float cost = 0.0f;
-        for (int i = 0; i < top_k; ++i) {
-            cost += cost_vector[i];
-        }
-        float cost_threshold = cost_vector[top_k - 1];
-        for (int i = 0; i < params.num_images - 1; ++i) {
-            if (cost_vector_copy[i] <= cost_threshold) {
-                setBit(*selected_views, i);
-            }
-        }
-        return cost / top_k;
+        float cost_threshold;
+        return selector.Finish(top_k, cost_threshold, *selected_views);
     }
     else {
         return cost_max;
     }
 }
 
-__device__ void ComputeMultiViewCostVector(const cudaTextureObject_t* images, const Camera* cameras, const int2 p, const float4 plane_hypothesis, float* cost_vector, const PatchMatchParams params)
+__device__ float ComputeMultiViewInitialCostandSelectedViews(const cudaTextureObject_t* images, const Camera* cameras, const int2 p, const float4 plane_hypothesis, unsigned int* selected_views, const PatchMatchParams params)
 {
-    for (int i = 1; i < params.num_images; ++i) {
-        cost_vector[i - 1] = ComputeBilateralNCC(images[0], cameras[0], images[i], cameras[i], p, plane_hypothesis, params);
+    PM_COUNT(params, hypotheses_evaluated, 1);
+    PM_COUNT(params, ncc_evaluations, params.num_images - 1);
+    // Selector capacity by top_k, so the default keeps four slots in registers
+    if (params.top_k <= 4) {
+        return SelectTopKViews<4>(images, cameras, p, plane_hypothesis, selected_views, params);
     }
+    if (params.top_k <= 8) {
+        return SelectTopKViews<8>(images, cameras, p, plane_hypothesis, selected_views, params);
+    }
+    return SelectTopKViews<32>(images, cameras, p, plane_hypothesis, selected_views, params);
 }
 
-__device__ float NormDiffCalculate(const float4 vec1, const float4 vec2) {
-    return fabs(vec1.x - vec2.x) + fabs(vec1.y - vec2.y) + fabs(vec1.z - vec2.z);
+__device__ void ComputeMultiViewCostVector(const cudaTextureObject_t* images, const Camera* cameras, const int2 p, const float4 plane_hypothesis, float* cost_vector, const PatchMatchParams params)
+{
+    PM_COUNT(params, hypotheses_evaluated, 1);
+    PM_COUNT(params, ncc_evaluations, params.num_images - 1);
+    for (int i = 1; i < params.num_images; ++i) {
+        cost_vector[i - 1] = ComputeBilateralNCC(images[0], images[i], cameras[i], params.view_pairs[i], p, plane_hypothesis, params);
+    }
 }
 
-__device__ float3 Get3DPointonWorld_cu(const float x, const float y, const float depth, const Camera camera)
-{
-    float3 pointX;
-    float3 tmpX;
-    // Reprojection
-    pointX.x = depth * (x - camera.K[2]) / camera.K[0];
-    pointX.y = depth * (y - camera.K[5]) / camera.K[4];
-    pointX.z = depth;
-
-    // Rotation
-    tmpX.x = camera.R[0] * pointX.x + camera.R[3] * pointX.y + camera.R[6] * pointX.z;
-    tmpX.y = camera.R[1] * pointX.x + camera.R[4] * pointX.y + camera.R[7] * pointX.z;
-    tmpX.z = camera.R[2] * pointX.x + camera.R[5] * pointX.y + camera.R[8] * pointX.z;
-
-    // Transformation
-    float3 C;
-    C.x = -(camera.R[0] * camera.t[0] + camera.R[3] * camera.t[1] + camera.R[6] * camera.t[2]);
-    C.y = -(camera.R[1] * camera.t[0] + camera.R[4] * camera.t[1] + camera.R[7] * camera.t[2]);
-    C.z = -(camera.R[2] * camera.t[0] + camera.R[5] * camera.t[1] + camera.R[8] * camera.t[2]);
-    pointX.x = tmpX.x + C.x;
-    pointX.y = tmpX.y + C.y;
-    pointX.z = tmpX.z + C.z;
-
-    return pointX;
-}
-
-__device__ void ProjectonCamera_cu(const float3 PointX, const Camera camera, float2& point, float& depth)
+// Per-view costs of a pixel's own plane, kept in fp16 between sweeps. An entry
+// is used only while the plane stored with it equals the pixel's plane, so any
+// write to plane_hypotheses invalidates it.
+__device__ void StoreCachedCostVector(const Camera* cameras, const int center, const float4 plane_hypothesis, const float* cost_vector, const PatchMatchParams params)
 {
-    float3 tmp;
-    tmp.x = camera.R[0] * PointX.x + camera.R[1] * PointX.y + camera.R[2] * PointX.z + camera.t[0];
-    tmp.y = camera.R[3] * PointX.x + camera.R[4] * PointX.y + camera.R[5] * PointX.z + camera.t[1];
-    tmp.z = camera.R[6] * PointX.x + camera.R[7] * PointX.y + camera.R[8] * PointX.z + camera.t[2];
-
-    depth = camera.K[6] * tmp.x + camera.K[7] * tmp.y + camera.K[8] * tmp.z;
-    point.x = (camera.K[0] * tmp.x + camera.K[1] * tmp.y + camera.K[2] * tmp.z) / depth;
-    point.y = (camera.K[3] * tmp.x + camera.K[4] * tmp.y + camera.K[5] * tmp.z) / depth;
+    const int num_pixels = cameras[0].width * cameras[0].height;
+    for (int i = 0; i < params.num_images - 1; ++i) {
+        params.cost_cache[i * num_pixels + center] = __half_as_ushort(__float2half_rn(cost_vector[i]));
+    }
+    params.cost_cache_planes[center] = plane_hypothesis;
 }
 
-__device__ float ComputeGeomConsistencyCost(const cudaTextureObject_t depth_image, const Camera ref_camera, const Camera src_camera, const float4 plane_hypothesis, const int2 p)
+// Cost vector of the pixel's current plane, from the cache when enabled and valid
+__device__ void ComputeCurrentCostVector(const cudaTextureObject_t* images, const Camera* cameras, const int2 p, const float4 plane_hypothesis, float* cost_vector, const PatchMatchParams params)
 {
-    const float max_cost = 3.0f;
-
-    float depth = ComputeDepthfromPlaneHypothesis(ref_camera, plane_hypothesis, p);
-    float3 forward_point = Get3DPointonWorld_cu(p.x, p.y, depth, ref_camera);
-
-    float2 src_pt;
-    float src_d;
-    ProjectonCamera_cu(forward_point, src_camera, src_pt, src_d);
-    const float src_depth = tex2D<float>(depth_image, (int)src_pt.x + 0.5f, (int)src_pt.y + 0.5f);
-
-    if (src_depth == 0.0f) {
-        return max_cost;
+    if (params.cost_cache == NULL) {
+        ComputeMultiViewCostVector(images, cameras, p, plane_hypothesis, cost_vector, params);
+        return;
     }
+    const int num_pixels = cameras[0].width * cameras[0].height;
+    const int center = p.y * cameras[0].width + p.x;
+    const float4 cached_plane = params.cost_cache_planes[center];
+    if (cached_plane.x == plane_hypothesis.x && cached_plane.y == plane_hypothesis.y && cached_plane.z == plane_hypothesis.z && cached_plane.w == plane_hypothesis.w) {
+        PM_COUNT(params, cost_cache_hits, 1);
+        for (int i = 0; i < params.num_images - 1; ++i) {
+            cost_vector[i] = __half2float(__ushort_as_half(params.cost_cache[i * num_pixels + center]));
+        }
+        return;
+    }
+    ComputeMultiViewCostVector(images, cameras, p, plane_hypothesis, cost_vector, params);
+    StoreCachedCostVector(cameras, center, plane_hypothesis, cost_vector, params);
+}
 
-    float3 src_3D_pt = Get3DPointonWorld_cu(src_pt.x, src_pt.y, src_depth, src_camera);
-
-    float2 backward_point;
-    float ref_d;
-    ProjectonCamera_cu(src_3D_pt, ref_camera, backward_point, ref_d);
+__device__ float NormDiffCalculate(const float4 vec1, const float4 vec2) {
+    return fabs(vec1.x - vec2.x) + fabs(vec1.y - vec2.y) + fabs(vec1.z - vec2.z);
+}
 
-    const float diff_col = p.x - backward_point.x;
-    const float diff_row = p.y - backward_point.y;
-    return min(max_cost, sqrt(diff_col * diff_col + diff_row * diff_row));
+__device__ float ComputeGeomConsistencyCost(const cudaTextureObject_t depth_image, const ViewPairHomography& forward, const ViewPairHomography& backward, const float4 plane_hypothesis, const int2 p)
+{
+    auto depth_at = [&](const float x, const float y) { return tex2D<float>(depth_image, (int)x + 0.5f, (int)y + 0.5f); };
+    return GeomConsistencyCost(forward, backward, depth_at, plane_hypothesis, p);
 }
 
 
-__global__ void RandomInitialization(cudaTextureObjects* texture_objects, Camera* cameras, float4* plane_hypotheses, float4* scaled_plane_hypotheses, float* costs, float* pre_costs, curandState* rand_states, unsigned int* selected_views, float4* prior_planes, unsigned int* plane_masks, const PatchMatchParams params, float* confidences, unsigned int* Canny, float* texture)
+__global__ void RandomInitialization(cudaTextureObjects* texture_objects, Camera* cameras, float4* plane_hypotheses, float4* scaled_plane_hypotheses, float* costs, float* pre_costs, curandState* rand_states, unsigned int* selected_views, float4* prior_planes, unsigned int* plane_masks, const PatchMatchParams params, float* confidences, const float* texture)
 {
 
     const int2 p = make_int2(blockIdx.x * blockDim.x + threadIdx.x, blockIdx.y * blockDim.y + threadIdx.y);
@@ -577,10 +557,6 @@ __global__ void RandomInitialization(cudaTextureObjects* texture_objects, Camera
 
     const int center = p.y * width + p.x;
     curand_init(clock64(), p.y, p.x, &rand_states[center]);
-    
-    if (!params.prior_consistency && !params.mand_consistency) {
-        texture[center] = ComputeTexture(Canny, cameras, p);
-    }
 
     if (!params.geom_consistency && !params.hierarchy && !params.prior_consistency) {
         plane_hypotheses[center] = GenerateRandomPlaneHypothesis(cameras[0], p, &rand_states[center], params.depth_min, params.depth_max);
@@ -631,60 +607,65 @@ __global__ void RandomInitialization(cudaTextureObjects* texture_objects, Camera
     }
     else {
         if (params.upsample) {
-            const float scale = 1.0 * params.scaled_cols / width;
-            const float sigmad = 0.50;
-            const float sigmar = 25.5;
-            const int Imagescale = max(width / params.scaled_cols, height / params.scaled_rows);
-            const int WinWidth = Imagescale * Imagescale + 1;
-            int num_neighbors = WinWidth / 2;
-
-            const float o_y = p.y * scale;
-            const float o_x = p.x * scale;
-            const float refPix = tex2D<float>(texture_objects[0].images[0], p.x + 0.5f, p.y + 0.5f);
-            int r_y = 0;
-            int r_ys = 0;
-            int r_x = 0;
-            int r_xs = 0;
-            float sgauss = 0.0, rgauss = 0.0, totalgauss = 0.0;
-            float c_total_val = 0.0, normalizing_factor = 0.0;
-            float  srcPix = 0, neighborPix = 0;
-            float4 srcNorm;
             float4 n_total_val;
-            n_total_val.x = 0; n_total_val.y = 0; n_total_val.z = 0; n_total_val.w = 0;
-            for (int j = -num_neighbors; j <= num_neighbors; ++j) {
-                // source
-                r_y = o_y + j;
-                r_y = (r_y > 0 ? (r_y < params.scaled_rows ? r_y : params.scaled_rows - 1) : 0);
-                // reference
-                r_ys = p.y + j;
-                for (int i = -num_neighbors; i <= num_neighbors; ++i) {
+            if (params.upsample_on_host) {
+                n_total_val = scaled_plane_hypotheses[center];
+            }
+            else {
+                const float scale = 1.0 * params.scaled_cols / width;
+                const float sigmad = 0.50;
+                const float sigmar = 25.5;
+                const int Imagescale = max(width / params.scaled_cols, height / params.scaled_rows);
+                const int WinWidth = Imagescale * Imagescale + 1;
+                int num_neighbors = WinWidth / 2;
+
+                const float o_y = p.y * scale;
+                const float o_x = p.x * scale;
+                const float refPix = FetchImage(texture_objects[0].images[0], p.x + 0.5f, p.y + 0.5f, params.image_scale);
+                int r_y = 0;
+                int r_ys = 0;
+                int r_x = 0;
+                int r_xs = 0;
+                float sgauss = 0.0, rgauss = 0.0, totalgauss = 0.0;
+                float c_total_val = 0.0, normalizing_factor = 0.0;
+                float  srcPix = 0, neighborPix = 0;
+                float4 srcNorm;
+                n_total_val.x = 0; n_total_val.y = 0; n_total_val.z = 0; n_total_val.w = 0;
+                for (int j = -num_neighbors; j <= num_neighbors; ++j) {
                     // source
-                    r_x = o_x + i;
-                    r_x = (r_x > 0 ? (r_x < params.scaled_cols ? r_x : params.scaled_cols - 1) : 0);
-                    const int s_center = r_y * params.scaled_cols + r_x;
-                    if (s_center >= params.scaled_rows * params.scaled_cols) {
-                        printf("Illegal: %d, %d, %f, %f (%d, %d)\n", r_x, r_y, o_x, o_y, params.scaled_cols, params.scaled_rows);
+                    r_y = o_y + j;
+                    r_y = (r_y > 0 ? (r_y < params.scaled_rows ? r_y : params.scaled_rows - 1) : 0);
+                    // reference
+                    r_ys = p.y + j;
+                    for (int i = -num_neighbors; i <= num_neighbors; ++i) {
+                        // source
+                        r_x = o_x + i;
+                        r_x = (r_x > 0 ? (r_x < params.scaled_cols ? r_x : params.scaled_cols - 1) : 0);
+                        const int s_center = r_y * params.scaled_cols + r_x;
+                        if (s_center >= params.scaled_rows * params.scaled_cols) {
+                            printf("Illegal: %d, %d, %f, %f (%d, %d)\n", r_x, r_y, o_x, o_y, params.scaled_cols, params.scaled_rows);
+                        }
+                        srcPix = scaled_plane_hypotheses[s_center].w;
+                        srcNorm = scaled_plane_hypotheses[s_center];
+                        // refIm
+                        r_xs = p.x + i;
+                        neighborPix = FetchImage(texture_objects[0].images[0], r_xs + 0.5f, r_ys + 0.5f, params.image_scale);
+
+                        sgauss = SpatialGauss(o_x, o_y, r_x, r_y, sigmad);
+                        rgauss = RangeGauss(fabs(refPix - neighborPix), sigmar);
+                        totalgauss = sgauss * rgauss;
+                        normalizing_factor += totalgauss;
+                        c_total_val += srcPix * totalgauss;
+                        mul4((&srcNorm), totalgauss);
+                        n_total_val.x = n_total_val.x + srcNorm.x;
+                        n_total_val.y = n_total_val.y + srcNorm.y;
+                        n_total_val.z = n_total_val.z + srcNorm.z;
                     }
-                    srcPix = scaled_plane_hypotheses[s_center].w;
-                    srcNorm = scaled_plane_hypotheses[s_center];
-                    // refIm
-                    r_xs = p.x + i;
-                    neighborPix = tex2D<float>(texture_objects[0].images[0], r_xs + 0.5f, r_ys + 0.5f);
-
-                    sgauss = SpatialGauss(o_x, o_y, r_x, r_y, sigmad);
-                    rgauss = RangeGauss(fabs(refPix - neighborPix), sigmar);
-                    totalgauss = sgauss * rgauss;
-                    normalizing_factor += totalgauss;
-                    c_total_val += srcPix * totalgauss;
-                    mul4((&srcNorm), totalgauss);
-                    n_total_val.x = n_total_val.x + srcNorm.x;
-                    n_total_val.y = n_total_val.y + srcNorm.y;
-                    n_total_val.z = n_total_val.z + srcNorm.z;
-                }
-            }
-            costs[center] = c_total_val / normalizing_factor;
-            vecdiv4((&n_total_val), normalizing_factor);
-            NormalizeVec3(&n_total_val);
+                }
+                costs[center] = c_total_val / normalizing_factor;
+                vecdiv4((&n_total_val), normalizing_factor);
+                NormalizeVec3(&n_total_val);
+            }
 
             costs[center] = ComputeMultiViewInitialCostandSelectedViews(texture_objects[0].images, cameras, p, plane_hypotheses[center], &selected_views[center], params);
             pre_costs[center] = costs[center];
@@ -712,8 +693,7 @@ __global__ void RandomInitialization(cudaTextureObjects* texture_objects, Camera
                 costs[center] = ComputeMultiViewInitialCostandSelectedViews(texture_objects[0].images, cameras, p, plane_hypotheses[center], &selected_views[center], params);
             }
             else {
-                float texture = ComputeTexture(Canny, cameras, p);
-                if (texture > 0.5) {
+                if (texture[center] > 0.5) {
                     confidences[center] = 0.1;
                     float4 plane_hypothesis;
                     if (params.hierarchy) {
@@ -762,8 +742,11 @@ __global__ void RandomInitialization(cudaTextureObjects* texture_objects, Camera
     }
 }
 
-__device__ void PlaneHypothesisRefinement(const cudaTextureObject_t* images, const cudaTextureObject_t* depth_images, const Camera* cameras, float4* plane_hypothesis, float* depth, float* cost, curandState* rand_state, const float* view_weights, const float weight_norm, float4* prior_planes, unsigned int* plane_masks, float* restricted_cost, const int2 p, const PatchMatchParams params, float texture)
+// Returns true if a candidate replaced *plane_hypothesis; its cost vector is
+// then copied to refined_cost_vector unless that is NULL
+__device__ bool PlaneHypothesisRefinement(const cudaTextureObject_t* images, const cudaTextureObject_t* depth_images, const Camera* cameras, float4* plane_hypothesis, float* depth, float* cost, curandState* rand_state, const float* view_weights, const float weight_norm, float4* prior_planes, unsigned int* plane_masks, float* restricted_cost, const int2 p, const PatchMatchParams params, float texture, float* refined_cost_vector)
 {
+    bool refined = false;
     float perturbation = 0.02f;
     const int center = p.y * cameras[0].width + p.x;
 
@@ -808,7 +791,7 @@ __device__ void PlaneHypothesisRefinement(const cudaTextureObject_t* images, con
         for (int j = 0; j < params.num_images - 1; ++j) {
             if (view_weights[j] > 0) {
                 if (params.geom_consistency) {
-                    temp_cost += view_weights[j] * (cost_vector[j] + 0.2f * ComputeGeomConsistencyCost(depth_images[j + 1], cameras[0], cameras[j + 1], temp_plane_hypothesis, p));
+                    temp_cost += view_weights[j] * (cost_vector[j] + 0.2f * ComputeGeomConsistencyCost(depth_images[j + 1], params.view_pairs[j + 1], params.inverse_view_pairs[j + 1], temp_plane_hypothesis, p));
                 }
                 else {
                     temp_cost += view_weights[j] * cost_vector[j];
@@ -828,6 +811,13 @@ __device__ void PlaneHypothesisRefinement(const cudaTextureObject_t* images, con
                 *plane_hypothesis = temp_plane_hypothesis;
                 *cost = temp_cost;
                 *restricted_cost = restricted_temp_cost;
+                PM_COUNT(params, refinement_accepted[i], 1);
+                refined = true;
+                if (refined_cost_vector != NULL) {
+                    for (int j = 0; j < params.num_images - 1; ++j) {
+                        refined_cost_vector[j] = cost_vector[j];
+                    }
+                }
             }
         }
         else {
@@ -835,9 +825,17 @@ __device__ void PlaneHypothesisRefinement(const cudaTextureObject_t* images, con
                 *depth = depth_before;
                 *plane_hypothesis = temp_plane_hypothesis;
                 *cost = temp_cost;
+                PM_COUNT(params, refinement_accepted[i], 1);
+                refined = true;
+                if (refined_cost_vector != NULL) {
+                    for (int j = 0; j < params.num_images - 1; ++j) {
+                        refined_cost_vector[j] = cost_vector[j];
+                    }
+                }
             }
         }
     }
+    return refined;
 }
 
 __device__ void ExtendedUpFarPropagation(const cudaTextureObject_t* images, const Camera* cameras, float4* plane_hypotheses, float* costs, unsigned int* selected_views, const int2 p, const PatchMatchParams params, int checkerboard_iter, int* position, float cost_array[][32], bool* flag) {
@@ -1340,11 +1338,12 @@ __device__ bool JudgeExtend(const int iter, int Extended_iter, int orientation,
         return false;
     }
     else {
+        PM_COUNT(params, extended_triggers[orientation], 1);
         return true;
     }
 }
 
-__device__ void CheckerboardPropagation(const cudaTextureObject_t* images, const cudaTextureObject_t* depths, const Camera* cameras, float4* plane_hypotheses, float* costs, float* pre_costs, curandState* rand_states, unsigned int* selected_views, float4* prior_planes, unsigned int* plane_masks, const int2 p, const PatchMatchParams params, const int iter, unsigned int* Canny, float* confidences)
+__device__ void CheckerboardPropagation(const cudaTextureObject_t* images, const cudaTextureObject_t* depths, const Camera* cameras, float4* plane_hypotheses, float* costs, float* pre_costs, curandState* rand_states, unsigned int* selected_views, float4* prior_planes, unsigned int* plane_masks, const int2 p, const PatchMatchParams params, const int iter, const float* texture_map, float* confidences)
 {
 
     int width = cameras[0].width;
@@ -1357,9 +1356,11 @@ __device__ void CheckerboardPropagation(const cudaTextureObject_t* images, const
 
     if (params.prior_consistency) {
         if (confidences[center] > 0.3) {
+            PM_COUNT(params, skipped_confidence, 1);
             return;
         }
         if (plane_masks[center] == 0) {
+            PM_COUNT(params, skipped_prior, 1);
             return;
         }
     }
@@ -1756,7 +1757,7 @@ __device__ void CheckerboardPropagation(const cudaTextureObject_t* images, const
             if (view_weights[j] > 0) {
                 if (params.geom_consistency) {
                     if (flag[i]) {
-                        final_costs[i] += view_weights[j] * (cost_array[i][j] + 0.2f * ComputeGeomConsistencyCost(depths[j + 1], cameras[0], cameras[j + 1], plane_hypotheses[positions[i]], p));
+                        final_costs[i] += view_weights[j] * (cost_array[i][j] + 0.2f * ComputeGeomConsistencyCost(depths[j + 1], params.view_pairs[j + 1], params.inverse_view_pairs[j + 1], plane_hypotheses[positions[i]], p));
                     }
                     else {
                         final_costs[i] += view_weights[j] * (cost_array[i][j] + 0.1f * 3.0f);
@@ -1773,11 +1774,11 @@ __device__ void CheckerboardPropagation(const cudaTextureObject_t* images, const
     const int min_cost_idx = FindMinCostIndex(final_costs, 8);
 
     float cost_vector_now[32] = { 2.0f };
-    ComputeMultiViewCostVector(images, cameras, p, plane_hypotheses[center], cost_vector_now, params);
+    ComputeCurrentCostVector(images, cameras, p, plane_hypotheses[center], cost_vector_now, params);
     float cost_now = 0.0f;
     for (int i = 0; i < params.num_images - 1; ++i) {
         if (params.geom_consistency) {
-            cost_now += view_weights[i] * (cost_vector_now[i] + 0.2f * ComputeGeomConsistencyCost(depths[i + 1], cameras[0], cameras[i + 1], plane_hypotheses[center], p));
+            cost_now += view_weights[i] * (cost_vector_now[i] + 0.2f * ComputeGeomConsistencyCost(depths[i + 1], params.view_pairs[i + 1], params.inverse_view_pairs[i + 1], plane_hypotheses[center], p));
         }
         else {
             cost_now += view_weights[i] * cost_vector_now[i];
@@ -1797,7 +1798,7 @@ __device__ void CheckerboardPropagation(const cudaTextureObject_t* images, const
         float two_angle_sigma_squared = 2 * angle_sigma * angle_sigma;
         float depth_prior = ComputeDepthfromPlaneHypothesis(cameras[0], prior_planes[center], p);
         float beta = 0.18f;
-        texture = ComputeTexture(Canny, cameras, p);
+        texture = texture_map[center];
 
         if (plane_masks[center] > 0) {
             for (int i = 0; i < 8; i++) {
@@ -1827,6 +1828,7 @@ __device__ void CheckerboardPropagation(const cudaTextureObject_t* images, const
                     costs[center] = final_costs[max_cost_idx];
                     restricted_cost = restricted_final_costs[max_cost_idx];
                     selected_views[center] = temp_selected_views;
+                    PM_COUNT(params, direction_wins[max_cost_idx], 1);
                 }
             }
         }
@@ -1837,11 +1839,14 @@ __device__ void CheckerboardPropagation(const cudaTextureObject_t* images, const
                 depth_now = depth_before;
                 plane_hypotheses[center] = plane_hypotheses[positions[min_cost_idx]];
                 costs[center] = final_costs[min_cost_idx];
+                PM_COUNT(params, direction_wins[min_cost_idx], 1);
             }
         }
     }
 
     float4 plane_hypotheses_now;
+    // Neighbour whose plane (and cost_array row) became plane_hypotheses_now
+    int now_idx = -1;
     if (!params.prior_consistency && flag[min_cost_idx]) {
         float depth_before = ComputeDepthfromPlaneHypothesis(cameras[0], plane_hypotheses[positions[min_cost_idx]], p);
 
@@ -1850,26 +1855,45 @@ __device__ void CheckerboardPropagation(const cudaTextureObject_t* images, const
             plane_hypotheses_now = plane_hypotheses[positions[min_cost_idx]];
             cost_now = final_costs[min_cost_idx];
             selected_views[center] = temp_selected_views;
+            now_idx = min_cost_idx;
+            PM_COUNT(params, direction_wins[min_cost_idx], 1);
         }
         if (costs[center] != costs[center]) {
             depth_now = depth_before;
             plane_hypotheses_now = plane_hypotheses[positions[min_cost_idx]];
             cost_now = final_costs[min_cost_idx];
             selected_views[center] = temp_selected_views;
+            now_idx = min_cost_idx;
         }
     }
-    PlaneHypothesisRefinement(images, depths, cameras, &plane_hypotheses_now, &depth_now, &cost_now, &rand_states[center], view_weights, weight_norm, prior_planes, plane_masks, &restricted_cost, p, params, texture);
+    // cost_vector_now is no longer needed and takes the refined cost vector
+    const bool refined = PlaneHypothesisRefinement(images, depths, cameras, &plane_hypotheses_now, &depth_now, &cost_now, &rand_states[center], view_weights, weight_norm, prior_planes, plane_masks, &restricted_cost, p, params, texture, params.cost_cache != NULL ? cost_vector_now : NULL);
 
+    bool updated = true;
     if (params.hierarchy) {
         if (cost_now < pre_costs[center] - 0.1f) {
             costs[center] = cost_now;
             plane_hypotheses[center] = plane_hypotheses_now;
         }
+        else {
+            updated = false;
+        }
     }
     else {
         costs[center] = cost_now;
         plane_hypotheses[center] = plane_hypotheses_now;
     }
+
+    // The next sweep finds the cost vector of the new plane in the cache
+    // when it came from refinement or a neighbour
+    if (params.cost_cache != NULL && updated) {
+        if (refined) {
+            StoreCachedCostVector(cameras, center, plane_hypotheses_now, cost_vector_now, params);
+        }
+        else if (now_idx >= 0) {
+            StoreCachedCostVector(cameras, center, plane_hypotheses_now, cost_array[now_idx], params);
+        }
+    }
 }
 
 __device__ void CheckerboardPropagation_MandatoryConsistency(const cudaTextureObject_t* images, const cudaTextureObject_t* depths, const Camera* cameras, float4* plane_hypotheses, float* costs, float* pre_costs, curandState* rand_states, unsigned int* selected_views, float4* prior_planes, unsigned int* plane_masks, const int2 p, const PatchMatchParams params, const int iter, float* confidences) {
@@ -2265,7 +2289,7 @@ __device__ void CheckerboardPropagation_MandatoryConsistency(const cudaTextureOb
                 if (view_weights[j] > 0) {
                     if (params.geom_consistency) {
                         if (flag[i]) {
-                            final_costs[i] += view_weights[j] * (cost_array[i][j] + 0.2f * ComputeGeomConsistencyCost(depths[j + 1], cameras[0], cameras[j + 1], plane_hypotheses[positions[i]], p));
+                            final_costs[i] += view_weights[j] * (cost_array[i][j] + 0.2f * ComputeGeomConsistencyCost(depths[j + 1], params.view_pairs[j + 1], params.inverse_view_pairs[j + 1], plane_hypotheses[positions[i]], p));
                         }
                         else {
                             final_costs[i] += view_weights[j] * (cost_array[i][j] + 0.1f * 3.0f);
@@ -2283,11 +2307,11 @@ __device__ void CheckerboardPropagation_MandatoryConsistency(const cudaTextureOb
 
         float cost_vector_now[32] = { 2.0f };
 
-        ComputeMultiViewCostVector(images, cameras, p, plane_hypotheses[center], cost_vector_now, params);
+        ComputeCurrentCostVector(images, cameras, p, plane_hypotheses[center], cost_vector_now, params);
         float cost_now = 0.0f;
         for (int i = 0; i < params.num_images - 1; ++i) {
             if (params.geom_consistency) {
-                cost_now += view_weights[i] * (cost_vector_now[i] + 0.2f * ComputeGeomConsistencyCost(depths[i + 1], cameras[0], cameras[i + 1], plane_hypotheses[center], p));
+                cost_now += view_weights[i] * (cost_vector_now[i] + 0.2f * ComputeGeomConsistencyCost(depths[i + 1], params.view_pairs[i + 1], params.inverse_view_pairs[i + 1], plane_hypotheses[center], p));
             }
             else {
                 cost_now += view_weights[i] * cost_vector_now[i];
@@ -2305,6 +2329,7 @@ __device__ void CheckerboardPropagation_MandatoryConsistency(const cudaTextureOb
                 plane_hypotheses_now = plane_hypotheses[positions[min_cost_idx]];
                 cost_now = final_costs[min_cost_idx];
                 selected_views[center] = temp_selected_views;
+                PM_COUNT(params, direction_wins[min_cost_idx], 1);
             }
             if (costs[center] != costs[center]) {
                 //depth_now = depth_before;
@@ -2314,7 +2339,7 @@ __device__ void CheckerboardPropagation_MandatoryConsistency(const cudaTextureOb
             }
         }
 
-        PlaneHypothesisRefinement(images, depths, cameras, &plane_hypotheses_now, &depth_now, &cost_now, &rand_states[center], view_weights, weight_norm, prior_planes, plane_masks, 0, p, params, 0);
+        PlaneHypothesisRefinement(images, depths, cameras, &plane_hypotheses_now, &depth_now, &cost_now, &rand_states[center], view_weights, weight_norm, prior_planes, plane_masks, 0, p, params, 0, NULL);
 
         costs[center] = cost_now;
         plane_hypotheses[center] = plane_hypotheses_now;
@@ -2688,7 +2713,7 @@ __device__ void CheckerboardPropagation_MandatoryConsistency(const cudaTextureOb
                 if (view_weights[j] > 0) {
                     if (params.geom_consistency) {
                         if (flag[i]) {
-                            final_costs[i] += view_weights[j] * (cost_array[i][j] + 0.2f * ComputeGeomConsistencyCost(depths[j + 1], cameras[0], cameras[j + 1], plane_hypotheses[positions[i]], p));
+                            final_costs[i] += view_weights[j] * (cost_array[i][j] + 0.2f * ComputeGeomConsistencyCost(depths[j + 1], params.view_pairs[j + 1], params.inverse_view_pairs[j + 1], plane_hypotheses[positions[i]], p));
                         }
                         else {
                             final_costs[i] += view_weights[j] * (cost_array[i][j] + 0.1f * 3.0f);
@@ -2726,11 +2751,11 @@ __device__ void CheckerboardPropagation_MandatoryConsistency(const cudaTextureOb
         const int max_cost_idx = FindMaxCostIndex(restricted_final_costs, 8);
 
         float cost_vector_now[32] = { 2.0f };
-        ComputeMultiViewCostVector(images, cameras, p, plane_hypotheses[center], cost_vector_now, params);
+        ComputeCurrentCostVector(images, cameras, p, plane_hypotheses[center], cost_vector_now, params);
         float cost_now = 0.0f;
         for (int i = 0; i < params.num_images - 1; ++i) {
             if (params.geom_consistency) {
-                cost_now += view_weights[i] * (cost_vector_now[i] + 0.2f * ComputeGeomConsistencyCost(depths[i + 1], cameras[0], cameras[i + 1], plane_hypotheses[center], p));
+                cost_now += view_weights[i] * (cost_vector_now[i] + 0.2f * ComputeGeomConsistencyCost(depths[i + 1], params.view_pairs[i + 1], params.inverse_view_pairs[i + 1], plane_hypotheses[center], p));
             }
             else {
                 cost_now += view_weights[i] * cost_vector_now[i];
@@ -2762,6 +2787,7 @@ __device__ void CheckerboardPropagation_MandatoryConsistency(const cudaTextureOb
         if (flag[max_cost_idx]) {
             float depth_before = ComputeDepthfromPlaneHypothesis(cameras[0], plane_hypotheses[positions[max_cost_idx]], p);
             if (depth_before >= params.depth_min && depth_before <= params.depth_max && restricted_final_costs[max_cost_idx] > restricted_cost_now) {
+                PM_COUNT(params, direction_wins[max_cost_idx], 1);
                 plane_hypotheses_now = plane_hypotheses[positions[max_cost_idx]];
                 cost_now = final_costs[max_cost_idx];
                 selected_views[center] = temp_selected_views;
@@ -2790,7 +2816,7 @@ __device__ void CheckerboardPropagation_MandatoryConsistency(const cudaTextureOb
     }
 }
 
-__global__ void BlackPixelUpdate(cudaTextureObjects* texture_objects, cudaTextureObjects* texture_depths, Camera* cameras, float4* plane_hypotheses, float* costs, float* pre_costs, curandState* rand_states, unsigned int* selected_views, float4* prior_planes, unsigned int* plane_masks, const PatchMatchParams params, const int iter, float* confidences, unsigned int* Canny)
+__global__ void BlackPixelUpdate(cudaTextureObjects* texture_objects, cudaTextureObjects* texture_depths, Camera* cameras, float4* plane_hypotheses, float* costs, float* pre_costs, curandState* rand_states, unsigned int* selected_views, float4* prior_planes, unsigned int* plane_masks, const PatchMatchParams params, const int iter, float* confidences, const float* texture)
 {
     int2 p = make_int2(blockIdx.x * blockDim.x + threadIdx.x, blockIdx.y * blockDim.y + threadIdx.y);
     if (threadIdx.x % 2 == 0) {
@@ -2804,11 +2830,11 @@ __global__ void BlackPixelUpdate(cudaTextureObjects* texture_objects, cudaTextur
         CheckerboardPropagation_MandatoryConsistency(texture_objects[0].images, texture_depths[0].images, cameras, plane_hypotheses, costs, pre_costs, rand_states, selected_views, prior_planes, plane_masks, p, params, iter, confidences);
     }
     else {
-        CheckerboardPropagation(texture_objects[0].images, texture_depths[0].images, cameras, plane_hypotheses, costs, pre_costs, rand_states, selected_views, prior_planes, plane_masks, p, params, iter, Canny, confidences);
+        CheckerboardPropagation(texture_objects[0].images, texture_depths[0].images, cameras, plane_hypotheses, costs, pre_costs, rand_states, selected_views, prior_planes, plane_masks, p, params, iter, texture, confidences);
     }
 }
 
-__global__ void RedPixelUpdate(cudaTextureObjects* texture_objects, cudaTextureObjects* texture_depths, Camera* cameras, float4* plane_hypotheses, float* costs, float* pre_costs, curandState* rand_states, unsigned int* selected_views, float4* prior_planes, unsigned int* plane_masks, const PatchMatchParams params, const int iter, float* confidences, unsigned int* Canny)
+__global__ void RedPixelUpdate(cudaTextureObjects* texture_objects, cudaTextureObjects* texture_depths, Camera* cameras, float4* plane_hypotheses, float* costs, float* pre_costs, curandState* rand_states, unsigned int* selected_views, float4* prior_planes, unsigned int* plane_masks, const PatchMatchParams params, const int iter, float* confidences, const float* texture)
 {
     int2 p = make_int2(blockIdx.x * blockDim.x + threadIdx.x, blockIdx.y * blockDim.y + threadIdx.y);
     if (threadIdx.x % 2 == 0) {
@@ -2822,7 +2848,7 @@ __global__ void RedPixelUpdate(cudaTextureObjects* texture_objects, cudaTextureO
         CheckerboardPropagation_MandatoryConsistency(texture_objects[0].images, texture_depths[0].images, cameras, plane_hypotheses, costs, pre_costs, rand_states, selected_views, prior_planes, plane_masks, p, params, iter, confidences);
     }
     else {
-        CheckerboardPropagation(texture_objects[0].images, texture_depths[0].images, cameras, plane_hypotheses, costs, pre_costs, rand_states, selected_views, prior_planes, plane_masks, p, params, iter, Canny, confidences);
+        CheckerboardPropagation(texture_objects[0].images, texture_depths[0].images, cameras, plane_hypotheses, costs, pre_costs, rand_states, selected_views, prior_planes, plane_masks, p, params, iter, texture, confidences);
     }
 }
 
@@ -2850,112 +2876,17 @@ __device__ void CheckerboardFilter(const Camera* cameras, float4* plane_hypothes
     }
 
     const int center = p.y * width + p.x;
-
-    float filter[21];
-    int index = 0;
-
-    filter[index++] = plane_hypotheses[center].w;
-
-    // Left
-    const int left = center - 1;
-    const int leftleft = center - 3;
-
-    // Up
-    const int up = center - width;
-    const int upup = center - 3 * width;
-
-    // Down
-    const int down = center + width;
-    const int downdown = center + 3 * width;
-
-    // Right
-    const int right = center + 1;
-    const int rightright = center + 3;
-
     if (costs[center] < 0.001f) {
         return;
     }
 
-    if (p.y > 0) {
-        filter[index++] = plane_hypotheses[up].w;
-    }
-    if (p.y > 2) {
-        filter[index++] = plane_hypotheses[upup].w;
-    }
-    if (p.y > 4) {
-        filter[index++] = plane_hypotheses[upup - width * 2].w;
-    }
-    if (p.y < height - 1) {
-        filter[index++] = plane_hypotheses[down].w;
-    }
-    if (p.y < height - 3) {
-        filter[index++] = plane_hypotheses[downdown].w;
-    }
-    if (p.y < height - 5) {
-        filter[index++] = plane_hypotheses[downdown + width * 2].w;
-    }
-    if (p.x > 0) {
-        filter[index++] = plane_hypotheses[left].w;
-    }
-    if (p.x > 2) {
-        filter[index++] = plane_hypotheses[leftleft].w;
-    }
-    if (p.x > 4) {
-        filter[index++] = plane_hypotheses[leftleft - 2].w;
-    }
-    if (p.x < width - 1) {
-        filter[index++] = plane_hypotheses[right].w;
-    }
-    if (p.x < width - 3) {
-        filter[index++] = plane_hypotheses[rightright].w;
-    }
-    if (p.x < width - 5) {
-        filter[index++] = plane_hypotheses[rightright + 2].w;
-    }
-    if (p.y > 0 &&
-        p.x < width - 2) {
-        filter[index++] = plane_hypotheses[up + 2].w;
-    }
-    if (p.y < height - 1 &&
-        p.x < width - 2) {
-        filter[index++] = plane_hypotheses[down + 2].w;
-    }
-    if (p.y > 0 &&
-        p.x > 1)
-    {
-        filter[index++] = plane_hypotheses[up - 2].w;
-    }
-    if (p.y < height - 1 &&
-        p.x>1) {
-        filter[index++] = plane_hypotheses[down - 2].w;
-    }
-    if (p.x > 0 &&
-        p.y > 2)
-    {
-        filter[index++] = plane_hypotheses[left - width * 2].w;
-    }
-    if (p.x < width - 1 &&
-        p.y>2)
-    {
-        filter[index++] = plane_hypotheses[right - width * 2].w;
-    }
-    if (p.x > 0 &&
-        p.y < height - 2) {
-        filter[index++] = plane_hypotheses[left + width * 2].w;
-    }
-    if (p.x < width - 1 &&
-        p.y < height - 2) {
-        filter[index++] = plane_hypotheses[right + width * 2].w;
-    }
-
-    sort_small(filter, index);
-    int median_index = index / 2;
-    if (index % 2 == 0) {
-        plane_hypotheses[center].w = (filter[median_index - 1] + filter[median_index]) / 2;
-    }
-    else {
-        plane_hypotheses[center].w = filter[median_index];
-    }
+    // Fixed wire indices keep the candidates in registers
+    float filter[CHECKERBOARD_FILTER_WIRES];
+    auto depth_at = [&](const int x, const int y) { return plane_hypotheses[y * width + x].w; };
+    const int count = GatherCheckerboardCandidates(depth_at, width, height, p.x, p.y, filter, 1);
+    MedianWires wires = { filter };
+    ApplyMedianNetwork<CHECKERBOARD_FILTER_WIRES>(wires);
+    plane_hypotheses[center].w = CheckerboardMedian(filter, 1, count);
 }
 
 __global__ void BlackPixelFilter(const Camera* cameras, float4* plane_hypotheses, float* costs)
@@ -2984,6 +2915,91 @@ __global__ void RedPixelFilter(const Camera* cameras, float4* plane_hypotheses,
     CheckerboardFilter(cameras, plane_hypotheses, costs, p);
 }
 
+void UploadHypothesisField(const HypothesisField& field, const int w_plane, float4* planes_cuda, float* costs_cuda)
+{
+    const int n = field.Rows() * field.Cols();
+
+    PooledBuffer<float4> planes_host(BUFFER_HOST, MEMORY_HYPOTHESES);
+    planes_host.Allocate(n);
+    field.Pack(w_plane, planes_host);
+    cudaMemcpy(planes_cuda, planes_host, sizeof(float4) * n, cudaMemcpyHostToDevice);
+    if (costs_cuda != NULL) {
+        cudaMemcpy(costs_cuda, field.PlaneData(HypothesisField::COST), sizeof(float) * n, cudaMemcpyHostToDevice);
+    }
+}
+
+void DownloadHypothesisField(const float4* planes_cuda, const float* costs_cuda, HypothesisField& field)
+{
+    const int n = field.Rows() * field.Cols();
+
+    PooledBuffer<float4> planes_host(BUFFER_HOST, MEMORY_HYPOTHESES);
+    planes_host.Allocate(n);
+    cudaMemcpy(planes_host, planes_cuda, sizeof(float4) * n, cudaMemcpyDeviceToHost);
+    field.Unpack(planes_host);
+    cudaMemcpy(field.PlaneData(HypothesisField::COST), costs_cuda, sizeof(float) * n, cudaMemcpyDeviceToHost);
+}
+
+float TimeCheckerboardFilter(const Camera& camera, const cv::Mat_<float>& depth, const int repeats)
+{
+    const int width = depth.cols;
+    const int height = depth.rows;
+    std::vector<float4> planes(width * height);
+    for (int r = 0; r < height; ++r) {
+        for (int c = 0; c < width; ++c) {
+            planes[r * width + c] = make_float4(0.0f, 0.0f, -1.0f, depth(r, c));
+        }
+    }
+    Camera filter_camera = camera;
+    filter_camera.width = width;
+    filter_camera.height = height;
+
+    // Every pixel has a cost above the filter threshold
+    const std::vector<float> costs(width * height, 1.0f);
+
+    PooledBuffer<Camera> camera_cuda;
+    PooledBuffer<float4> planes_cuda;
+    PooledBuffer<float> costs_cuda;
+    camera_cuda.Allocate(1);
+    planes_cuda.Allocate(width * height);
+    costs_cuda.Allocate(width * height);
+    cudaMemcpy(camera_cuda, &filter_camera, sizeof(Camera), cudaMemcpyHostToDevice);
+    cudaMemcpy(costs_cuda, &costs[0], sizeof(float) * width * height, cudaMemcpyHostToDevice);
+
+    // Block shape of the checkerboard sweeps of RunPatchMatch; the grid also
+    // covers the last row of odd heights, like CheckerboardMedianFilter
+    const int BLOCK_W = 32;
+    const int BLOCK_H = (BLOCK_W / 2);
+    dim3 grid_size_checkerboard;
+    grid_size_checkerboard.x = (width + BLOCK_W - 1) / BLOCK_W;
+    grid_size_checkerboard.y = (((height + 1) / 2) + BLOCK_H - 1) / BLOCK_H;
+    grid_size_checkerboard.z = 1;
+    dim3 block_size_checkerboard;
+    block_size_checkerboard.x = BLOCK_W;
+    block_size_checkerboard.y = BLOCK_H;
+    block_size_checkerboard.z = 1;
+
+    cudaEvent_t start, stop;
+    cudaEventCreate(&start);
+    cudaEventCreate(&stop);
+    float total_ms = 0.0f;
+    for (int i = 0; i < repeats; ++i) {
+        // The filter works in place, so every repeat starts from the input
+        cudaMemcpy(planes_cuda, &planes[0], sizeof(float4) * width * height, cudaMemcpyHostToDevice);
+        cudaEventRecord(start);
+        BlackPixelFilter << <grid_size_checkerboard, block_size_checkerboard >> > (camera_cuda, planes_cuda, costs_cuda);
+        RedPixelFilter << <grid_size_checkerboard, block_size_checkerboard >> > (camera_cuda, planes_cuda, costs_cuda);
+        cudaEventRecord(stop);
+        cudaEventSynchronize(stop);
+        float milliseconds = 0.0f;
+        cudaEventElapsedTime(&milliseconds, start, stop);
+        total_ms += milliseconds;
+    }
+    CUDA_CHECK_ERROR();
+    cudaEventDestroy(start);
+    cudaEventDestroy(stop);
+    return repeats > 0 ? total_ms / repeats : 0.0f;
+}
+
 void HPM::RunPatchMatch()
 {
     const int width = cameras[0].width;
@@ -3010,41 +3026,84 @@ void HPM::RunPatchMatch()
     block_size_checkerboard.y = BLOCK_H;
     block_size_checkerboard.z = 1;
 
-    int max_iterations = 3;
+    const int max_iterations = patchmatch_iterations;
+
+    // Counters are read back and cleared after every launch
+    sweep_stats.clear();
+    if (collect_stats) {
+        stats_cuda.Allocate(1);
+        cudaMemset(stats_cuda, 0, sizeof(PatchMatchCounters));
+        params.stats = stats_cuda;
+    }
+    // Cached cost vectors depend on the images and parameters of this run
+    if (use_cost_cache) {
+        cost_cache_cuda.Allocate((size_t)width * height * (num_images - 1));
+        cost_cache_planes_cuda.Allocate((size_t)width * height);
+        // All-ones planes are NaN and match no hypothesis
+        cudaMemset(cost_cache_planes_cuda, 0xFF, sizeof(float4) * width * height);
+        params.cost_cache = cost_cache_cuda;
+        params.cost_cache_planes = cost_cache_planes_cuda;
+    }
+    auto record_stats = [&](const int iteration, const char* sweep) {
+        if (!collect_stats) {
+            return;
+        }
+        PatchMatchSweepStats stats;
+        stats.iteration = iteration;
+        stats.sweep = sweep;
+        cudaMemcpy(&stats.counters, stats_cuda, sizeof(PatchMatchCounters), cudaMemcpyDeviceToHost);
+        cudaMemset(stats_cuda, 0, sizeof(PatchMatchCounters));
+        sweep_stats.push_back(stats);
+    };
 
-    RandomInitialization << <grid_size_randinit, block_size_randinit >> > (texture_objects_cuda, cameras_cuda, plane_hypotheses_cuda, scaled_plane_hypotheses_cuda, costs_cuda, pre_costs_cuda, rand_states_cuda, selected_views_cuda, prior_planes_cuda, plane_masks_cuda, params, confidences_cuda, Canny_cuda, texture_cuda);
-    CUDA_SAFE_CALL(cudaDeviceSynchronize());
+    // Every launch is synchronized, so the trace scopes time the kernels
+    {
+        HPM_TRACE_SCOPE("RandomInitialization");
+        RandomInitialization << <grid_size_randinit, block_size_randinit >> > (texture_objects_cuda, cameras_cuda, plane_hypotheses_cuda, scaled_plane_hypotheses_cuda, costs_cuda, pre_costs_cuda, rand_states_cuda, selected_views_cuda, prior_planes_cuda, plane_masks_cuda, params, confidences_cuda, texture_cuda);
+        CUDA_SAFE_CALL(cudaDeviceSynchronize());
+    }
+    record_stats(-1, "init");
 
     for (int i = 0; i < max_iterations; ++i) {
-        BlackPixelUpdate << <grid_size_checkerboard, block_size_checkerboard >> > (texture_objects_cuda, texture_depths_cuda, cameras_cuda, plane_hypotheses_cuda, costs_cuda, pre_costs_cuda, rand_states_cuda, selected_views_cuda, prior_planes_cuda, plane_masks_cuda, params, i, confidences_cuda, Canny_cuda);
-        CUDA_SAFE_CALL(cudaDeviceSynchronize());
-        RedPixelUpdate << <grid_size_checkerboard, block_size_checkerboard >> > (texture_objects_cuda, texture_depths_cuda, cameras_cuda, plane_hypotheses_cuda, costs_cuda, pre_costs_cuda, rand_states_cuda, selected_views_cuda, prior_planes_cuda, plane_masks_cuda, params, i, confidences_cuda, Canny_cuda);
-        CUDA_SAFE_CALL(cudaDeviceSynchronize());
+        {
+            HPM_TRACE_SCOPE("BlackPixelUpdate");
+            BlackPixelUpdate << <grid_size_checkerboard, block_size_checkerboard >> > (texture_objects_cuda, texture_depths_cuda, cameras_cuda, plane_hypotheses_cuda, costs_cuda, pre_costs_cuda, rand_states_cuda, selected_views_cuda, prior_planes_cuda, plane_masks_cuda, params, i, confidences_cuda, texture_cuda);
+            CUDA_SAFE_CALL(cudaDeviceSynchronize());
+        }
+        record_stats(i, "black");
+        {
+            HPM_TRACE_SCOPE("RedPixelUpdate");
+            RedPixelUpdate << <grid_size_checkerboard, block_size_checkerboard >> > (texture_objects_cuda, texture_depths_cuda, cameras_cuda, plane_hypotheses_cuda, costs_cuda, pre_costs_cuda, rand_states_cuda, selected_views_cuda, prior_planes_cuda, plane_masks_cuda, params, i, confidences_cuda, texture_cuda);
+            CUDA_SAFE_CALL(cudaDeviceSynchronize());
+        }
+        record_stats(i, "red");
         printf("iteration: %d\n", i);
     }
 
+    params.stats = NULL;
+    params.cost_cache = NULL;
+    params.cost_cache_planes = NULL;
+
+    HPM_TRACE_SCOPE("GetDepthAndDownload");
     GetDepthandNormal << <grid_size_randinit, block_size_randinit >> > (cameras_cuda, plane_hypotheses_cuda, params);
     CUDA_SAFE_CALL(cudaDeviceSynchronize());
 
-    cudaMemcpy(plane_hypotheses_host, plane_hypotheses_cuda, sizeof(float4) * width * height, cudaMemcpyDeviceToHost);
-    cudaMemcpy(costs_host, costs_cuda, sizeof(float) * width * height, cudaMemcpyDeviceToHost);
-    if (!params.mand_consistency && !params.prior_consistency) {
-        cudaMemcpy(texture_host, texture_cuda, sizeof(float) * width * height, cudaMemcpyDeviceToHost);
-    }
+    DownloadHypothesisField(plane_hypotheses_cuda, costs_cuda, hypotheses_host);
     CUDA_SAFE_CALL(cudaDeviceSynchronize());
 }
 
-__global__ void JBU_cu(JBUParameters* jp, JBUTexObj* jt, float* depth)
+__global__ void JBU_cu(JBUParameters* jp, JBUTexObj* jt, const float* src, float* values)
 {
+    // p.y is relative to the band, y is the row in the full image
     const int2 p = make_int2(blockIdx.x * blockDim.x + threadIdx.x, blockIdx.y * blockDim.y + threadIdx.y);
-    const int rows = jp[0].height;
     const int cols = jp[0].width;
     const int center = p.y * cols + p.x;
+    const int y = p.y + jp[0].y_offset;
 
     if (p.x >= cols) {
         return;
     }
-    if (p.y >= rows) {
+    if (p.y >= jp[0].band_rows) {
         return;
     }
 
@@ -3053,49 +3112,191 @@ __global__ void JBU_cu(JBUParameters* jp, JBUTexObj* jt, float* depth)
     const float sigmar = 25.5;
     const int WinWidth = jp[0].Imagescale * jp[0].Imagescale + 1;
     int num_neighbors = WinWidth / 2;
+    const int num_channels = jp[0].num_channels;
+    const int src_plane = jp[0].s_band_rows * jp[0].s_width;
+    const int dst_plane = jp[0].band_rows * cols;
 
-    const float o_y = p.y * scale;
+    const float o_y = y * scale;
     const float o_x = p.x * scale;
-    const float refPix = tex2D<float>(jt[0].imgs[0], p.x + 0.5f, p.y + 0.5f);
+    const float refPix = tex2D<float>(jt[0].imgs[0], p.x + 0.5f, y - jp[0].guide_y0 + 0.5f);
     int r_y = 0;
     int r_ys = 0;
     int r_x = 0;
     int r_xs = 0;
     float sgauss = 0.0, rgauss = 0.0, totalgauss = 0.0;
-    float total_val = 0.0, normalizing_factor = 0.0;
-    float  srcPix = 0, neighborPix = 0;
+    float total_val[JBU_MAX_CHANNELS];
+    float normalizing_factor = 0.0;
+    float neighborPix = 0;
+#pragma unroll
+    for (int c = 0; c < JBU_MAX_CHANNELS; ++c) {
+        total_val[c] = 0.0f;
+    }
 
     for (int j = -num_neighbors; j <= num_neighbors; ++j) {
         // source
         r_y = o_y + j;
         r_y = (r_y > 0 ? (r_y < jp[0].s_height ? r_y : jp[0].s_height - 1) : 0);
         // reference
-        r_ys = p.y + j;
+        r_ys = y + j;
         r_ys = (r_ys > 0 ? (r_ys < jp[0].height ? r_ys : jp[0].height - 1) : 0);
         for (int i = -num_neighbors; i <= num_neighbors; ++i) {
             // source
             r_x = o_x + i;
             r_x = (r_x > 0 ? (r_x < jp[0].s_width ? r_x : jp[0].s_width - 1) : 0);
-            srcPix = tex2D<float>(jt[0].imgs[1], r_x + 0.5f, r_y + 0.5f);
+            const int s_center = (r_y - jp[0].src_y0) * jp[0].s_width + r_x;
             // refIm
             r_xs = p.x + i;
             r_xs = (r_xs > 0 ? (r_xs < jp[0].width ? r_xs : jp[0].width - 1) : 0);
-            neighborPix = tex2D<float>(jt[0].imgs[0], r_xs + 0.5f, r_ys + 0.5f);
+            neighborPix = tex2D<float>(jt[0].imgs[0], r_xs + 0.5f, r_ys - jp[0].guide_y0 + 0.5f);
 
             sgauss = SpatialGauss(o_x, o_y, r_x, r_y, sigmad);
             rgauss = RangeGauss(fabs(refPix - neighborPix), sigmar);
             totalgauss = sgauss * rgauss;
             normalizing_factor += totalgauss;
-            total_val += srcPix * totalgauss;
+            // The weight is shared by every channel
+#pragma unroll
+            for (int c = 0; c < JBU_MAX_CHANNELS; ++c) {
+                if (c < num_channels) {
+                    total_val[c] += src[c * src_plane + s_center] * totalgauss;
+                }
+            }
         }
     }
 
-    depth[center] = total_val / normalizing_factor;
+#pragma unroll
+    for (int c = 0; c < JBU_MAX_CHANNELS; ++c) {
+        if (c < num_channels) {
+            values[c * dst_plane + center] = total_val[c] / normalizing_factor;
+        }
+    }
+}
+__global__ void BilateralNCCBench_cu(const cudaTextureObjects* texture_objects, const Camera* cameras, const int2* pixels, const float4* planes, const int num_planes, const bool all_views, float* costs, const PatchMatchParams params)
+{
+    const int k = blockIdx.x * blockDim.x + threadIdx.x;
+    if (k >= num_planes) {
+        return;
+    }
+    if (all_views) {
+        ComputeMultiViewCostVector(texture_objects[0].images, cameras, pixels[k], planes[k], costs + (size_t)k * (params.num_images - 1), params);
+    }
+    else {
+        costs[k] = ComputeBilateralNCC(texture_objects[0].images[0], texture_objects[0].images[1], cameras[1], params.view_pairs[1], pixels[k], planes[k], params);
+    }
+}
 
+float TimeBilateralNCC(const std::vector<cv::Mat>& images, const std::vector<Camera>& cameras, const std::vector<int2>& pixels, const std::vector<float4>& planes, const PatchMatchParams& params, const bool all_views, const int repeats)
+{
+    const int num_images = (int)images.size();
+    const int num_planes = (int)pixels.size();
+
+    // Textures as CudaSpaceInitialization builds them
+    cudaTextureObjects texture_objects_host;
+    std::vector<cudaArray*> arrays(num_images);
+    for (int i = 0; i < num_images; ++i) {
+        const int bits = (int)images[i].elemSize1() * 8;
+        cudaChannelFormatDesc channelDesc = cudaCreateChannelDesc(bits, 0, 0, 0, cudaChannelFormatKindUnsigned);
+        cudaMallocArray(&arrays[i], &channelDesc, images[i].cols, images[i].rows);
+        cudaMemcpy2DToArray(arrays[i], 0, 0, images[i].ptr(), images[i].step[0], images[i].cols * images[i].elemSize(), images[i].rows, cudaMemcpyHostToDevice);
+
+        struct cudaResourceDesc resDesc;
+        memset(&resDesc, 0, sizeof(cudaResourceDesc));
+        resDesc.resType = cudaResourceTypeArray;
+        resDesc.res.array.array = arrays[i];
+
+        struct cudaTextureDesc texDesc;
+        memset(&texDesc, 0, sizeof(cudaTextureDesc));
+        texDesc.addressMode[0] = cudaAddressModeWrap;
+        texDesc.addressMode[1] = cudaAddressModeWrap;
+        texDesc.filterMode = cudaFilterModeLinear;
+        texDesc.readMode = cudaReadModeNormalizedFloat;
+        texDesc.normalizedCoords = 0;
+        cudaCreateTextureObject(&texture_objects_host.images[i], &resDesc, &texDesc, NULL);
+    }
+
+    std::vector<ViewPairHomography> view_pairs;
+    ComputeViewPairHomographies(cameras, view_pairs);
+
+    PooledBuffer<cudaTextureObjects> texture_objects_cuda;
+    PooledBuffer<Camera> cameras_cuda;
+    PooledBuffer<ViewPairHomography> view_pairs_cuda;
+    PooledBuffer<int2> pixels_cuda;
+    PooledBuffer<float4> planes_cuda;
+    PooledBuffer<float> costs_cuda;
+    texture_objects_cuda.Allocate(1);
+    cameras_cuda.Allocate(num_images);
+    view_pairs_cuda.Allocate(num_images);
+    pixels_cuda.Allocate(num_planes);
+    planes_cuda.Allocate(num_planes);
+    costs_cuda.Allocate((size_t)num_planes * (all_views ? num_images - 1 : 1));
+    cudaMemcpy(texture_objects_cuda, &texture_objects_host, sizeof(cudaTextureObjects), cudaMemcpyHostToDevice);
+    cudaMemcpy(cameras_cuda, &cameras[0], sizeof(Camera) * num_images, cudaMemcpyHostToDevice);
+    cudaMemcpy(view_pairs_cuda, &view_pairs[0], sizeof(ViewPairHomography) * num_images, cudaMemcpyHostToDevice);
+    cudaMemcpy(pixels_cuda, &pixels[0], sizeof(int2) * num_planes, cudaMemcpyHostToDevice);
+    cudaMemcpy(planes_cuda, &planes[0], sizeof(float4) * num_planes, cudaMemcpyHostToDevice);
+
+    PatchMatchParams bench_params = params;
+    bench_params.num_images = num_images;
+    bench_params.view_pairs = view_pairs_cuda;
+    bench_params.stats = NULL;
+
+    const int block_size = 128;
+    const int grid_size = (num_planes + block_size - 1) / block_size;
+    cudaEvent_t start, stop;
+    cudaEventCreate(&start);
+    cudaEventCreate(&stop);
+    float total_ms = 0.0f;
+    for (int i = 0; i < repeats; ++i) {
+        cudaEventRecord(start);
+        BilateralNCCBench_cu << <grid_size, block_size >> > (texture_objects_cuda, cameras_cuda, pixels_cuda, planes_cuda, num_planes, all_views, costs_cuda, bench_params);
+        cudaEventRecord(stop);
+        cudaEventSynchronize(stop);
+        float milliseconds = 0.0f;
+        cudaEventElapsedTime(&milliseconds, start, stop);
+        total_ms += milliseconds;
+    }
+    CUDA_CHECK_ERROR();
+    cudaEventDestroy(start);
+    cudaEventDestroy(stop);
+    for (int i = 0; i < num_images; ++i) {
+        cudaDestroyTextureObject(texture_objects_host.images[i]);
+        cudaFreeArray(arrays[i]);
+    }
+    return repeats > 0 ? total_ms / repeats : 0.0f;
 }
+
+float JBU::TimeKernel(const int repeats)
+{
+    dim3 grid_size;
+    grid_size.x = (jp_h.width + 16 - 1) / 16;
+    grid_size.y = (jp_h.band_rows + 16 - 1) / 16;
+    grid_size.z = 1;
+    dim3 block_size;
+    block_size.x = 16;
+    block_size.y = 16;
+    block_size.z = 1;
+
+    cudaEvent_t start, stop;
+    cudaEventCreate(&start);
+    cudaEventCreate(&stop);
+    float total_ms = 0.0f;
+    for (int i = 0; i < repeats; ++i) {
+        cudaEventRecord(start);
+        JBU_cu << <grid_size, block_size >> > (jp_d, jt_d, src_d, values_d);
+        cudaEventRecord(stop);
+        cudaEventSynchronize(stop);
+        float milliseconds = 0.0f;
+        cudaEventElapsedTime(&milliseconds, start, stop);
+        total_ms += milliseconds;
+    }
+    CUDA_CHECK_ERROR();
+    cudaEventDestroy(start);
+    cudaEventDestroy(stop);
+    return repeats > 0 ? total_ms / repeats : 0.0f;
+}
+
 void JBU::CudaRun()
 {
-    int rows = jp_h.height;
+    int rows = jp_h.band_rows;
     int cols = jp_h.width;
 
     dim3 grid_size_initrand;
@@ -3114,10 +3315,10 @@ void JBU::CudaRun()
     cudaEventRecord(start);
 
     cudaDeviceSynchronize();
-    JBU_cu << < grid_size_initrand, block_size_initrand >> > (jp_d, jt_d, depth_d);
+    JBU_cu << < grid_size_initrand, block_size_initrand >> > (jp_d, jt_d, src_d, values_d);
     cudaDeviceSynchronize();
 
-    cudaMemcpy(depth_h, depth_d, sizeof(float) * rows * cols, cudaMemcpyDeviceToHost);
+    cudaMemcpy(values_h, values_d, sizeof(float) * rows * cols * jp_h.num_channels, cudaMemcpyDeviceToHost);
     cudaDeviceSynchronize();
 
     cudaEventRecord(stop);
@@ -3129,14 +3330,14 @@ void JBU::CudaRun()
 
 __global__ void JBU_cu_prior(JBUParameters* jp, JBUTexObj* jt, float* depth, float4* normal, float4* normal_origin_cuda) {
     const int2 p = make_int2(blockIdx.x * blockDim.x + threadIdx.x, blockIdx.y * blockDim.y + threadIdx.y);
-    const int rows = jp[0].height;
     const int cols = jp[0].width;
     const int center = p.y * cols + p.x;
+    const int y = p.y + jp[0].y_offset;
 
     if (p.x >= cols) {
         return;
     }
-    if (p.y >= rows) {
+    if (p.y >= jp[0].band_rows) {
         return;
     }
     const float scale = 1.0 * jp[0].s_width / jp[0].width;
@@ -3145,9 +3346,9 @@ __global__ void JBU_cu_prior(JBUParameters* jp, JBUTexObj* jt, float* depth, flo
     const int WinWidth = jp[0].Imagescale * jp[0].Imagescale + 1;
     int num_neighbors = WinWidth / 2;
 
-    const float o_y = p.y * scale;
+    const float o_y = y * scale;
     const float o_x = p.x * scale;
-    const float refPix = tex2D<float>(jt[0].imgs[0], p.x + 0.5f, p.y + 0.5f);
+    const float refPix = tex2D<float>(jt[0].imgs[0], p.x + 0.5f, y - jp[0].guide_y0 + 0.5f);
     int r_y = 0;
     int r_ys = 0;
     int r_x = 0;
@@ -3169,16 +3370,16 @@ __global__ void JBU_cu_prior(JBUParameters* jp, JBUTexObj* jt, float* depth, flo
         r_y = (r_y > 0 ? (r_y < jp[0].s_height ? r_y : jp[0].s_height - 1) : 0);
 
         // reference
-        r_ys = p.y + j;
+        r_ys = y + j;
         for (int i = -num_neighbors; i <= num_neighbors; ++i) {
             r_x = o_x + i;
             r_x = (r_x > 0 ? (r_x < jp[0].s_width ? r_x : jp[0].s_width - 1) : 0);
-            const int s_center = r_y * jp[0].s_width + r_x;
-            srcPix = tex2D<float>(jt[0].imgs[1], r_x + 0.5f, r_y + 0.5f);
+            const int s_center = (r_y - jp[0].src_y0) * jp[0].s_width + r_x;
+            srcPix = tex2D<float>(jt[0].imgs[1], r_x + 0.5f, r_y - jp[0].src_y0 + 0.5f);
             srcNorm = normal_origin_cuda[s_center];
             r_xs = p.x + i;
 
-            neighborPix = tex2D<float>(jt[0].imgs[0], r_xs + 0.5f, r_ys + 0.5f);
+            neighborPix = tex2D<float>(jt[0].imgs[0], r_xs + 0.5f, r_ys - jp[0].guide_y0 + 0.5f);
             sgauss = SpatialGauss(o_x, o_y, r_x, r_y, sigmad);
             rgauss = RangeGauss(fabs(refPix - neighborPix), sigmar);
             totalgauss = sgauss * rgauss;
@@ -3200,7 +3401,7 @@ __global__ void JBU_cu_prior(JBUParameters* jp, JBUTexObj* jt, float* depth, flo
 
 void JBU_prior::CudaRun_prior()
 {
-    int rows = jp_h.height;
+    int rows = jp_h.band_rows;
     int cols = jp_h.width;
 
     dim3 grid_size_initrand;
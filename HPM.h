@@ -2,27 +2,96 @@
 #define _HPM_H_
 
 #include "main.h"
+#include "HypothesisField.h"
+#include "BufferArena.h"
+#include "PatchMatchStats.h"
+#include "NormalCodec.h"
 
 int readDepthDmb(const std::string file_path, cv::Mat_<float> &depth);
+// Normal readers accept float and octahedral DMB files. The NormalMap
+// overload keeps the file's codes when they already match storage.
 int readNormalDmb(const std::string file_path, cv::Mat_<cv::Vec3f> &normal);
+int readNormalDmb(const std::string file_path, NormalMap &normal, const NormalEncoding storage);
 int writeDepthDmb(const std::string file_path, const cv::Mat_<float> depth);
-int writeNormalDmb(const std::string file_path, const cv::Mat_<cv::Vec3f> normal);
+int writeNormalDmb(const std::string file_path, const cv::Mat_<cv::Vec3f> normal, const NormalEncoding encoding = NORMAL_FLOAT);
+// Interleaves separate normal planes while writing
+int writeNormalDmb(const std::string file_path, const cv::Mat_<float> &nx, const cv::Mat_<float> &ny, const cv::Mat_<float> &nz, const NormalEncoding encoding = NORMAL_FLOAT);
 
+// Writes a DMB file row band by row band, so the full map never has to be
+// resident. The header is written on Open; Close checks the row count.
+class DmbStreamWriter {
+public:
+    DmbStreamWriter();
+    ~DmbStreamWriter();
+
+    // type is DMB_TYPE_FLOAT or one of the octahedral normal types
+    int Open(const std::string file_path, const int height, const int width, const int channels, const int type = DMB_TYPE_FLOAT);
+    int WriteRows(const cv::Mat& rows);
+    int Close();
+
+private:
+    FILE* outimage;
+    int height;
+    int width;
+    int channels;
+    size_t elem_size;
+    int rows_written;
+};
+
+// Reads pair.txt; source views with a score of 0 are dropped
+void GenerateSampleList(const std::string &dense_folder, std::vector<Problem> &problems);
 Camera ReadCamera(const std::string &cam_path);
+// Inverse of ReadCamera; returns -1 if the file cannot be opened
+int WriteCamera(const std::string &cam_path, const Camera &camera);
 void  RescaleImageAndCamera(cv::Mat_<cv::Vec3b> &src, cv::Mat_<cv::Vec3b> &dst, cv::Mat_<float> &depth, Camera &camera);
 void RescaleMask(cv::Mat_<cv::Vec3b>& src, cv::Mat_<cv::Vec3b>& dst, cv::Mat_<float>& depth);
 float3 Get3DPointonWorld(const int x, const int y, const float depth, const Camera camera);
 void ProjectonCamera(const float3 PointX, const Camera camera, float2 &point, float &depth);
 float GetAngle(const cv::Vec3f &v1, const cv::Vec3f &v2);
+// Fusion test of the world point PointX seen at pixel (c, r) of view ref_id
+// against its source views: reprojection error, relative depth and normal
+// angle. Consistent source pixels go to used_list (indexed like src_ids) and
+// their weights are added to dynamic_consistency; returns their count.
+int CheckFusionConsistency(const std::vector<Camera> &cameras, const std::vector<cv::Mat_<float> > &depths, const std::vector<NormalMap> &normals, const std::vector<cv::Mat> &masks, const std::vector<int> &src_ids, const int ref_id, const int r, const int c, const float3 PointX, const float ref_depth, const cv::Vec3f &ref_normal, std::vector<int2> &used_list, float &dynamic_consistency);
 void StoreColorPlyFileBinaryPointCloud (const std::string &plyFilePath, const std::vector<PointList> &pc);
 void ExportPointCloud(const std::string& plyFilePath, const std::vector<PointList>& pc);
-void RunJBU(const cv::Mat_<float>  &scaled_image_float, const cv::Mat_<float> &src_depthmap, const std::string &dense_folder , const Problem &problem);
+// Upsamples the previous scale's depths and normals in one pass and writes
+// them at rows x cols; src_normal may be empty. The guide is the 8-bit image
+// resized band by band, see ResizeGuideRows.
+void RunJBU(const cv::Mat_<uint8_t> &image, const int rows, const int cols, const cv::Mat_<float> &src_depthmap, const cv::Mat_<cv::Vec3f> &src_normal, const std::string &dense_folder , const Problem &problem, const PipelineOptions &options);
 
 #define CUDA_SAFE_CALL(error) CudaSafeCall(error, __FILE__, __LINE__)
 #define CUDA_CHECK_ERROR() CudaCheckError(__FILE__, __LINE__)
 
 void CudaSafeCall(const cudaError_t error, const std::string& file, const int line);
 void CudaCheckError(const char* file, const int line);
+bool CudaDeviceAvailable();
+
+// Packs a field into interleaved float4 hypotheses on the host and copies
+// them to planes_cuda; w_plane selects the plane stored in .w. The cost plane
+// is copied to costs_cuda unless it is NULL.
+void UploadHypothesisField(const HypothesisField &field, const int w_plane, float4 *planes_cuda, float *costs_cuda);
+void DownloadHypothesisField(const float4 *planes_cuda, const float *costs_cuda, HypothesisField &field);
+
+// Plane-independent terms of the homography from the reference to a source
+// view: H = A - b m^T, where only m = K_ref^-T n / d depends on the plane
+struct ViewPairHomography {
+    float A[9];         // K_src R_relative K_ref^-1
+    float b[3];         // K_src t_relative
+    float ref_K_inv[4]; // 1 / fx, 1 / fy, cx / fx, cy / fy of the reference
+};
+
+__host__ __device__ void ComputeViewPairHomography(const Camera ref_camera, const Camera src_camera, ViewPairHomography &pair);
+// One entry per camera, cameras[0] being the reference (entry 0 maps it onto itself)
+void ComputeViewPairHomographies(const std::vector<Camera> &cameras, std::vector<ViewPairHomography> &pairs);
+// Plane-induced homography from the reference to a source view as a rank-1
+// update of the pair terms; shared by the kernels and the host NCC
+__host__ __device__ void ComputeHomography(const ViewPairHomography &pair, const float4 plane_hypothesis, float *H);
+__host__ __device__ void ComputeHomography(const Camera ref_camera, const Camera src_camera, const float4 plane_hypothesis, float *H);
+__host__ __device__ float2 ComputeCorrespondingPoint(const float *H, const int2 p);
+// Milliseconds per black + red pass of the checkerboard median filter over
+// depth, averaged over repeats; used by hpm_bench
+float TimeCheckerboardFilter(const Camera &camera, const cv::Mat_<float> &depth, const int repeats);
 
 struct cudaTextureObjects {
     cudaTextureObject_t images[MAX_IMAGES];
@@ -51,9 +120,32 @@ struct PatchMatchParams {
     bool multi_geometry = false;
     bool hierarchy = false;
     bool upsample = false;
+    bool upsample_on_host = false;
+    // Image textures are read as normalized floats; this restores the
+    // 0-255 intensity range sigma_color and the JBU range sigma assume
+    float image_scale = 255.0f;
     bool mand_consistency = false;
+    // Device counters the sweeps add to; NULL unless statistics are collected
+    PatchMatchCounters *stats = NULL;
+    // Device table of ComputeViewPairHomographies, set by CudaSpaceInitialization
+    const ViewPairHomography *view_pairs = NULL;
+    // Source-to-reference table of ComputeInverseViewPairHomographies for the
+    // geometric consistency cost, set by CudaSpaceInitialization
+    const ViewPairHomography *inverse_view_pairs = NULL;
+    // fp16 per-view costs of each pixel's own plane (cost_cache[view * pixels + pixel])
+    // and the planes they were computed for; NULL unless the cost cache is enabled
+    unsigned short *cost_cache = NULL;
+    float4 *cost_cache_planes = NULL;
 };
 
+// Milliseconds per launch of ComputeBilateralNCC against view 1 (or, with
+// all_views, ComputeMultiViewCostVector) for each pixel and plane, averaged
+// over repeats; used by hpm_bench
+float TimeBilateralNCC(const std::vector<cv::Mat> &images, const std::vector<Camera> &cameras, const std::vector<int2> &pixels, const std::vector<float4> &planes, const PatchMatchParams &params, const bool all_views, const int repeats);
+// Milliseconds per JBU kernel launch over the whole guide (a single band),
+// averaged over repeats; used by hpm_bench
+float TimeJBU(const cv::Mat_<float> &guide, const cv::Mat_<float> &src_depth, const int Imagescale, const int repeats);
+
 class HPM {
 public:
     HPM();
@@ -67,13 +159,18 @@ public:
     void SetPlanarPriorParams();
     void SetHierarchyParams();
     void SetMandConsistencyParams(bool flag);
+    void SetUpsampleParams(const PipelineOptions& options);
+    void SetStatsParams(bool collect);
+    // Patch size, sampling step, top-k views and sweeps from the command line
+    void SetTuningParams(const PipelineOptions& options);
 
     int GetReferenceImageWidth();
     int GetReferenceImageHeight();
     cv::Mat GetReferenceImage();
-    float4 GetPlaneHypothesis(const int index);
-    float GetCost(const int index);
-    float GetTexture(const int index);
+    // SoA hypotheses of the last RunPatchMatch; views stay valid until the HPM is destroyed
+    const HypothesisField &GetHypotheses() const;
+    // Counters of the initialization and every sweep of the last RunPatchMatch
+    const std::vector<PatchMatchSweepStats> &GetSweepStats() const;
     void GetSupportPoints(std::vector<cv::Point>& support2DPoints);
     void GetSupportPoints_Double_Check(std::vector<cv::Point>& support2DPoints, const cv::Mat_<float>& costs, const cv::Mat_<float>& mand_consistency, float hpm_factor);
     void GetSupportPoints_Simple_Check(std::vector<cv::Point>& support2DPoints, const cv::Mat_<float>& costs, const cv::Mat_<float>& mand_consistency, float hpm_factor);
@@ -87,7 +184,8 @@ public:
     void CudaPlanarPriorInitialization(const std::vector<float4> &PlaneParams, const cv::Mat_<float> &masks);
     void CudaHypothesesReload(cv::Mat_ <float>depths, cv::Mat_<float>costs, cv::Mat_<cv::Vec3f>normals);
     void CudaConfidenceInitialization(const std::string& dense_folder, const std::vector<Problem>& problems, const int idx);
-    void CudaCannyInitialization(const cv::Mat_<int>& Canny);
+    // Uploads the edge-density texture map of the reference image (TextureMap.h)
+    void CudaTextureInitialization(const cv::Mat_<float>& texture);
 
     void CudaPlanarPriorRelease();
     void CudaSpaceRelease(bool geom_consistency);
@@ -100,7 +198,8 @@ public:
     float GetDistance2Origin(const int2 p, const float depth, const float4 normal);
     void ReloadPlanarPriorInitialization(const cv::Mat_<float>& masks, float4* prior_plane_parameters);
 
-    void TextureInformationInitialization();
+    // Compares host NCC throughput over row-major, tiled and Morton image layouts
+    void BenchmarkImageLayouts();
 
 private:
     int num_images;
@@ -109,34 +208,46 @@ private:
     std::vector<Camera> cameras;
     cudaTextureObjects texture_objects_host;
     cudaTextureObjects texture_depths_host;
-    float4 *plane_hypotheses_host;
-    float4 *scaled_plane_hypotheses_host;
-    float *costs_host;
-    float *pre_costs_host;
-    float4 *prior_planes_host;
-    unsigned int *plane_masks_host;
+    HypothesisField hypotheses_host;
+    HypothesisField scaled_hypotheses_host; // cost plane goes to .w on upload
+    HypothesisField prior_planes_host{MEMORY_PRIORS};
+    PooledBuffer<unsigned int> plane_masks_host{BUFFER_HOST, MEMORY_PRIORS};
     PatchMatchParams params;
-    float* confidences_host;
-    float* texture_host;
+    PooledBuffer<float> confidences_host{BUFFER_HOST, MEMORY_HYPOTHESES};
+    UpsampleMethod prior_upsample = UPSAMPLE_JBU;
+    UpsampleMethod hierarchy_upsample = UPSAMPLE_JBU;
+    int upsample_tile_rows = 0;
+    bool collect_stats = false;
+    int patchmatch_iterations = 3; // red/black sweep pairs per RunPatchMatch
+    bool use_cost_cache = false;
+    std::vector<PatchMatchSweepStats> sweep_stats;
+    MemoryCharge images_charge{MEMORY_IMAGES, BUFFER_HOST}; // images and geometric depth maps
+    MemoryCharge image_arrays_charge{MEMORY_IMAGES, BUFFER_DEVICE};
 
 
-    Camera *cameras_cuda;
+    // Device buffers come from the BufferArena and go back to it when the
+    // problem is released
+    PooledBuffer<Camera> cameras_cuda;
+    PooledBuffer<ViewPairHomography> view_pairs_cuda;
+    PooledBuffer<ViewPairHomography> inverse_view_pairs_cuda;
     cudaArray *cuArray[MAX_IMAGES];
     cudaArray *cuDepthArray[MAX_IMAGES];
-    cudaTextureObjects *texture_objects_cuda;
-    cudaTextureObjects *texture_depths_cuda;
-    float4 *plane_hypotheses_cuda;
-    float4 *scaled_plane_hypotheses_cuda;
-    float *costs_cuda;
-    float *pre_costs_cuda;
-    curandState *rand_states_cuda;
-    unsigned int *selected_views_cuda;
-    float* depths_cuda;
-    float4* prior_planes_cuda;
-    unsigned int* plane_masks_cuda;
-    float* confidences_cuda;
-    unsigned int* Canny_cuda;
-    float* texture_cuda;
+    PooledBuffer<cudaTextureObjects> texture_objects_cuda;
+    PooledBuffer<cudaTextureObjects> texture_depths_cuda;
+    PooledBuffer<float4> plane_hypotheses_cuda{BUFFER_DEVICE, MEMORY_HYPOTHESES};
+    PooledBuffer<float4> scaled_plane_hypotheses_cuda{BUFFER_DEVICE, MEMORY_HYPOTHESES};
+    PooledBuffer<float> costs_cuda{BUFFER_DEVICE, MEMORY_HYPOTHESES};
+    PooledBuffer<float> pre_costs_cuda{BUFFER_DEVICE, MEMORY_HYPOTHESES};
+    PooledBuffer<curandState> rand_states_cuda{BUFFER_DEVICE, MEMORY_RNG};
+    PooledBuffer<unsigned int> selected_views_cuda{BUFFER_DEVICE, MEMORY_HYPOTHESES};
+    PooledBuffer<float> depths_cuda{BUFFER_DEVICE, MEMORY_HYPOTHESES};
+    PooledBuffer<float4> prior_planes_cuda{BUFFER_DEVICE, MEMORY_PRIORS};
+    PooledBuffer<unsigned int> plane_masks_cuda{BUFFER_DEVICE, MEMORY_PRIORS};
+    PooledBuffer<float> confidences_cuda{BUFFER_DEVICE, MEMORY_HYPOTHESES};
+    PooledBuffer<float> texture_cuda{BUFFER_DEVICE, MEMORY_IMAGES};
+    PooledBuffer<PatchMatchCounters> stats_cuda;
+    PooledBuffer<unsigned short> cost_cache_cuda{BUFFER_DEVICE, MEMORY_HYPOTHESES};
+    PooledBuffer<float4> cost_cache_planes_cuda{BUFFER_DEVICE, MEMORY_HYPOTHESES};
 };
 
 struct TexObj {
@@ -149,30 +260,42 @@ struct JBUParameters {
     int s_height;
     int s_width;
     int Imagescale;
+    // Band of output rows processed by one launch; the textures hold only the
+    // guide rows from guide_y0 and the source rows from src_y0
+    int y_offset = 0;
+    int band_rows = 0;
+    int guide_y0 = 0;
+    int src_y0 = 0;
+    int s_band_rows = 0;
+    int num_channels = 1;
 };
 
 struct JBUTexObj {
     cudaTextureObject_t imgs[JBU_NUM];
 };
 
+// Upsamples num_channels source planes with one set of weights per tap
 class JBU {
 public:
     JBU();
     ~JBU();
 
     // Host Parameters
-    float *depth_h;
+    PooledBuffer<float> values_h{BUFFER_HOST, MEMORY_JBU}; // num_channels planes of band_rows * width
     JBUTexObj jt_h;
     JBUParameters jp_h;
 
     // Device Parameters
-    float *depth_d;
-    cudaArray *cuArray[JBU_NUM]; // The first for reference image, and the second for stereo depth image
+    PooledBuffer<float> values_d{BUFFER_DEVICE, MEMORY_JBU};
+    PooledBuffer<float> src_d{BUFFER_DEVICE, MEMORY_JBU}; // num_channels planes of the band's source rows
+    cudaArray *cuArray[JBU_NUM]; // Only the first, the reference image, is used
     JBUTexObj *jt_d;
     JBUParameters *jp_d;
 
-    void InitializeParameters(int n);
+    void InitializeParameters(const std::vector<cv::Mat_<float> > &src_channels);
     void CudaRun();
+    // Milliseconds per JBU_cu launch over the band, averaged over repeats
+    float TimeKernel(const int repeats);
 };
 
 class JBU_prior {
@@ -181,24 +304,23 @@ public:
     ~JBU_prior();
 
     // Host Parameters
-    float* depth_h;
-    float4* normal_h;
+    PooledBuffer<float> depth_h{BUFFER_HOST, MEMORY_JBU};
+    PooledBuffer<float4> normal_h{BUFFER_HOST, MEMORY_JBU};
     JBUTexObj jt_h;
     JBUParameters jp_h;
-    float4* normal_origin_host;
+    PooledBuffer<float4> normal_origin_host{BUFFER_HOST, MEMORY_JBU};
 
     // Device Parameters
-    float* depth_d;
+    PooledBuffer<float> depth_d{BUFFER_DEVICE, MEMORY_JBU};
     cudaArray* cuArray[JBU_NUM]; // The first for reference image, and the second for stereo depth image
     JBUTexObj* jt_d;
     JBUParameters* jp_d;
-    float4* normal_d;
-    float4* normal_origin_cuda;
+    PooledBuffer<float4> normal_d{BUFFER_DEVICE, MEMORY_JBU};
+    PooledBuffer<float4> normal_origin_cuda{BUFFER_DEVICE, MEMORY_JBU};
 
     void InitializeParameters_prior(int n, int origin_n);
     void CudaRun_prior();
     void ReleaseJBUCudaMemory_prior();
-    void ReleaseJBUHostMemory_prior();
 };
 
 
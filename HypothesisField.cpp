@@ -0,0 +1,136 @@
+#include "HypothesisField.h"
+#include "BufferArena.h"
+
+#include <cstring>
+
+// Planes start on cache line boundaries; arena host buffers share this alignment
+static const size_t kPlaneAlignment = 64;
+
+HypothesisField::HypothesisField(const MemorySubsystem _subsystem) : data(NULL), rows(0), cols(0), plane_stride(0), subsystem(_subsystem) {}
+
+HypothesisField::~HypothesisField()
+{
+	Release();
+}
+
+void HypothesisField::Allocate(const int _rows, const int _cols)
+{
+	if (data == NULL || rows != _rows || cols != _cols) {
+		Release();
+		rows = _rows;
+		cols = _cols;
+		const size_t floats_per_line = kPlaneAlignment / sizeof(float);
+		plane_stride = ((size_t)rows * cols + floats_per_line - 1) / floats_per_line * floats_per_line;
+		data = (float*)BufferArena::Instance().Acquire(BUFFER_HOST, sizeof(float) * plane_stride * NUM_PLANES);
+		if (data == NULL) {
+			std::cout << "HypothesisField: failed to allocate " << rows << "x" << cols << std::endl;
+			rows = 0;
+			cols = 0;
+			plane_stride = 0;
+			return;
+		}
+		MemoryAdd(subsystem, BUFFER_HOST, (long long)(sizeof(float) * plane_stride * NUM_PLANES));
+	}
+	memset(data, 0, sizeof(float) * plane_stride * NUM_PLANES);
+}
+
+void HypothesisField::Release()
+{
+	if (data != NULL) {
+		MemoryAdd(subsystem, BUFFER_HOST, -(long long)(sizeof(float) * plane_stride * NUM_PLANES));
+		BufferArena::Instance().Release(BUFFER_HOST, data, sizeof(float) * plane_stride * NUM_PLANES);
+	}
+	data = NULL;
+	rows = 0;
+	cols = 0;
+	plane_stride = 0;
+}
+
+cv::Mat_<float> HypothesisField::View(const int plane) const
+{
+	return cv::Mat_<float>(rows, cols, const_cast<float*>(PlaneData(plane)));
+}
+
+void HypothesisField::SetPlane(const int plane, const cv::Mat_<float>& values)
+{
+	float* dst = PlaneData(plane);
+#pragma omp parallel for
+	for (int row = 0; row < rows; ++row) {
+		memcpy(dst + (size_t)row * cols, values.ptr<float>(row), sizeof(float) * cols);
+	}
+}
+
+void HypothesisField::SetNormals(const cv::Mat_<cv::Vec3f>& normals)
+{
+	float* nx = PlaneData(NX);
+	float* ny = PlaneData(NY);
+	float* nz = PlaneData(NZ);
+#pragma omp parallel for
+	for (int row = 0; row < rows; ++row) {
+		const cv::Vec3f* n = normals.ptr<cv::Vec3f>(row);
+		const size_t offset = (size_t)row * cols;
+		for (int col = 0; col < cols; ++col) {
+			nx[offset + col] = n[col][0];
+			ny[offset + col] = n[col][1];
+			nz[offset + col] = n[col][2];
+		}
+	}
+}
+
+void HypothesisField::GetNormals(cv::Mat_<cv::Vec3f>& normals) const
+{
+	const float* nx = PlaneData(NX);
+	const float* ny = PlaneData(NY);
+	const float* nz = PlaneData(NZ);
+	normals.create(rows, cols);
+#pragma omp parallel for
+	for (int row = 0; row < rows; ++row) {
+		cv::Vec3f* n = normals.ptr<cv::Vec3f>(row);
+		const size_t offset = (size_t)row * cols;
+		for (int col = 0; col < cols; ++col) {
+			n[col] = cv::Vec3f(nx[offset + col], ny[offset + col], nz[offset + col]);
+		}
+	}
+}
+
+void HypothesisField::Pack(const int w_plane, float4* planes) const
+{
+	const float* nx = PlaneData(NX);
+	const float* ny = PlaneData(NY);
+	const float* nz = PlaneData(NZ);
+	const float* w = PlaneData(w_plane);
+	const int n = rows * cols;
+#pragma omp parallel for
+	for (int i = 0; i < n; ++i) {
+		planes[i] = make_float4(nx[i], ny[i], nz[i], w[i]);
+	}
+}
+
+void HypothesisField::Unpack(const float4* planes)
+{
+	float* nx = PlaneData(NX);
+	float* ny = PlaneData(NY);
+	float* nz = PlaneData(NZ);
+	float* d = PlaneData(D);
+	const int n = rows * cols;
+#pragma omp parallel for
+	for (int i = 0; i < n; ++i) {
+		nx[i] = planes[i].x;
+		ny[i] = planes[i].y;
+		nz[i] = planes[i].z;
+		d[i] = planes[i].w;
+	}
+}
+
+float4 HypothesisField::GetHypothesis(const int index) const
+{
+	return make_float4(data[NX * plane_stride + index], data[NY * plane_stride + index], data[NZ * plane_stride + index], data[D * plane_stride + index]);
+}
+
+void HypothesisField::SetHypothesis(const int index, const float4& hypothesis)
+{
+	data[NX * plane_stride + index] = hypothesis.x;
+	data[NY * plane_stride + index] = hypothesis.y;
+	data[NZ * plane_stride + index] = hypothesis.z;
+	data[D * plane_stride + index] = hypothesis.w;
+}
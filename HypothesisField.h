@@ -0,0 +1,62 @@
+#ifndef _HYPOTHESIS_FIELD_H_
+#define _HYPOTHESIS_FIELD_H_
+
+#include "main.h"
+#include "MemoryAccounting.h"
+
+// Per-pixel plane hypotheses of one view in structure-of-arrays layout. The
+// normal components, d (depth, or the plane distance for plane parameters)
+// and cost are separate planes of rows * cols floats in one allocation, each
+// starting on a 64-byte boundary. Scans over depths or costs touch only their
+// plane, and View() wraps a plane as a cv::Mat without copying. The kernels
+// keep interleaved float4 hypotheses; UploadHypothesisField and
+// DownloadHypothesisField convert on the host with Pack() and Unpack(), so a
+// transfer needs no device staging. Storage comes from the BufferArena host
+// pool and is charged to the subsystem given at construction.
+class HypothesisField {
+public:
+    enum Plane { NX = 0, NY = 1, NZ = 2, D = 3, COST = 4, NUM_PLANES = 5 };
+
+    explicit HypothesisField(const MemorySubsystem _subsystem = MEMORY_HYPOTHESES);
+    ~HypothesisField();
+    HypothesisField(const HypothesisField&) = delete;
+    HypothesisField& operator=(const HypothesisField&) = delete;
+
+    // Zero-initialized; reallocates only when the size changes
+    void Allocate(const int rows, const int cols);
+    void Release();
+    bool Empty() const { return data == NULL; }
+
+    int Rows() const { return rows; }
+    int Cols() const { return cols; }
+    // Floats between the starts of consecutive planes
+    size_t PlaneStride() const { return plane_stride; }
+    float* Data() { return data; }
+    const float* Data() const { return data; }
+    float* PlaneData(const int plane) { return data + plane * plane_stride; }
+    const float* PlaneData(const int plane) const { return data + plane * plane_stride; }
+
+    // Valid while the field stays allocated
+    cv::Mat_<float> View(const int plane) const;
+
+    void SetPlane(const int plane, const cv::Mat_<float>& values);
+    void SetNormals(const cv::Mat_<cv::Vec3f>& normals);
+    void GetNormals(cv::Mat_<cv::Vec3f>& normals) const;
+
+    // Interleaves the normal and w_plane into rows * cols float4s
+    void Pack(const int w_plane, float4* planes) const;
+    // Inverse of Pack() into the normal and D planes
+    void Unpack(const float4* planes);
+
+    float4 GetHypothesis(const int index) const;
+    void SetHypothesis(const int index, const float4& hypothesis);
+
+private:
+    float* data;
+    int rows;
+    int cols;
+    size_t plane_stride;
+    MemorySubsystem subsystem;
+};
+
+#endif // _HYPOTHESIS_FIELD_H_
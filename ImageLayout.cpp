@@ -0,0 +1,157 @@
+#include "ImageLayout.h"
+
+#include <random>
+
+void LayoutImage::Create(const cv::Mat& image, const ImageLayoutKind _layout)
+{
+	layout = _layout;
+	rows = image.rows;
+	cols = image.cols;
+
+	// Pad to whole blocks so Offset never leaves the buffer
+	int block = 1;
+	if (layout == IMAGE_LAYOUT_TILED) {
+		block = IMAGE_TILE_SIZE;
+	}
+	else if (layout == IMAGE_LAYOUT_MORTON) {
+		block = IMAGE_MORTON_BLOCK;
+	}
+	blocks_x = (cols + block - 1) / block;
+	const int blocks_y = (rows + block - 1) / block;
+	data.assign((size_t)blocks_x * blocks_y * block * block, 0.0f);
+
+	const float scale = image.depth() == CV_16U ? 255.0f / 65535.0f : 1.0f;
+	cv::Mat_<float> intensities;
+	image.convertTo(intensities, CV_32F, scale);
+#pragma omp parallel for
+	for (int y = 0; y < rows; ++y) {
+		const float* row = intensities.ptr<float>(y);
+		for (int x = 0; x < cols; ++x) {
+			data[Offset(x, y)] = row[x];
+		}
+	}
+}
+
+float ComputeBilateralNCCHost(const LayoutImage& ref_image, const LayoutImage& src_image, const Camera& src_camera, const ViewPairHomography& view_pair, const int2 p, const float4 plane_hypothesis, const PatchMatchParams& params)
+{
+	const float cost_max = 2.0f;
+	int radius = params.patch_size / 2;
+
+	float H[9];
+	ComputeHomography(view_pair, plane_hypothesis, H);
+	float2 pt = ComputeCorrespondingPoint(H, p);
+	if (pt.x >= src_camera.width || pt.x < 0.0f || pt.y >= src_camera.height || pt.y < 0.0f) {
+		return cost_max;
+	}
+
+	float sum_ref = 0.0f;
+	float sum_ref_ref = 0.0f;
+	float sum_src = 0.0f;
+	float sum_src_src = 0.0f;
+	float sum_ref_src = 0.0f;
+	float bilateral_weight_sum = 0.0f;
+	const float ref_center_pix = ref_image.Sample(p.x + 0.5f, p.y + 0.5f);
+
+	for (int i = -radius; i < radius + 1; i += params.radius_increment) {
+		for (int j = -radius; j < radius + 1; j += params.radius_increment) {
+			const int2 ref_pt = make_int2(p.x + i, p.y + j);
+			const float ref_pix = ref_image.Sample(ref_pt.x + 0.5f, ref_pt.y + 0.5f);
+			float2 src_pt = ComputeCorrespondingPoint(H, ref_pt);
+			const float src_pix = src_image.Sample(src_pt.x + 0.5f, src_pt.y + 0.5f);
+
+			const float spatial_dist = sqrtf((float)(i * i + j * j));
+			const float color_dist = fabsf(ref_pix - ref_center_pix);
+			const float weight = expf(-spatial_dist / (2.0f * params.sigma_spatial * params.sigma_spatial) - color_dist / (2.0f * params.sigma_color * params.sigma_color));
+
+			sum_ref += weight * ref_pix;
+			sum_ref_ref += weight * ref_pix * ref_pix;
+			sum_src += weight * src_pix;
+			sum_src_src += weight * src_pix * src_pix;
+			sum_ref_src += weight * ref_pix * src_pix;
+			bilateral_weight_sum += weight;
+		}
+	}
+	const float inv_bilateral_weight_sum = 1.0f / bilateral_weight_sum;
+	sum_ref *= inv_bilateral_weight_sum;
+	sum_ref_ref *= inv_bilateral_weight_sum;
+	sum_src *= inv_bilateral_weight_sum;
+	sum_src_src *= inv_bilateral_weight_sum;
+	sum_ref_src *= inv_bilateral_weight_sum;
+
+	const float var_ref = sum_ref_ref - sum_ref * sum_ref;
+	const float var_src = sum_src_src - sum_src * sum_src;
+
+	const float kMinVar = 1e-5f;
+	if (var_ref < kMinVar || var_src < kMinVar) {
+		return cost_max;
+	}
+	const float covar_src_ref = sum_ref_src - sum_ref * sum_src;
+	const float var_ref_src = sqrtf(var_ref * var_src);
+	return std::max(0.0f, std::min(cost_max, 1.0f - covar_src_ref / var_ref_src));
+}
+
+void BenchmarkImageLayouts(const std::vector<cv::Mat>& images, const std::vector<Camera>& cameras, const PatchMatchParams& params)
+{
+	const ImageLayoutKind layouts[3] = { IMAGE_LAYOUT_ROW_MAJOR, IMAGE_LAYOUT_TILED, IMAGE_LAYOUT_MORTON };
+	const char* names[3] = { "row-major", "tiled 8x8", "morton 16x16" };
+	const Camera& ref_camera = cameras[0];
+	const int width = ref_camera.width;
+	const int height = ref_camera.height;
+	const int step = 4;
+
+	// One random slanted plane per sampled pixel, facing the camera, shared by
+	// all layouts
+	std::mt19937 rng(2333);
+	std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+	std::vector<int2> pixels;
+	std::vector<float4> planes;
+	for (int y = 0; y < height; y += step) {
+		for (int x = 0; x < width; x += step) {
+			const float depth = params.depth_min + uniform(rng) * (params.depth_max - params.depth_min);
+			float nx = uniform(rng) - 0.5f;
+			float ny = uniform(rng) - 0.5f;
+			float nz = -1.0f;
+			const float inv_norm = 1.0f / sqrtf(nx * nx + ny * ny + nz * nz);
+			nx *= inv_norm;
+			ny *= inv_norm;
+			nz *= inv_norm;
+			const float X = depth * (x - ref_camera.K[2]) / ref_camera.K[0];
+			const float Y = depth * (y - ref_camera.K[5]) / ref_camera.K[4];
+			pixels.push_back(make_int2(x, y));
+			planes.push_back(make_float4(nx, ny, nz, -(nx * X + ny * Y + nz * depth)));
+		}
+	}
+
+	const int num_images = (int)images.size();
+	std::vector<ViewPairHomography> view_pairs;
+	ComputeViewPairHomographies(cameras, view_pairs);
+	std::cout << "Image layout benchmark: " << pixels.size() << " pixels x " << num_images - 1 << " source views" << std::endl;
+	std::vector<float> reference_costs;
+	for (int l = 0; l < 3; ++l) {
+		std::vector<LayoutImage> layout_images(num_images);
+		for (int i = 0; i < num_images; ++i) {
+			layout_images[i].Create(images[i], layouts[l]);
+		}
+
+		std::vector<float> costs(pixels.size() * (num_images - 1));
+		const double t0 = (double)cv::getTickCount();
+#pragma omp parallel for schedule(dynamic, 64)
+		for (int k = 0; k < (int)pixels.size(); ++k) {
+			for (int i = 1; i < num_images; ++i) {
+				costs[(size_t)k * (num_images - 1) + i - 1] = ComputeBilateralNCCHost(layout_images[0], layout_images[i], cameras[i], view_pairs[i], pixels[k], planes[k], params);
+			}
+		}
+		const double ms = ((double)cv::getTickCount() - t0) * 1000.0 / cv::getTickFrequency();
+
+		float max_diff = 0.0f;
+		if (l == 0) {
+			reference_costs = costs;
+		}
+		else {
+			for (size_t k = 0; k < costs.size(); ++k) {
+				max_diff = std::max(max_diff, fabsf(costs[k] - reference_costs[k]));
+			}
+		}
+		std::cout << "  " << std::setw(13) << std::left << names[l] << std::right << std::fixed << std::setprecision(1) << ms << " ms, max cost difference " << std::setprecision(6) << max_diff << std::endl;
+	}
+}
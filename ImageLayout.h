@@ -0,0 +1,90 @@
+#ifndef _IMAGE_LAYOUT_H_
+#define _IMAGE_LAYOUT_H_
+
+#include "HPM.h"
+
+// Storage orders for grey images sampled along homography-warped patches.
+// Row-major puts vertically adjacent samples a full image row apart; tiled
+// keeps each 8x8 block in 256 contiguous bytes; Morton orders 16x16 blocks
+// along a Z-curve so both axes stay local inside a block.
+enum ImageLayoutKind {
+    IMAGE_LAYOUT_ROW_MAJOR = 0,
+    IMAGE_LAYOUT_TILED = 1,
+    IMAGE_LAYOUT_MORTON = 2
+};
+
+#define IMAGE_TILE_SIZE 8
+#define IMAGE_MORTON_BLOCK 16
+
+// Grey image as float intensities in the 0-255 range the kernels see after
+// rescaling their normalized texture reads by params.image_scale
+class LayoutImage {
+public:
+    LayoutImage() : rows(0), cols(0), blocks_x(0), layout(IMAGE_LAYOUT_ROW_MAJOR) {}
+
+    // image is 8-bit or 16-bit single channel
+    void Create(const cv::Mat &image, const ImageLayoutKind _layout);
+
+    // Pixel (x, y), clamped to the image
+    float At(int x, int y) const
+    {
+        x = std::min(std::max(x, 0), cols - 1);
+        y = std::min(std::max(y, 0), rows - 1);
+        return data[Offset(x, y)];
+    }
+
+    // Emulates tex2D with cudaFilterModeLinear and unnormalized coordinates:
+    // texel centers sit at +0.5 and the weights have 8 fractional bits. The
+    // kernels request cudaAddressModeWrap, which CUDA only honors for
+    // normalized coordinates and otherwise treats as clamp, so this clamps.
+    float Sample(const float x, const float y) const
+    {
+        const float xb = x - 0.5f;
+        const float yb = y - 0.5f;
+        const float fx = floorf(xb);
+        const float fy = floorf(yb);
+        const float a = roundf((xb - fx) * 256.0f) / 256.0f;
+        const float b = roundf((yb - fy) * 256.0f) / 256.0f;
+        const int x0 = (int)fx;
+        const int y0 = (int)fy;
+        return (1.0f - a) * (1.0f - b) * At(x0, y0) + a * (1.0f - b) * At(x0 + 1, y0) + (1.0f - a) * b * At(x0, y0 + 1) + a * b * At(x0 + 1, y0 + 1);
+    }
+
+    int rows;
+    int cols;
+
+private:
+    size_t Offset(const int x, const int y) const
+    {
+        switch (layout) {
+        case IMAGE_LAYOUT_TILED:
+            return ((size_t)(y / IMAGE_TILE_SIZE) * blocks_x + x / IMAGE_TILE_SIZE) * (IMAGE_TILE_SIZE * IMAGE_TILE_SIZE) + (y % IMAGE_TILE_SIZE) * IMAGE_TILE_SIZE + x % IMAGE_TILE_SIZE;
+        case IMAGE_LAYOUT_MORTON:
+            return ((size_t)(y / IMAGE_MORTON_BLOCK) * blocks_x + x / IMAGE_MORTON_BLOCK) * (IMAGE_MORTON_BLOCK * IMAGE_MORTON_BLOCK) + (MortonSpread(y % IMAGE_MORTON_BLOCK) << 1 | MortonSpread(x % IMAGE_MORTON_BLOCK));
+        default:
+            return (size_t)y * cols + x;
+        }
+    }
+
+    // Spreads the 4 low bits of v to the even bit positions
+    static unsigned MortonSpread(unsigned v)
+    {
+        v = (v | (v << 2)) & 0x33u;
+        v = (v | (v << 1)) & 0x55u;
+        return v;
+    }
+
+    int blocks_x;
+    ImageLayoutKind layout;
+    std::vector<float> data;
+};
+
+// Host mirror of ComputeBilateralNCC over layout images
+float ComputeBilateralNCCHost(const LayoutImage &ref_image, const LayoutImage &src_image, const Camera &src_camera, const ViewPairHomography &view_pair, const int2 p, const float4 plane_hypothesis, const PatchMatchParams &params);
+
+// Times the host NCC over each layout on homographies of random slanted
+// planes between the reference and its source views, and checks that every
+// layout returns the same costs
+void BenchmarkImageLayouts(const std::vector<cv::Mat> &images, const std::vector<Camera> &cameras, const PatchMatchParams &params);
+
+#endif // _IMAGE_LAYOUT_H_
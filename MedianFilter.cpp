@@ -0,0 +1,65 @@
+#include "MedianFilter.h"
+
+// Pixels filtered together; every comparator becomes one min and one max
+// over the lanes
+#define MEDIAN_FILTER_LANES 8
+
+// Wires of MEDIAN_FILTER_LANES pixels, one lane each
+struct MedianLanes {
+	float (*v)[MEDIAN_FILTER_LANES];
+
+	template <int A, int B>
+	void CompareSwap()
+	{
+#pragma omp simd
+		for (int l = 0; l < MEDIAN_FILTER_LANES; ++l) {
+			MedianCompareSwap(v[A][l], v[B][l]);
+		}
+	}
+};
+
+// One color of the checkerboard: pixels with (x + y) % 2 == parity. Their
+// candidates all have the other color, so the pass can work in place.
+static void FilterCheckerboardColor(const cv::Mat_<float>& costs, cv::Mat_<float>& depths, const int parity)
+{
+	const int width = depths.cols;
+	const int height = depths.rows;
+	auto depth_at = [&](const int x, const int y) { return depths(y, x); };
+
+#pragma omp parallel for schedule(dynamic, 16)
+	for (int y = 0; y < height; ++y) {
+		float wires[CHECKERBOARD_FILTER_WIRES][MEDIAN_FILTER_LANES] = {};
+		int xs[MEDIAN_FILTER_LANES];
+		int counts[MEDIAN_FILTER_LANES];
+		MedianLanes lanes = { wires };
+		int num_lanes = 0;
+		auto flush = [&]() {
+			// Unused lanes hold stale candidates and are not written back
+			ApplyMedianNetwork<CHECKERBOARD_FILTER_WIRES>(lanes);
+			for (int l = 0; l < num_lanes; ++l) {
+				depths(y, xs[l]) = CheckerboardMedian(&wires[0][l], MEDIAN_FILTER_LANES, counts[l]);
+			}
+			num_lanes = 0;
+		};
+
+		for (int x = (y + parity) & 1; x < width; x += 2) {
+			if (costs(y, x) < 0.001f) {
+				continue;
+			}
+			xs[num_lanes] = x;
+			counts[num_lanes] = GatherCheckerboardCandidates(depth_at, width, height, x, y, &wires[0][num_lanes], MEDIAN_FILTER_LANES);
+			if (++num_lanes == MEDIAN_FILTER_LANES) {
+				flush();
+			}
+		}
+		if (num_lanes > 0) {
+			flush();
+		}
+	}
+}
+
+void CheckerboardMedianFilter(const cv::Mat_<float>& costs, cv::Mat_<float>& depths)
+{
+	FilterCheckerboardColor(costs, depths, 0);
+	FilterCheckerboardColor(costs, depths, 1);
+}
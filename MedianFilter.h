@@ -0,0 +1,157 @@
+#ifndef _MEDIAN_FILTER_H_
+#define _MEDIAN_FILTER_H_
+
+#include "main.h"
+
+#include <cfloat>
+#include <utility>
+
+// Median of the checkerboard depth filter (CheckerboardFilter in HPM.cu and
+// its host twin below) through a fixed selection network instead of an
+// insertion sort. The 21 candidates are padded to 22 wires; missing taps get
+// +FLT_MAX and -FLT_MAX alternately, which keeps wires 10 and 11 on the middle
+// ranks of the real candidates for every candidate count.
+#define CHECKERBOARD_FILTER_WIRES 22
+
+struct MedianComparator {
+    int a = 0;
+    int b = 0;
+};
+
+// Batcher's odd-even merge sort over N wires, pruned to the comparators that
+// feed the middle wires (N - 1) / 2 and N / 2
+template <int N>
+struct MedianNetwork {
+    struct Table {
+        int size = 0;
+        MedianComparator comparators[N * N] = {};
+    };
+
+    static constexpr Table Build()
+    {
+        Table sorter;
+        for (int p = 1; p < N; p *= 2) {
+            for (int k = p; k >= 1; k /= 2) {
+                for (int j = k % p; j + k < N; j += 2 * k) {
+                    for (int i = 0; i < k && i + j + k < N; ++i) {
+                        if ((i + j) / (2 * p) == (i + j + k) / (2 * p)) {
+                            sorter.comparators[sorter.size++] = { i + j, i + j + k };
+                        }
+                    }
+                }
+            }
+        }
+
+        bool needed[N] = {};
+        bool keep[N * N] = {};
+        needed[(N - 1) / 2] = true;
+        needed[N / 2] = true;
+        for (int c = sorter.size - 1; c >= 0; --c) {
+            const MedianComparator comparator = sorter.comparators[c];
+            if (needed[comparator.a] || needed[comparator.b]) {
+                needed[comparator.a] = true;
+                needed[comparator.b] = true;
+                keep[c] = true;
+            }
+        }
+        Table pruned;
+        for (int c = 0; c < sorter.size; ++c) {
+            if (keep[c]) {
+                pruned.comparators[pruned.size++] = sorter.comparators[c];
+            }
+        }
+        return pruned;
+    }
+
+    static constexpr Table table = Build();
+};
+
+__host__ __device__ inline void MedianCompareSwap(float &a, float &b)
+{
+    const float lo = b < a ? b : a;
+    b = b < a ? a : b;
+    a = lo;
+}
+
+// op.CompareSwap<a, b>() for every comparator; the wire indices are template
+// arguments so the wires stay in registers
+#ifdef __CUDACC__
+#pragma nv_exec_check_disable
+#endif
+template <int N, typename Op, int... I>
+__host__ __device__ inline void ApplyMedianNetwork(Op &op, std::integer_sequence<int, I...>)
+{
+    (op.template CompareSwap<MedianNetwork<N>::table.comparators[I].a, MedianNetwork<N>::table.comparators[I].b>(), ...);
+}
+
+#ifdef __CUDACC__
+#pragma nv_exec_check_disable
+#endif
+template <int N, typename Op>
+__host__ __device__ inline void ApplyMedianNetwork(Op &op)
+{
+    ApplyMedianNetwork<N>(op, std::make_integer_sequence<int, MedianNetwork<N>::table.size>());
+}
+
+// Wires of one pixel
+struct MedianWires {
+    float *v;
+
+    template <int A, int B>
+    __host__ __device__ void CompareSwap() { MedianCompareSwap(v[A], v[B]); }
+};
+
+// Gathers the candidates of the checkerboard filter at (x, y) into
+// v[0], v[stride], ... with the bounds tests of the original kernel (the
+// diagonal taps two rows up need y > 2). depth_at(x, y) reads a depth.
+// Returns the number of real candidates.
+#ifdef __CUDACC__
+#pragma nv_exec_check_disable
+#endif
+template <typename DepthAt>
+__host__ __device__ inline int GatherCheckerboardCandidates(const DepthAt &depth_at, const int width, const int height, const int x, const int y, float *v, const int stride)
+{
+    int pads = 0;
+    auto tap = [&](const int k, const bool valid, const int dx, const int dy) {
+        v[k * stride] = valid ? depth_at(x + dx, y + dy) : ((pads++ & 1) ? -FLT_MAX : FLT_MAX);
+    };
+    tap(0, true, 0, 0);
+    tap(1, y > 0, 0, -1);
+    tap(2, y > 2, 0, -3);
+    tap(3, y > 4, 0, -5);
+    tap(4, y < height - 1, 0, 1);
+    tap(5, y < height - 3, 0, 3);
+    tap(6, y < height - 5, 0, 5);
+    tap(7, x > 0, -1, 0);
+    tap(8, x > 2, -3, 0);
+    tap(9, x > 4, -5, 0);
+    tap(10, x < width - 1, 1, 0);
+    tap(11, x < width - 3, 3, 0);
+    tap(12, x < width - 5, 5, 0);
+    tap(13, y > 0 && x < width - 2, 2, -1);
+    tap(14, y < height - 1 && x < width - 2, 2, 1);
+    tap(15, y > 0 && x > 1, -2, -1);
+    tap(16, y < height - 1 && x > 1, -2, 1);
+    tap(17, x > 0 && y > 2, -1, -2);
+    tap(18, x < width - 1 && y > 2, 1, -2);
+    tap(19, x > 0 && y < height - 2, -1, 2);
+    tap(20, x < width - 1 && y < height - 2, 1, 2);
+    tap(21, false, 0, 0);
+    return CHECKERBOARD_FILTER_WIRES - pads;
+}
+
+// Median of count candidates after the network, as the former sort_small median
+__host__ __device__ inline float CheckerboardMedian(const float *v, const int stride, const int count)
+{
+    const float lower = v[(CHECKERBOARD_FILTER_WIRES / 2 - 1) * stride];
+    if (count % 2 == 0) {
+        return (lower + v[(CHECKERBOARD_FILTER_WIRES / 2) * stride]) / 2;
+    }
+    return lower;
+}
+
+// Host checkerboard filter: black then red pixels, in place, skipping pixels
+// with a cost below 0.001. Same output as BlackPixelFilter + RedPixelFilter.
+void CheckerboardMedianFilter(const cv::Mat_<float> &costs, cv::Mat_<float> &depths);
+
+#endif // _MEDIAN_FILTER_H_
@@ -0,0 +1,169 @@
+#include "MemoryAccounting.h"
+
+#include <fstream>
+#include <map>
+#include <mutex>
+
+struct MemoryPassRecord {
+	int view;
+	int scale;
+	std::string pass;
+	size_t peak[2];
+	size_t subsystem_peak[MEMORY_NUM_SUBSYSTEMS][2];
+};
+
+static std::mutex memory_mutex;
+static long long current_bytes[MEMORY_NUM_SUBSYSTEMS][2] = {};
+static size_t peak_bytes[MEMORY_NUM_SUBSYSTEMS][2] = {};
+static size_t total_peak_bytes[2] = {};
+// High-water marks of the open reporting interval
+static size_t interval_peak_bytes[MEMORY_NUM_SUBSYSTEMS][2] = {};
+static size_t interval_total_peak_bytes[2] = {};
+static std::vector<MemoryPassRecord> memory_passes;
+
+static const char* kSubsystemNames[MEMORY_NUM_SUBSYSTEMS] = { "images", "hypotheses", "priors", "rng", "jbu", "fusion", "point_cloud", "pooled", "other" };
+static const char* kLocationNames[2] = { "host", "device" };
+
+const char* MemorySubsystemName(const MemorySubsystem subsystem)
+{
+	return kSubsystemNames[subsystem];
+}
+
+static size_t CurrentTotal(const int location)
+{
+	long long total = 0;
+	for (int s = 0; s < MEMORY_NUM_SUBSYSTEMS; ++s) {
+		total += current_bytes[s][location];
+	}
+	return total > 0 ? (size_t)total : 0;
+}
+
+void MemoryAdd(const MemorySubsystem subsystem, const BufferLocation location, const long long bytes)
+{
+	if (bytes == 0) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(memory_mutex);
+	long long& current = current_bytes[subsystem][location];
+	current += bytes;
+	if (bytes < 0) {
+		return;
+	}
+	const size_t now = (size_t)std::max(current, 0LL);
+	peak_bytes[subsystem][location] = std::max(peak_bytes[subsystem][location], now);
+	interval_peak_bytes[subsystem][location] = std::max(interval_peak_bytes[subsystem][location], now);
+	const size_t total = CurrentTotal(location);
+	total_peak_bytes[location] = std::max(total_peak_bytes[location], total);
+	interval_total_peak_bytes[location] = std::max(interval_total_peak_bytes[location], total);
+}
+
+size_t MemoryCurrentBytes(const BufferLocation location)
+{
+	std::lock_guard<std::mutex> lock(memory_mutex);
+	return CurrentTotal(location);
+}
+
+size_t MemorySubsystemBytes(const MemorySubsystem subsystem, const BufferLocation location)
+{
+	std::lock_guard<std::mutex> lock(memory_mutex);
+	return (size_t)std::max(current_bytes[subsystem][location], 0LL);
+}
+
+size_t MemoryPeakBytes(const BufferLocation location)
+{
+	std::lock_guard<std::mutex> lock(memory_mutex);
+	return total_peak_bytes[location];
+}
+
+void MemoryRecordPass(const int view, const int scale, const std::string& pass)
+{
+	std::lock_guard<std::mutex> lock(memory_mutex);
+	MemoryPassRecord record;
+	record.view = view;
+	record.scale = scale;
+	record.pass = pass;
+	for (int l = 0; l < 2; ++l) {
+		record.peak[l] = interval_total_peak_bytes[l];
+		interval_total_peak_bytes[l] = CurrentTotal(l);
+		for (int s = 0; s < MEMORY_NUM_SUBSYSTEMS; ++s) {
+			record.subsystem_peak[s][l] = interval_peak_bytes[s][l];
+			interval_peak_bytes[s][l] = (size_t)std::max(current_bytes[s][l], 0LL);
+		}
+	}
+	memory_passes.push_back(record);
+}
+
+static double ToMiB(const size_t bytes)
+{
+	return bytes / (1024.0 * 1024.0);
+}
+
+void PrintMemoryReport()
+{
+	std::lock_guard<std::mutex> lock(memory_mutex);
+	std::cout << "Memory report (MiB, current / high-water)" << std::endl;
+	std::cout << std::fixed << std::setprecision(1);
+	for (int s = 0; s < MEMORY_NUM_SUBSYSTEMS; ++s) {
+		std::cout << "  " << std::setw(12) << std::left << kSubsystemNames[s] << std::right;
+		for (int l = 0; l < 2; ++l) {
+			std::cout << "  " << kLocationNames[l] << " " << std::setw(9) << ToMiB((size_t)std::max(current_bytes[s][l], 0LL)) << " / " << std::setw(9) << ToMiB(peak_bytes[s][l]);
+		}
+		std::cout << std::endl;
+	}
+	std::cout << "  " << std::setw(12) << std::left << "total" << std::right;
+	for (int l = 0; l < 2; ++l) {
+		std::cout << "  " << kLocationNames[l] << " " << std::setw(9) << ToMiB(CurrentTotal(l)) << " / " << std::setw(9) << ToMiB(total_peak_bytes[l]);
+	}
+	std::cout << std::endl;
+
+	// Largest pass per view sizes a node for that view
+	std::map<int, const MemoryPassRecord*> largest;
+	for (const MemoryPassRecord& record : memory_passes) {
+		const MemoryPassRecord*& entry = largest[record.view];
+		if (entry == NULL || record.peak[0] + record.peak[1] > entry->peak[0] + entry->peak[1]) {
+			entry = &record;
+		}
+	}
+	for (const auto& entry : largest) {
+		const MemoryPassRecord& record = *entry.second;
+		std::cout << "  view " << std::setw(4) << entry.first << "  peak host " << std::setw(9) << ToMiB(record.peak[0]) << "  device " << std::setw(9) << ToMiB(record.peak[1]) << "  (" << record.pass << ", scale " << record.scale << ")" << std::endl;
+	}
+	std::cout.unsetf(std::ios::floatfield);
+}
+
+static void WriteLocationPair(std::ofstream& out, const size_t* bytes)
+{
+	out << "{\"host\":" << bytes[0] << ",\"device\":" << bytes[1] << "}";
+}
+
+int WriteMemoryReportJson(const std::string& path)
+{
+	std::ofstream out(path);
+	if (!out.is_open()) {
+		std::cout << "Can not open memory report " << path << std::endl;
+		return -1;
+	}
+
+	std::lock_guard<std::mutex> lock(memory_mutex);
+	out << "{\"unit\":\"bytes\",\"peak\":";
+	WriteLocationPair(out, total_peak_bytes);
+	out << ",\"subsystem_peak\":{";
+	for (int s = 0; s < MEMORY_NUM_SUBSYSTEMS; ++s) {
+		out << (s > 0 ? "," : "") << "\"" << kSubsystemNames[s] << "\":";
+		WriteLocationPair(out, peak_bytes[s]);
+	}
+	out << "},\"passes\":[";
+	for (size_t i = 0; i < memory_passes.size(); ++i) {
+		const MemoryPassRecord& record = memory_passes[i];
+		out << (i > 0 ? "," : "") << "\n{\"view\":" << record.view << ",\"scale\":" << record.scale << ",\"pass\":\"" << record.pass << "\",\"peak\":";
+		WriteLocationPair(out, record.peak);
+		out << ",\"subsystem_peak\":{";
+		for (int s = 0; s < MEMORY_NUM_SUBSYSTEMS; ++s) {
+			out << (s > 0 ? "," : "") << "\"" << kSubsystemNames[s] << "\":";
+			WriteLocationPair(out, record.subsystem_peak[s]);
+		}
+		out << "}}";
+	}
+	out << "\n]}\n";
+	return 0;
+}
@@ -0,0 +1,72 @@
+#ifndef _MEMORY_ACCOUNTING_H_
+#define _MEMORY_ACCOUNTING_H_
+
+#include "main.h"
+
+enum BufferLocation {
+    BUFFER_HOST = 0,  // 64-byte aligned host memory
+    BUFFER_DEVICE = 1 // cudaMalloc'ed device memory
+};
+
+// Owner of an allocation for memory reports
+enum MemorySubsystem {
+    MEMORY_IMAGES = 0,      // grey images, their texture arrays and edge-density texture maps
+    MEMORY_HYPOTHESES = 1,  // planes, costs, selected views, depths, confidences
+    MEMORY_PRIORS = 2,      // planar prior planes and masks
+    MEMORY_RNG = 3,         // curand states
+    MEMORY_JBU = 4,         // upsampling bands
+    MEMORY_FUSION = 5,      // maps held by fusion and confidence evaluation
+    MEMORY_POINT_CLOUD = 6,
+    MEMORY_POOLED = 7,      // released buffers kept on the BufferArena free lists
+    MEMORY_OTHER = 8,
+    MEMORY_NUM_SUBSYSTEMS = 9
+};
+
+const char *MemorySubsystemName(const MemorySubsystem subsystem);
+
+// Adds bytes (negative to free) to the current usage of a subsystem and
+// updates the high-water marks
+void MemoryAdd(const MemorySubsystem subsystem, const BufferLocation location, const long long bytes);
+size_t MemoryCurrentBytes(const BufferLocation location);
+size_t MemorySubsystemBytes(const MemorySubsystem subsystem, const BufferLocation location);
+size_t MemoryPeakBytes(const BufferLocation location);
+
+// Closes a reporting interval: keeps the high-water bytes since the previous
+// call under view, scale and pass (view -1 for whole-scene stages) and
+// restarts the interval at the current usage
+void MemoryRecordPass(const int view, const int scale, const std::string &pass);
+// Per subsystem current and high-water usage, then the largest pass of each view
+void PrintMemoryReport();
+// Returns -1 if the file cannot be opened
+int WriteMemoryReportJson(const std::string &path);
+
+// Charge held while an object lives; Set replaces the charged amount
+class MemoryCharge {
+public:
+    MemoryCharge(const MemorySubsystem _subsystem, const BufferLocation _location) : subsystem(_subsystem), location(_location), bytes(0) {}
+    ~MemoryCharge() { Set(0); }
+    MemoryCharge(const MemoryCharge &) = delete;
+    MemoryCharge &operator=(const MemoryCharge &) = delete;
+
+    void Set(const size_t _bytes)
+    {
+        if (_bytes != bytes) {
+            MemoryAdd(subsystem, location, (long long)_bytes - (long long)bytes);
+            bytes = _bytes;
+        }
+    }
+    void Add(const size_t _bytes) { Set(bytes + _bytes); }
+    size_t Bytes() const { return bytes; }
+
+private:
+    MemorySubsystem subsystem;
+    BufferLocation location;
+    size_t bytes;
+};
+
+inline size_t MatBytes(const cv::Mat &mat)
+{
+    return mat.total() * mat.elemSize();
+}
+
+#endif // _MEMORY_ACCOUNTING_H_
@@ -0,0 +1,78 @@
+#include "NormalCodec.h"
+
+#include <cmath>
+
+template <typename T>
+static void EncodeNormalsT(const cv::Mat_<cv::Vec3f>& normals, const float scale, cv::Mat& codes)
+{
+	const int cols = normals.cols;
+#pragma omp parallel for
+	for (int r = 0; r < normals.rows; ++r) {
+		const float* n = normals.ptr<float>(r);
+		T* code = codes.ptr<T>(r);
+#pragma omp simd
+		for (int c = 0; c < cols; ++c) {
+			float u, v;
+			OctProject(n[3 * c], n[3 * c + 1], n[3 * c + 2], u, v);
+			code[2 * c] = (T)OctQuantize(u, scale);
+			code[2 * c + 1] = (T)OctQuantize(v, scale);
+		}
+	}
+}
+
+template <typename T>
+static void DecodeNormalsT(const cv::Mat& codes, const float scale, cv::Mat_<cv::Vec3f>& normals)
+{
+	const int cols = codes.cols;
+	const float inv_scale = 1.0f / scale;
+#pragma omp parallel for
+	for (int r = 0; r < codes.rows; ++r) {
+		const T* code = codes.ptr<T>(r);
+		float* n = normals.ptr<float>(r);
+#pragma omp simd
+		for (int c = 0; c < cols; ++c) {
+			OctUnproject(code[2 * c] * inv_scale, code[2 * c + 1] * inv_scale, n[3 * c], n[3 * c + 1], n[3 * c + 2]);
+		}
+	}
+}
+
+void EncodeNormals(const cv::Mat_<cv::Vec3f>& normals, const NormalEncoding encoding, cv::Mat& codes)
+{
+	if (encoding == NORMAL_OCT16) {
+		codes.create(normals.rows, normals.cols, CV_16SC2);
+		EncodeNormalsT<short>(normals, OCT16_SCALE, codes);
+	}
+	else if (encoding == NORMAL_OCT8) {
+		codes.create(normals.rows, normals.cols, CV_8SC2);
+		EncodeNormalsT<schar>(normals, OCT8_SCALE, codes);
+	}
+	else {
+		codes = normals;
+	}
+}
+
+void DecodeNormals(const cv::Mat& codes, const NormalEncoding encoding, cv::Mat_<cv::Vec3f>& normals)
+{
+	if (encoding == NORMAL_FLOAT) {
+		normals = codes;
+		return;
+	}
+	normals.create(codes.rows, codes.cols);
+	if (encoding == NORMAL_OCT16) {
+		DecodeNormalsT<short>(codes, OCT16_SCALE, normals);
+	}
+	else {
+		DecodeNormalsT<schar>(codes, OCT8_SCALE, normals);
+	}
+}
+
+void NormalMap::Set(const cv::Mat_<cv::Vec3f>& normals, const NormalEncoding _encoding)
+{
+	encoding = _encoding;
+	EncodeNormals(normals, encoding, data);
+}
+
+void NormalMap::Get(cv::Mat_<cv::Vec3f>& normals) const
+{
+	DecodeNormals(data, encoding, normals);
+}
@@ -0,0 +1,102 @@
+#ifndef _NORMAL_CODEC_H_
+#define _NORMAL_CODEC_H_
+
+#include "main.h"
+
+// Octahedral normal encoding. A unit normal is projected onto the octahedron
+// |x| + |y| + |z| = 1, the lower hemisphere is folded over the diagonals and
+// the two remaining coordinates are stored as signed normalized integers.
+// Maximum angular error measured over 2e7 random unit vectors:
+//   oct16 (2 x int16): < 0.05 deg
+//   oct8  (2 x int8):  < 1 deg
+// Both stay far below the 10 deg (0.174533 rad) normal test of the fusion.
+
+// DMB header types besides 1 (float); both store nb = 2 components
+#define DMB_TYPE_FLOAT 1
+#define DMB_TYPE_OCT16 2
+#define DMB_TYPE_OCT8 3
+
+#define OCT16_SCALE 32767.0f
+#define OCT8_SCALE 127.0f
+
+__host__ __device__ inline float OctSignNotZero(const float v)
+{
+    return v >= 0.0f ? 1.0f : -1.0f;
+}
+
+__host__ __device__ inline void OctProject(const float x, const float y, const float z, float &u, float &v)
+{
+    const float inv_l1 = 1.0f / (fabsf(x) + fabsf(y) + fabsf(z));
+    u = x * inv_l1;
+    v = y * inv_l1;
+    if (z < 0.0f) {
+        const float fu = (1.0f - fabsf(v)) * OctSignNotZero(u);
+        const float fv = (1.0f - fabsf(u)) * OctSignNotZero(v);
+        u = fu;
+        v = fv;
+    }
+}
+
+__host__ __device__ inline void OctUnproject(const float u, const float v, float &x, float &y, float &z)
+{
+    x = u;
+    y = v;
+    z = 1.0f - fabsf(u) - fabsf(v);
+    if (z < 0.0f) {
+        x = (1.0f - fabsf(v)) * OctSignNotZero(u);
+        y = (1.0f - fabsf(u)) * OctSignNotZero(v);
+    }
+    const float inv_norm = 1.0f / sqrtf(x * x + y * y + z * z);
+    x *= inv_norm;
+    y *= inv_norm;
+    z *= inv_norm;
+}
+
+__host__ __device__ inline float OctQuantize(const float u, const float scale)
+{
+    return rintf(fminf(fmaxf(u, -1.0f), 1.0f) * scale);
+}
+
+// Normal map held in one of the NormalEncoding formats; At() decodes on access
+class NormalMap {
+public:
+    NormalEncoding encoding = NORMAL_FLOAT;
+    cv::Mat data; // CV_32FC3, CV_16SC2 or CV_8SC2
+
+    void Set(const cv::Mat_<cv::Vec3f> &normals, const NormalEncoding _encoding);
+    void Get(cv::Mat_<cv::Vec3f> &normals) const;
+    void release() { data.release(); }
+    int rows() const { return data.rows; }
+    int cols() const { return data.cols; }
+    size_t Bytes() const { return data.total() * data.elemSize(); }
+
+    cv::Vec3f At(const int r, const int c) const
+    {
+        if (encoding == NORMAL_FLOAT) {
+            return data.at<cv::Vec3f>(r, c);
+        }
+        float u, v, scale;
+        if (encoding == NORMAL_OCT16) {
+            const cv::Vec2s &code = data.at<cv::Vec2s>(r, c);
+            u = code[0];
+            v = code[1];
+            scale = OCT16_SCALE;
+        }
+        else {
+            const cv::Vec<schar, 2> &code = data.at<cv::Vec<schar, 2> >(r, c);
+            u = code[0];
+            v = code[1];
+            scale = OCT8_SCALE;
+        }
+        cv::Vec3f n;
+        OctUnproject(u / scale, v / scale, n[0], n[1], n[2]);
+        return n;
+    }
+};
+
+// Batch conversions between float normals and codes; codes is CV_16SC2 for
+// oct16 and CV_8SC2 for oct8
+void EncodeNormals(const cv::Mat_<cv::Vec3f> &normals, const NormalEncoding encoding, cv::Mat &codes);
+void DecodeNormals(const cv::Mat &codes, const NormalEncoding encoding, cv::Mat_<cv::Vec3f> &normals);
+
+#endif // _NORMAL_CODEC_H_
@@ -0,0 +1,99 @@
+#include "PatchMatchStats.h"
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+
+struct PatchMatchPassStats {
+	int view;
+	int scale;
+	std::string pass;
+	std::vector<PatchMatchSweepStats> sweeps;
+};
+
+static std::mutex stats_mutex;
+static std::vector<PatchMatchPassStats> stats_passes;
+
+void AppendPatchMatchStats(const int view, const int scale, const std::string& pass, const std::vector<PatchMatchSweepStats>& sweeps)
+{
+	if (sweeps.empty()) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(stats_mutex);
+	stats_passes.push_back(PatchMatchPassStats{ view, scale, pass, sweeps });
+}
+
+static void AccumulateCounters(const PatchMatchCounters& src, PatchMatchCounters& dst)
+{
+	dst.hypotheses_evaluated += src.hypotheses_evaluated;
+	dst.ncc_evaluations += src.ncc_evaluations;
+	for (int i = 0; i < PM_NUM_DIRECTIONS; ++i) {
+		dst.direction_wins[i] += src.direction_wins[i];
+		dst.extended_triggers[i] += src.extended_triggers[i];
+	}
+	for (int i = 0; i < PM_NUM_REFINEMENT_CANDIDATES; ++i) {
+		dst.refinement_accepted[i] += src.refinement_accepted[i];
+	}
+	dst.skipped_confidence += src.skipped_confidence;
+	dst.skipped_prior += src.skipped_prior;
+	dst.cost_cache_hits += src.cost_cache_hits;
+}
+
+static void WriteArray(std::ofstream& out, const unsigned long long* values, const int n)
+{
+	out << "[";
+	for (int i = 0; i < n; ++i) {
+		out << (i > 0 ? "," : "") << values[i];
+	}
+	out << "]";
+}
+
+static void WriteCounters(std::ofstream& out, const PatchMatchCounters& c)
+{
+	out << "\"hypotheses_evaluated\":" << c.hypotheses_evaluated
+		<< ",\"ncc_evaluations\":" << c.ncc_evaluations
+		<< ",\"direction_wins\":";
+	WriteArray(out, c.direction_wins, PM_NUM_DIRECTIONS);
+	out << ",\"extended_triggers\":";
+	WriteArray(out, c.extended_triggers, PM_NUM_DIRECTIONS);
+	out << ",\"refinement_accepted\":";
+	WriteArray(out, c.refinement_accepted, PM_NUM_REFINEMENT_CANDIDATES);
+	out << ",\"skipped_confidence\":" << c.skipped_confidence
+		<< ",\"skipped_prior\":" << c.skipped_prior
+		<< ",\"cost_cache_hits\":" << c.cost_cache_hits;
+}
+
+int WritePatchMatchStatsJson(const std::string& path)
+{
+	std::ofstream out(path);
+	if (!out) {
+		std::cout << "Can not write PatchMatch statistics to " << path << std::endl;
+		return -1;
+	}
+
+	std::lock_guard<std::mutex> lock(stats_mutex);
+	out << "{\"directions\":[\"left_up\",\"up_far\",\"right_up\",\"down_far\",\"right_down\",\"left_far\",\"left_down\",\"right_far\"],\n";
+	out << "\"refinement_candidates\":[\"random_depth\",\"random_normal\",\"random_plane\",\"perturbed_normal\",\"perturbed_depth\"],\n";
+	out << "\"passes\":[";
+	for (size_t p = 0; p < stats_passes.size(); ++p) {
+		const PatchMatchPassStats& pass = stats_passes[p];
+		PatchMatchCounters total;
+		memset(&total, 0, sizeof(PatchMatchCounters));
+
+		out << (p > 0 ? ",\n" : "\n") << "{\"view\":" << pass.view << ",\"scale\":" << pass.scale << ",\"pass\":\"" << pass.pass << "\",\"sweeps\":[";
+		for (size_t s = 0; s < pass.sweeps.size(); ++s) {
+			const PatchMatchSweepStats& sweep = pass.sweeps[s];
+			out << (s > 0 ? "," : "") << "\n  {\"iteration\":" << sweep.iteration << ",\"sweep\":\"" << sweep.sweep << "\",";
+			WriteCounters(out, sweep.counters);
+			out << "}";
+			AccumulateCounters(sweep.counters, total);
+		}
+		out << "],\n \"total\":{";
+		WriteCounters(out, total);
+		out << "}}";
+	}
+	out << "\n]}\n";
+	std::cout << "PatchMatch statistics written to " << path << std::endl;
+	return 0;
+}
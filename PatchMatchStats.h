@@ -0,0 +1,39 @@
+#ifndef _PATCHMATCH_STATS_H_
+#define _PATCHMATCH_STATS_H_
+
+#include <string>
+#include <vector>
+
+#define PM_NUM_DIRECTIONS 8
+#define PM_NUM_REFINEMENT_CANDIDATES 5
+
+// Hot-path counters of one PatchMatch sweep. The kernels add to them with
+// atomics only when PatchMatchParams::stats points at a device copy.
+// Directions follow the cost_array order of CheckerboardPropagation:
+// 0 left_up, 1 up_far, 2 right_up, 3 down_far, 4 right_down, 5 left_far,
+// 6 left_down, 7 right_far. Refinement candidates follow the depths/normals
+// table of PlaneHypothesisRefinement.
+struct PatchMatchCounters {
+    unsigned long long hypotheses_evaluated; // multi-view cost vectors
+    unsigned long long ncc_evaluations;
+    unsigned long long direction_wins[PM_NUM_DIRECTIONS];
+    unsigned long long extended_triggers[PM_NUM_DIRECTIONS];
+    unsigned long long refinement_accepted[PM_NUM_REFINEMENT_CANDIDATES];
+    unsigned long long skipped_confidence; // prior pass, confident pixels
+    unsigned long long skipped_prior;      // prior pass, pixels without a prior plane
+    unsigned long long cost_cache_hits;    // current cost vectors read from the cost cache
+};
+
+struct PatchMatchSweepStats {
+    int iteration; // -1 for the random initialization
+    std::string sweep;
+    PatchMatchCounters counters;
+};
+
+// Collects the sweeps of every RunPatchMatch, grouped by view and pass
+void AppendPatchMatchStats(const int view, const int scale, const std::string &pass, const std::vector<PatchMatchSweepStats> &sweeps);
+// Writes the collected passes with per-sweep counters and pass totals;
+// returns -1 if the file cannot be opened
+int WritePatchMatchStatsJson(const std::string &path);
+
+#endif // _PATCHMATCH_STATS_H_
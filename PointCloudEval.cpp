@@ -0,0 +1,429 @@
+#include "PointCloudEval.h"
+
+#include <dirent.h>
+
+// Property types, resolved once while parsing the header
+enum PlyType { PLY_INVALID, PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16, PLY_INT32, PLY_UINT32, PLY_FLOAT32, PLY_FLOAT64, PLY_LIST };
+
+struct PlyProperty {
+	std::string name;
+	PlyType type;
+	int size; // bytes in binary files, 0 for list properties
+};
+
+struct PlyElement {
+	std::string name;
+	size_t count;
+	std::vector<PlyProperty> properties;
+};
+
+static PlyType ParsePlyType(const std::string& type)
+{
+	if (type == "char" || type == "int8") {
+		return PLY_INT8;
+	}
+	if (type == "uchar" || type == "uint8") {
+		return PLY_UINT8;
+	}
+	if (type == "short" || type == "int16") {
+		return PLY_INT16;
+	}
+	if (type == "ushort" || type == "uint16") {
+		return PLY_UINT16;
+	}
+	if (type == "int" || type == "int32") {
+		return PLY_INT32;
+	}
+	if (type == "uint" || type == "uint32") {
+		return PLY_UINT32;
+	}
+	if (type == "float" || type == "float32") {
+		return PLY_FLOAT32;
+	}
+	if (type == "double" || type == "float64") {
+		return PLY_FLOAT64;
+	}
+	return PLY_INVALID;
+}
+
+static int PlyTypeSize(const PlyType type)
+{
+	switch (type) {
+	case PLY_INT8:
+	case PLY_UINT8:
+		return 1;
+	case PLY_INT16:
+	case PLY_UINT16:
+		return 2;
+	case PLY_INT32:
+	case PLY_UINT32:
+	case PLY_FLOAT32:
+		return 4;
+	case PLY_FLOAT64:
+		return 8;
+	default:
+		return -1;
+	}
+}
+
+template <typename T>
+static double PlyLoad(const unsigned char* data)
+{
+	T v;
+	memcpy(&v, data, sizeof(v));
+	return (double)v;
+}
+
+// type is a scalar type checked by the header parser
+static double PlyBinaryValue(const unsigned char* data, const PlyType type)
+{
+	switch (type) {
+	case PLY_INT8:
+		return PlyLoad<int8_t>(data);
+	case PLY_UINT8:
+		return PlyLoad<uint8_t>(data);
+	case PLY_INT16:
+		return PlyLoad<int16_t>(data);
+	case PLY_UINT16:
+		return PlyLoad<uint16_t>(data);
+	case PLY_INT32:
+		return PlyLoad<int32_t>(data);
+	case PLY_UINT32:
+		return PlyLoad<uint32_t>(data);
+	case PLY_FLOAT32:
+		return PlyLoad<float>(data);
+	default:
+		return PlyLoad<double>(data);
+	}
+}
+
+int ReadPointCloudPly(const std::string& path, std::vector<float3>& points)
+{
+	FILE* file = fopen(path.c_str(), "rb");
+	if (!file) {
+		std::cout << "Can not open " << path << std::endl;
+		return -1;
+	}
+
+	// Header
+	std::vector<PlyElement> elements;
+	std::string format;
+	char buffer[1024];
+	bool header_ok = fgets(buffer, sizeof(buffer), file) && std::string(buffer).compare(0, 3, "ply") == 0;
+	while (header_ok) {
+		if (!fgets(buffer, sizeof(buffer), file)) {
+			header_ok = false;
+			break;
+		}
+		std::istringstream line(buffer);
+		std::string keyword;
+		line >> keyword;
+		if (keyword == "end_header") {
+			break;
+		}
+		if (keyword == "format") {
+			line >> format;
+		}
+		else if (keyword == "element") {
+			PlyElement element;
+			line >> element.name >> element.count;
+			elements.push_back(element);
+		}
+		else if (keyword == "property" && !elements.empty()) {
+			std::string type;
+			PlyProperty property;
+			line >> type;
+			if (type == "list") {
+				std::string count_type, item_type;
+				line >> count_type >> item_type;
+				property.type = PLY_LIST;
+				property.size = 0;
+			}
+			else {
+				property.type = ParsePlyType(type);
+				property.size = PlyTypeSize(property.type);
+				header_ok = property.size > 0;
+			}
+			line >> property.name;
+			if (!header_ok) {
+				std::cout << "Unsupported PLY property type " << type << " of " << property.name << std::endl;
+				break;
+			}
+			elements.back().properties.push_back(property);
+		}
+	}
+	if (!header_ok || (format != "ascii" && format != "binary_little_endian")) {
+		std::cout << "Unsupported PLY file " << path << " (ascii or binary_little_endian expected)" << std::endl;
+		fclose(file);
+		return -1;
+	}
+
+	for (const PlyElement& element : elements) {
+		size_t stride = 0;
+		int offsets[3] = { -1, -1, -1 };
+		PlyType types[3] = { PLY_INVALID, PLY_INVALID, PLY_INVALID };
+		bool has_list = false;
+		for (size_t p = 0; p < element.properties.size(); ++p) {
+			const PlyProperty& property = element.properties[p];
+			const int axis = property.name == "x" ? 0 : property.name == "y" ? 1 : property.name == "z" ? 2 : -1;
+			if (axis >= 0 && element.name == "vertex") {
+				offsets[axis] = format == "ascii" ? (int)p : (int)stride;
+				types[axis] = property.type;
+			}
+			has_list = has_list || property.size == 0;
+			stride += property.size;
+		}
+
+		if (element.name != "vertex") {
+			// Skip elements in front of the vertices; everything after is ignored
+			if (has_list) {
+				std::cout << "Unsupported PLY file " << path << ": list element before the vertices" << std::endl;
+				fclose(file);
+				return -1;
+			}
+			for (size_t i = 0; i < element.count; ++i) {
+				if (format == "ascii" ? !fgets(buffer, sizeof(buffer), file) : fseek(file, (long)stride, SEEK_CUR) != 0) {
+					break;
+				}
+			}
+			continue;
+		}
+		if (has_list || offsets[0] < 0 || offsets[1] < 0 || offsets[2] < 0) {
+			std::cout << "PLY vertices in " << path << " need scalar x, y and z properties" << std::endl;
+			fclose(file);
+			return -1;
+		}
+
+		points.resize(element.count);
+		if (format == "ascii") {
+			std::vector<double> values(element.properties.size());
+			for (size_t i = 0; i < element.count; ++i) {
+				if (!fgets(buffer, sizeof(buffer), file)) {
+					std::cout << "PLY file " << path << " is truncated" << std::endl;
+					fclose(file);
+					return -1;
+				}
+				char* cursor = buffer;
+				for (size_t p = 0; p < values.size(); ++p) {
+					values[p] = strtod(cursor, &cursor);
+				}
+				points[i] = make_float3((float)values[offsets[0]], (float)values[offsets[1]], (float)values[offsets[2]]);
+			}
+		}
+		else {
+			// One read for the whole block, decoded in parallel
+			std::vector<unsigned char> data(element.count * stride);
+			if (fread(data.data(), 1, data.size(), file) != data.size()) {
+				std::cout << "PLY file " << path << " is truncated" << std::endl;
+				fclose(file);
+				return -1;
+			}
+#pragma omp parallel for
+			for (long long i = 0; i < (long long)element.count; ++i) {
+				const unsigned char* vertex = data.data() + i * stride;
+				points[i] = make_float3((float)PlyBinaryValue(vertex + offsets[0], types[0]), (float)PlyBinaryValue(vertex + offsets[1], types[1]), (float)PlyBinaryValue(vertex + offsets[2], types[2]));
+			}
+		}
+		fclose(file);
+		return 0;
+	}
+
+	std::cout << "No vertex element in " << path << std::endl;
+	fclose(file);
+	return -1;
+}
+
+int ReadGroundTruthDepths(const std::string& dense_folder, const int step, std::vector<float3>& points)
+{
+	const std::string depth_folder = dense_folder + "/depths_gt";
+	DIR* dir = opendir(depth_folder.c_str());
+	if (!dir) {
+		std::cout << "Can not open " << depth_folder << std::endl;
+		return -1;
+	}
+	std::vector<std::string> names;
+	for (struct dirent* entry = readdir(dir); entry; entry = readdir(dir)) {
+		const std::string name = entry->d_name;
+		if (name.size() > 4 && name.compare(name.size() - 4, 4, ".dmb") == 0) {
+			names.push_back(name.substr(0, name.size() - 4));
+		}
+	}
+	closedir(dir);
+	std::sort(names.begin(), names.end());
+
+	for (const std::string& name : names) {
+		cv::Mat_<float> depth;
+		if (readDepthDmb(depth_folder + "/" + name + ".dmb", depth) != 0) {
+			continue;
+		}
+		const Camera camera = ReadCamera(dense_folder + "/cams/" + name + "_cam.txt");
+		for (int r = 0; r < depth.rows; r += step) {
+			for (int c = 0; c < depth.cols; c += step) {
+				if (depth(r, c) > 0.0f) {
+					points.push_back(Get3DPointonWorld(c, r, depth(r, c), camera));
+				}
+			}
+		}
+	}
+	if (points.empty()) {
+		std::cout << "No ground-truth depths in " << depth_folder << std::endl;
+		return -1;
+	}
+	return 0;
+}
+
+void PointKDTree::Build(const std::vector<float3>& _points)
+{
+	points = _points;
+	axes.assign(points.size(), 0);
+#pragma omp parallel
+#pragma omp single
+	BuildRange(0, (int)points.size());
+}
+
+void PointKDTree::BuildRange(const int lo, const int hi)
+{
+	if (hi - lo <= 1) {
+		return;
+	}
+	float3 min_p = points[lo];
+	float3 max_p = points[lo];
+	for (int i = lo + 1; i < hi; ++i) {
+		min_p = make_float3(std::min(min_p.x, points[i].x), std::min(min_p.y, points[i].y), std::min(min_p.z, points[i].z));
+		max_p = make_float3(std::max(max_p.x, points[i].x), std::max(max_p.y, points[i].y), std::max(max_p.z, points[i].z));
+	}
+	const float3 extent = make_float3(max_p.x - min_p.x, max_p.y - min_p.y, max_p.z - min_p.z);
+	const int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+
+	const int mid = lo + (hi - lo) / 2;
+	std::nth_element(points.begin() + lo, points.begin() + mid, points.begin() + hi, [axis](const float3& a, const float3& b) {
+		return (&a.x)[axis] < (&b.x)[axis];
+	});
+	axes[mid] = (unsigned char)axis;
+
+	// Subtrees are disjoint ranges; split large ones across threads
+	if (hi - lo > 65536) {
+#pragma omp task
+		BuildRange(lo, mid);
+#pragma omp task
+		BuildRange(mid + 1, hi);
+#pragma omp taskwait
+	}
+	else {
+		BuildRange(lo, mid);
+		BuildRange(mid + 1, hi);
+	}
+}
+
+float PointKDTree::NearestSquaredDistance(const float3& query) const
+{
+	float best = FLT_MAX;
+	Search(0, (int)points.size(), query, best);
+	return best;
+}
+
+void PointKDTree::Search(const int lo, const int hi, const float3& query, float& best) const
+{
+	if (hi - lo <= 8) {
+		for (int i = lo; i < hi; ++i) {
+			const float dx = points[i].x - query.x;
+			const float dy = points[i].y - query.y;
+			const float dz = points[i].z - query.z;
+			best = std::min(best, dx * dx + dy * dy + dz * dz);
+		}
+		return;
+	}
+	const int mid = lo + (hi - lo) / 2;
+	const float3& p = points[mid];
+	const float dx = p.x - query.x;
+	const float dy = p.y - query.y;
+	const float dz = p.z - query.z;
+	best = std::min(best, dx * dx + dy * dy + dz * dz);
+
+	const int axis = axes[mid];
+	const float diff = (&query.x)[axis] - (&p.x)[axis];
+	// Near side first, the far side only if the splitting plane is closer than the best match
+	if (diff < 0.0f) {
+		Search(lo, mid, query, best);
+		if (diff * diff < best) {
+			Search(mid + 1, hi, query, best);
+		}
+	}
+	else {
+		Search(mid + 1, hi, query, best);
+		if (diff * diff < best) {
+			Search(lo, mid, query, best);
+		}
+	}
+}
+
+static void NearestDistances(const PointKDTree& tree, const std::vector<float3>& queries, std::vector<float>& distances)
+{
+	distances.resize(queries.size());
+#pragma omp parallel for schedule(dynamic, 4096)
+	for (long long i = 0; i < (long long)queries.size(); ++i) {
+		distances[i] = sqrtf(tree.NearestSquaredDistance(queries[i]));
+	}
+}
+
+// Mean and median of distances, which is reordered
+static void DistanceSummary(std::vector<float>& distances, float& mean, float& median)
+{
+	mean = 0.0f;
+	median = 0.0f;
+	if (distances.empty()) {
+		return;
+	}
+	double sum = 0.0;
+#pragma omp parallel for reduction(+ : sum)
+	for (long long i = 0; i < (long long)distances.size(); ++i) {
+		sum += distances[i];
+	}
+	mean = (float)(sum / distances.size());
+	std::nth_element(distances.begin(), distances.begin() + distances.size() / 2, distances.end());
+	median = distances[distances.size() / 2];
+}
+
+static float FractionWithin(const std::vector<float>& distances, const float threshold)
+{
+	if (distances.empty()) {
+		return 0.0f;
+	}
+	long long count = 0;
+#pragma omp parallel for reduction(+ : count)
+	for (long long i = 0; i < (long long)distances.size(); ++i) {
+		count += distances[i] < threshold ? 1 : 0;
+	}
+	return (float)count / distances.size();
+}
+
+void EvaluatePointCloud(const std::vector<float3>& points, const std::vector<float3>& gt_points, const std::vector<float>& thresholds, PointCloudEvaluation& evaluation)
+{
+	std::vector<float> accuracy_distances;
+	std::vector<float> completeness_distances;
+	{
+		PointKDTree gt_tree;
+		gt_tree.Build(gt_points);
+		NearestDistances(gt_tree, points, accuracy_distances);
+	}
+	{
+		PointKDTree tree;
+		tree.Build(points);
+		NearestDistances(tree, gt_points, completeness_distances);
+	}
+
+	evaluation.num_points = points.size();
+	evaluation.num_gt_points = gt_points.size();
+	evaluation.metrics.clear();
+	for (const float threshold : thresholds) {
+		PointCloudMetrics metrics;
+		metrics.threshold = threshold;
+		metrics.accuracy = FractionWithin(accuracy_distances, threshold);
+		metrics.completeness = FractionWithin(completeness_distances, threshold);
+		const float sum = metrics.accuracy + metrics.completeness;
+		metrics.f_score = sum > 0.0f ? 2.0f * metrics.accuracy * metrics.completeness / sum : 0.0f;
+		evaluation.metrics.push_back(metrics);
+	}
+	DistanceSummary(accuracy_distances, evaluation.mean_accuracy_distance, evaluation.median_accuracy_distance);
+	DistanceSummary(completeness_distances, evaluation.mean_completeness_distance, evaluation.median_completeness_distance);
+}
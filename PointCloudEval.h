@@ -0,0 +1,53 @@
+#ifndef _POINT_CLOUD_EVAL_H_
+#define _POINT_CLOUD_EVAL_H_
+
+#include "HPM.h"
+
+// Reads the x, y, z vertex properties of an ascii or binary little-endian PLY;
+// faces and other properties are ignored, so a mesh yields its vertices.
+// Returns -1 if the file cannot be read.
+int ReadPointCloudPly(const std::string &path, std::vector<float3> &points);
+
+// Back-projects the depths_gt maps of a dense folder (see hpm_synth), keeping
+// every step-th pixel in both directions. Returns -1 if no map can be read.
+int ReadGroundTruthDepths(const std::string &dense_folder, const int step, std::vector<float3> &points);
+
+// Static 3-d tree for nearest-neighbour distances. Points are reordered in
+// place into an implicit balanced tree: the median of each range is its node
+// and splits along the widest axis of the range.
+class PointKDTree {
+public:
+    void Build(const std::vector<float3> &_points);
+    // Squared distance to the closest point, FLT_MAX for an empty tree
+    float NearestSquaredDistance(const float3 &query) const;
+    size_t Size() const { return points.size(); }
+
+private:
+    void BuildRange(const int lo, const int hi);
+    void Search(const int lo, const int hi, const float3 &query, float &best) const;
+
+    std::vector<float3> points;
+    std::vector<unsigned char> axes; // split axis of the node at each median index
+};
+
+struct PointCloudMetrics {
+    float threshold;
+    float accuracy;     // fraction of reconstructed points within threshold of the ground truth
+    float completeness; // fraction of ground-truth points within threshold of the reconstruction
+    float f_score;
+};
+
+struct PointCloudEvaluation {
+    size_t num_points;
+    size_t num_gt_points;
+    float mean_accuracy_distance;
+    float median_accuracy_distance;
+    float mean_completeness_distance;
+    float median_completeness_distance;
+    std::vector<PointCloudMetrics> metrics; // one per threshold, in the given order
+};
+
+// Nearest-neighbour distances in both directions, in parallel over the query points
+void EvaluatePointCloud(const std::vector<float3> &points, const std::vector<float3> &gt_points, const std::vector<float> &thresholds, PointCloudEvaluation &evaluation);
+
+#endif // _POINT_CLOUD_EVAL_H_
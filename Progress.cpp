@@ -0,0 +1,307 @@
+#include "Progress.h"
+#include "MemoryAccounting.h"
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <thread>
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+struct ProgressStage {
+	long long units = 0;
+	long long pixels = 0;
+	double seconds = 0.0;
+};
+
+typedef std::chrono::steady_clock ProgressClock;
+
+static std::mutex progress_mutex;
+static const ProgressClock::time_point progress_start = ProgressClock::now();
+static int progress_scale = -1;
+static int progress_view = -1;
+static std::string progress_pass;
+static long long pass_units_done = 0;
+static long long pass_units_total = 0;
+static ProgressClock::time_point pass_start;
+static ProgressClock::time_point unit_start;
+static long long units_done = 0;
+static long long units_total = 0;
+static int views_per_pass = 0;
+static bool progress_finished = false;
+static std::map<std::string, ProgressStage> progress_stages;
+
+static std::thread progress_thread;
+static std::atomic<bool> progress_stop(false);
+static std::string progress_status_path;
+static float progress_interval = 5.0f;
+static int progress_socket = -1;
+
+static double SecondsSince(const ProgressClock::time_point t)
+{
+	return std::chrono::duration<double>(ProgressClock::now() - t).count();
+}
+
+// Stage of a pass for throughput: prior0, prior1, ... all count as prior
+static std::string StageName(const std::string& pass)
+{
+	std::string stage;
+	for (const char c : pass) {
+		if (c < '0' || c > '9') {
+			stage += c;
+		}
+	}
+	return stage;
+}
+
+void ProgressSetTotalUnits(const long long units)
+{
+	std::lock_guard<std::mutex> lock(progress_mutex);
+	units_total = units;
+}
+
+void ProgressSetViewsPerPass(const int views)
+{
+	std::lock_guard<std::mutex> lock(progress_mutex);
+	views_per_pass = views;
+}
+
+void ProgressBeginUnit(const int view, const int scale, const std::string& pass)
+{
+	std::lock_guard<std::mutex> lock(progress_mutex);
+	const int unit_scale = scale >= 0 ? scale : progress_scale;
+	if (unit_scale != progress_scale || pass != progress_pass) {
+		progress_scale = unit_scale;
+		progress_pass = pass;
+		pass_units_done = 0;
+		pass_units_total = views_per_pass;
+		pass_start = ProgressClock::now();
+	}
+	progress_view = view;
+	unit_start = ProgressClock::now();
+}
+
+void ProgressEndUnit(const long long pixels)
+{
+	std::lock_guard<std::mutex> lock(progress_mutex);
+	ProgressStage& stage = progress_stages[StageName(progress_pass)];
+	stage.units++;
+	stage.pixels += pixels;
+	stage.seconds += SecondsSince(unit_start);
+	pass_units_done++;
+	units_done++;
+}
+
+static double Eta(const double elapsed, const long long done, const long long total)
+{
+	return done > 0 && total > done ? elapsed / done * (total - done) : 0.0;
+}
+
+static std::string StatusJson()
+{
+	std::lock_guard<std::mutex> lock(progress_mutex);
+	const double elapsed = SecondsSince(progress_start);
+	const double pass_elapsed = progress_pass.empty() ? 0.0 : SecondsSince(pass_start);
+	std::stringstream out;
+	out << std::setprecision(6);
+	out << "{\"finished\":" << (progress_finished ? "true" : "false") << ",\"elapsed_seconds\":" << elapsed
+		<< ",\"scale\":" << progress_scale << ",\"pass\":\"" << progress_pass << "\",\"view\":" << progress_view
+		<< ",\"pass_units_done\":" << pass_units_done << ",\"pass_units_total\":" << pass_units_total
+		<< ",\"pass_eta_seconds\":" << Eta(pass_elapsed, pass_units_done, pass_units_total)
+		<< ",\"units_done\":" << units_done << ",\"units_total\":" << units_total
+		<< ",\"eta_seconds\":" << Eta(elapsed, units_done, units_total) << ",\"stages\":{";
+	bool first = true;
+	for (const auto& item : progress_stages) {
+		const ProgressStage& stage = item.second;
+		out << (first ? "" : ",") << "\"" << item.first << "\":{\"units\":" << stage.units << ",\"seconds\":" << stage.seconds
+			<< ",\"pixels_per_second\":" << (stage.seconds > 0.0 ? stage.pixels / stage.seconds : 0.0) << "}";
+		first = false;
+	}
+	out << "},\"memory\":{\"host_bytes\":" << MemoryCurrentBytes(BUFFER_HOST) << ",\"device_bytes\":" << MemoryCurrentBytes(BUFFER_DEVICE)
+		<< ",\"host_peak_bytes\":" << MemoryPeakBytes(BUFFER_HOST) << ",\"device_peak_bytes\":" << MemoryPeakBytes(BUFFER_DEVICE) << ",\"subsystems\":{";
+	for (int s = 0; s < MEMORY_NUM_SUBSYSTEMS; ++s) {
+		const MemorySubsystem subsystem = (MemorySubsystem)s;
+		out << (s > 0 ? "," : "") << "\"" << MemorySubsystemName(subsystem) << "\":{\"host\":" << MemorySubsystemBytes(subsystem, BUFFER_HOST)
+			<< ",\"device\":" << MemorySubsystemBytes(subsystem, BUFFER_DEVICE) << "}";
+	}
+	out << "}}}\n";
+	return out.str();
+}
+
+static std::string PrometheusText()
+{
+	std::lock_guard<std::mutex> lock(progress_mutex);
+	const double elapsed = SecondsSince(progress_start);
+	const double pass_elapsed = progress_pass.empty() ? 0.0 : SecondsSince(pass_start);
+	std::stringstream out;
+	out << std::setprecision(9);
+	out << "# TYPE hpm_elapsed_seconds gauge\nhpm_elapsed_seconds " << elapsed << "\n";
+	out << "# TYPE hpm_scale gauge\nhpm_scale " << progress_scale << "\n";
+	out << "# TYPE hpm_view gauge\nhpm_view " << progress_view << "\n";
+	out << "# TYPE hpm_pass_info gauge\nhpm_pass_info{pass=\"" << progress_pass << "\"} 1\n";
+	out << "# TYPE hpm_pass_units_done gauge\nhpm_pass_units_done " << pass_units_done << "\n";
+	out << "# TYPE hpm_pass_units_total gauge\nhpm_pass_units_total " << pass_units_total << "\n";
+	out << "# TYPE hpm_pass_eta_seconds gauge\nhpm_pass_eta_seconds " << Eta(pass_elapsed, pass_units_done, pass_units_total) << "\n";
+	out << "# TYPE hpm_units_done counter\nhpm_units_done " << units_done << "\n";
+	out << "# TYPE hpm_units_total gauge\nhpm_units_total " << units_total << "\n";
+	out << "# TYPE hpm_eta_seconds gauge\nhpm_eta_seconds " << Eta(elapsed, units_done, units_total) << "\n";
+	out << "# TYPE hpm_stage_units counter\n";
+	for (const auto& item : progress_stages) {
+		out << "hpm_stage_units{stage=\"" << item.first << "\"} " << item.second.units << "\n";
+	}
+	out << "# TYPE hpm_stage_seconds counter\n";
+	for (const auto& item : progress_stages) {
+		out << "hpm_stage_seconds{stage=\"" << item.first << "\"} " << item.second.seconds << "\n";
+	}
+	out << "# TYPE hpm_stage_pixels_per_second gauge\n";
+	for (const auto& item : progress_stages) {
+		const ProgressStage& stage = item.second;
+		out << "hpm_stage_pixels_per_second{stage=\"" << item.first << "\"} " << (stage.seconds > 0.0 ? stage.pixels / stage.seconds : 0.0) << "\n";
+	}
+	const char* locations[2] = { "host", "device" };
+	out << "# TYPE hpm_memory_bytes gauge\n";
+	for (int l = 0; l < 2; ++l) {
+		for (int s = 0; s < MEMORY_NUM_SUBSYSTEMS; ++s) {
+			out << "hpm_memory_bytes{location=\"" << locations[l] << "\",subsystem=\"" << MemorySubsystemName((MemorySubsystem)s) << "\"} "
+				<< MemorySubsystemBytes((MemorySubsystem)s, (BufferLocation)l) << "\n";
+		}
+	}
+	out << "# TYPE hpm_memory_peak_bytes gauge\n";
+	for (int l = 0; l < 2; ++l) {
+		out << "hpm_memory_peak_bytes{location=\"" << locations[l] << "\"} " << MemoryPeakBytes((BufferLocation)l) << "\n";
+	}
+	return out.str();
+}
+
+// Rewrites through a temporary file so readers never see a partial status
+static void WriteStatusFile()
+{
+	if (progress_status_path.empty()) {
+		return;
+	}
+	const std::string tmp_path = progress_status_path + ".tmp";
+	{
+		std::ofstream out(tmp_path);
+		if (!out.is_open()) {
+			return;
+		}
+		out << StatusJson();
+	}
+	std::rename(tmp_path.c_str(), progress_status_path.c_str());
+}
+
+#ifndef _WIN32
+// Answers any request on an accepted connection with the metrics. A client
+// that sends nothing or stops reading only delays the loop by the timeouts.
+static void ServeMetrics(const int client)
+{
+	struct pollfd fd;
+	fd.fd = client;
+	fd.events = POLLIN;
+	if (poll(&fd, 1, 500) > 0) {
+		char request[1024];
+		recv(client, request, sizeof(request), 0);
+	}
+	struct timeval send_timeout = {};
+	send_timeout.tv_sec = 1;
+	setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+	const std::string body = PrometheusText();
+	std::stringstream response;
+	response << "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " << body.size() << "\r\nConnection: close\r\n\r\n" << body;
+	const std::string text = response.str();
+	size_t sent = 0;
+	while (sent < text.size()) {
+		const ssize_t n = send(client, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+		if (n <= 0) {
+			break;
+		}
+		sent += n;
+	}
+	close(client);
+}
+#endif
+
+static void ProgressLoop()
+{
+	ProgressClock::time_point next_write = ProgressClock::now();
+	while (!progress_stop) {
+		if (ProgressClock::now() >= next_write) {
+			WriteStatusFile();
+			next_write = ProgressClock::now() + std::chrono::milliseconds((long long)(progress_interval * 1000.0f));
+		}
+#ifndef _WIN32
+		if (progress_socket >= 0) {
+			struct pollfd fd;
+			fd.fd = progress_socket;
+			fd.events = POLLIN;
+			if (poll(&fd, 1, 200) > 0) {
+				const int client = accept(progress_socket, NULL, NULL);
+				if (client >= 0) {
+					ServeMetrics(client);
+				}
+			}
+			continue;
+		}
+#endif
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	}
+}
+
+int ProgressStart(const std::string& status_path, const float interval_seconds, const int port)
+{
+	progress_status_path = status_path;
+	progress_interval = std::max(0.1f, interval_seconds);
+	if (port > 0) {
+#ifndef _WIN32
+		progress_socket = socket(AF_INET, SOCK_STREAM, 0);
+		const int reuse = 1;
+		setsockopt(progress_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+		struct sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		address.sin_port = htons((uint16_t)port);
+		if (progress_socket < 0 || bind(progress_socket, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(progress_socket, 4) != 0) {
+			std::cout << "Can not listen on 127.0.0.1:" << port << std::endl;
+			if (progress_socket >= 0) {
+				close(progress_socket);
+			}
+			progress_socket = -1;
+			return -1;
+		}
+#else
+		std::cout << "The metrics port is not supported on this platform" << std::endl;
+		return -1;
+#endif
+	}
+	progress_stop = false;
+	progress_thread = std::thread(ProgressLoop);
+	return 0;
+}
+
+void ProgressStop()
+{
+	{
+		std::lock_guard<std::mutex> lock(progress_mutex);
+		progress_finished = true;
+	}
+	if (!progress_thread.joinable()) {
+		return;
+	}
+	progress_stop = true;
+	progress_thread.join();
+	WriteStatusFile();
+#ifndef _WIN32
+	if (progress_socket >= 0) {
+		close(progress_socket);
+		progress_socket = -1;
+	}
+#endif
+}
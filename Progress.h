@@ -0,0 +1,27 @@
+#ifndef _PROGRESS_H_
+#define _PROGRESS_H_
+
+#include <string>
+
+// Live progress of a run. Work is counted in units, one view of a pass
+// (photometric, prior<d>, geometric, jbu, confidence, fusion, ...). Without
+// ProgressStart the calls only keep counters.
+
+// Starts a thread that rewrites status_path (if not empty) every
+// interval_seconds and serves Prometheus text metrics on 127.0.0.1:port
+// (if port > 0). Returns -1 if the port cannot be bound.
+int ProgressStart(const std::string &status_path, const float interval_seconds, const int port);
+// Writes the final status and stops the thread
+void ProgressStop();
+
+// Units of the whole run, for the overall ETA
+void ProgressSetTotalUnits(const long long units);
+// Units of every pass
+void ProgressSetViewsPerPass(const int views);
+
+// A new (scale, pass) pair starts a new pass; scale -1 keeps the current one
+void ProgressBeginUnit(const int view, const int scale, const std::string &pass);
+// pixels feed the per-stage throughput
+void ProgressEndUnit(const long long pixels);
+
+#endif // _PROGRESS_H_
@@ -0,0 +1,322 @@
+#include "SyntheticScene.h"
+#include "HPM.h"
+
+#include <filesystem>
+
+enum SceneMaterial {
+	MATERIAL_WALL = 0,
+	MATERIAL_GROUND = 1,
+	MATERIAL_PANEL = 2,
+	MATERIAL_STRIPES = 3,
+	MATERIAL_SKY = 4
+};
+
+// Rectangle center +- half_u * u +- half_v * v, facing the cameras along n
+struct SceneQuad {
+	float3 center;
+	float3 u;
+	float3 v;
+	float3 n;
+	float half_u;
+	float half_v;
+	SceneMaterial material;
+};
+
+static float3 operator+(const float3& a, const float3& b) { return make_float3(a.x + b.x, a.y + b.y, a.z + b.z); }
+static float3 operator-(const float3& a, const float3& b) { return make_float3(a.x - b.x, a.y - b.y, a.z - b.z); }
+static float3 operator*(const float3& a, const float s) { return make_float3(a.x * s, a.y * s, a.z * s); }
+static float Dot(const float3& a, const float3& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+static float3 Cross(const float3& a, const float3& b) { return make_float3(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x); }
+static float3 Normalize(const float3& a) { return a * (1.0f / sqrtf(Dot(a, a))); }
+
+// World frame: y points down, the cameras look along +z
+static std::vector<SceneQuad> BuildScene()
+{
+	const float a = 40.0f * (float)M_PI / 180.0f;
+	const float b = 35.0f * (float)M_PI / 180.0f;
+	std::vector<SceneQuad> quads;
+	quads.push_back({ make_float3(0.0f, 0.15f, 7.0f), make_float3(1, 0, 0), make_float3(0, 1, 0), make_float3(0, 0, -1), 10.0f, 1.35f, MATERIAL_WALL });
+	quads.push_back({ make_float3(0.0f, 1.5f, 3.5f), make_float3(1, 0, 0), make_float3(0, 0, 1), make_float3(0, -1, 0), 10.0f, 3.5f, MATERIAL_GROUND });
+	quads.push_back({ make_float3(-1.0f, 0.5f, 4.5f), make_float3(cosf(a), 0, sinf(a)), make_float3(0, 1, 0), make_float3(sinf(a), 0, -cosf(a)), 1.0f, 0.9f, MATERIAL_PANEL });
+	quads.push_back({ make_float3(1.3f, 0.8f, 3.8f), make_float3(1, 0, 0), make_float3(0, cosf(b), -sinf(b)), make_float3(0, -sinf(b), -cosf(b)), 0.8f, 0.7f, MATERIAL_STRIPES });
+	return quads;
+}
+
+// Nearest quad along the ray; false for sky
+static bool TraceRay(const std::vector<SceneQuad>& quads, const float3& origin, const float3& dir, float3& point, SceneMaterial& material)
+{
+	float best_t = FLT_MAX;
+	for (const SceneQuad& quad : quads) {
+		const float denom = Dot(dir, quad.n);
+		if (fabsf(denom) < 1e-6f) {
+			continue;
+		}
+		const float t = Dot(quad.center - origin, quad.n) / denom;
+		if (t <= 0.0f || t >= best_t) {
+			continue;
+		}
+		const float3 p = origin + dir * t;
+		const float3 offset = p - quad.center;
+		if (fabsf(Dot(offset, quad.u)) > quad.half_u || fabsf(Dot(offset, quad.v)) > quad.half_v) {
+			continue;
+		}
+		best_t = t;
+		point = p;
+		material = quad.material;
+	}
+	return best_t < FLT_MAX;
+}
+
+static float Hash(const int x, const int y, const int z, const unsigned int seed)
+{
+	unsigned int h = seed;
+	h ^= (unsigned int)x * 73856093u;
+	h ^= (unsigned int)y * 19349663u;
+	h ^= (unsigned int)z * 83492791u;
+	h *= 2654435761u;
+	h ^= h >> 15;
+	h *= 0x2c1b3c6du;
+	h ^= h >> 12;
+	return (h & 0xffffff) / 16777215.0f;
+}
+
+static float ValueNoise(const float3& p, const unsigned int seed)
+{
+	const float fx = floorf(p.x);
+	const float fy = floorf(p.y);
+	const float fz = floorf(p.z);
+	const int x = (int)fx;
+	const int y = (int)fy;
+	const int z = (int)fz;
+	// Smoothstep weights keep the texture free of grid creases
+	float wx = p.x - fx;
+	float wy = p.y - fy;
+	float wz = p.z - fz;
+	wx = wx * wx * (3.0f - 2.0f * wx);
+	wy = wy * wy * (3.0f - 2.0f * wy);
+	wz = wz * wz * (3.0f - 2.0f * wz);
+
+	float value = 0.0f;
+	for (int k = 0; k < 8; ++k) {
+		const int dx = k & 1;
+		const int dy = (k >> 1) & 1;
+		const int dz = (k >> 2) & 1;
+		const float w = (dx ? wx : 1.0f - wx) * (dy ? wy : 1.0f - wy) * (dz ? wz : 1.0f - wz);
+		value += w * Hash(x + dx, y + dy, z + dz, seed);
+	}
+	return value;
+}
+
+// 4 octaves in [0, 1]
+static float Fbm(const float3& p, const unsigned int seed)
+{
+	float value = 0.0f;
+	float amplitude = 0.5f;
+	float frequency = 1.0f;
+	for (int octave = 0; octave < 4; ++octave) {
+		value += amplitude * ValueNoise(p * frequency, seed + octave);
+		amplitude *= 0.5f;
+		frequency *= 2.0f;
+	}
+	return value / 0.9375f;
+}
+
+// BGR color in [0, 255]; view independent except for the sky
+static cv::Vec3f Shade(const float3& p, const SceneMaterial material, const float3& dir, const unsigned int seed)
+{
+	switch (material) {
+	case MATERIAL_WALL: {
+		if (p.x > 1.5f && p.x < 3.5f && p.y > -1.0f && p.y < 0.5f) {
+			return cv::Vec3f(150.0f, 150.0f, 150.0f);
+		}
+		const float g = 40.0f + 190.0f * Fbm(p * 4.0f, seed);
+		return cv::Vec3f(g * 0.8f, g * 0.9f, g);
+	}
+	case MATERIAL_GROUND: {
+		const int checker = ((int)floorf(p.x * 2.0f) + (int)floorf(p.z * 2.0f)) & 1;
+		const float g = (checker ? 70.0f : 150.0f) + 80.0f * Fbm(p * 8.0f, seed + 16);
+		return cv::Vec3f(g * 0.7f, g * 0.85f, g * 0.8f);
+	}
+	case MATERIAL_PANEL: {
+		const float g = 30.0f + 210.0f * Fbm(p * 10.0f, seed + 32);
+		return cv::Vec3f(g * 0.6f, g * 0.8f, g);
+	}
+	case MATERIAL_STRIPES: {
+		const float stripes = 0.5f + 0.5f * sinf(p.x * 25.0f + 6.0f * Fbm(p * 3.0f, seed + 48));
+		const float g = 50.0f + 180.0f * stripes;
+		return cv::Vec3f(g, g * 0.8f, g * 0.6f);
+	}
+	default: {
+		const float up = std::min(std::max(-dir.y, 0.0f), 1.0f);
+		return cv::Vec3f(235.0f - 30.0f * up, 200.0f - 40.0f * up, 160.0f - 60.0f * up);
+	}
+	}
+}
+
+struct SceneCamera {
+	Camera camera;
+	float3 center;
+	float angle;
+};
+
+static SceneCamera MakeCamera(const SyntheticSceneOptions& options, const int index)
+{
+	const float3 target = make_float3(0.0f, 0.2f, 4.0f);
+	const float radius = 4.0f;
+	const float arc = options.arc_degrees * (float)M_PI / 180.0f;
+	const float angle = options.num_views > 1 ? -0.5f * arc + arc * index / (options.num_views - 1) : 0.0f;
+
+	SceneCamera scene_camera;
+	scene_camera.angle = angle;
+	scene_camera.center = target + make_float3(radius * sinf(angle), -0.2f, -radius * cosf(angle));
+
+	// Rows of R are the camera axes in world coordinates, y pointing down
+	const float3 z = Normalize(target - scene_camera.center);
+	const float3 x = Normalize(Cross(make_float3(0, 1, 0), z));
+	const float3 y = Cross(z, x);
+	const float3 axes[3] = { x, y, z };
+	Camera& camera = scene_camera.camera;
+	for (int i = 0; i < 3; ++i) {
+		camera.R[3 * i + 0] = axes[i].x;
+		camera.R[3 * i + 1] = axes[i].y;
+		camera.R[3 * i + 2] = axes[i].z;
+		camera.t[i] = -Dot(axes[i], scene_camera.center);
+	}
+
+	const float focal = 0.5f * options.width / tanf(0.5f * options.fov_degrees * (float)M_PI / 180.0f);
+	const float K[9] = { focal, 0.0f, 0.5f * options.width, 0.0f, focal, 0.5f * options.height, 0.0f, 0.0f, 1.0f };
+	memcpy(camera.K, K, sizeof(K));
+	camera.width = options.width;
+	camera.height = options.height;
+	camera.depth_min = 0.0f;
+	camera.depth_max = 0.0f;
+	return scene_camera;
+}
+
+static float3 PixelRay(const SceneCamera& scene_camera, const float x, const float y)
+{
+	const Camera& camera = scene_camera.camera;
+	const float3 dir_cam = make_float3((x - camera.K[2]) / camera.K[0], (y - camera.K[5]) / camera.K[4], 1.0f);
+	// R^T * dir_cam
+	const float3 dir = make_float3(
+		camera.R[0] * dir_cam.x + camera.R[3] * dir_cam.y + camera.R[6] * dir_cam.z,
+		camera.R[1] * dir_cam.x + camera.R[4] * dir_cam.y + camera.R[7] * dir_cam.z,
+		camera.R[2] * dir_cam.x + camera.R[5] * dir_cam.y + camera.R[8] * dir_cam.z);
+	return Normalize(dir);
+}
+
+int GenerateSyntheticScene(const std::string& dense_folder, const SyntheticSceneOptions& options)
+{
+	if (options.num_views < 2 || options.width < 16 || options.height < 16) {
+		std::cout << "Synthetic scene needs at least 2 views of 16x16 pixels" << std::endl;
+		return -1;
+	}
+	const std::string image_folder = dense_folder + "/images";
+	const std::string cam_folder = dense_folder + "/cams";
+	const std::string depth_folder = dense_folder + "/depths_gt";
+	const std::string mask_folder = dense_folder + "/masks";
+	std::filesystem::create_directories(image_folder);
+	std::filesystem::create_directories(cam_folder);
+	std::filesystem::create_directories(depth_folder);
+	if (options.masks) {
+		std::filesystem::create_directories(mask_folder);
+	}
+
+	const std::vector<SceneQuad> quads = BuildScene();
+	// 2x2 samples per pixel for the image; depth is taken at the pixel center
+	const float offsets[4][2] = { { -0.25f, -0.25f }, { 0.25f, -0.25f }, { -0.25f, 0.25f }, { 0.25f, 0.25f } };
+	std::vector<SceneCamera> scene_cameras(options.num_views);
+
+	for (int i = 0; i < options.num_views; ++i) {
+		SceneCamera& scene_camera = scene_cameras[i];
+		scene_camera = MakeCamera(options, i);
+		const Camera& camera = scene_camera.camera;
+
+		cv::Mat_<cv::Vec3b> image(options.height, options.width);
+		cv::Mat_<float> depth(options.height, options.width);
+		cv::Mat_<cv::Vec3b> mask(options.height, options.width);
+#pragma omp parallel for schedule(dynamic, 8)
+		for (int r = 0; r < options.height; ++r) {
+			for (int c = 0; c < options.width; ++c) {
+				cv::Vec3f color(0.0f, 0.0f, 0.0f);
+				for (int s = 0; s < 4; ++s) {
+					const float3 dir = PixelRay(scene_camera, c + offsets[s][0], r + offsets[s][1]);
+					float3 point = make_float3(0.0f, 0.0f, 0.0f);
+					SceneMaterial material = MATERIAL_SKY;
+					TraceRay(quads, scene_camera.center, dir, point, material);
+					color += Shade(point, material, dir, options.seed) * 0.25f;
+				}
+				image(r, c) = cv::Vec3b(cv::saturate_cast<uchar>(color[0]), cv::saturate_cast<uchar>(color[1]), cv::saturate_cast<uchar>(color[2]));
+
+				const float3 dir = PixelRay(scene_camera, (float)c, (float)r);
+				float3 point = make_float3(0.0f, 0.0f, 0.0f);
+				SceneMaterial material = MATERIAL_SKY;
+				const bool hit = TraceRay(quads, scene_camera.center, dir, point, material);
+				// Depth is the camera z, as in Get3DPointonWorld
+				depth(r, c) = hit ? camera.R[6] * point.x + camera.R[7] * point.y + camera.R[8] * point.z + camera.t[2] : 0.0f;
+				mask(r, c) = hit ? cv::Vec3b(0, 0, 0) : cv::Vec3b(234, 235, 55);
+			}
+		}
+
+		float depth_min = FLT_MAX;
+		float depth_max = 0.0f;
+		for (int r = 0; r < options.height; ++r) {
+			for (int c = 0; c < options.width; ++c) {
+				if (depth(r, c) > 0.0f) {
+					depth_min = std::min(depth_min, depth(r, c));
+					depth_max = std::max(depth_max, depth(r, c));
+				}
+			}
+		}
+		if (depth_max <= 0.0f) {
+			std::cout << "Synthetic view " << i << " sees no geometry" << std::endl;
+			return -1;
+		}
+		scene_camera.camera.depth_min = 0.9f * depth_min;
+		scene_camera.camera.depth_max = 1.1f * depth_max;
+
+		std::stringstream name;
+		name << std::setw(8) << std::setfill('0') << i;
+		if (!cv::imwrite(image_folder + "/" + name.str() + ".jpg", image, { cv::IMWRITE_JPEG_QUALITY, 95 })) {
+			std::cout << "Can not write " << image_folder << "/" << name.str() << ".jpg" << std::endl;
+			return -1;
+		}
+		// Quality 100 keeps the flat sky color that fusion compares exactly
+		if (options.masks && !cv::imwrite(mask_folder + "/" + name.str() + ".jpg", mask, { cv::IMWRITE_JPEG_QUALITY, 100 })) {
+			std::cout << "Can not write " << mask_folder << "/" << name.str() << ".jpg" << std::endl;
+			return -1;
+		}
+		if (WriteCamera(cam_folder + "/" + name.str() + "_cam.txt", scene_camera.camera) != 0) {
+			return -1;
+		}
+		if (writeDepthDmb(depth_folder + "/" + name.str() + ".dmb", depth) != 0) {
+			return -1;
+		}
+		std::cout << "Synthetic view " << name.str() << " depth range " << depth_min << " - " << depth_max << std::endl;
+	}
+
+	// Sources ordered by angular distance along the arc
+	std::ofstream pair_file(dense_folder + "/pair.txt");
+	if (!pair_file.is_open()) {
+		std::cout << "Can not open " << dense_folder << "/pair.txt" << std::endl;
+		return -1;
+	}
+	const int num_sources = std::min(options.num_sources, options.num_views - 1);
+	pair_file << options.num_views << std::endl;
+	for (int i = 0; i < options.num_views; ++i) {
+		std::vector<std::pair<float, int> > sources;
+		for (int j = 0; j < options.num_views; ++j) {
+			if (j != i) {
+				sources.push_back(std::make_pair(fabsf(scene_cameras[j].angle - scene_cameras[i].angle), j));
+			}
+		}
+		std::sort(sources.begin(), sources.end());
+		pair_file << i << std::endl << num_sources;
+		for (int k = 0; k < num_sources; ++k) {
+			const float score = 100.0f / (1.0f + sources[k].first * 180.0f / (float)M_PI);
+			pair_file << " " << sources[k].second << " " << score;
+		}
+		pair_file << std::endl;
+	}
+	return 0;
+}
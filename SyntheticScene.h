@@ -0,0 +1,26 @@
+#ifndef _SYNTHETIC_SCENE_H_
+#define _SYNTHETIC_SCENE_H_
+
+#include "main.h"
+
+// Procedural test scene: a textured back wall with a textureless patch, a
+// checkered ground plane, two slanted panels in front (one turned about the
+// vertical axis, one striped and tilted back) and open sky above the wall.
+// Cameras sit on a horizontal arc looking at the scene center. Textures are
+// functions of the world point, so all views see the same surfaces.
+struct SyntheticSceneOptions {
+    int num_views = 8;
+    int width = 640;
+    int height = 480;
+    int num_sources = 10;    // source views per pair.txt entry, at most num_views - 1
+    float arc_degrees = 40.0f; // angle between the outermost cameras
+    float fov_degrees = 60.0f; // horizontal field of view
+    unsigned int seed = 2333;  // texture pattern
+    bool masks = false;        // also write masks/ with the sky in the fusion's sky color
+};
+
+// Writes images/, cams/*_cam.txt, pair.txt, depths_gt/*.dmb (0 for sky) and
+// optionally masks/ under dense_folder. Returns -1 if a file cannot be written.
+int GenerateSyntheticScene(const std::string &dense_folder, const SyntheticSceneOptions &options);
+
+#endif // _SYNTHETIC_SCENE_H_
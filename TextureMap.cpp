@@ -0,0 +1,137 @@
+#include "TextureMap.h"
+#include "MemoryAccounting.h"
+#include "Trace.h"
+
+#include <map>
+#include <mutex>
+
+// Summed-area table of the edge pixels (x, y) with x % 2 == qx and
+// y % 2 == qy, indexed by ((y - qy) / 2, (x - qx) / 2) with a zero border
+struct ParitySat {
+	int cols = 0;
+	int rows = 0;
+	std::vector<int> sums;
+
+	int At(const int r, const int c) const { return sums[r * (cols + 1) + c]; }
+};
+
+static void BuildParitySat(const cv::Mat& edges, const int qx, const int qy, ParitySat& sat)
+{
+	sat.cols = (edges.cols - qx + 1) / 2;
+	sat.rows = (edges.rows - qy + 1) / 2;
+	sat.sums.assign((sat.rows + 1) * (sat.cols + 1), 0);
+	const int stride = sat.cols + 1;
+#pragma omp parallel for schedule(static)
+	for (int r = 0; r < sat.rows; ++r) {
+		const unsigned char* row = edges.ptr<unsigned char>(qy + 2 * r);
+		int* sum_row = &sat.sums[(r + 1) * stride];
+		int sum = 0;
+		for (int c = 0; c < sat.cols; ++c) {
+			sum += row[qx + 2 * c] != 0;
+			sum_row[c + 1] = sum;
+		}
+	}
+#pragma omp parallel for schedule(static)
+	for (int c = 1; c <= sat.cols; ++c) {
+		for (int r = 2; r <= sat.rows; ++r) {
+			sat.sums[r * stride + c] += sat.sums[(r - 1) * stride + c];
+		}
+	}
+}
+
+void ComputeEdgeTexture(const cv::Mat& edges, cv::Mat_<float>& texture)
+{
+	HPM_TRACE_SCOPE("EdgeTexture");
+	const int width = edges.cols;
+	const int height = edges.rows;
+	ParitySat sats[4];
+	for (int q = 0; q < 4; ++q) {
+		BuildParitySat(edges, q & 1, q >> 1, sats[q]);
+	}
+
+	texture.create(height, width);
+#pragma omp parallel for schedule(static)
+	for (int r = 0; r < height; ++r) {
+		// Samples at odd offsets have the parity of the neighbours
+		const int qy = (r + 1) & 1;
+		float* texture_row = texture[r];
+		for (int c = 0; c < width; ++c) {
+			const int qx = (c + 1) & 1;
+			const ParitySat& sat = sats[qy * 2 + qx];
+			const int x0 = std::max(0, (c - 5 - qx) / 2);
+			const int x1 = std::min(sat.cols - 1, (c + 5 - qx) / 2);
+			const int y0 = std::max(0, (r - 5 - qy) / 2);
+			const int y1 = std::min(sat.rows - 1, (r + 5 - qy) / 2);
+			if (x1 < x0 || y1 < y0) {
+				texture_row[c] = 0.5f;
+				continue;
+			}
+			const int total_pixels = (x1 - x0 + 1) * (y1 - y0 + 1);
+			const int edge_pixels = sat.At(y1 + 1, x1 + 1) - sat.At(y0, x1 + 1) - sat.At(y1 + 1, x0) + sat.At(y0, x0);
+			// Same expression as the former per-pixel kernel loop
+			texture_row[c] = ((edge_pixels * 1.0f / total_pixels) + 0.00005) / ((edge_pixels * 1.0f / total_pixels) + 0.0001);
+		}
+	}
+}
+
+static std::mutex edge_texture_mutex;
+static std::map<std::pair<int, int>, cv::Mat_<float>> edge_textures;
+static MemoryCharge edge_texture_charge(MEMORY_IMAGES, BUFFER_HOST);
+
+int GetEdgeTexture(const std::string& dense_folder, const int view, const int scale, const int width, const int height, cv::Mat_<float>& texture)
+{
+	std::lock_guard<std::mutex> lock(edge_texture_mutex);
+	const std::pair<int, int> key(view, scale);
+	const auto cached = edge_textures.find(key);
+	if (cached != edge_textures.end()) {
+		if (cached->second.cols == width && cached->second.rows == height) {
+			texture = cached->second;
+			return 0;
+		}
+		// Prior passes round the size of the coarser scale on their own; a
+		// map of another size is replaced instead of handed out
+		edge_texture_charge.Set(edge_texture_charge.Bytes() - MatBytes(cached->second));
+		edge_textures.erase(cached);
+	}
+
+	std::stringstream image_path;
+	image_path << dense_folder << "/images" << "/" << std::setw(8) << std::setfill('0') << view << ".jpg";
+	const cv::Mat image = cv::imread(image_path.str(), 1);
+	if (image.empty()) {
+		std::cout << "Can not read " << image_path.str() << std::endl;
+		return -1;
+	}
+	cv::Mat resized, edges;
+	{
+		HPM_TRACE_SCOPE("Canny");
+		cv::resize(image, resized, cv::Size(width, height), 0, 0, cv::INTER_LINEAR);
+		cv::Canny(resized, edges, 50, 150);
+	}
+	ComputeEdgeTexture(edges, texture);
+	edge_textures[key] = texture;
+	edge_texture_charge.Add(MatBytes(texture));
+	return 0;
+}
+
+void EvictEdgeTextures(const int max_scale)
+{
+	std::lock_guard<std::mutex> lock(edge_texture_mutex);
+	size_t bytes = 0;
+	for (auto it = edge_textures.begin(); it != edge_textures.end();) {
+		if (it->first.second > max_scale) {
+			it = edge_textures.erase(it);
+		}
+		else {
+			bytes += MatBytes(it->second);
+			++it;
+		}
+	}
+	edge_texture_charge.Set(bytes);
+}
+
+void ClearEdgeTextureCache()
+{
+	std::lock_guard<std::mutex> lock(edge_texture_mutex);
+	edge_textures.clear();
+	edge_texture_charge.Set(0);
+}
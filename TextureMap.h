@@ -0,0 +1,31 @@
+#ifndef _TEXTURE_MAP_H_
+#define _TEXTURE_MAP_H_
+
+#include "main.h"
+
+// Edge-density texture map: for every pixel the fraction d of Canny edges
+// among the in-image samples at offsets -5, -3, ..., 5 in x and y, mapped to
+// (d + 0.00005) / (d + 0.0001). Flat regions are 0.5, textured ones close to 1.
+// Each sample grid hits a single parity class of the image, so one summed-area
+// table per class gives the count in O(1) per pixel.
+void ComputeEdgeTexture(const cv::Mat &edges, cv::Mat_<float> &texture);
+
+// Texture map of a view at a scale, computed from the Canny edges of
+// images/<view>.jpg resized to width x height on first use and cached until
+// evicted. A cached map of another size is recomputed and replaced. Returns
+// -1 if the image cannot be read.
+//
+// The cache holds one float map per view and scale, charged to MEMORY_IMAGES.
+// Each time main moves to a finer scale it evicts every map more than two
+// scales coarser than the new one, so at most the current scale and the two
+// below it stay cached: about 1.3x a float map of the current resolution per
+// view, or 5.25 * width * height bytes for every view on the final scale.
+// Prior passes read the map at scale + hpm_scale_distance; that distance can
+// reach max_hpm_scale - scale, and a map that was already evicted is then
+// recomputed from the image rather than served from the cache.
+int GetEdgeTexture(const std::string &dense_folder, const int view, const int scale, const int width, const int height, cv::Mat_<float> &texture);
+// Drops the maps of scales coarser than max_scale
+void EvictEdgeTextures(const int max_scale);
+void ClearEdgeTextureCache();
+
+#endif // _TEXTURE_MAP_H_
@@ -0,0 +1,59 @@
+#include "TopKSelector.h"
+
+// Hypotheses selected together, one per SIMD lane
+#define TOP_K_LANES 8
+
+template <int K>
+static void SelectTopKViewsLanes(const float* costs, const int num_hypotheses, const int num_views, const int top_k, float* aggregated, unsigned int* selected_views)
+{
+	const float cost_max = 2.0f;
+	const int num_batches = (num_hypotheses + TOP_K_LANES - 1) / TOP_K_LANES;
+#pragma omp parallel for schedule(static)
+	for (int b = 0; b < num_batches; ++b) {
+		const int first = b * TOP_K_LANES;
+		const int lanes = std::min(TOP_K_LANES, num_hypotheses - first);
+		float best[K][TOP_K_LANES];
+		unsigned int best_views[K][TOP_K_LANES];
+		float overflow_cost[TOP_K_LANES];
+		unsigned int overflow_views[TOP_K_LANES];
+		int num_valid_views[TOP_K_LANES];
+		float lane_costs[TOP_K_LANES];
+
+#pragma omp simd
+		for (int l = 0; l < TOP_K_LANES; ++l) {
+			TopKReset<K, TOP_K_LANES>(&best[0][l], &best_views[0][l], overflow_cost[l], overflow_views[l]);
+			num_valid_views[l] = 0;
+		}
+		for (int v = 0; v < num_views; ++v) {
+			// Missing lanes of the last batch see the maximum cost
+			for (int l = 0; l < TOP_K_LANES; ++l) {
+				lane_costs[l] = l < lanes ? costs[(size_t)(first + l) * num_views + v] : cost_max;
+			}
+#pragma omp simd
+			for (int l = 0; l < TOP_K_LANES; ++l) {
+				TopKPush<K, TOP_K_LANES>(&best[0][l], &best_views[0][l], overflow_cost[l], overflow_views[l], lane_costs[l], 1u << v);
+				num_valid_views[l] += lane_costs[l] < cost_max;
+			}
+		}
+		for (int l = 0; l < lanes; ++l) {
+			const int k = std::min(num_valid_views[l], top_k);
+			float threshold;
+			unsigned int views = 0;
+			aggregated[first + l] = k > 0 ? TopKFinish<K, TOP_K_LANES>(&best[0][l], &best_views[0][l], overflow_cost[l], overflow_views[l], k, threshold, views) : cost_max;
+			selected_views[first + l] = views;
+		}
+	}
+}
+
+void SelectTopKViewsHost(const float* costs, const int num_hypotheses, const int num_views, const int top_k, float* aggregated, unsigned int* selected_views)
+{
+	if (top_k <= 4) {
+		SelectTopKViewsLanes<4>(costs, num_hypotheses, num_views, top_k, aggregated, selected_views);
+	}
+	else if (top_k <= 8) {
+		SelectTopKViewsLanes<8>(costs, num_hypotheses, num_views, top_k, aggregated, selected_views);
+	}
+	else {
+		SelectTopKViewsLanes<32>(costs, num_hypotheses, num_views, top_k, aggregated, selected_views);
+	}
+}
@@ -0,0 +1,89 @@
+#ifndef _TOP_K_SELECTOR_H_
+#define _TOP_K_SELECTOR_H_
+
+#include "main.h"
+
+#include <cfloat>
+
+// One-pass selection of the k best (lowest) view costs for the multi-view
+// cost, replacing a full sort of the cost vector. The K best costs (K fixed at
+// compile time, k <= K chosen at the end) are kept sorted with branch-free
+// insertion, each with the bit of its view. The smallest cost that left the K
+// best is kept with the bits of all views sharing it, so views tied with the
+// k-th best cost are selected exactly as by the former full sort.
+//
+// The core works on arrays with a compile-time stride so the same code serves
+// one pixel (stride 1, registers on the device) and SIMD lanes on the host.
+
+template <int K, int S>
+__host__ __device__ inline void TopKReset(float *best, unsigned int *best_views, float &overflow_cost, unsigned int &overflow_views)
+{
+    for (int j = 0; j < K; ++j) {
+        best[j * S] = FLT_MAX;
+        best_views[j * S] = 0;
+    }
+    overflow_cost = FLT_MAX;
+    overflow_views = 0;
+}
+
+template <int K, int S>
+__host__ __device__ inline void TopKPush(float *best, unsigned int *best_views, float &overflow_cost, unsigned int &overflow_views, const float cost, const unsigned int view_bit)
+{
+    // Either the cost or the current K-th best leaves the K best
+    const bool keep = cost < best[(K - 1) * S];
+    const float out_cost = keep ? best[(K - 1) * S] : cost;
+    const unsigned int out_views = keep ? best_views[(K - 1) * S] : view_bit;
+    overflow_views = out_cost < overflow_cost ? out_views : (out_cost == overflow_cost ? overflow_views | out_views : overflow_views);
+    overflow_cost = out_cost < overflow_cost ? out_cost : overflow_cost;
+
+    for (int j = K - 1; j > 0; --j) {
+        const bool shift = cost < best[(j - 1) * S];
+        const bool insert = cost < best[j * S];
+        best_views[j * S] = shift ? best_views[(j - 1) * S] : (insert ? view_bit : best_views[j * S]);
+        best[j * S] = shift ? best[(j - 1) * S] : (insert ? cost : best[j * S]);
+    }
+    const bool first = cost < best[0];
+    best_views[0] = first ? view_bit : best_views[0];
+    best[0] = first ? cost : best[0];
+}
+
+// Mean of the k best costs (0 < k <= K, summed in ascending order); views
+// holds every view with a cost <= the k-th best
+template <int K, int S>
+__host__ __device__ inline float TopKFinish(const float *best, const unsigned int *best_views, const float overflow_cost, const unsigned int overflow_views, const int k, float &threshold, unsigned int &views)
+{
+    float cost = 0.0f;
+    threshold = 0.0f;
+    for (int j = 0; j < K; ++j) {
+        if (j < k) {
+            cost += best[j * S];
+            threshold = best[j * S];
+        }
+    }
+    views = overflow_cost <= threshold ? overflow_views : 0;
+    for (int j = 0; j < K; ++j) {
+        views |= best[j * S] <= threshold ? best_views[j * S] : 0;
+    }
+    return cost / k;
+}
+
+// Selector of one pixel
+template <int K>
+struct TopKSelector {
+    float best[K];
+    unsigned int best_views[K];
+    float overflow_cost;
+    unsigned int overflow_views;
+
+    __host__ __device__ void Reset() { TopKReset<K, 1>(best, best_views, overflow_cost, overflow_views); }
+    __host__ __device__ void Push(const float cost, const int view) { TopKPush<K, 1>(best, best_views, overflow_cost, overflow_views, cost, 1u << view); }
+    __host__ __device__ float Finish(const int k, float &threshold, unsigned int &views) const { return TopKFinish<K, 1>(best, best_views, overflow_cost, overflow_views, k, threshold, views); }
+};
+
+// Mean of the top_k best of num_views costs per hypothesis (costs[h * num_views + v])
+// and the selected views, as ComputeMultiViewInitialCostandSelectedViews: k
+// is limited to the views below the maximum cost 2, and without such views
+// the result is 2 with no view selected.
+void SelectTopKViewsHost(const float *costs, const int num_hypotheses, const int num_views, const int top_k, float *aggregated, unsigned int *selected_views);
+
+#endif // _TOP_K_SELECTOR_H_
@@ -0,0 +1,122 @@
+#include "Trace.h"
+
+#ifdef HPM_ENABLE_TRACE
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+struct TraceEvent {
+	const char* name;
+	int64_t begin_us;
+	int64_t duration_us;
+	int view;
+	int scale;
+};
+
+// Each thread appends to its own buffer; the registry only locks when a
+// thread records its first event and when the trace is written
+struct TraceThreadBuffer {
+	int tid = 0;
+	int view = -1;
+	int scale = -1;
+	std::vector<TraceEvent> events;
+};
+
+static std::atomic<bool> trace_enabled(false);
+static std::mutex trace_mutex;
+static std::vector<std::shared_ptr<TraceThreadBuffer> > trace_buffers;
+static const std::chrono::steady_clock::time_point trace_origin = std::chrono::steady_clock::now();
+
+static int64_t TraceNowUs()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - trace_origin).count();
+}
+
+static TraceThreadBuffer& TraceLocalBuffer()
+{
+	thread_local std::shared_ptr<TraceThreadBuffer> buffer;
+	if (!buffer) {
+		buffer = std::make_shared<TraceThreadBuffer>();
+		std::lock_guard<std::mutex> lock(trace_mutex);
+		buffer->tid = (int)trace_buffers.size();
+		trace_buffers.push_back(buffer);
+	}
+	return *buffer;
+}
+
+TraceScope::TraceScope(const char* _name) : name(_name), begin_us(-1)
+{
+	if (trace_enabled.load(std::memory_order_relaxed)) {
+		begin_us = TraceNowUs();
+	}
+}
+
+TraceScope::~TraceScope()
+{
+	if (begin_us < 0) {
+		return;
+	}
+	TraceThreadBuffer& buffer = TraceLocalBuffer();
+	TraceEvent event;
+	event.name = name;
+	event.begin_us = begin_us;
+	event.duration_us = TraceNowUs() - begin_us;
+	event.view = buffer.view;
+	event.scale = buffer.scale;
+	buffer.events.push_back(event);
+}
+
+void TraceEnable(const bool enable)
+{
+	trace_enabled.store(enable);
+}
+
+bool TraceEnabled()
+{
+	return trace_enabled.load();
+}
+
+void TraceSetContext(const int view, const int scale)
+{
+	TraceThreadBuffer& buffer = TraceLocalBuffer();
+	buffer.view = view;
+	buffer.scale = scale;
+}
+
+int TraceWriteChrome(const std::string& path)
+{
+	std::ofstream out(path);
+	if (!out) {
+		std::cout << "Can not write trace to " << path << std::endl;
+		return -1;
+	}
+
+	std::lock_guard<std::mutex> lock(trace_mutex);
+	out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+	bool first = true;
+	for (const auto& buffer : trace_buffers) {
+		for (const TraceEvent& event : buffer->events) {
+			out << (first ? "\n" : ",\n");
+			first = false;
+			out << "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << buffer->tid
+				<< ",\"ts\":" << event.begin_us << ",\"dur\":" << event.duration_us << ",\"args\":{";
+			if (event.view >= 0) {
+				out << "\"view\":" << event.view;
+			}
+			if (event.scale >= 0) {
+				out << (event.view >= 0 ? "," : "") << "\"scale\":" << event.scale;
+			}
+			out << "}}";
+		}
+	}
+	out << "\n]}\n";
+	std::cout << "Trace written to " << path << std::endl;
+	return 0;
+}
+
+#endif // HPM_ENABLE_TRACE
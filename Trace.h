@@ -0,0 +1,56 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <string>
+
+// Scoped stage tracing exported as Chrome trace JSON, viewable in
+// chrome://tracing or ui.perfetto.dev. Compiled in only with the CMake option
+// HPM_ENABLE_TRACE; otherwise every macro expands to nothing. When compiled
+// in, events are recorded only after TraceEnable(true) (--trace=<path>).
+//
+//   HPM_TRACE_CONTEXT(view, scale);   // tag later events of this thread
+//   { HPM_TRACE_SCOPE("Canny"); ... } // one complete event per scope
+//   HPM_TRACE_WRITE(path);
+//
+// Scope names must be string literals; they are stored by pointer.
+
+#ifdef HPM_ENABLE_TRACE
+
+#include <cstdint>
+
+class TraceScope {
+public:
+    explicit TraceScope(const char *_name);
+    ~TraceScope();
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+
+private:
+    const char *name;
+    int64_t begin_us;
+};
+
+void TraceEnable(const bool enable);
+bool TraceEnabled();
+// View id and scale attached to the events of the calling thread; -1 omits them
+void TraceSetContext(const int view, const int scale);
+// Writes every event recorded so far; returns -1 if the file cannot be opened
+int TraceWriteChrome(const std::string &path);
+
+#define HPM_TRACE_CONCAT_(a, b) a##b
+#define HPM_TRACE_CONCAT(a, b) HPM_TRACE_CONCAT_(a, b)
+#define HPM_TRACE_SCOPE(name) TraceScope HPM_TRACE_CONCAT(hpm_trace_scope_, __LINE__)(name)
+#define HPM_TRACE_CONTEXT(view, scale) TraceSetContext(view, scale)
+#define HPM_TRACE_ENABLE(enable) TraceEnable(enable)
+#define HPM_TRACE_WRITE(path) TraceWriteChrome(path)
+
+#else
+
+#define HPM_TRACE_SCOPE(name) ((void)0)
+#define HPM_TRACE_CONTEXT(view, scale) ((void)0)
+#define HPM_TRACE_ENABLE(enable) ((void)0)
+#define HPM_TRACE_WRITE(path) ((void)0)
+
+#endif // HPM_ENABLE_TRACE
+
+#endif // _TRACE_H_
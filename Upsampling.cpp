@@ -0,0 +1,464 @@
+#include "Upsampling.h"
+
+#include <chrono>
+#include <cmath>
+
+// Must match JBU_cu / JBU_cu_prior
+static const float kJBUSigmaSpatial = 0.5f;
+static const float kJBUSigmaRange = 25.5f;
+// Guide differences are quantized to 1/64 of an intensity level
+static const int kRangeLUTSteps = 64;
+static const int kRangeLUTMaxDiff = 256;
+
+static inline int ClampIndex(const int v, const int size)
+{
+	return v > 0 ? (v < size ? v : size - 1) : 0;
+}
+
+void JBUWeightTables::Initialize(const int _width, const int _height, const int _s_width, const int _s_height, const int Imagescale)
+{
+	width = _width;
+	height = _height;
+	s_width = _s_width;
+	s_height = _s_height;
+
+	const int num_neighbors = (Imagescale * Imagescale + 1) / 2;
+	num_taps = 2 * num_neighbors + 1;
+
+	// The kernels use the horizontal ratio for both axes
+	const float scale = 1.0f * s_width / width;
+	const float spatial_denom = 2.0f * kJBUSigmaSpatial * kJBUSigmaSpatial;
+
+	src_x.resize(num_taps * width);
+	guide_x.resize(num_taps * width);
+	weight_x.resize(num_taps * width);
+	for (int t = 0; t < num_taps; ++t) {
+		const int i = t - num_neighbors;
+		for (int x = 0; x < width; ++x) {
+			const float o_x = x * scale;
+			const int r_x = ClampIndex((int)(o_x + i), s_width);
+			src_x[t * width + x] = r_x;
+			guide_x[t * width + x] = ClampIndex(x + i, width);
+			weight_x[t * width + x] = std::exp(-(o_x - r_x) * (o_x - r_x) / spatial_denom);
+		}
+	}
+
+	src_y.resize(num_taps * height);
+	guide_y.resize(num_taps * height);
+	weight_y.resize(num_taps * height);
+	for (int t = 0; t < num_taps; ++t) {
+		const int j = t - num_neighbors;
+		for (int y = 0; y < height; ++y) {
+			const float o_y = y * scale;
+			const int r_y = ClampIndex((int)(o_y + j), s_height);
+			src_y[t * height + y] = r_y;
+			guide_y[t * height + y] = ClampIndex(y + j, height);
+			weight_y[t * height + y] = std::exp(-(o_y - r_y) * (o_y - r_y) / spatial_denom);
+		}
+	}
+
+	range_lut_scale = (float)kRangeLUTSteps;
+	range_lut.resize(kRangeLUTMaxDiff * kRangeLUTSteps + 1);
+	const float range_denom = 2.0f * kJBUSigmaRange * kJBUSigmaRange;
+	for (size_t k = 0; k < range_lut.size(); ++k) {
+		const float diff = (float)k / kRangeLUTSteps;
+		range_lut[k] = std::exp(-diff * diff / range_denom);
+	}
+}
+
+JBUBand ComputeJBUBand(const int y0, const int y1, const int height, const int width, const int s_height, const int s_width, const int Imagescale)
+{
+	const int num_neighbors = (Imagescale * Imagescale + 1) / 2;
+	const float scale = 1.0f * s_width / width;
+
+	JBUBand band;
+	band.y0 = y0;
+	band.y1 = y1;
+	band.guide_y0 = ClampIndex(y0 - num_neighbors, height);
+	band.guide_y1 = ClampIndex(y1 - 1 + num_neighbors, height) + 1;
+	// Same float arithmetic as the kernels so the band covers every tap
+	band.src_y0 = ClampIndex((int)(y0 * scale - num_neighbors), s_height);
+	band.src_y1 = ClampIndex((int)((y1 - 1) * scale + num_neighbors), s_height) + 1;
+	return band;
+}
+
+// Source index and weight of the right/lower neighbour for one output
+// coordinate, as cv::resize INTER_LINEAR maps pixel centres
+static inline void LinearResizeTap(const int d, const double scale, const int s_size, int& s, float& alpha)
+{
+	const float f = (float)((d + 0.5) * scale - 0.5);
+	s = (int)std::floor(f);
+	alpha = f - s;
+	if (s < 0) {
+		s = 0;
+		alpha = 0.0f;
+	}
+	if (s >= s_size - 1) {
+		s = s_size - 1;
+		alpha = 0.0f;
+	}
+}
+
+void ResizeGuideRows(const cv::Mat_<uint8_t>& image, const int rows, const int cols, const int y0, const int y1, cv::Mat_<float>& guide_rows)
+{
+	const double scale_x = (double)image.cols / cols;
+	const double scale_y = (double)image.rows / rows;
+	std::vector<int> sx(cols);
+	std::vector<float> ax(cols);
+	for (int x = 0; x < cols; ++x) {
+		LinearResizeTap(x, scale_x, image.cols, sx[x], ax[x]);
+	}
+
+	guide_rows.create(y1 - y0, cols);
+#pragma omp parallel for
+	for (int y = y0; y < y1; ++y) {
+		int sy;
+		float ay;
+		LinearResizeTap(y, scale_y, image.rows, sy, ay);
+		const uint8_t* row0 = image.ptr<uint8_t>(sy);
+		const uint8_t* row1 = image.ptr<uint8_t>(std::min(sy + 1, image.rows - 1));
+		float* dst = guide_rows.ptr<float>(y - y0);
+		for (int x = 0; x < cols; ++x) {
+			const int x1 = std::min(sx[x] + 1, image.cols - 1);
+			const float top = row0[sx[x]] + ax[x] * (row0[x1] - row0[sx[x]]);
+			const float bottom = row1[sx[x]] + ax[x] * (row1[x1] - row1[sx[x]]);
+			dst[x] = top + ay * (bottom - top);
+		}
+	}
+}
+
+// Accumulates one output row over the full window. x is the innermost loop so
+// the table lookups and accumulations vectorize; the source and guide reads
+// are gathers through the column tables. guide holds the rows starting at
+// guide_y0 and src_planes the rows starting at src_y0.
+template <int NUM_CHANNELS>
+static void AccumulateJBURow(const JBUWeightTables& tables, const cv::Mat_<float>& guide, const int guide_y0, const float* const src_planes[NUM_CHANNELS], const int src_step, const int src_y0, const int y, float* accum[NUM_CHANNELS], float* normalizing)
+{
+	const int width = tables.width;
+	const int lut_max = (int)tables.range_lut.size() - 1;
+	const float lut_scale = tables.range_lut_scale;
+	const float* lut = tables.range_lut.data();
+	const float* ref_row = guide.ptr<float>(y - guide_y0);
+
+	for (int x = 0; x < width; ++x) {
+		normalizing[x] = 0.0f;
+	}
+	for (int c = 0; c < NUM_CHANNELS; ++c) {
+		for (int x = 0; x < width; ++x) {
+			accum[c][x] = 0.0f;
+		}
+	}
+
+	for (int tj = 0; tj < tables.num_taps; ++tj) {
+		const int r_y = tables.src_y[tj * tables.height + y];
+		const float w_y = tables.weight_y[tj * tables.height + y];
+		const float* guide_row = guide.ptr<float>(tables.guide_y[tj * tables.height + y] - guide_y0);
+		const float* src_rows[NUM_CHANNELS];
+		for (int c = 0; c < NUM_CHANNELS; ++c) {
+			src_rows[c] = src_planes[c] + (size_t)(r_y - src_y0) * src_step;
+		}
+
+		for (int ti = 0; ti < tables.num_taps; ++ti) {
+			const int* src_x = &tables.src_x[ti * width];
+			const int* guide_x = &tables.guide_x[ti * width];
+			const float* w_x = &tables.weight_x[ti * width];
+#pragma omp simd
+			for (int x = 0; x < width; ++x) {
+				const float diff = std::fabs(ref_row[x] - guide_row[guide_x[x]]);
+				const int q = std::min((int)(diff * lut_scale + 0.5f), lut_max);
+				const float w = w_y * w_x[x] * lut[q];
+				normalizing[x] += w;
+				for (int c = 0; c < NUM_CHANNELS; ++c) {
+					accum[c][x] += src_rows[c][src_x[x]] * w;
+				}
+			}
+		}
+	}
+}
+
+template <int NUM_CHANNELS>
+static void JBUHostChannelsN(const JBUWeightTables& tables, const cv::Mat_<float>& guide, const std::vector<cv::Mat_<float> >& src_channels, const JBUBand& band, std::vector<cv::Mat_<float> >& dst_channels)
+{
+	const int cols = tables.width;
+	const int band_rows = band.y1 - band.y0;
+	// Sources hold the full maps; only the band's rows are read
+	std::vector<cv::Mat_<float> > src(NUM_CHANNELS);
+	const float* src_planes[NUM_CHANNELS];
+	for (int c = 0; c < NUM_CHANNELS; ++c) {
+		src[c] = src_channels[c].rowRange(band.src_y0, band.src_y1);
+		src_planes[c] = src[c].ptr<float>(0);
+	}
+	const int src_step = (int)(src[0].step[0] / sizeof(float));
+	dst_channels.resize(NUM_CHANNELS);
+	for (int c = 0; c < NUM_CHANNELS; ++c) {
+		dst_channels[c].create(band_rows, cols);
+	}
+
+#pragma omp parallel
+	{
+		std::vector<float> accum_buf(NUM_CHANNELS * cols), normalizing(cols);
+		float* accum[NUM_CHANNELS];
+		for (int c = 0; c < NUM_CHANNELS; ++c) {
+			accum[c] = &accum_buf[c * cols];
+		}
+#pragma omp for schedule(dynamic, 8)
+		for (int y = band.y0; y < band.y1; ++y) {
+			AccumulateJBURow<NUM_CHANNELS>(tables, guide, band.guide_y0, src_planes, src_step, band.src_y0, y, accum, normalizing.data());
+			for (int c = 0; c < NUM_CHANNELS; ++c) {
+				float* out = dst_channels[c].ptr<float>(y - band.y0);
+				for (int x = 0; x < cols; ++x) {
+					out[x] = accum[c][x] / normalizing[x];
+				}
+			}
+		}
+	}
+}
+
+void JBUHostChannels(const JBUWeightTables& tables, const cv::Mat_<float>& guide, const std::vector<cv::Mat_<float> >& src_channels, const JBUBand& band, std::vector<cv::Mat_<float> >& dst_channels)
+{
+	switch (src_channels.size()) {
+	case 1: JBUHostChannelsN<1>(tables, guide, src_channels, band, dst_channels); break;
+	case 2: JBUHostChannelsN<2>(tables, guide, src_channels, band, dst_channels); break;
+	case 3: JBUHostChannelsN<3>(tables, guide, src_channels, band, dst_channels); break;
+	case 4: JBUHostChannelsN<4>(tables, guide, src_channels, band, dst_channels); break;
+	case 5: JBUHostChannelsN<5>(tables, guide, src_channels, band, dst_channels); break;
+	case 6: JBUHostChannelsN<6>(tables, guide, src_channels, band, dst_channels); break;
+	case 7: JBUHostChannelsN<7>(tables, guide, src_channels, band, dst_channels); break;
+	case 8: JBUHostChannelsN<8>(tables, guide, src_channels, band, dst_channels); break;
+	default:
+		std::cout << "JBUHostChannels: unsupported channel count " << src_channels.size() << std::endl;
+		dst_channels.clear();
+		break;
+	}
+}
+
+void JBUHostRows(const JBUWeightTables& tables, const cv::Mat_<float>& guide, const cv::Mat_<float>& src_depth, const JBUBand& band, cv::Mat_<float>& dst_depth)
+{
+	std::vector<cv::Mat_<float> > src_channels(1, src_depth), dst_channels;
+	JBUHostChannels(tables, guide, src_channels, band, dst_channels);
+	dst_depth = dst_channels[0];
+}
+
+void SplitNormalPlanes(const cv::Mat_<cv::Vec3f>& normal, std::vector<cv::Mat_<float> >& planes)
+{
+	const int rows = normal.rows;
+	const int cols = normal.cols;
+	planes.resize(3);
+	for (int c = 0; c < 3; ++c) {
+		planes[c].create(rows, cols);
+	}
+#pragma omp parallel for
+	for (int i = 0; i < rows; ++i) {
+		const cv::Vec3f* n = normal.ptr<cv::Vec3f>(i);
+		float* nx = planes[0].ptr<float>(i);
+		float* ny = planes[1].ptr<float>(i);
+		float* nz = planes[2].ptr<float>(i);
+		for (int j = 0; j < cols; ++j) {
+			nx[j] = n[j][0];
+			ny[j] = n[j][1];
+			nz[j] = n[j][2];
+		}
+	}
+}
+
+void MergeNormalPlanes(const cv::Mat_<float>& nx, const cv::Mat_<float>& ny, const cv::Mat_<float>& nz, cv::Mat_<cv::Vec3f>& normal)
+{
+	const int rows = nx.rows;
+	const int cols = nx.cols;
+	normal.create(rows, cols);
+#pragma omp parallel for
+	for (int i = 0; i < rows; ++i) {
+		const float* px = nx.ptr<float>(i);
+		const float* py = ny.ptr<float>(i);
+		const float* pz = nz.ptr<float>(i);
+		cv::Vec3f* out = normal.ptr<cv::Vec3f>(i);
+		for (int j = 0; j < cols; ++j) {
+			const float inv_norm = 1.0f / std::sqrt(px[j] * px[j] + py[j] * py[j] + pz[j] * pz[j]);
+			out[j] = cv::Vec3f(px[j] * inv_norm, py[j] * inv_norm, pz[j] * inv_norm);
+		}
+	}
+}
+
+void JBUHost(const cv::Mat_<float>& guide, const cv::Mat_<float>& src_depth, cv::Mat_<float>& dst_depth, const int Imagescale)
+{
+	JBUWeightTables tables;
+	tables.Initialize(guide.cols, guide.rows, src_depth.cols, src_depth.rows, Imagescale);
+	JBUBand band = ComputeJBUBand(0, guide.rows, guide.rows, guide.cols, src_depth.rows, src_depth.cols, Imagescale);
+	JBUHostRows(tables, guide, src_depth, band, dst_depth);
+}
+
+void JBUHost_prior(const cv::Mat_<float>& guide, const cv::Mat_<float>& src_depth, const cv::Mat_<cv::Vec3f>& src_normal, cv::Mat_<float>& dst_depth, cv::Mat_<cv::Vec3f>& dst_normal, const int Imagescale, const int tile_rows)
+{
+	const int rows = guide.rows;
+	const int cols = guide.cols;
+	JBUWeightTables tables;
+	tables.Initialize(cols, rows, src_depth.cols, src_depth.rows, Imagescale);
+
+	// Depth and normal share each tap's weight
+	std::vector<cv::Mat_<float> > normal_planes;
+	SplitNormalPlanes(src_normal, normal_planes);
+	std::vector<cv::Mat_<float> > src_channels;
+	src_channels.push_back(src_depth);
+	src_channels.insert(src_channels.end(), normal_planes.begin(), normal_planes.end());
+
+	// Only one band of upsampled planes exists at a time
+	dst_depth.create(rows, cols);
+	dst_normal.create(rows, cols);
+	const int band_rows = tile_rows > 0 ? tile_rows : rows;
+	for (int y0 = 0; y0 < rows; y0 += band_rows) {
+		const int y1 = std::min(y0 + band_rows, rows);
+		const JBUBand band = ComputeJBUBand(y0, y1, rows, cols, src_depth.rows, src_depth.cols, Imagescale);
+		std::vector<cv::Mat_<float> > dst_channels;
+		JBUHostChannels(tables, guide.rowRange(band.guide_y0, band.guide_y1), src_channels, band, dst_channels);
+
+		cv::Mat depth_band = dst_depth.rowRange(y0, y1);
+		dst_channels[0].copyTo(depth_band);
+		cv::Mat_<cv::Vec3f> normal_rows;
+		MergeNormalPlanes(dst_channels[1], dst_channels[2], dst_channels[3], normal_rows);
+		cv::Mat normal_band = dst_normal.rowRange(y0, y1);
+		normal_rows.copyTo(normal_band);
+	}
+}
+
+// Window radius in source pixels, equal to the JBU window at Imagescale 2;
+// eps matches the JBU range sigma
+static const int kGuidedRadius = 2;
+static const float kGuidedEps = kJBUSigmaRange * kJBUSigmaRange;
+
+void GuidedUpsampleHost(const cv::Mat_<float>& guide, const std::vector<cv::Mat_<float>>& src_channels, std::vector<cv::Mat_<float>>& dst_channels, const int radius, const float eps)
+{
+	const int rows = guide.rows;
+	const int cols = guide.cols;
+	const cv::Size src_size(src_channels[0].cols, src_channels[0].rows);
+	const cv::Size window(2 * radius + 1, 2 * radius + 1);
+
+	cv::Mat guide_low;
+	cv::resize(guide, guide_low, src_size, 0, 0, cv::INTER_AREA);
+
+	cv::Mat mean_I, corr_I, guide_sq;
+	cv::boxFilter(guide_low, mean_I, CV_32F, window);
+	cv::multiply(guide_low, guide_low, guide_sq);
+	cv::boxFilter(guide_sq, corr_I, CV_32F, window);
+
+	// var_I is shared by every channel
+	cv::Mat_<float> var_I(src_size);
+	for (int i = 0; i < src_size.height; ++i) {
+		const float* m = mean_I.ptr<float>(i);
+		const float* c = corr_I.ptr<float>(i);
+		float* v = var_I.ptr<float>(i);
+		for (int j = 0; j < src_size.width; ++j) {
+			v[j] = c[j] - m[j] * m[j] + eps;
+		}
+	}
+
+	dst_channels.resize(src_channels.size());
+	for (size_t c = 0; c < src_channels.size(); ++c) {
+		const cv::Mat_<float>& p = src_channels[c];
+		cv::Mat mean_p, corr_Ip, guide_p;
+		cv::boxFilter(p, mean_p, CV_32F, window);
+		cv::multiply(guide_low, p, guide_p);
+		cv::boxFilter(guide_p, corr_Ip, CV_32F, window);
+
+		cv::Mat_<float> a(src_size), b(src_size);
+		for (int i = 0; i < src_size.height; ++i) {
+			const float* mI = mean_I.ptr<float>(i);
+			const float* mp = mean_p.ptr<float>(i);
+			const float* cIp = corr_Ip.ptr<float>(i);
+			const float* v = var_I.ptr<float>(i);
+			float* pa = a.ptr<float>(i);
+			float* pb = b.ptr<float>(i);
+			for (int j = 0; j < src_size.width; ++j) {
+				pa[j] = (cIp[j] - mI[j] * mp[j]) / v[j];
+				pb[j] = mp[j] - pa[j] * mI[j];
+			}
+		}
+
+		cv::Mat mean_a, mean_b, A, B;
+		cv::boxFilter(a, mean_a, CV_32F, window);
+		cv::boxFilter(b, mean_b, CV_32F, window);
+		cv::resize(mean_a, A, cv::Size(cols, rows), 0, 0, cv::INTER_LINEAR);
+		cv::resize(mean_b, B, cv::Size(cols, rows), 0, 0, cv::INTER_LINEAR);
+
+		cv::Mat_<float>& q = dst_channels[c];
+		q.create(rows, cols);
+#pragma omp parallel for
+		for (int i = 0; i < rows; ++i) {
+			const float* I = guide.ptr<float>(i);
+			const float* pA = A.ptr<float>(i);
+			const float* pB = B.ptr<float>(i);
+			float* out = q.ptr<float>(i);
+#pragma omp simd
+			for (int j = 0; j < cols; ++j) {
+				out[j] = pA[j] * I[j] + pB[j];
+			}
+		}
+	}
+}
+
+void GuidedUpsampleHost(const cv::Mat_<float>& guide, const std::vector<cv::Mat_<float>>& src_channels, std::vector<cv::Mat_<float>>& dst_channels)
+{
+	GuidedUpsampleHost(guide, src_channels, dst_channels, kGuidedRadius, kGuidedEps);
+}
+
+void GuidedUpsampleHost(const cv::Mat_<float>& guide, const cv::Mat_<float>& src, cv::Mat_<float>& dst)
+{
+	std::vector<cv::Mat_<float>> src_channels(1, src);
+	std::vector<cv::Mat_<float>> dst_channels;
+	GuidedUpsampleHost(guide, src_channels, dst_channels, kGuidedRadius, kGuidedEps);
+	dst = dst_channels[0];
+}
+
+void GuidedUpsampleHost(const cv::Mat_<float>& guide, const cv::Mat_<float>& src, const cv::Mat_<cv::Vec3f>& src_normal, cv::Mat_<float>& dst, cv::Mat_<cv::Vec3f>& dst_normal)
+{
+	std::vector<cv::Mat> normal_channels;
+	cv::split(src_normal, normal_channels);
+	std::vector<cv::Mat_<float>> src_channels = { src, normal_channels[0], normal_channels[1], normal_channels[2] };
+	std::vector<cv::Mat_<float>> dst_channels;
+	GuidedUpsampleHost(guide, src_channels, dst_channels, kGuidedRadius, kGuidedEps);
+
+	dst = dst_channels[0];
+	MergeNormalPlanes(dst_channels[1], dst_channels[2], dst_channels[3], dst_normal);
+}
+
+void CompareUpsamplingMethods(const cv::Mat_<float>& guide, const cv::Mat_<float>& src_depth, const int Imagescale)
+{
+	cv::Mat_<float> jbu_depth, guided_depth;
+
+	auto start = std::chrono::steady_clock::now();
+	JBUHost(guide, src_depth, jbu_depth, Imagescale);
+	auto mid = std::chrono::steady_clock::now();
+	GuidedUpsampleHost(guide, src_depth, guided_depth);
+	auto stop = std::chrono::steady_clock::now();
+
+	double sum_abs = 0.0;
+	double sum_rel = 0.0;
+	size_t num_valid = 0;
+	size_t num_over = 0;
+	for (int i = 0; i < guide.rows; ++i) {
+		for (int j = 0; j < guide.cols; ++j) {
+			const float d0 = jbu_depth(i, j);
+			const float d1 = guided_depth(i, j);
+			if (!(d0 > 0.0f) || d1 != d1) {
+				continue;
+			}
+			const double diff = std::fabs(d0 - d1);
+			sum_abs += diff;
+			sum_rel += diff / d0;
+			if (diff / d0 > 0.01) {
+				num_over++;
+			}
+			num_valid++;
+		}
+	}
+	if (num_valid == 0) {
+		num_valid = 1;
+	}
+
+	const double jbu_ms = std::chrono::duration<double, std::milli>(mid - start).count();
+	const double guided_ms = std::chrono::duration<double, std::milli>(stop - mid).count();
+	std::cout << "Upsampling x" << Imagescale << " " << src_depth.cols << "x" << src_depth.rows << " -> " << guide.cols << "x" << guide.rows
+		<< ": JBU " << jbu_ms << " ms, guided " << guided_ms << " ms"
+		<< ", mean abs diff " << sum_abs / num_valid
+		<< ", mean rel diff " << sum_rel / num_valid
+		<< ", >1% rel diff " << 100.0 * num_over / num_valid << "%" << std::endl;
+}
@@ -0,0 +1,80 @@
+#ifndef _UPSAMPLING_H_
+#define _UPSAMPLING_H_
+
+#include "main.h"
+
+// Precomputed weights for the host joint bilateral upsampling. The spatial
+// term of JBU_cu is separable, so it is tabulated once per output column and
+// per output row (one entry per window tap); the range term is a LUT indexed
+// by the quantized guide intensity difference.
+struct JBUWeightTables {
+    int width = 0;
+    int height = 0;
+    int s_width = 0;
+    int s_height = 0;
+    int num_taps = 0;
+
+    // Indexed as [tap * width + x] / [tap * height + y]
+    std::vector<int> src_x;
+    std::vector<int> guide_x;
+    std::vector<float> weight_x;
+    std::vector<int> src_y;
+    std::vector<int> guide_y;
+    std::vector<float> weight_y;
+
+    std::vector<float> range_lut;
+    float range_lut_scale = 0.0f;
+
+    void Initialize(const int width, const int height, const int s_width, const int s_height, const int Imagescale);
+};
+
+// A band of output rows [y0, y1) together with the guide rows [guide_y0,
+// guide_y1) and source rows [src_y0, src_y1) its JBU window touches.
+struct JBUBand {
+    int y0, y1;
+    int guide_y0, guide_y1;
+    int src_y0, src_y1;
+};
+
+JBUBand ComputeJBUBand(const int y0, const int y1, const int height, const int width, const int s_height, const int s_width, const int Imagescale);
+
+// Rows [y0, y1) of the 8-bit image bilinearly resized to rows x cols, as
+// float, with the pixel mapping of cv::resize INTER_LINEAR. Each output row
+// reads only its two source rows, so a band holds just its own rows and any
+// band split gives the same values as resizing the whole image at once.
+void ResizeGuideRows(const cv::Mat_<uint8_t>& image, const int rows, const int cols, const int y0, const int y1, cv::Mat_<float>& guide_rows);
+
+// Upsamples the rows of one band for up to JBU_MAX_CHANNELS source maps at
+// once; each tap's weight is computed a single time and applied to every
+// channel. Outputs are one plane per channel. guide holds only the band's
+// guide rows.
+void JBUHostChannels(const JBUWeightTables& tables, const cv::Mat_<float>& guide, const std::vector<cv::Mat_<float> >& src_channels, const JBUBand& band, std::vector<cv::Mat_<float> >& dst_channels);
+void JBUHostRows(const JBUWeightTables& tables, const cv::Mat_<float>& guide, const cv::Mat_<float>& src_depth, const JBUBand& band, cv::Mat_<float>& dst_depth);
+
+// CPU equivalents of JBU_cu and JBU_cu_prior. Pixels whose weights vanish are
+// left as NaN, as on the GPU, so callers keep their existing fallback.
+void JBUHost(const cv::Mat_<float>& guide, const cv::Mat_<float>& src_depth, cv::Mat_<float>& dst_depth, const int Imagescale);
+// The prior maps are upsampled in bands of tile_rows rows (0 for one band)
+// straight into the full-resolution outputs
+void JBUHost_prior(const cv::Mat_<float>& guide, const cv::Mat_<float>& src_depth, const cv::Mat_<cv::Vec3f>& src_normal, cv::Mat_<float>& dst_depth, cv::Mat_<cv::Vec3f>& dst_normal, const int Imagescale, const int tile_rows);
+
+// Conversions between interleaved normals and per-channel planes; merging
+// renormalizes the interpolated vectors.
+void SplitNormalPlanes(const cv::Mat_<cv::Vec3f>& normal, std::vector<cv::Mat_<float> >& planes);
+void MergeNormalPlanes(const cv::Mat_<float>& nx, const cv::Mat_<float>& ny, const cv::Mat_<float>& nz, cv::Mat_<cv::Vec3f>& normal);
+
+// Fast guided filter upsampling. The linear coefficients are fitted on the
+// low resolution grid with box filters and bilinearly interpolated, so the
+// per-pixel cost does not depend on the upsampling factor. radius is in
+// source pixels and eps is in guide intensity units squared.
+void GuidedUpsampleHost(const cv::Mat_<float>& guide, const std::vector<cv::Mat_<float>>& src_channels, std::vector<cv::Mat_<float>>& dst_channels, const int radius, const float eps);
+// Default radius and eps, matching the JBU window and range sigma
+void GuidedUpsampleHost(const cv::Mat_<float>& guide, const std::vector<cv::Mat_<float>>& src_channels, std::vector<cv::Mat_<float>>& dst_channels);
+void GuidedUpsampleHost(const cv::Mat_<float>& guide, const cv::Mat_<float>& src, cv::Mat_<float>& dst);
+// Normals are filtered per channel and renormalized
+void GuidedUpsampleHost(const cv::Mat_<float>& guide, const cv::Mat_<float>& src, const cv::Mat_<cv::Vec3f>& src_normal, cv::Mat_<float>& dst, cv::Mat_<cv::Vec3f>& dst_normal);
+
+// Runs both upsamplers on the host and prints timings and depth differences
+void CompareUpsamplingMethods(const cv::Mat_<float>& guide, const cv::Mat_<float>& src_depth, const int Imagescale);
+
+#endif // _UPSAMPLING_H_
@@ -0,0 +1,621 @@
+#include "HPM.h"
+#include "ImageLayout.h"
+#include "MedianFilter.h"
+#include "Upsampling.h"
+#include "SyntheticScene.h"
+#include "TopKSelector.h"
+#include "TextureMap.h"
+#include "GeomConsistency.h"
+
+#include <chrono>
+#include <filesystem>
+#include <random>
+#include <thread>
+#include <omp.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+struct BenchOptions {
+    std::string dense_folder; // empty: generate a synthetic scene
+    int width = 640;
+    int height = 480;
+    int num_views = 5;
+    int repeats = 5;
+    int threads = 0; // 0 keeps the OpenMP default
+    bool pin = false;
+    std::string filter; // run only benchmarks whose name contains this
+    std::string json_path;
+    std::string baseline_path;
+    float tolerance = 0.1f; // allowed relative throughput loss against the baseline
+};
+
+struct BenchResult {
+    std::string name;
+    std::string unit; // what items counts
+    double items;
+    double seconds; // median over the repeats
+    double throughput;
+};
+
+// Inputs shared by all benchmarks; view 0 is the reference
+struct BenchScene {
+    std::string dense_folder;
+    std::vector<Problem> problems;
+    std::vector<cv::Mat> images;
+    std::vector<Camera> cameras;
+    std::vector<cv::Mat_<float> > depths;
+    PatchMatchParams params;
+};
+
+// One warm-up run, then the median wall time of repeats runs
+template <typename F>
+static BenchResult Measure(const std::string& name, const std::string& unit, const double items, const int repeats, F run)
+{
+	run();
+	std::vector<double> seconds(repeats);
+	for (int i = 0; i < repeats; ++i) {
+		const auto t0 = std::chrono::steady_clock::now();
+		run();
+		seconds[i] = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+	}
+	std::sort(seconds.begin(), seconds.end());
+	BenchResult result;
+	result.name = name;
+	result.unit = unit;
+	result.items = items;
+	result.seconds = seconds[repeats / 2];
+	result.throughput = result.seconds > 0.0 ? items / result.seconds : 0.0;
+	return result;
+}
+
+// Device benchmarks: run returns the kernel milliseconds from CUDA events
+// for one launch; one warm-up, then the median of repeats launches
+template <typename F>
+static BenchResult MeasureDevice(const std::string& name, const std::string& unit, const double items, const int repeats, F run)
+{
+	run();
+	std::vector<double> seconds(repeats);
+	for (int i = 0; i < repeats; ++i) {
+		seconds[i] = run() / 1000.0;
+	}
+	std::sort(seconds.begin(), seconds.end());
+	BenchResult result;
+	result.name = name;
+	result.unit = unit;
+	result.items = items;
+	result.seconds = seconds[repeats / 2];
+	result.throughput = result.seconds > 0.0 ? items / result.seconds : 0.0;
+	return result;
+}
+
+// Binds OpenMP thread i to logical CPU i; the runtime keeps its pool, so
+// later parallel regions stay pinned
+static void PinThreads()
+{
+#ifdef __linux__
+	const int num_cpus = std::max(1, (int)std::thread::hardware_concurrency());
+#pragma omp parallel
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(omp_get_thread_num() % num_cpus, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+	}
+#else
+	std::cout << "Thread pinning is only supported on Linux" << std::endl;
+#endif
+}
+
+static int LoadScene(const BenchOptions& options, BenchScene& scene)
+{
+	scene.dense_folder = options.dense_folder;
+	if (scene.dense_folder.empty()) {
+		std::stringstream folder;
+		folder << (std::filesystem::temp_directory_path() / "hpm_bench_scene").string() << "_" << options.width << "x" << options.height << "_" << options.num_views;
+		scene.dense_folder = folder.str();
+		SyntheticSceneOptions synth;
+		synth.num_views = options.num_views;
+		synth.width = options.width;
+		synth.height = options.height;
+		if (GenerateSyntheticScene(scene.dense_folder, synth) != 0) {
+			return -1;
+		}
+	}
+
+	GenerateSampleList(scene.dense_folder, scene.problems);
+	if (scene.problems.empty()) {
+		std::cout << "No problems in " << scene.dense_folder << "/pair.txt" << std::endl;
+		return -1;
+	}
+	// The reference and its sources, in pair.txt order
+	std::vector<int> ids(1, scene.problems[0].ref_image_id);
+	ids.insert(ids.end(), scene.problems[0].src_image_ids.begin(), scene.problems[0].src_image_ids.end());
+	for (const int id : ids) {
+		std::stringstream name;
+		name << std::setw(8) << std::setfill('0') << id;
+		cv::Mat image = cv::imread(scene.dense_folder + "/images/" + name.str() + ".jpg", cv::IMREAD_GRAYSCALE);
+		if (image.empty()) {
+			std::cout << "Can not read image " << name.str() << std::endl;
+			return -1;
+		}
+		Camera camera = ReadCamera(scene.dense_folder + "/cams/" + name.str() + "_cam.txt");
+		camera.width = image.cols;
+		camera.height = image.rows;
+		cv::Mat_<float> depth;
+		if (readDepthDmb(scene.dense_folder + "/depths_gt/" + name.str() + ".dmb", depth) != 0) {
+			// Real datasets have no ground truth; use a fronto-parallel plane
+			depth = cv::Mat_<float>(image.rows, image.cols, 0.5f * (camera.depth_min + camera.depth_max));
+		}
+		scene.images.push_back(image);
+		scene.cameras.push_back(camera);
+		scene.depths.push_back(depth);
+	}
+	scene.params.num_images = (int)scene.images.size();
+	scene.params.depth_min = scene.cameras[0].depth_min;
+	scene.params.depth_max = scene.cameras[0].depth_max;
+	return 0;
+}
+
+// Planes through the ground-truth depth of every step-th pixel with a random
+// tilt towards the camera
+static void SamplePlanes(const BenchScene& scene, const int step, std::vector<int2>& pixels, std::vector<float4>& planes)
+{
+	const Camera& camera = scene.cameras[0];
+	const cv::Mat_<float>& depth = scene.depths[0];
+	std::mt19937 rng(2333);
+	std::uniform_real_distribution<float> uniform(-0.3f, 0.3f);
+	for (int y = 0; y < camera.height; y += step) {
+		for (int x = 0; x < camera.width; x += step) {
+			const float d = depth(y, x) > 0.0f ? depth(y, x) : scene.params.depth_max;
+			float nx = uniform(rng);
+			float ny = uniform(rng);
+			float nz = -1.0f;
+			const float inv_norm = 1.0f / sqrtf(nx * nx + ny * ny + nz * nz);
+			nx *= inv_norm;
+			ny *= inv_norm;
+			nz *= inv_norm;
+			const float X = d * (x - camera.K[2]) / camera.K[0];
+			const float Y = d * (y - camera.K[5]) / camera.K[4];
+			pixels.push_back(make_int2(x, y));
+			planes.push_back(make_float4(nx, ny, nz, -(nx * X + ny * Y + nz * d)));
+		}
+	}
+}
+
+static bool Selected(const BenchOptions& options, const std::string& name)
+{
+	return options.filter.empty() || name.find(options.filter) != std::string::npos;
+}
+
+static void RunBenchmarks(const BenchOptions& options, const BenchScene& scene, std::vector<BenchResult>& results)
+{
+	const int repeats = options.repeats;
+	const Camera& ref_camera = scene.cameras[0];
+	const int width = ref_camera.width;
+	const int height = ref_camera.height;
+	const int num_images = scene.params.num_images;
+	const std::string scratch = scene.dense_folder + "/bench_scratch";
+	std::filesystem::create_directories(scratch);
+
+	std::vector<int2> pixels;
+	std::vector<float4> planes;
+	SamplePlanes(scene, 2, pixels, planes);
+	const int num_planes = (int)pixels.size();
+
+	std::vector<LayoutImage> layout_images(num_images);
+	for (int i = 0; i < num_images; ++i) {
+		layout_images[i].Create(scene.images[i], IMAGE_LAYOUT_ROW_MAJOR);
+	}
+	std::vector<ViewPairHomography> view_pairs;
+	ComputeViewPairHomographies(scene.cameras, view_pairs);
+
+	if (Selected(options, "homography")) {
+		std::vector<float2> points(num_planes);
+		results.push_back(Measure("homography", "homographies", num_planes, repeats, [&]() {
+#pragma omp parallel for
+			for (int k = 0; k < num_planes; ++k) {
+				float H[9];
+				ComputeHomography(view_pairs[1], planes[k], H);
+				points[k] = ComputeCorrespondingPoint(H, pixels[k]);
+			}
+		}));
+	}
+
+	// The kernels the sweeps run; the *_host variants time the host reference
+	// implementations and say nothing about device performance
+	const bool use_cuda = CudaDeviceAvailable();
+	if (Selected(options, "ncc") || Selected(options, "cost_vector")) {
+		if (!use_cuda) {
+			std::cout << "Skipping ncc and cost_vector: no CUDA device" << std::endl;
+		}
+		else if (Selected(options, "ncc")) {
+			results.push_back(MeasureDevice("ncc", "hypotheses", num_planes, repeats, [&]() {
+				return TimeBilateralNCC(scene.images, scene.cameras, pixels, planes, scene.params, false, 1);
+			}));
+		}
+		if (use_cuda && Selected(options, "cost_vector")) {
+			results.push_back(MeasureDevice("cost_vector", "hypotheses", num_planes, repeats, [&]() {
+				return TimeBilateralNCC(scene.images, scene.cameras, pixels, planes, scene.params, true, 1);
+			}));
+		}
+	}
+
+	if (Selected(options, "ncc_host")) {
+		std::vector<float> costs(num_planes);
+		results.push_back(Measure("ncc_host", "hypotheses", num_planes, repeats, [&]() {
+#pragma omp parallel for schedule(dynamic, 64)
+			for (int k = 0; k < num_planes; ++k) {
+				costs[k] = ComputeBilateralNCCHost(layout_images[0], layout_images[1], scene.cameras[1], view_pairs[1], pixels[k], planes[k], scene.params);
+			}
+		}));
+	}
+
+	if (Selected(options, "cost_vector_host")) {
+		std::vector<float> costs((size_t)num_planes * (num_images - 1));
+		results.push_back(Measure("cost_vector_host", "hypotheses", num_planes, repeats, [&]() {
+#pragma omp parallel for schedule(dynamic, 64)
+			for (int k = 0; k < num_planes; ++k) {
+				for (int i = 1; i < num_images; ++i) {
+					costs[(size_t)k * (num_images - 1) + i - 1] = ComputeBilateralNCCHost(layout_images[0], layout_images[i], scene.cameras[i], view_pairs[i], pixels[k], planes[k], scene.params);
+				}
+			}
+		}));
+	}
+
+	if (Selected(options, "top_k")) {
+		// Costs of the scene hypotheses, with some views at the maximum cost
+		const int num_views = num_images - 1;
+		std::vector<float> costs((size_t)num_planes * num_views);
+#pragma omp parallel for schedule(dynamic, 64)
+		for (int k = 0; k < num_planes; ++k) {
+			for (int i = 1; i < num_images; ++i) {
+				costs[(size_t)k * num_views + i - 1] = ComputeBilateralNCCHost(layout_images[0], layout_images[i], scene.cameras[i], view_pairs[i], pixels[k], planes[k], scene.params);
+			}
+		}
+		std::vector<float> aggregated(num_planes);
+		std::vector<unsigned int> selected_views(num_planes);
+		results.push_back(Measure("top_k", "hypotheses", num_planes, repeats, [&]() {
+			SelectTopKViewsHost(&costs[0], num_planes, num_views, scene.params.top_k, &aggregated[0], &selected_views[0]);
+		}));
+	}
+
+	if (Selected(options, "geom_cost")) {
+		// Every candidate against every source depth map, one batch per view
+		std::vector<ViewPairHomography> inverse_view_pairs;
+		ComputeInverseViewPairHomographies(scene.cameras, inverse_view_pairs);
+		std::vector<float> costs((size_t)num_planes * (num_images - 1));
+		results.push_back(Measure("geom_cost", "hypotheses", num_planes, repeats, [&]() {
+			for (int i = 1; i < num_images; ++i) {
+				ComputeGeomConsistencyCostsHost(scene.depths[i], view_pairs[i], inverse_view_pairs[i], &pixels[0], &planes[0], num_planes, &costs[(size_t)(i - 1) * num_planes]);
+			}
+		}));
+	}
+
+	if (Selected(options, "median_filter")) {
+		if (use_cuda) {
+			results.push_back(MeasureDevice("median_filter", "pixels", (double)width * height, repeats, [&]() {
+				return TimeCheckerboardFilter(ref_camera, scene.depths[0], 1);
+			}));
+		}
+		else {
+			std::cout << "Skipping median_filter: no CUDA device" << std::endl;
+		}
+	}
+
+	if (Selected(options, "median_filter_host")) {
+		const cv::Mat_<float> costs(height, width, 1.0f);
+		cv::Mat_<float> depth;
+		results.push_back(Measure("median_filter_host", "pixels", (double)width * height, repeats, [&]() {
+			scene.depths[0].copyTo(depth);
+			CheckerboardMedianFilter(costs, depth);
+		}));
+	}
+
+	if (Selected(options, "dmb_write")) {
+		results.push_back(Measure("dmb_write", "pixels", (double)width * height, repeats, [&]() {
+			writeDepthDmb(scratch + "/depth.dmb", scene.depths[0]);
+		}));
+	}
+
+	if (Selected(options, "dmb_read")) {
+		writeDepthDmb(scratch + "/depth.dmb", scene.depths[0]);
+		results.push_back(Measure("dmb_read", "pixels", (double)width * height, repeats, [&]() {
+			cv::Mat_<float> depth;
+			readDepthDmb(scratch + "/depth.dmb", depth);
+		}));
+	}
+
+	if (Selected(options, "edge_texture")) {
+		cv::Mat edges;
+		cv::Canny(scene.images[0], edges, 50, 150);
+		results.push_back(Measure("edge_texture", "pixels", (double)width * height, repeats, [&]() {
+			cv::Mat_<float> texture;
+			ComputeEdgeTexture(edges, texture);
+		}));
+	}
+
+	if (Selected(options, "ply_export")) {
+		std::vector<PointList> point_cloud;
+		for (int r = 0; r < height; ++r) {
+			for (int c = 0; c < width; ++c) {
+				const float depth = scene.depths[0](r, c);
+				if (depth <= 0.0f) {
+					continue;
+				}
+				PointList point;
+				point.coord = Get3DPointonWorld(c, r, depth, ref_camera);
+				point.normal = make_float3(0.0f, 0.0f, -1.0f);
+				point.color = make_float3(128.0f, 128.0f, 128.0f);
+				point_cloud.push_back(point);
+			}
+		}
+		results.push_back(Measure("ply_export", "points", (double)point_cloud.size(), repeats, [&]() {
+			ExportPointCloud(scratch + "/points.ply", point_cloud);
+		}));
+	}
+
+	if (Selected(options, "delaunay_planes") || Selected(options, "support_points")) {
+		HPM hpm;
+		hpm.InuputInitialization(scene.dense_folder, scene.problems, 0);
+
+		if (Selected(options, "delaunay_planes")) {
+			std::vector<cv::Point> support_points;
+			for (int r = 0; r < height; r += 5) {
+				for (int c = 0; c < width; c += 5) {
+					if (scene.depths[0](r, c) > 0.0f) {
+						support_points.push_back(cv::Point(c, r));
+					}
+				}
+			}
+			results.push_back(Measure("delaunay_planes", "support points", (double)support_points.size(), repeats, [&]() {
+				const std::vector<Triangle> triangles = hpm.DelaunayTriangulation(cv::Rect(0, 0, width, height), support_points);
+				std::vector<float4> plane_params(triangles.size());
+				for (size_t k = 0; k < triangles.size(); ++k) {
+					plane_params[k] = hpm.GetPriorPlaneParams(triangles[k], scene.depths[0]);
+				}
+			}));
+		}
+
+		if (Selected(options, "support_points")) {
+			cv::Mat_<float> costs(height, width);
+			cv::Mat_<float> confidences(height, width);
+			cv::Mat_<float> texture(height, width);
+			std::mt19937 rng(2333);
+			std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+			for (int r = 0; r < height; ++r) {
+				for (int c = 0; c < width; ++c) {
+					costs(r, c) = 0.3f * uniform(rng);
+					confidences(r, c) = uniform(rng);
+					texture(r, c) = uniform(rng);
+				}
+			}
+			results.push_back(Measure("support_points", "pixels", (double)width * height, repeats, [&]() {
+				std::vector<cv::Point> support_points;
+				hpm.GetSupportPoints_Classify_Check(support_points, costs, confidences, texture, 1.0f);
+			}));
+		}
+	}
+
+	if (Selected(options, "jbu") || Selected(options, "jbu_host")) {
+		cv::Mat_<float> guide;
+		scene.images[0].convertTo(guide, CV_32F);
+		cv::Mat_<float> src_depth;
+		cv::resize(scene.depths[0], src_depth, cv::Size(width / 2, height / 2), 0, 0, cv::INTER_NEAREST);
+		if (Selected(options, "jbu")) {
+			if (use_cuda) {
+				results.push_back(MeasureDevice("jbu", "pixels", (double)width * height, repeats, [&]() {
+					return TimeJBU(guide, src_depth, 2, 1);
+				}));
+			}
+			else {
+				std::cout << "Skipping jbu: no CUDA device" << std::endl;
+			}
+		}
+		if (Selected(options, "jbu_host")) {
+			results.push_back(Measure("jbu_host", "pixels", (double)width * height, repeats, [&]() {
+				cv::Mat_<float> dst_depth;
+				JBUHost(guide, src_depth, dst_depth, 2);
+			}));
+		}
+	}
+
+	if (Selected(options, "fusion_tile")) {
+		// Central tile of the reference against all its sources, with flat normals
+		const int tile = 256;
+		const cv::Rect rect = cv::Rect(std::max(0, width / 2 - tile / 2), std::max(0, height / 2 - tile / 2), std::min(tile, width), std::min(tile, height));
+		std::vector<NormalMap> normals(num_images);
+		std::vector<cv::Mat> masks(num_images);
+		for (int i = 0; i < num_images; ++i) {
+			normals[i].Set(cv::Mat_<cv::Vec3f>(height, width, cv::Vec3f(0.0f, 0.0f, -1.0f)), NORMAL_FLOAT);
+			masks[i] = cv::Mat::zeros(height, width, CV_8UC1);
+		}
+		std::vector<int> src_ids;
+		for (int i = 1; i < num_images; ++i) {
+			src_ids.push_back(i);
+		}
+		int num_fused = 0;
+		results.push_back(Measure("fusion_tile", "pixels", (double)rect.width * rect.height, repeats, [&]() {
+			num_fused = 0;
+			std::vector<int2> used_list(src_ids.size(), make_int2(-1, -1));
+			for (int r = rect.y; r < rect.y + rect.height; ++r) {
+				for (int c = rect.x; c < rect.x + rect.width; ++c) {
+					const float ref_depth = scene.depths[0](r, c);
+					if (ref_depth <= 0.0f) {
+						continue;
+					}
+					const float3 PointX = Get3DPointonWorld(c, r, ref_depth, ref_camera);
+					float dynamic_consistency = 0.0f;
+					const int num_consistent = CheckFusionConsistency(scene.cameras, scene.depths, normals, masks, src_ids, 0, r, c, PointX, ref_depth, normals[0].At(r, c), used_list, dynamic_consistency);
+					if (num_consistent >= 1 && dynamic_consistency > 0.3f * num_consistent) {
+						++num_fused;
+					}
+				}
+			}
+		}));
+	}
+
+	std::filesystem::remove_all(scratch);
+}
+
+static int WriteBenchJson(const std::string& path, const BenchOptions& options, const BenchScene& scene, const std::vector<BenchResult>& results)
+{
+	std::ofstream out(path);
+	if (!out.is_open()) {
+		std::cout << "Can not open " << path << std::endl;
+		return -1;
+	}
+	out << std::setprecision(9);
+	out << "{\"width\":" << scene.cameras[0].width << ",\"height\":" << scene.cameras[0].height << ",\"views\":" << scene.params.num_images
+		<< ",\"threads\":" << omp_get_max_threads() << ",\"pinned\":" << (options.pin ? "true" : "false") << ",\"repeats\":" << options.repeats << ",\"benchmarks\":[";
+	// One benchmark per line; ReadBaseline relies on it
+	for (size_t i = 0; i < results.size(); ++i) {
+		const BenchResult& result = results[i];
+		out << (i > 0 ? "," : "") << "\n{\"name\":\"" << result.name << "\",\"unit\":\"" << result.unit << "\",\"items\":" << result.items
+			<< ",\"seconds\":" << result.seconds << ",\"throughput\":" << result.throughput << "}";
+	}
+	out << "\n]}\n";
+	return 0;
+}
+
+static std::string JsonField(const std::string& line, const std::string& key)
+{
+	const std::string pattern = "\"" + key + "\":";
+	const size_t start = line.find(pattern);
+	if (start == std::string::npos) {
+		return "";
+	}
+	size_t begin = start + pattern.size();
+	size_t end = line.find_first_of(",}", begin);
+	std::string value = line.substr(begin, end - begin);
+	if (!value.empty() && value[0] == '"') {
+		value = value.substr(1, value.size() - 2);
+	}
+	return value;
+}
+
+// Throughputs by name from a file written by WriteBenchJson
+static int ReadBaseline(const std::string& path, std::map<std::string, double>& throughputs)
+{
+	std::ifstream in(path);
+	if (!in.is_open()) {
+		std::cout << "Can not open baseline " << path << std::endl;
+		return -1;
+	}
+	std::string line;
+	while (std::getline(in, line)) {
+		const std::string name = JsonField(line, "name");
+		const std::string throughput = JsonField(line, "throughput");
+		if (!name.empty() && !throughput.empty()) {
+			throughputs[name] = std::atof(throughput.c_str());
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	BenchOptions options;
+	for (int i = 1; i < argc; ++i) {
+		const std::string arg = argv[i];
+		const size_t eq = arg.find('=');
+		const std::string key = arg.substr(0, eq);
+		const std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+
+		bool ok = true;
+		if (key == "--data") {
+			options.dense_folder = value;
+		}
+		else if (key == "--size") {
+			ok = sscanf(value.c_str(), "%dx%d", &options.width, &options.height) == 2;
+		}
+		else if (key == "--views") {
+			options.num_views = std::atoi(value.c_str());
+			ok = options.num_views >= 2;
+		}
+		else if (key == "--repeats") {
+			options.repeats = std::atoi(value.c_str());
+			ok = options.repeats > 0;
+		}
+		else if (key == "--threads") {
+			options.threads = std::atoi(value.c_str());
+			ok = options.threads > 0;
+		}
+		else if (key == "--pin") {
+			options.pin = true;
+		}
+		else if (key == "--filter") {
+			options.filter = value;
+		}
+		else if (key == "--json") {
+			options.json_path = value;
+		}
+		else if (key == "--baseline") {
+			options.baseline_path = value;
+		}
+		else if (key == "--tolerance") {
+			options.tolerance = (float)std::atof(value.c_str());
+		}
+		else {
+			ok = false;
+		}
+
+		if (!ok) {
+			std::cout << "Invalid option: " << arg << std::endl;
+			std::cout << "USAGE: hpm_bench [options]" << std::endl;
+			std::cout << "  --data=<dense_folder>  benchmark on a dataset instead of a synthetic scene" << std::endl;
+			std::cout << "  --size=WxH             synthetic image size (default: 640x480)" << std::endl;
+			std::cout << "  --views=N              synthetic views (default: 5)" << std::endl;
+			std::cout << "  --repeats=N            timed runs per benchmark, the median is reported (default: 5)" << std::endl;
+			std::cout << "  --threads=N            OpenMP threads" << std::endl;
+			std::cout << "  --pin                  pin OpenMP threads to CPUs (Linux)" << std::endl;
+			std::cout << "  --filter=<substring>   run matching benchmarks only" << std::endl;
+			std::cout << "  --json=<path>          write the results as JSON" << std::endl;
+			std::cout << "  --baseline=<path>      compare against a JSON written by --json" << std::endl;
+			std::cout << "  --tolerance=F          allowed throughput loss against the baseline (default: 0.1)" << std::endl;
+			return -1;
+		}
+	}
+
+	if (options.threads > 0) {
+		omp_set_num_threads(options.threads);
+	}
+	if (options.pin) {
+		PinThreads();
+	}
+
+	BenchScene scene;
+	if (LoadScene(options, scene) != 0) {
+		return -1;
+	}
+
+	std::vector<BenchResult> results;
+	RunBenchmarks(options, scene, results);
+
+	std::map<std::string, double> baseline;
+	if (!options.baseline_path.empty() && ReadBaseline(options.baseline_path, baseline) != 0) {
+		return -1;
+	}
+
+	int num_regressions = 0;
+	std::cout << "hpm_bench " << scene.cameras[0].width << "x" << scene.cameras[0].height << ", " << scene.params.num_images << " views, " << omp_get_max_threads() << " threads" << std::endl;
+	for (const BenchResult& result : results) {
+		std::cout << "  " << std::setw(16) << std::left << result.name << std::right << std::fixed << std::setprecision(3) << std::setw(10) << result.seconds * 1000.0 << " ms  "
+			<< std::setprecision(2) << std::setw(12) << result.throughput / 1e6 << " M" << result.unit << "/s";
+		auto it = baseline.find(result.name);
+		if (it != baseline.end() && it->second > 0.0) {
+			const double ratio = result.throughput / it->second;
+			const bool regression = ratio < 1.0 - options.tolerance;
+			num_regressions += regression ? 1 : 0;
+			std::cout << "  x" << std::setprecision(3) << ratio << " vs baseline" << (regression ? "  REGRESSION" : "");
+		}
+		std::cout << std::endl;
+	}
+
+	if (!options.json_path.empty() && WriteBenchJson(options.json_path, options, scene, results) != 0) {
+		return -1;
+	}
+	// Non-zero exit lets scripts gate on the baseline comparison
+	return num_regressions > 0 ? 1 : 0;
+}
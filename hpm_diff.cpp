@@ -0,0 +1,227 @@
+#include "DepthDiff.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <omp.h>
+
+struct DiffBounds {
+    float max_above_tolerance = 0.001f; // fraction of pixels valid in both
+    float max_mean_rel_error = 0.001f;
+    float min_valid_agreement = 0.999f;
+    float max_normal_p99 = 5.0f; // degrees
+};
+
+static bool IsDirectory(const std::string& path)
+{
+	struct stat info;
+	return stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+// Accepts a dense folder or its HPM_MVS_plusplus result folder
+static std::string ResultFolder(const std::string& folder)
+{
+	return IsDirectory(folder + "/HPM_MVS_plusplus") ? folder + "/HPM_MVS_plusplus" : folder;
+}
+
+static std::vector<std::string> ListViewFolders(const std::string& folder)
+{
+	std::vector<std::string> names;
+	DIR* dir = opendir(folder.c_str());
+	if (!dir) {
+		return names;
+	}
+	for (struct dirent* entry = readdir(dir); entry; entry = readdir(dir)) {
+		const std::string name = entry->d_name;
+		if (name.compare(0, 5, "2333_") == 0 && IsDirectory(folder + "/" + name)) {
+			names.push_back(name);
+		}
+	}
+	closedir(dir);
+	std::sort(names.begin(), names.end());
+	return names;
+}
+
+static double Ratio(const double a, const long long b)
+{
+	return b > 0 ? a / b : 0.0;
+}
+
+static void PrintDiffLine(const std::string& name, const DepthDiffStats& stats)
+{
+	std::cout << std::setw(14) << std::left << name << std::right << std::scientific << std::setprecision(2)
+		<< std::setw(10) << Ratio(stats.sum_abs_error, stats.both_valid) << std::setw(10) << stats.max_abs_error
+		<< std::setw(10) << Ratio(stats.sum_rel_error, stats.both_valid) << std::setw(10) << stats.max_rel_error
+		<< std::fixed << std::setprecision(4) << std::setw(10) << Ratio(stats.above_tolerance, stats.both_valid)
+		<< std::setw(10) << Ratio(stats.valid_agree, stats.pixels)
+		<< std::setprecision(2) << std::setw(9) << Ratio(stats.sum_angle, stats.normal_pixels)
+		<< std::setw(9) << DepthDiffAnglePercentile(stats, 0.5f) << std::setw(9) << DepthDiffAnglePercentile(stats, 0.9f)
+		<< std::setw(9) << DepthDiffAnglePercentile(stats, 0.99f) << std::endl;
+}
+
+static void WriteDiffJsonObject(std::ofstream& out, const DepthDiffStats& stats)
+{
+	out << "{\"pixels\":" << stats.pixels << ",\"old_valid\":" << stats.old_valid << ",\"new_valid\":" << stats.new_valid << ",\"both_valid\":" << stats.both_valid
+		<< ",\"valid_agreement\":" << Ratio(stats.valid_agree, stats.pixels)
+		<< ",\"mean_abs_error\":" << Ratio(stats.sum_abs_error, stats.both_valid) << ",\"max_abs_error\":" << stats.max_abs_error
+		<< ",\"mean_rel_error\":" << Ratio(stats.sum_rel_error, stats.both_valid) << ",\"max_rel_error\":" << stats.max_rel_error
+		<< ",\"above_tolerance\":" << Ratio(stats.above_tolerance, stats.both_valid)
+		<< ",\"normal_mean_deg\":" << Ratio(stats.sum_angle, stats.normal_pixels) << ",\"normal_p50_deg\":" << DepthDiffAnglePercentile(stats, 0.5f)
+		<< ",\"normal_p90_deg\":" << DepthDiffAnglePercentile(stats, 0.9f) << ",\"normal_p99_deg\":" << DepthDiffAnglePercentile(stats, 0.99f)
+		<< ",\"normal_max_deg\":" << DepthDiffAnglePercentile(stats, 1.0f) << "}";
+}
+
+// Compares the depth and normal maps of two result trees, e.g. before and
+// after a kernel change
+int main(int argc, char** argv)
+{
+	if (argc < 3) {
+		std::cout << "USAGE: hpm_diff old_folder new_folder [options]" << std::endl;
+		std::cout << "  folders are dense folders or their HPM_MVS_plusplus result folders" << std::endl;
+		std::cout << "  --depth-file=<name>     depth map in each view folder (default: depths_geom.dmb)" << std::endl;
+		std::cout << "  --normal-file=<name>    normal map, float or octahedral; empty to skip (default: normals.dmb)" << std::endl;
+		std::cout << "  --tolerance=F           relative depth error counted as above tolerance (default: 0.01)" << std::endl;
+		std::cout << "  --max-above=F           fail if more pixels are above tolerance (default: 0.001)" << std::endl;
+		std::cout << "  --max-mean-rel=F        fail above this mean relative depth error (default: 0.001)" << std::endl;
+		std::cout << "  --min-agreement=F       fail below this fraction of pixels with matching validity (default: 0.999)" << std::endl;
+		std::cout << "  --max-normal-p99=DEG    fail above this 99th percentile normal angle (default: 5)" << std::endl;
+		std::cout << "  --threads=N             OpenMP threads" << std::endl;
+		std::cout << "  --json=<path>           also write per-view and total statistics as JSON" << std::endl;
+		return -1;
+	}
+
+	const std::string old_folder = ResultFolder(argv[1]);
+	const std::string new_folder = ResultFolder(argv[2]);
+	DepthDiffOptions options;
+	DiffBounds bounds;
+	std::string json_path;
+	for (int i = 3; i < argc; ++i) {
+		const std::string arg = argv[i];
+		const size_t eq = arg.find('=');
+		const std::string key = arg.substr(0, eq);
+		const std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+
+		bool ok = eq != std::string::npos;
+		if (key == "--depth-file") {
+			options.depth_file = value;
+			ok = ok && !value.empty();
+		}
+		else if (key == "--normal-file") {
+			options.normal_file = value;
+		}
+		else if (key == "--tolerance") {
+			options.relative_tolerance = (float)std::atof(value.c_str());
+		}
+		else if (key == "--max-above") {
+			bounds.max_above_tolerance = (float)std::atof(value.c_str());
+		}
+		else if (key == "--max-mean-rel") {
+			bounds.max_mean_rel_error = (float)std::atof(value.c_str());
+		}
+		else if (key == "--min-agreement") {
+			bounds.min_valid_agreement = (float)std::atof(value.c_str());
+		}
+		else if (key == "--max-normal-p99") {
+			bounds.max_normal_p99 = (float)std::atof(value.c_str());
+		}
+		else if (key == "--threads") {
+			const int threads = std::atoi(value.c_str());
+			ok = ok && threads > 0;
+			if (ok) {
+				omp_set_num_threads(threads);
+			}
+		}
+		else if (key == "--json") {
+			json_path = value;
+		}
+		else {
+			ok = false;
+		}
+
+		if (!ok) {
+			std::cout << "Invalid option: " << arg << std::endl;
+			return -1;
+		}
+	}
+
+	const std::vector<std::string> views = ListViewFolders(old_folder);
+	if (views.empty()) {
+		std::cout << "No view folders in " << old_folder << std::endl;
+		return -1;
+	}
+	const std::vector<std::string> new_views = ListViewFolders(new_folder);
+	int num_failed = 0;
+	for (const std::string& name : new_views) {
+		if (!std::binary_search(views.begin(), views.end(), name)) {
+			std::cout << name << " only exists in " << new_folder << std::endl;
+			++num_failed;
+		}
+	}
+
+	const int num_views = (int)views.size();
+	std::vector<DepthDiffStats> stats(num_views);
+	std::vector<int> status(num_views);
+#pragma omp parallel for schedule(dynamic)
+	for (int i = 0; i < num_views; ++i) {
+		status[i] = DiffViewFolder(old_folder + "/" + views[i], new_folder + "/" + views[i], options, stats[i]);
+	}
+
+	DepthDiffStats total;
+	std::cout << "view          mean_abs   max_abs  mean_rel   max_rel  >tol      agree   n_mean    n_p50    n_p90    n_p99" << std::endl;
+	for (int i = 0; i < num_views; ++i) {
+		if (status[i] != 0) {
+			std::cout << std::setw(14) << std::left << views[i] << std::right << "failed to compare" << std::endl;
+			++num_failed;
+			continue;
+		}
+		MergeDepthDiff(total, stats[i]);
+		PrintDiffLine(views[i], stats[i]);
+	}
+	PrintDiffLine("total", total);
+
+	const double above = Ratio(total.above_tolerance, total.both_valid);
+	const double mean_rel = Ratio(total.sum_rel_error, total.both_valid);
+	const double agreement = Ratio(total.valid_agree, total.pixels);
+	const float normal_p99 = DepthDiffAnglePercentile(total, 0.99f);
+	bool pass = num_failed == 0;
+	if (above > bounds.max_above_tolerance) {
+		std::cout << "FAIL: " << above << " of the pixels above tolerance (bound " << bounds.max_above_tolerance << ")" << std::endl;
+		pass = false;
+	}
+	if (mean_rel > bounds.max_mean_rel_error) {
+		std::cout << "FAIL: mean relative depth error " << mean_rel << " (bound " << bounds.max_mean_rel_error << ")" << std::endl;
+		pass = false;
+	}
+	if (agreement < bounds.min_valid_agreement) {
+		std::cout << "FAIL: valid-pixel agreement " << agreement << " (bound " << bounds.min_valid_agreement << ")" << std::endl;
+		pass = false;
+	}
+	if (normal_p99 > bounds.max_normal_p99) {
+		std::cout << "FAIL: 99th percentile normal angle " << normal_p99 << " degrees (bound " << bounds.max_normal_p99 << ")" << std::endl;
+		pass = false;
+	}
+	if (num_failed > 0) {
+		std::cout << "FAIL: " << num_failed << " views could not be compared" << std::endl;
+	}
+	std::cout << (pass ? "PASS" : "FAIL") << std::endl;
+
+	if (!json_path.empty()) {
+		std::ofstream out(json_path);
+		if (!out.is_open()) {
+			std::cout << "Can not open " << json_path << std::endl;
+			return -1;
+		}
+		out << std::setprecision(9) << "{\"pass\":" << (pass ? "true" : "false") << ",\"failed_views\":" << num_failed << ",\"total\":";
+		WriteDiffJsonObject(out, total);
+		out << ",\"views\":{";
+		bool first = true;
+		for (int i = 0; i < num_views; ++i) {
+			if (status[i] == 0) {
+				out << (first ? "" : ",") << "\n\"" << views[i] << "\":";
+				WriteDiffJsonObject(out, stats[i]);
+				first = false;
+			}
+		}
+		out << "\n}}\n";
+	}
+	return pass ? 0 : 1;
+}
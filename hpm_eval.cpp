@@ -0,0 +1,128 @@
+#include "PointCloudEval.h"
+
+#include <chrono>
+#include <omp.h>
+
+static int WriteEvaluationJson(const std::string& path, const PointCloudEvaluation& evaluation)
+{
+	std::ofstream out(path);
+	if (!out.is_open()) {
+		std::cout << "Can not open " << path << std::endl;
+		return -1;
+	}
+	out << std::setprecision(9);
+	out << "{\"points\":" << evaluation.num_points << ",\"gt_points\":" << evaluation.num_gt_points
+		<< ",\"mean_accuracy_distance\":" << evaluation.mean_accuracy_distance << ",\"median_accuracy_distance\":" << evaluation.median_accuracy_distance
+		<< ",\"mean_completeness_distance\":" << evaluation.mean_completeness_distance << ",\"median_completeness_distance\":" << evaluation.median_completeness_distance
+		<< ",\"thresholds\":[";
+	for (size_t i = 0; i < evaluation.metrics.size(); ++i) {
+		const PointCloudMetrics& metrics = evaluation.metrics[i];
+		out << (i > 0 ? "," : "") << "\n{\"threshold\":" << metrics.threshold << ",\"accuracy\":" << metrics.accuracy
+			<< ",\"completeness\":" << metrics.completeness << ",\"f_score\":" << metrics.f_score << "}";
+	}
+	out << "\n]}\n";
+	return 0;
+}
+
+// Scores a fused point cloud against a ground-truth cloud or mesh vertices
+int main(int argc, char** argv)
+{
+	if (argc < 2) {
+		std::cout << "USAGE: hpm_eval fused.ply [options]" << std::endl;
+		std::cout << "  --gt=<ply>                  ground-truth points or mesh samples" << std::endl;
+		std::cout << "  --gt-dense=<dense_folder>   back-project depths_gt/*.dmb instead (see hpm_synth)" << std::endl;
+		std::cout << "  --gt-step=N                 pixel step for --gt-dense (default: 1)" << std::endl;
+		std::cout << "  --thresholds=t1,t2,...      distance thresholds in scene units (default: 0.01,0.02,0.05,0.1,0.2,0.5)" << std::endl;
+		std::cout << "  --threads=N                 OpenMP threads" << std::endl;
+		std::cout << "  --json=<path>               also write the results as JSON" << std::endl;
+		return -1;
+	}
+
+	const std::string ply_path = argv[1];
+	std::string gt_path;
+	std::string gt_dense_folder;
+	std::string json_path;
+	int gt_step = 1;
+	std::vector<float> thresholds = { 0.01f, 0.02f, 0.05f, 0.1f, 0.2f, 0.5f };
+	for (int i = 2; i < argc; ++i) {
+		const std::string arg = argv[i];
+		const size_t eq = arg.find('=');
+		const std::string key = arg.substr(0, eq);
+		const std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+
+		bool ok = eq != std::string::npos;
+		if (key == "--gt") {
+			gt_path = value;
+		}
+		else if (key == "--gt-dense") {
+			gt_dense_folder = value;
+		}
+		else if (key == "--gt-step") {
+			gt_step = std::atoi(value.c_str());
+			ok = ok && gt_step > 0;
+		}
+		else if (key == "--thresholds") {
+			thresholds.clear();
+			std::stringstream list(value);
+			std::string item;
+			while (std::getline(list, item, ',')) {
+				thresholds.push_back((float)std::atof(item.c_str()));
+				ok = ok && thresholds.back() > 0.0f;
+			}
+			ok = ok && !thresholds.empty();
+		}
+		else if (key == "--threads") {
+			const int threads = std::atoi(value.c_str());
+			ok = ok && threads > 0;
+			if (ok) {
+				omp_set_num_threads(threads);
+			}
+		}
+		else if (key == "--json") {
+			json_path = value;
+		}
+		else {
+			ok = false;
+		}
+
+		if (!ok) {
+			std::cout << "Invalid option: " << arg << std::endl;
+			return -1;
+		}
+	}
+	if (gt_path.empty() == gt_dense_folder.empty()) {
+		std::cout << "Exactly one of --gt and --gt-dense is required" << std::endl;
+		return -1;
+	}
+
+	const auto t0 = std::chrono::steady_clock::now();
+	std::vector<float3> points;
+	std::vector<float3> gt_points;
+	if (ReadPointCloudPly(ply_path, points) != 0) {
+		return -1;
+	}
+	if (!gt_path.empty() ? ReadPointCloudPly(gt_path, gt_points) != 0 : ReadGroundTruthDepths(gt_dense_folder, gt_step, gt_points) != 0) {
+		return -1;
+	}
+	const auto t1 = std::chrono::steady_clock::now();
+
+	PointCloudEvaluation evaluation;
+	EvaluatePointCloud(points, gt_points, thresholds, evaluation);
+	const auto t2 = std::chrono::steady_clock::now();
+
+	std::cout << evaluation.num_points << " points against " << evaluation.num_gt_points << " ground-truth points (load "
+		<< std::fixed << std::setprecision(2) << std::chrono::duration<double>(t1 - t0).count() << " s, evaluate "
+		<< std::chrono::duration<double>(t2 - t1).count() << " s)" << std::endl;
+	std::cout << std::setprecision(4) << "accuracy distance mean " << evaluation.mean_accuracy_distance << ", median " << evaluation.median_accuracy_distance << std::endl;
+	std::cout << "completeness distance mean " << evaluation.mean_completeness_distance << ", median " << evaluation.median_completeness_distance << std::endl;
+	std::cout << "  threshold  accuracy  completeness  F-score" << std::endl;
+	for (const PointCloudMetrics& metrics : evaluation.metrics) {
+		std::cout << "  " << std::setw(9) << metrics.threshold << std::setprecision(2) << std::setw(9) << metrics.accuracy * 100.0f << "%"
+			<< std::setw(13) << metrics.completeness * 100.0f << "%" << std::setw(8) << metrics.f_score * 100.0f << "%" << std::setprecision(4) << std::endl;
+	}
+
+	if (!json_path.empty() && WriteEvaluationJson(json_path, evaluation) != 0) {
+		return -1;
+	}
+	return 0;
+}
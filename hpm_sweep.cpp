@@ -0,0 +1,367 @@
+#include "PointCloudEval.h"
+
+#include <chrono>
+#include <filesystem>
+
+// One swept PipelineOptions flag and its values; an axis with no values keeps
+// the pipeline default
+struct SweepAxis {
+    std::string flag;
+    std::vector<std::string> values;
+};
+
+struct SweepRun {
+    std::string settings; // flags passed to the pipeline
+    bool ok;
+    double seconds;
+    size_t peak_host_bytes;
+    size_t peak_device_bytes;
+    PointCloudEvaluation evaluation;
+    bool pareto;
+};
+
+static std::string Quote(const std::string& text)
+{
+	return "'" + text + "'";
+}
+
+// Same pixel rectangle in every view: images and masks are cropped and the
+// principal points shifted
+static int PrepareCroppedScene(const std::string& dense_folder, const std::string& work_folder, const cv::Rect& roi)
+{
+	const char* image_dirs[2] = { "images", "masks" };
+	for (const char* dir : image_dirs) {
+		const std::string src_folder = dense_folder + "/" + dir;
+		if (!std::filesystem::is_directory(src_folder)) {
+			continue;
+		}
+		std::filesystem::create_directories(work_folder + "/" + dir);
+		for (const auto& entry : std::filesystem::directory_iterator(src_folder)) {
+			cv::Mat image = cv::imread(entry.path().string(), cv::IMREAD_UNCHANGED);
+			if (image.empty()) {
+				continue;
+			}
+			const cv::Rect rect = roi & cv::Rect(0, 0, image.cols, image.rows);
+			if (rect.width < 16 || rect.height < 16) {
+				std::cout << "ROI leaves less than 16x16 pixels of " << entry.path().string() << std::endl;
+				return -1;
+			}
+			// Full quality so the crop does not add compression noise
+			std::vector<int> params = { cv::IMWRITE_JPEG_QUALITY, 100 };
+			if (!cv::imwrite(work_folder + "/" + dir + "/" + entry.path().filename().string(), image(rect), params)) {
+				std::cout << "Can not write the cropped " << entry.path().filename().string() << std::endl;
+				return -1;
+			}
+		}
+	}
+
+	std::filesystem::create_directories(work_folder + "/cams");
+	for (const auto& entry : std::filesystem::directory_iterator(dense_folder + "/cams")) {
+		Camera camera = ReadCamera(entry.path().string());
+		camera.K[2] -= roi.x;
+		camera.K[5] -= roi.y;
+		if (WriteCamera(work_folder + "/cams/" + entry.path().filename().string(), camera) != 0) {
+			return -1;
+		}
+	}
+	std::filesystem::copy_file(dense_folder + "/pair.txt", work_folder + "/pair.txt", std::filesystem::copy_options::overwrite_existing);
+	return 0;
+}
+
+// Links the inputs so runs write their results into the work folder only
+static int PrepareLinkedScene(const std::string& dense_folder, const std::string& work_folder)
+{
+	const char* entries[4] = { "images", "cams", "masks", "pair.txt" };
+	for (const char* entry : entries) {
+		const std::filesystem::path src = std::filesystem::absolute(dense_folder + "/" + entry);
+		const std::filesystem::path dst = work_folder + "/" + entry;
+		if (!std::filesystem::exists(src) || std::filesystem::exists(std::filesystem::symlink_status(dst))) {
+			continue;
+		}
+		std::error_code error;
+		std::filesystem::create_symlink(src, dst, error);
+		if (error) {
+			std::cout << "Can not link " << dst.string() << ": " << error.message() << std::endl;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Keeps the ground-truth points that project into the ROI of at least one view
+static void FilterToRoi(const std::string& dense_folder, const cv::Rect& roi, std::vector<float3>& points)
+{
+	std::vector<Camera> cameras;
+	for (const auto& entry : std::filesystem::directory_iterator(dense_folder + "/cams")) {
+		cameras.push_back(ReadCamera(entry.path().string()));
+	}
+	std::vector<char> keep(points.size(), 0);
+#pragma omp parallel for
+	for (long long i = 0; i < (long long)points.size(); ++i) {
+		for (const Camera& camera : cameras) {
+			float2 pt;
+			float depth;
+			ProjectonCamera(points[i], camera, pt, depth);
+			if (depth > 0.0f && roi.contains(cv::Point((int)pt.x, (int)pt.y))) {
+				keep[i] = 1;
+				break;
+			}
+		}
+	}
+	size_t num_kept = 0;
+	for (size_t i = 0; i < points.size(); ++i) {
+		if (keep[i]) {
+			points[num_kept++] = points[i];
+		}
+	}
+	points.resize(num_kept);
+}
+
+// Total host and device high-water bytes from a --memory-report JSON
+static void ReadPeakMemory(const std::string& path, size_t& host_bytes, size_t& device_bytes)
+{
+	host_bytes = 0;
+	device_bytes = 0;
+	std::ifstream in(path);
+	std::stringstream buffer;
+	buffer << in.rdbuf();
+	const std::string text = buffer.str();
+	const size_t peak = text.find("\"peak\":{\"host\":");
+	if (peak == std::string::npos) {
+		return;
+	}
+	unsigned long long host = 0, device = 0;
+	if (sscanf(text.c_str() + peak, "\"peak\":{\"host\":%llu,\"device\":%llu", &host, &device) == 2) {
+		host_bytes = host;
+		device_bytes = device;
+	}
+}
+
+// A run is Pareto-optimal if no other run is at least as fast, as small and
+// as accurate, and strictly better in one of them
+static void MarkPareto(std::vector<SweepRun>& runs)
+{
+	for (SweepRun& run : runs) {
+		run.pareto = run.ok;
+		if (!run.ok) {
+			continue;
+		}
+		const size_t bytes = run.peak_host_bytes + run.peak_device_bytes;
+		const float f_score = run.evaluation.metrics[0].f_score;
+		for (const SweepRun& other : runs) {
+			if (&other == &run || !other.ok) {
+				continue;
+			}
+			const size_t other_bytes = other.peak_host_bytes + other.peak_device_bytes;
+			const float other_f_score = other.evaluation.metrics[0].f_score;
+			const bool no_worse = other.seconds <= run.seconds && other_bytes <= bytes && other_f_score >= f_score;
+			const bool better = other.seconds < run.seconds || other_bytes < bytes || other_f_score > f_score;
+			if (no_worse && better) {
+				run.pareto = false;
+				break;
+			}
+		}
+	}
+}
+
+static void PrintRun(const SweepRun& run)
+{
+	std::cout << std::fixed << std::setprecision(1) << std::setw(9) << run.seconds << std::setw(10) << run.peak_host_bytes / 1048576.0
+		<< std::setw(10) << run.peak_device_bytes / 1048576.0;
+	if (run.ok) {
+		const PointCloudMetrics& metrics = run.evaluation.metrics[0];
+		std::cout << std::setprecision(2) << std::setw(8) << metrics.f_score * 100.0f << std::setw(8) << metrics.accuracy * 100.0f << std::setw(8) << metrics.completeness * 100.0f;
+	}
+	else {
+		std::cout << "  failed                ";
+	}
+	std::cout << (run.pareto ? "  * " : "    ") << run.settings << std::endl;
+}
+
+// Runs the pipeline over a grid of settings and reports the Pareto-optimal
+// trade-offs between wall time, peak memory and F-score
+int main(int argc, char** argv)
+{
+	if (argc < 2) {
+		std::cout << "USAGE: hpm_sweep dense_folder [options]" << std::endl;
+		std::cout << "  --patch-size=a,b,...         values to sweep; also --radius-increment, --top-k, --iterations," << std::endl;
+		std::cout << "                               --geom-iterations, --max-image-size and --scale-size-bound" << std::endl;
+		std::cout << "  --roi=x,y,w,h                crop every view to this rectangle" << std::endl;
+		std::cout << "  --gt=<ply>                   ground truth points (default: depths_gt of dense_folder, see hpm_synth)" << std::endl;
+		std::cout << "  --threshold=F                F-score distance threshold in scene units (default: 0.05)" << std::endl;
+		std::cout << "  --mask                       run with sky masks" << std::endl;
+		std::cout << "  --exe=<path>                 pipeline executable (default: HPM-MVS_plusplus next to hpm_sweep)" << std::endl;
+		std::cout << "  --work=<folder>              scene copy and results (default: dense_folder/sweep)" << std::endl;
+		std::cout << "  --csv=<path>                 also write every run as CSV" << std::endl;
+		return -1;
+	}
+
+	const std::string dense_folder = argv[1];
+	std::string work_folder = dense_folder + "/sweep";
+	std::string exe_path = (std::filesystem::path(argv[0]).parent_path() / "HPM-MVS_plusplus").string();
+	std::string gt_path;
+	std::string csv_path;
+	float threshold = 0.05f;
+	bool mask = false;
+	bool use_roi = false;
+	cv::Rect roi;
+	std::vector<SweepAxis> axes;
+	const char* axis_flags[7] = { "--patch-size", "--radius-increment", "--top-k", "--iterations", "--geom-iterations", "--max-image-size", "--scale-size-bound" };
+	for (const char* flag : axis_flags) {
+		SweepAxis axis;
+		axis.flag = flag;
+		axes.push_back(axis);
+	}
+
+	for (int i = 2; i < argc; ++i) {
+		const std::string arg = argv[i];
+		const size_t eq = arg.find('=');
+		const std::string key = arg.substr(0, eq);
+		const std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+
+		bool ok = eq != std::string::npos;
+		SweepAxis* axis = NULL;
+		for (SweepAxis& candidate : axes) {
+			if (key == candidate.flag) {
+				axis = &candidate;
+			}
+		}
+		if (axis) {
+			std::stringstream list(value);
+			std::string item;
+			while (std::getline(list, item, ',')) {
+				axis->values.push_back(item);
+			}
+			ok = ok && !axis->values.empty();
+		}
+		else if (key == "--roi") {
+			ok = ok && sscanf(value.c_str(), "%d,%d,%d,%d", &roi.x, &roi.y, &roi.width, &roi.height) == 4 && roi.width > 0 && roi.height > 0;
+			use_roi = true;
+		}
+		else if (key == "--gt") {
+			gt_path = value;
+		}
+		else if (key == "--threshold") {
+			threshold = (float)std::atof(value.c_str());
+			ok = ok && threshold > 0.0f;
+		}
+		else if (key == "--mask") {
+			mask = true;
+			ok = true;
+		}
+		else if (key == "--exe") {
+			exe_path = value;
+		}
+		else if (key == "--work") {
+			work_folder = value;
+		}
+		else if (key == "--csv") {
+			csv_path = value;
+		}
+		else {
+			ok = false;
+		}
+
+		if (!ok) {
+			std::cout << "Invalid option: " << arg << std::endl;
+			return -1;
+		}
+	}
+
+	std::vector<float3> gt_points;
+	if (!gt_path.empty() ? ReadPointCloudPly(gt_path, gt_points) != 0 : ReadGroundTruthDepths(dense_folder, 1, gt_points) != 0) {
+		return -1;
+	}
+	std::filesystem::create_directories(work_folder);
+	if (use_roi) {
+		FilterToRoi(dense_folder, roi, gt_points);
+		if (PrepareCroppedScene(dense_folder, work_folder, roi) != 0) {
+			return -1;
+		}
+	}
+	else if (PrepareLinkedScene(dense_folder, work_folder) != 0) {
+		return -1;
+	}
+	std::cout << gt_points.size() << " ground-truth points" << std::endl;
+
+	// Cartesian product of the axes; index[a] walks axis a like an odometer
+	std::vector<SweepRun> runs;
+	std::vector<size_t> index(axes.size(), 0);
+	const std::string memory_path = work_folder + "/sweep_memory.json";
+	const std::string ply_path = work_folder + "/HPM_MVS_plusplus/" + (mask ? "HPM_MVS_plusplus_mask.ply" : "HPM_MVS_plusplus.ply");
+	while (true) {
+		SweepRun run;
+		for (size_t a = 0; a < axes.size(); ++a) {
+			if (!axes[a].values.empty()) {
+				run.settings += (run.settings.empty() ? "" : " ") + axes[a].flag + "=" + axes[a].values[index[a]];
+			}
+		}
+		std::filesystem::remove_all(work_folder + "/HPM_MVS_plusplus");
+		std::filesystem::remove(memory_path);
+		const std::string command = Quote(exe_path) + " " + Quote(work_folder) + (mask ? " true " : " ") + run.settings + " --memory-report=" + Quote(memory_path) + " > " + Quote(work_folder + "/sweep_run.log") + " 2>&1";
+		std::cout << "Run " << runs.size() + 1 << ": " << (run.settings.empty() ? "defaults" : run.settings) << std::endl;
+
+		const auto t0 = std::chrono::steady_clock::now();
+		const int status = std::system(command.c_str());
+		run.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+		ReadPeakMemory(memory_path, run.peak_host_bytes, run.peak_device_bytes);
+
+		std::vector<float3> points;
+		run.ok = status == 0 && ReadPointCloudPly(ply_path, points) == 0;
+		if (run.ok) {
+			EvaluatePointCloud(points, gt_points, std::vector<float>(1, threshold), run.evaluation);
+		}
+		else {
+			std::cout << "Run failed, see " << work_folder << "/sweep_run.log" << std::endl;
+		}
+		runs.push_back(run);
+
+		size_t a = 0;
+		while (a < axes.size() && (axes[a].values.empty() || ++index[a] == axes[a].values.size())) {
+			index[a] = 0;
+			++a;
+		}
+		if (a == axes.size()) {
+			break;
+		}
+	}
+
+	MarkPareto(runs);
+	std::cout << "   time_s   host_MB    dev_MB  F_score    acc   compl    settings (* Pareto-optimal, F-score at " << threshold << ")" << std::endl;
+	for (const SweepRun& run : runs) {
+		PrintRun(run);
+	}
+
+	std::vector<const SweepRun*> pareto;
+	for (const SweepRun& run : runs) {
+		if (run.pareto) {
+			pareto.push_back(&run);
+		}
+	}
+	std::sort(pareto.begin(), pareto.end(), [](const SweepRun* a, const SweepRun* b) { return a->seconds < b->seconds; });
+	std::cout << std::endl << "Pareto-optimal configurations, fastest first:" << std::endl;
+	for (const SweepRun* run : pareto) {
+		PrintRun(*run);
+	}
+
+	if (!csv_path.empty()) {
+		std::ofstream csv(csv_path);
+		if (!csv.is_open()) {
+			std::cout << "Can not open " << csv_path << std::endl;
+			return -1;
+		}
+		csv << "settings,ok,seconds,peak_host_bytes,peak_device_bytes,threshold,f_score,accuracy,completeness,pareto" << std::endl;
+		for (const SweepRun& run : runs) {
+			csv << "\"" << run.settings << "\"," << run.ok << "," << run.seconds << "," << run.peak_host_bytes << "," << run.peak_device_bytes << "," << threshold;
+			if (run.ok) {
+				const PointCloudMetrics& metrics = run.evaluation.metrics[0];
+				csv << "," << metrics.f_score << "," << metrics.accuracy << "," << metrics.completeness;
+			}
+			else {
+				csv << ",,,";
+			}
+			csv << "," << run.pareto << std::endl;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,69 @@
+#include "SyntheticScene.h"
+
+// Writes a procedural dense folder that HPM-MVS_plusplus can run on directly
+int main(int argc, char** argv)
+{
+	if (argc < 2) {
+		std::cout << "USAGE: hpm_synth dense_folder [options]" << std::endl;
+		std::cout << "  --views=N        number of cameras (default: 8)" << std::endl;
+		std::cout << "  --width=W        image width (default: 640)" << std::endl;
+		std::cout << "  --height=H       image height (default: 480)" << std::endl;
+		std::cout << "  --sources=K      source views per reference in pair.txt (default: 10)" << std::endl;
+		std::cout << "  --arc=DEG        angle between the outermost cameras (default: 40)" << std::endl;
+		std::cout << "  --fov=DEG        horizontal field of view (default: 60)" << std::endl;
+		std::cout << "  --seed=S         texture seed (default: 2333)" << std::endl;
+		std::cout << "  --masks          also write sky masks for the masked fusion" << std::endl;
+		return -1;
+	}
+
+	const std::string dense_folder = argv[1];
+	SyntheticSceneOptions options;
+	for (int i = 2; i < argc; ++i) {
+		const std::string arg = argv[i];
+		const size_t eq = arg.find('=');
+		const std::string key = arg.substr(0, eq);
+		const std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+
+		bool ok = true;
+		if (key == "--views") {
+			options.num_views = std::atoi(value.c_str());
+		}
+		else if (key == "--width") {
+			options.width = std::atoi(value.c_str());
+		}
+		else if (key == "--height") {
+			options.height = std::atoi(value.c_str());
+		}
+		else if (key == "--sources") {
+			options.num_sources = std::atoi(value.c_str());
+			ok = options.num_sources > 0;
+		}
+		else if (key == "--arc") {
+			options.arc_degrees = (float)std::atof(value.c_str());
+		}
+		else if (key == "--fov") {
+			options.fov_degrees = (float)std::atof(value.c_str());
+			ok = options.fov_degrees > 0.0f && options.fov_degrees < 180.0f;
+		}
+		else if (key == "--seed") {
+			options.seed = (unsigned int)std::strtoul(value.c_str(), NULL, 10);
+		}
+		else if (key == "--masks") {
+			options.masks = true;
+		}
+		else {
+			ok = false;
+		}
+
+		if (!ok || (eq == std::string::npos && key != "--masks")) {
+			std::cout << "Invalid option: " << arg << std::endl;
+			return -1;
+		}
+	}
+
+	if (GenerateSyntheticScene(dense_folder, options) != 0) {
+		return -1;
+	}
+	std::cout << "Wrote " << options.num_views << " synthetic views to " << dense_folder << std::endl;
+	return 0;
+}
@@ -1,44 +1,15 @@
 #include "main.h"
 #include "HPM.h"
+#include "Upsampling.h"
+#include "Progress.h"
+#include "TextureMap.h"
 
 #include <filesystem>
 
-void GenerateSampleList(const std::string& dense_folder, std::vector<Problem>& problems)
-{
-	std::string cluster_list_path = dense_folder + std::string("/pair.txt");
-
-	problems.clear();
-
-	std::ifstream file(cluster_list_path);
-
-	int num_images;
-	file >> num_images;
-
-	for (int i = 0; i < num_images; ++i) {
-		Problem problem;
-		problem.src_image_ids.clear();
-		file >> problem.ref_image_id;
-
-		int num_src_images;
-		file >> num_src_images;
-		for (int j = 0; j < num_src_images; ++j) {
-			int id;
-			float score;
-			file >> id >> score;
-			if (score <= 0.0f) {
-				continue;
-			}
-			problem.src_image_ids.push_back(id);
-		}
-		problems.push_back(problem);
-	}
-}
-
-int ComputeMultiScaleSettings(const std::string& dense_folder, std::vector<Problem>& problems)
+int ComputeMultiScaleSettings(const std::string& dense_folder, std::vector<Problem>& problems, const PipelineOptions& options)
 {
 	int max_num_downscale = -1;
-	int size_bound = 1000;
-	PatchMatchParams pmp;
+	int size_bound = options.scale_size_bound;
 	std::string image_folder = dense_folder + std::string("/images");
 
 	size_t num_images = problems.size();
@@ -51,8 +22,8 @@ int ComputeMultiScaleSettings(const std::string& dense_folder, std::vector<Probl
 		int rows = image_uint.rows;
 		int cols = image_uint.cols;
 		int max_size = std::max(rows, cols);
-		if (max_size > pmp.max_image_size) {
-			max_size = pmp.max_image_size;
+		if (max_size > options.max_image_size) {
+			max_size = options.max_image_size;
 		}
 		problems[i].max_image_size = max_size;
 
@@ -72,9 +43,11 @@ int ComputeMultiScaleSettings(const std::string& dense_folder, std::vector<Probl
 	return max_num_downscale;
 }
 
-void ProcessProblem(const std::string& dense_folder, const std::vector<Problem>& problems, const int idx, bool geom_consistency, bool prior_consistency, bool hierarchy, bool mand_consistency, int image_scale, bool multi_geometrty = false, int hpm_scale_distance = 0)
+void ProcessProblem(const std::string& dense_folder, const std::vector<Problem>& problems, const int idx, const PipelineOptions& options, bool geom_consistency, bool prior_consistency, bool hierarchy, bool mand_consistency, int image_scale, bool multi_geometrty = false, int hpm_scale_distance = 0)
 {
 	const Problem problem = problems[idx];
+	HPM_TRACE_CONTEXT(problem.ref_image_id, image_scale);
+	HPM_TRACE_SCOPE("ProcessProblem");
 	std::cout << "Processing image " << std::setw(8) << std::setfill('0') << problem.ref_image_id << "..." << std::endl;
 	cudaSetDevice(0);
 	std::stringstream result_path;
@@ -83,6 +56,8 @@ void ProcessProblem(const std::string& dense_folder, const std::vector<Problem>&
 	std::filesystem::create_directories(result_folder);
 
 	HPM hpm;
+	hpm.SetUpsampleParams(options);
+	hpm.SetTuningParams(options);
 	if (geom_consistency) {
 		hpm.SetGeomConsistencyParams(multi_geometrty);
 	}
@@ -90,6 +65,10 @@ void ProcessProblem(const std::string& dense_folder, const std::vector<Problem>&
 		hpm.SetHierarchyParams();
 	}
 
+	if (!options.stats_path.empty()) {
+		hpm.SetStatsParams(true);
+	}
+
 	hpm.InuputInitialization(dense_folder, problems, idx);
 	hpm.CudaSpaceInitialization(dense_folder, problem);
 
@@ -99,28 +78,42 @@ void ProcessProblem(const std::string& dense_folder, const std::vector<Problem>&
 	cv::Mat_<float> depths = cv::Mat::zeros(height, width, CV_32FC1);
 	cv::Mat_<cv::Vec3f> normals = cv::Mat::zeros(height, width, CV_32FC3);
 	cv::Mat_<float> costs = cv::Mat::zeros(height, width, CV_32FC1);
-	cv::Mat_<float>texture = cv::Mat::zeros(height, width, CV_32FC1);
 
 	hpm.SetMandConsistencyParams(mand_consistency);
 
-	std::stringstream canny_image_path;
-	cv::Mat Image_grey;
-	cv::Mat Canny_edge;
-	std::string image_folder = dense_folder + std::string("/images");
-	canny_image_path << image_folder << "/" << std::setw(8) << std::setfill('0') << problem.ref_image_id << ".jpg";
-	cv::resize(cv::imread(canny_image_path.str(), 1), Image_grey, cv::Size(width, height), 0, 0, cv::INTER_LINEAR);
-	cv::Canny(Image_grey, Canny_edge, 50, 150);
-	std::cout << "Get Canny egdes down!" << std::endl;
-	hpm.CudaCannyInitialization(Canny_edge);
-	Image_grey.release();
-	Canny_edge.release();
+	std::string pass_name = "photometric";
+	if (prior_consistency) {
+		pass_name = "prior" + std::to_string(hpm_scale_distance);
+	}
+	else if (mand_consistency) {
+		pass_name = "mandatory";
+	}
+	else if (geom_consistency) {
+		pass_name = "geometric";
+	}
+	if (hierarchy) {
+		pass_name += "_hierarchy";
+	}
+	ProgressBeginUnit(problem.ref_image_id, image_scale, pass_name);
+	auto append_stats = [&]() {
+		if (!options.stats_path.empty()) {
+			AppendPatchMatchStats(problem.ref_image_id, image_scale, pass_name, hpm.GetSweepStats());
+		}
+	};
+
+	// Computed once per view and scale, then shared by every pass
+	cv::Mat_<float> texture;
+	if (GetEdgeTexture(dense_folder, problem.ref_image_id, image_scale, width, height, texture) != 0) {
+		// Still counted as done, so the pass and run totals reach 100%
+		std::cout << "Processing image " << std::setw(8) << std::setfill('0') << problem.ref_image_id << " failed!" << std::endl;
+		ProgressEndUnit(0);
+		return;
+	}
+	hpm.CudaTextureInitialization(texture);
 
 	if (mand_consistency || prior_consistency) {
 		hpm.CudaConfidenceInitialization(dense_folder, problems, idx);
 	}
-	if (!prior_consistency && !mand_consistency) {
-		hpm.TextureInformationInitialization();
-	}
 
 	if (!prior_consistency) {
 		if (mand_consistency) {
@@ -133,18 +126,7 @@ void ProcessProblem(const std::string& dense_folder, const std::vector<Problem>&
 			std::cout << "Run Photometric Consistency ..." << std::endl;
 		}
 		hpm.RunPatchMatch();
-		for (int col = 0; col < width; ++col) {
-			for (int row = 0; row < height; ++row) {
-				int center = row * width + col;
-				float4 plane_hypothesis = hpm.GetPlaneHypothesis(center);
-				depths(row, col) = plane_hypothesis.w;
-				normals(row, col) = cv::Vec3f(plane_hypothesis.x, plane_hypothesis.y, plane_hypothesis.z);
-				costs(row, col) = hpm.GetCost(center);
-				if (!mand_consistency) {
-					texture(row, col) = hpm.GetTexture(center);
-				}
-			}
-		}
+		append_stats();
 	}
 	else if (prior_consistency) {
 		std::cout << "Run Prior Consistency ..." << std::endl;
@@ -175,11 +157,7 @@ void ProcessProblem(const std::string& dense_folder, const std::vector<Problem>&
 			const cv::Rect imageRC(0, 0, width, height);
 			std::vector<cv::Point> support2DPoints;
 
-			std::string texture_path = result_folder + "/texture" + std::to_string(image_scale) + ".dmb";
-			cv::Mat_<float>textures;
-			readDepthDmb(texture_path, textures);
-
-			hpm.GetSupportPoints_Classify_Check(support2DPoints, costs, confidences, textures, 1);
+			hpm.GetSupportPoints_Classify_Check(support2DPoints, costs, confidences, texture, 1);
 			const auto triangles = hpm.DelaunayTriangulation(imageRC, support2DPoints);
 
 			cv::Mat refImage = hpm.GetReferenceImage().clone();
@@ -209,25 +187,28 @@ void ProcessProblem(const std::string& dense_folder, const std::vector<Problem>&
 			planeParams_tri.clear();
 
 			uint32_t idx = 0;
-			for (const auto triangle : triangles) {
-				if (imageRC.contains(triangle.pt1) && imageRC.contains(triangle.pt2) && imageRC.contains(triangle.pt3)) {
-					float L01 = sqrt(pow(triangle.pt1.x - triangle.pt2.x, 2) + pow(triangle.pt1.y - triangle.pt2.y, 2));
-					float L02 = sqrt(pow(triangle.pt1.x - triangle.pt3.x, 2) + pow(triangle.pt1.y - triangle.pt3.y, 2));
-					float L12 = sqrt(pow(triangle.pt2.x - triangle.pt3.x, 2) + pow(triangle.pt2.y - triangle.pt3.y, 2));
-
-					float max_edge_length = std::max(L01, std::max(L02, L12));
-					float step = 1.0 / max_edge_length;
-
-					for (float p = 0; p < 1.0; p += step) {
-						for (float q = 0; q < 1.0 - p; q += step) {
-							int x = p * triangle.pt1.x + q * triangle.pt2.x + (1.0 - p - q) * triangle.pt3.x;
-							int y = p * triangle.pt1.y + q * triangle.pt2.y + (1.0 - p - q) * triangle.pt3.y;
-							mask_tri(y, x) = idx + 1.0; // To distinguish from the label of non-triangulated areas
+			{
+				HPM_TRACE_SCOPE("RasterizeTriangles");
+				for (const auto triangle : triangles) {
+					if (imageRC.contains(triangle.pt1) && imageRC.contains(triangle.pt2) && imageRC.contains(triangle.pt3)) {
+						float L01 = sqrt(pow(triangle.pt1.x - triangle.pt2.x, 2) + pow(triangle.pt1.y - triangle.pt2.y, 2));
+						float L02 = sqrt(pow(triangle.pt1.x - triangle.pt3.x, 2) + pow(triangle.pt1.y - triangle.pt3.y, 2));
+						float L12 = sqrt(pow(triangle.pt2.x - triangle.pt3.x, 2) + pow(triangle.pt2.y - triangle.pt3.y, 2));
+
+						float max_edge_length = std::max(L01, std::max(L02, L12));
+						float step = 1.0 / max_edge_length;
+
+						for (float p = 0; p < 1.0; p += step) {
+							for (float q = 0; q < 1.0 - p; q += step) {
+								int x = p * triangle.pt1.x + q * triangle.pt2.x + (1.0 - p - q) * triangle.pt3.x;
+								int y = p * triangle.pt1.y + q * triangle.pt2.y + (1.0 - p - q) * triangle.pt3.y;
+								mask_tri(y, x) = idx + 1.0; // To distinguish from the label of non-triangulated areas
+							}
 						}
+						float4 n4 = hpm.GetPriorPlaneParams(triangle, depths);
+						planeParams_tri.push_back(n4);
+						idx++;
 					}
-					float4 n4 = hpm.GetPriorPlaneParams(triangle, depths);
-					planeParams_tri.push_back(n4);
-					idx++;
 				}
 			}
 
@@ -252,7 +233,7 @@ void ProcessProblem(const std::string& dense_folder, const std::vector<Problem>&
 			hpm.CudaPlanarPriorInitialization(planeParams_tri, mask_tri);
 			hpm.CudaHypothesesReload(depths, costs, normals);
 			hpm.RunPatchMatch();
-			textures.release();
+			append_stats();
 			mask_tri.release();
 			planeParams_tri.clear();
 			planeParams_tri.shrink_to_fit();
@@ -276,9 +257,13 @@ void ProcessProblem(const std::string& dense_folder, const std::vector<Problem>&
 
 
 
-			std::string texture_path = result_folder + "/texture" + std::to_string(image_scale + hpm_scale_distance) + ".dmb";
+			// Cached by the pass that ran at the coarser scale unless evicted since
 			cv::Mat_<float>textures;
-			readDepthDmb(texture_path, textures);
+			if (GetEdgeTexture(dense_folder, problem.ref_image_id, image_scale + hpm_scale_distance, hpm_width, hpm_height, textures) != 0) {
+				std::cout << "Processing image " << std::setw(8) << std::setfill('0') << problem.ref_image_id << " failed!" << std::endl;
+				ProgressEndUnit(0);
+				return;
+			}
 
 			const cv::Rect imageRC(0, 0, hpm_width, hpm_height);
 			std::vector<cv::Point> support2DPoints;
@@ -309,26 +294,29 @@ void ProcessProblem(const std::string& dense_folder, const std::vector<Problem>&
 			cv::Mat_<float> mask_tri = cv::Mat::zeros(hpm_height, hpm_width, CV_32FC1);
 			planeParams_tri.clear();
 			uint32_t idx = 0;
-			for (const auto triangle : triangles) {
-				if (imageRC.contains(triangle.pt1) && imageRC.contains(triangle.pt2) && imageRC.contains(triangle.pt3)) {
-					float L01 = sqrt(pow(triangle.pt1.x - triangle.pt2.x, 2) + pow(triangle.pt1.y - triangle.pt2.y, 2));
-					float L02 = sqrt(pow(triangle.pt1.x - triangle.pt3.x, 2) + pow(triangle.pt1.y - triangle.pt3.y, 2));
-					float L12 = sqrt(pow(triangle.pt2.x - triangle.pt3.x, 2) + pow(triangle.pt2.y - triangle.pt3.y, 2));
-
-					float max_edge_length = std::max(L01, std::max(L02, L12));
-					float step = 1.0 / max_edge_length;
-
-					for (float p = 0; p < 1.0; p += step) {
-						for (float q = 0; q < 1.0 - p; q += step) {
-							int x = p * triangle.pt1.x + q * triangle.pt2.x + (1.0 - p - q) * triangle.pt3.x;
-							int y = p * triangle.pt1.y + q * triangle.pt2.y + (1.0 - p - q) * triangle.pt3.y;
-							mask_tri(y, x) = idx + 1.0; // To distinguish from the label of non-triangulated areas
+			{
+				HPM_TRACE_SCOPE("RasterizeTriangles");
+				for (const auto triangle : triangles) {
+					if (imageRC.contains(triangle.pt1) && imageRC.contains(triangle.pt2) && imageRC.contains(triangle.pt3)) {
+						float L01 = sqrt(pow(triangle.pt1.x - triangle.pt2.x, 2) + pow(triangle.pt1.y - triangle.pt2.y, 2));
+						float L02 = sqrt(pow(triangle.pt1.x - triangle.pt3.x, 2) + pow(triangle.pt1.y - triangle.pt3.y, 2));
+						float L12 = sqrt(pow(triangle.pt2.x - triangle.pt3.x, 2) + pow(triangle.pt2.y - triangle.pt3.y, 2));
+
+						float max_edge_length = std::max(L01, std::max(L02, L12));
+						float step = 1.0 / max_edge_length;
+
+						for (float p = 0; p < 1.0; p += step) {
+							for (float q = 0; q < 1.0 - p; q += step) {
+								int x = p * triangle.pt1.x + q * triangle.pt2.x + (1.0 - p - q) * triangle.pt3.x;
+								int y = p * triangle.pt1.y + q * triangle.pt2.y + (1.0 - p - q) * triangle.pt3.y;
+								mask_tri(y, x) = idx + 1.0; // To distinguish from the label of non-triangulated areas
+							}
 						}
+						//renew the camera's parameters 
+						float4 n4 = hpm.GetPriorPlaneParams_factor(triangle, depths_downsample, hpm_factor);
+						planeParams_tri.push_back(n4);
+						idx++;
 					}
-					//renew the camera's parameters 
-					float4 n4 = hpm.GetPriorPlaneParams_factor(triangle, depths_downsample, hpm_factor);
-					planeParams_tri.push_back(n4);
-					idx++;
 				}
 			}
 
@@ -369,6 +357,8 @@ void ProcessProblem(const std::string& dense_folder, const std::vector<Problem>&
 
 			cv::Mat_<float>mask_tri_new = cv::Mat::zeros(height, width, CV_32FC1);
 			float4* prior_planeParams = new float4[height * width];
+			MemoryCharge prior_planes_charge(MEMORY_PRIORS, BUFFER_HOST);
+			prior_planes_charge.Set(sizeof(float4) * height * width);
 			for (int i = 0; i < width; i++) {
 				for (int j = 0; j < height; j++) {
 					if (priordepths_upsample(j, i) <= hpm.GetMaxDepth() && priordepths_upsample(j, i) >= hpm.GetMinDepth()) {
@@ -396,6 +386,7 @@ void ProcessProblem(const std::string& dense_folder, const std::vector<Problem>&
 			hpm.ReloadPlanarPriorInitialization(mask_tri_new, prior_planeParams);
 			hpm.CudaHypothesesReload(depths, costs, normals);
 			hpm.RunPatchMatch();
+			append_stats();
 
 			refImage.release();
 			mbgr.clear();
@@ -417,16 +408,6 @@ void ProcessProblem(const std::string& dense_folder, const std::vector<Problem>&
 			delete[] prior_planeParams;
 		}
 
-		for (int col = 0; col < width; ++col) {
-			for (int row = 0; row < height; ++row) {
-				int center = row * width + col;
-				float4 plane_hypothesis = hpm.GetPlaneHypothesis(center);
-				depths(row, col) = plane_hypothesis.w;
-				normals(row, col) = cv::Vec3f(plane_hypothesis.x, plane_hypothesis.y, plane_hypothesis.z);
-				costs(row, col) = hpm.GetCost(center);
-			}
-		}
-
 		hpm.CudaPlanarPriorRelease();
 	}
 
@@ -438,13 +419,11 @@ void ProcessProblem(const std::string& dense_folder, const std::vector<Problem>&
 	std::string normal_path = result_folder + "/normals.dmb";
 	std::string cost_path = result_folder + "/costs.dmb";
 
-	writeDepthDmb(depth_path, depths);
-	writeNormalDmb(normal_path, normals);
-	writeDepthDmb(cost_path, costs);
-	if (!mand_consistency && !prior_consistency) {
-		std::string texture_path = result_folder + "/texture" + std::to_string(image_scale) + ".dmb";
-		writeDepthDmb(texture_path, texture);
-	}
+	// Written straight from the SoA planes of the final hypotheses
+	const HypothesisField& hypotheses = hpm.GetHypotheses();
+	writeDepthDmb(depth_path, hypotheses.View(HypothesisField::D));
+	writeNormalDmb(normal_path, hypotheses.View(HypothesisField::NX), hypotheses.View(HypothesisField::NY), hypotheses.View(HypothesisField::NZ), options.normal_dmb);
+	writeDepthDmb(cost_path, hypotheses.View(HypothesisField::COST));
 	texture.release();
 	depths.release();
 	normals.release();
@@ -452,38 +431,61 @@ void ProcessProblem(const std::string& dense_folder, const std::vector<Problem>&
 	hpm.CudaSpaceRelease(geom_consistency);
 	hpm.ReleaseProblemHostMemory();
 	std::cout << "Processing image " << std::setw(8) << std::setfill('0') << problem.ref_image_id << " done!" << std::endl;
+	ProgressEndUnit((long long)width * height);
+	MemoryRecordPass(problem.ref_image_id, image_scale, pass_name);
 }
 
-void JointBilateralUpsampling(const std::string& dense_folder, const Problem& problem, int acmmp_size)
+void JointBilateralUpsampling(const std::string& dense_folder, const Problem& problem, int acmmp_size, int image_scale, const PipelineOptions& options)
 {
+	HPM_TRACE_CONTEXT(problem.ref_image_id, image_scale);
+	HPM_TRACE_SCOPE("JointBilateralUpsampling");
+	ProgressBeginUnit(problem.ref_image_id, image_scale, "jbu");
 	std::stringstream result_path;
 	result_path << dense_folder << "/HPM_MVS_plusplus" << "/2333_" << std::setw(8) << std::setfill('0') << problem.ref_image_id;
 	std::string result_folder = result_path.str();
 	std::string depth_path = result_folder + "/depths_geom.dmb";
+	std::string normal_path = result_folder + "/normals.dmb";
 	cv::Mat_<float> ref_depth;
 	readDepthDmb(depth_path, ref_depth);
+	// Normals go through the same pass so the hierarchy initialization finds
+	// them at full resolution; the previous costs are never read there
+	cv::Mat_<cv::Vec3f> ref_normal;
+	readNormalDmb(normal_path, ref_normal);
 
 	std::string image_folder = dense_folder + std::string("/images");
 	std::stringstream image_path;
 	image_path << image_folder << "/" << std::setw(8) << std::setfill('0') << problem.ref_image_id << ".jpg";
 	cv::Mat_<uint8_t> image_uint = cv::imread(image_path.str(), cv::IMREAD_GRAYSCALE);
-	cv::Mat image_float;
-	image_uint.convertTo(image_float, CV_32FC1);
-	const float factor_x = static_cast<float>(acmmp_size) / image_float.cols;
-	const float factor_y = static_cast<float>(acmmp_size) / image_float.rows;
+	const float factor_x = static_cast<float>(acmmp_size) / image_uint.cols;
+	const float factor_y = static_cast<float>(acmmp_size) / image_uint.rows;
 	const float factor = std::min(factor_x, factor_y);
 
-	const int new_cols = std::round(image_float.cols * factor);
-	const int new_rows = std::round(image_float.rows * factor);
-	cv::Mat scaled_image_float;
-	cv::resize(image_float, scaled_image_float, cv::Size(new_cols, new_rows), 0, 0, cv::INTER_LINEAR);
+	const int new_cols = std::round(image_uint.cols * factor);
+	const int new_rows = std::round(image_uint.rows * factor);
 
+	if (options.compare_upsample) {
+		const int Imagescale = std::max(new_rows / ref_depth.rows, new_cols / ref_depth.cols);
+		if (Imagescale > 1) {
+			// Diagnostic only; needs the whole float guide
+			cv::Mat_<float> scaled_image;
+			ResizeGuideRows(image_uint, new_rows, new_cols, 0, new_rows, scaled_image);
+			CompareUpsamplingMethods(scaled_image, ref_depth, Imagescale);
+		}
+	}
+
+	// The guide stays 8-bit at its original size; RunJBU resizes one band
+	// of float rows at a time
 	std::cout << "Run JBU for image " << problem.ref_image_id << ".jpg" << std::endl;
-	RunJBU(scaled_image_float, ref_depth, dense_folder, problem);
+	RunJBU(image_uint, new_rows, new_cols, ref_depth, ref_normal, dense_folder, problem, options);
+	ProgressEndUnit((long long)new_rows * new_cols);
+	MemoryRecordPass(problem.ref_image_id, image_scale, "jbu");
 }
 
-void RunFusion_Sky_Strict(std::string& dense_folder, const std::vector<Problem>& problems, bool geom_consistency)
+void RunFusion_Sky_Strict(std::string& dense_folder, const std::vector<Problem>& problems, bool geom_consistency, const PipelineOptions& options)
 {
+	// Covers every view; clear the view and scale left by the last problem
+	HPM_TRACE_CONTEXT(-1, -1);
+	HPM_TRACE_SCOPE("Fusion");
 	size_t num_images = problems.size();
 	std::string image_folder = dense_folder + std::string("/images");
 	std::string cam_folder = dense_folder + std::string("/cams");
@@ -492,7 +494,7 @@ void RunFusion_Sky_Strict(std::string& dense_folder, const std::vector<Problem>&
 	std::vector<cv::Mat> images;
 	std::vector<Camera> cameras;
 	std::vector<cv::Mat_<float>> depths;
-	std::vector<cv::Mat_<cv::Vec3f>> normals;
+	std::vector<NormalMap> normals;
 	std::vector<cv::Mat> masks;
 	std::vector<cv::Mat> sky_masks;
 	images.clear();
@@ -501,6 +503,7 @@ void RunFusion_Sky_Strict(std::string& dense_folder, const std::vector<Problem>&
 	normals.clear();
 	masks.clear();
 	sky_masks.clear();
+	MemoryCharge maps_charge(MEMORY_FUSION, BUFFER_HOST);
 
 	for (size_t i = 0; i < num_images; ++i) {
 		std::cout << "Reading image " << std::setw(8) << std::setfill('0') << i << "..." << std::endl;
@@ -527,9 +530,9 @@ void RunFusion_Sky_Strict(std::string& dense_folder, const std::vector<Problem>&
 		std::string depth_path = result_folder + suffix;
 		std::string normal_path = result_folder + "/normals.dmb";
 		cv::Mat_<float> depth;
-		cv::Mat_<cv::Vec3f> normal;
+		NormalMap normal;
 		readDepthDmb(depth_path, depth);
-		readNormalDmb(normal_path, normal);
+		readNormalDmb(normal_path, normal, options.normal_storage);
 
 		cv::Mat_<cv::Vec3b> scaled_image;
 		RescaleImageAndCamera(image, scaled_image, depth, camera);
@@ -544,6 +547,7 @@ void RunFusion_Sky_Strict(std::string& dense_folder, const std::vector<Problem>&
 		normals.push_back(normal);
 		masks.push_back(mask);
 		sky_masks.push_back(scaled_sky_mask);
+		maps_charge.Add(MatBytes(scaled_image) + MatBytes(depth) + normal.Bytes() + MatBytes(mask) + MatBytes(scaled_sky_mask));
 		image.release();
 		sky_mask.release();
 		depth.release();
@@ -554,9 +558,11 @@ void RunFusion_Sky_Strict(std::string& dense_folder, const std::vector<Problem>&
 
 	std::vector<PointList> PointCloud;
 	PointCloud.clear();
+	MemoryCharge point_cloud_charge(MEMORY_POINT_CLOUD, BUFFER_HOST);
 
 	for (size_t i = 0; i < num_images; ++i) {
 		std::cout << "Fusing image " << std::setw(8) << std::setfill('0') << i << "..." << std::endl;
+		ProgressBeginUnit(problems[i].ref_image_id, -1, "fusion");
 		const int cols = depths[i].cols;
 		const int rows = depths[i].rows;
 		int num_ngb = problems[i].src_image_ids.size();
@@ -567,7 +573,7 @@ void RunFusion_Sky_Strict(std::string& dense_folder, const std::vector<Problem>&
 				if (masks[i].at<uchar>(r, c) == 1)
 					continue;
 				float ref_depth = depths[i].at<float>(r, c);
-				cv::Vec3f ref_normal = normals[i].at<cv::Vec3f>(r, c);
+				cv::Vec3f ref_normal = normals[i].At(r, c);
 
 				if (ref_depth <= 0.0)
 					continue;
@@ -577,45 +583,8 @@ void RunFusion_Sky_Strict(std::string& dense_folder, const std::vector<Problem>&
 				cv::Vec3f consistent_normal = ref_normal;
 				float consistent_Color[3] = { (float)images[i].at<cv::Vec3b>(r, c)[0], (float)images[i].at<cv::Vec3b>(r, c)[1], (float)images[i].at<cv::Vec3b>(r, c)[2] };
 				float segment_Color[3] = { (float)sky_masks[i].at<cv::Vec3b>(r, c)[0], (float)sky_masks[i].at<cv::Vec3b>(r, c)[1], (float)sky_masks[i].at<cv::Vec3b>(r, c)[2] };
-				int num_consistent = 0;
 				float dynamic_consistency = 0;
-
-				for (int j = 0; j < num_ngb; ++j) {
-					int src_id = problems[i].src_image_ids[j];
-					const int src_cols = depths[src_id].cols;
-					const int src_rows = depths[src_id].rows;
-					float2 point;
-					float proj_depth;
-					ProjectonCamera(PointX, cameras[src_id], point, proj_depth);
-					int src_r = int(point.y + 0.5f);
-					int src_c = int(point.x + 0.5f);
-					if (src_c >= 0 && src_c < src_cols && src_r >= 0 && src_r < src_rows) {
-						if (masks[src_id].at<uchar>(src_r, src_c) == 1)
-							continue;
-
-						float src_depth = depths[src_id].at<float>(src_r, src_c);
-						cv::Vec3f src_normal = normals[src_id].at<cv::Vec3f>(src_r, src_c);
-						if (src_depth <= 0.0)
-							continue;
-
-						float3 tmp_X = Get3DPointonWorld(src_c, src_r, src_depth, cameras[src_id]);
-						float2 tmp_pt;
-						ProjectonCamera(tmp_X, cameras[i], tmp_pt, proj_depth);
-						float reproj_error = sqrt(pow(c - tmp_pt.x, 2) + pow(r - tmp_pt.y, 2));
-						float relative_depth_diff = fabs(proj_depth - ref_depth) / ref_depth;
-						float angle = GetAngle(ref_normal, src_normal);
-
-						if (reproj_error < 2.0f && relative_depth_diff < 0.01f && angle < 0.174533f) {
-							used_list[j].x = src_c;
-							used_list[j].y = src_r;
-
-							float tmp_index = reproj_error + 200 * relative_depth_diff + angle * 10;
-							float cons = exp(-tmp_index);
-							dynamic_consistency += exp(-tmp_index);
-							num_consistent++;
-						}
-					}
-				}
+				const int num_consistent = CheckFusionConsistency(cameras, depths, normals, masks, problems[i].src_image_ids, (int)i, r, c, PointX, ref_depth, ref_normal, used_list, dynamic_consistency);
 
 				int view_num = 1;
 				float factor = 0.3;
@@ -638,14 +607,19 @@ void RunFusion_Sky_Strict(std::string& dense_folder, const std::vector<Problem>&
 				}
 			}
 		}
+		point_cloud_charge.Set(PointCloud.capacity() * sizeof(PointList));
+		ProgressEndUnit((long long)rows * cols);
 	}
 
 	std::string ply_path = dense_folder + "/HPM_MVS_plusplus/HPM_MVS_plusplus_mask.ply";
 	ExportPointCloud(ply_path, PointCloud);
+	MemoryRecordPass(-1, 0, "fusion");
 }
 
-void RunFusion(std::string& dense_folder, const std::vector<Problem>& problems, bool geom_consistency)
+void RunFusion(std::string& dense_folder, const std::vector<Problem>& problems, bool geom_consistency, const PipelineOptions& options)
 {
+	HPM_TRACE_CONTEXT(-1, -1);
+	HPM_TRACE_SCOPE("Fusion");
 	size_t num_images = problems.size();
 	std::string image_folder = dense_folder + std::string("/images");
 	std::string cam_folder = dense_folder + std::string("/cams");
@@ -653,13 +627,14 @@ void RunFusion(std::string& dense_folder, const std::vector<Problem>& problems,
 	std::vector<cv::Mat> images;
 	std::vector<Camera> cameras;
 	std::vector<cv::Mat_<float>> depths;
-	std::vector<cv::Mat_<cv::Vec3f>> normals;
+	std::vector<NormalMap> normals;
 	std::vector<cv::Mat> masks;
 	images.clear();
 	cameras.clear();
 	depths.clear();
 	normals.clear();
 	masks.clear();
+	MemoryCharge maps_charge(MEMORY_FUSION, BUFFER_HOST);
 
 	for (size_t i = 0; i < num_images; ++i) {
 		std::cout << "Reading image " << std::setw(8) << std::setfill('0') << i << "..." << std::endl;
@@ -680,9 +655,9 @@ void RunFusion(std::string& dense_folder, const std::vector<Problem>& problems,
 		std::string depth_path = result_folder + suffix;
 		std::string normal_path = result_folder + "/normals.dmb";
 		cv::Mat_<float> depth;
-		cv::Mat_<cv::Vec3f> normal;
+		NormalMap normal;
 		readDepthDmb(depth_path, depth);
-		readNormalDmb(normal_path, normal);
+		readNormalDmb(normal_path, normal, options.normal_storage);
 
 		cv::Mat_<cv::Vec3b> scaled_image;
 		RescaleImageAndCamera(image, scaled_image, depth, camera);
@@ -692,15 +667,18 @@ void RunFusion(std::string& dense_folder, const std::vector<Problem>& problems,
 		normals.push_back(normal);
 		cv::Mat mask = cv::Mat::zeros(depth.rows, depth.cols, CV_8UC1);
 		masks.push_back(mask);
+		maps_charge.Add(MatBytes(scaled_image) + MatBytes(depth) + normal.Bytes() + MatBytes(mask));
 
 
 	}
 
 	std::vector<PointList> PointCloud;
 	PointCloud.clear();
+	MemoryCharge point_cloud_charge(MEMORY_POINT_CLOUD, BUFFER_HOST);
 
 	for (size_t i = 0; i < num_images; ++i) {
 		std::cout << "Fusing image " << std::setw(8) << std::setfill('0') << i << "..." << std::endl;
+		ProgressBeginUnit(problems[i].ref_image_id, -1, "fusion");
 		const int cols = depths[i].cols;
 		const int rows = depths[i].rows;
 		int num_ngb = problems[i].src_image_ids.size();
@@ -710,7 +688,7 @@ void RunFusion(std::string& dense_folder, const std::vector<Problem>& problems,
 				if (masks[i].at<uchar>(r, c) == 1)
 					continue;
 				float ref_depth = depths[i].at<float>(r, c);
-				cv::Vec3f ref_normal = normals[i].at<cv::Vec3f>(r, c);
+				cv::Vec3f ref_normal = normals[i].At(r, c);
 
 				if (ref_depth <= 0.0)
 					continue;
@@ -719,45 +697,8 @@ void RunFusion(std::string& dense_folder, const std::vector<Problem>& problems,
 				float3 consistent_Point = PointX;
 				cv::Vec3f consistent_normal = ref_normal;
 				float consistent_Color[3] = { (float)images[i].at<cv::Vec3b>(r, c)[0], (float)images[i].at<cv::Vec3b>(r, c)[1], (float)images[i].at<cv::Vec3b>(r, c)[2] };
-				int num_consistent = 0;
 				float dynamic_consistency = 0;
-
-				for (int j = 0; j < num_ngb; ++j) {
-					int src_id = problems[i].src_image_ids[j];
-					const int src_cols = depths[src_id].cols;
-					const int src_rows = depths[src_id].rows;
-					float2 point;
-					float proj_depth;
-					ProjectonCamera(PointX, cameras[src_id], point, proj_depth);
-					int src_r = int(point.y + 0.5f);
-					int src_c = int(point.x + 0.5f);
-					if (src_c >= 0 && src_c < src_cols && src_r >= 0 && src_r < src_rows) {
-						if (masks[src_id].at<uchar>(src_r, src_c) == 1)
-							continue;
-
-						float src_depth = depths[src_id].at<float>(src_r, src_c);
-						cv::Vec3f src_normal = normals[src_id].at<cv::Vec3f>(src_r, src_c);
-						if (src_depth <= 0.0)
-							continue;
-
-						float3 tmp_X = Get3DPointonWorld(src_c, src_r, src_depth, cameras[src_id]);
-						float2 tmp_pt;
-						ProjectonCamera(tmp_X, cameras[i], tmp_pt, proj_depth);
-						float reproj_error = sqrt(pow(c - tmp_pt.x, 2) + pow(r - tmp_pt.y, 2));
-						float relative_depth_diff = fabs(proj_depth - ref_depth) / ref_depth;
-						float angle = GetAngle(ref_normal, src_normal);
-
-						if (reproj_error < 2.0f && relative_depth_diff < 0.01f && angle < 0.174533f) {
-							used_list[j].x = src_c;
-							used_list[j].y = src_r;
-
-							float tmp_index = reproj_error + 200 * relative_depth_diff + angle * 10;
-							float cons = exp(-tmp_index);
-							dynamic_consistency += exp(-tmp_index);
-							num_consistent++;
-						}
-					}
-				}
+				const int num_consistent = CheckFusionConsistency(cameras, depths, normals, masks, problems[i].src_image_ids, (int)i, r, c, PointX, ref_depth, ref_normal, used_list, dynamic_consistency);
 
 				if (num_consistent >= 1 && (dynamic_consistency > 0.3 * num_consistent)) {
 					PointList point3D;
@@ -773,20 +714,25 @@ void RunFusion(std::string& dense_folder, const std::vector<Problem>& problems,
 				}
 			}
 		}
+		point_cloud_charge.Set(PointCloud.capacity() * sizeof(PointList));
+		ProgressEndUnit((long long)rows * cols);
 	}
 
 	std::string ply_path = dense_folder + "/HPM_MVS_plusplus/HPM_MVS_plusplus.ply";
 	ExportPointCloud(ply_path, PointCloud);
+	MemoryRecordPass(-1, 0, "fusion");
 }
 
-void ConfidenceEvaluation(std::string& dense_folder, const std::vector<Problem>& problems, bool geom_consistency) {
+void ConfidenceEvaluation(std::string& dense_folder, const std::vector<Problem>& problems, bool geom_consistency, const PipelineOptions& options) {
+	HPM_TRACE_CONTEXT(-1, -1);
+	HPM_TRACE_SCOPE("ConfidenceEvaluation");
 	size_t num_images = problems.size();
 	std::string image_folder = dense_folder + std::string("/images");
 	std::string cam_folder = dense_folder + std::string("/cams");
 
 	std::vector<Camera> cameras;
 	std::vector<cv::Mat_<float>> depths;
-	std::vector<cv::Mat_<cv::Vec3f>> normals;
+	std::vector<NormalMap> normals;
 	std::vector<cv::Mat> masks;
 	std::vector<cv::Mat_<float>>consistency;
 	cameras.clear();
@@ -794,6 +740,7 @@ void ConfidenceEvaluation(std::string& dense_folder, const std::vector<Problem>&
 	normals.clear();
 	masks.clear();
 	consistency.clear();
+	MemoryCharge maps_charge(MEMORY_FUSION, BUFFER_HOST);
 	for (size_t i = 0; i < num_images; ++i) {
 		std::cout << "Reading image " << std::setw(8) << std::setfill('0') << i << "..." << std::endl;
 		std::stringstream image_path;
@@ -812,9 +759,9 @@ void ConfidenceEvaluation(std::string& dense_folder, const std::vector<Problem>&
 		std::string depth_path = result_folder + suffix;
 		std::string normal_path = result_folder + "/normals.dmb";
 		cv::Mat_<float> depth;
-		cv::Mat_<cv::Vec3f> normal;
+		NormalMap normal;
 		readDepthDmb(depth_path, depth);
-		readNormalDmb(normal_path, normal);
+		readNormalDmb(normal_path, normal, options.normal_storage);
 
 		cv::Mat_<cv::Vec3b> scaled_image;
 		RescaleImageAndCamera(image, scaled_image, depth, camera);
@@ -825,6 +772,7 @@ void ConfidenceEvaluation(std::string& dense_folder, const std::vector<Problem>&
 		masks.push_back(mask);
 		cv::Mat consist = cv::Mat::zeros(depth.rows, depth.cols, CV_32FC1);
 		consistency.push_back(consist);
+		maps_charge.Add(MatBytes(depth) + normal.Bytes() + MatBytes(mask) + MatBytes(consist));
 		depth.release();
 		normal.release();
 		mask.release();
@@ -835,6 +783,7 @@ void ConfidenceEvaluation(std::string& dense_folder, const std::vector<Problem>&
 	}
 	for (size_t i = 0; i < num_images; ++i) {
 		std::cout << "Hypothesis Confidence Evaluating Image " << std::setw(8) << std::setfill('0') << i << "..." << std::endl;
+		ProgressBeginUnit(problems[i].ref_image_id, -1, "confidence");
 		const int cols = depths[i].cols;
 		const int rows = depths[i].rows;
 		int num_ngb = problems[i].src_image_ids.size();
@@ -844,7 +793,7 @@ void ConfidenceEvaluation(std::string& dense_folder, const std::vector<Problem>&
 				if (masks[i].at<uchar>(r, c) == 1)
 					continue;
 				float ref_depth = depths[i].at<float>(r, c);
-				cv::Vec3f ref_normal = normals[i].at<cv::Vec3f>(r, c);
+				cv::Vec3f ref_normal = normals[i].At(r, c);
 
 				if (ref_depth <= 0.0) {
 					continue;
@@ -873,7 +822,7 @@ void ConfidenceEvaluation(std::string& dense_folder, const std::vector<Problem>&
 							continue;
 
 						float src_depth = depths[src_id].at<float>(src_r, src_c);
-						cv::Vec3f src_normal = normals[src_id].at<cv::Vec3f>(src_r, src_c);
+						cv::Vec3f src_normal = normals[src_id].At(src_r, src_c);
 						if (src_depth <= 0.0) {
 							continue;
 						}
@@ -916,6 +865,7 @@ void ConfidenceEvaluation(std::string& dense_folder, const std::vector<Problem>&
 		std::string result_folder = result_path.str();
 		std::string mask_path = result_folder + "/confidence.dmb";
 		writeDepthDmb(mask_path, consistency[i]);
+		ProgressEndUnit((long long)rows * cols);
 	}
 	cameras.clear();
 	depths.clear();
@@ -929,25 +879,219 @@ void ConfidenceEvaluation(std::string& dense_folder, const std::vector<Problem>&
 	masks.shrink_to_fit();
 	consistency.shrink_to_fit();
 	std::cout << "Hypotheses Confidence Evaluating Over..." << std::endl;
+	MemoryRecordPass(-1, 0, "confidence");
+}
+
+static bool ParseNormalEncoding(const std::string& value, NormalEncoding& encoding)
+{
+	if (value == "float") {
+		encoding = NORMAL_FLOAT;
+	}
+	else if (value == "oct16") {
+		encoding = NORMAL_OCT16;
+	}
+	else if (value == "oct8") {
+		encoding = NORMAL_OCT8;
+	}
+	else {
+		return false;
+	}
+	return true;
+}
+
+static bool ParseUpsampleMethod(const std::string& value, UpsampleMethod& method)
+{
+	if (value == "jbu") {
+		method = UPSAMPLE_JBU;
+	}
+	else if (value == "guided") {
+		method = UPSAMPLE_GUIDED;
+	}
+	else {
+		return false;
+	}
+	return true;
+}
+
+// Units the scale loop of main reports to Progress: every pass, JBU,
+// confidence evaluation and the final fusion visit each view once
+static long long CountProgressUnits(const int max_num_downscale, const int geom_iterations, const long long num_images)
+{
+	long long units = 0;
+	for (int scale = max_num_downscale; scale >= 0; --scale) {
+		const int prior_passes = max_num_downscale - scale + 1;
+		// Photometric on the coarsest scale, JBU and hierarchy on the others
+		units += scale == max_num_downscale ? num_images : 2 * num_images;
+		// Confidence evaluation and prior pass per HPM scale
+		units += prior_passes * 2 * num_images;
+		// Geometric iterations, all but the first after a confidence evaluation
+		units += (2 * geom_iterations - 1) * num_images;
+	}
+	return units + num_images;
+}
+
+// Parses --key=value options; returns -1 on an unknown or malformed option
+int ParsePipelineOptions(const std::vector<std::string>& args, PipelineOptions& options)
+{
+	for (const std::string& arg : args) {
+		const size_t eq = arg.find('=');
+		const std::string key = arg.substr(0, eq);
+		const std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+
+		bool ok = true;
+		if (key == "--upsample") {
+			ok = ParseUpsampleMethod(value, options.depth_upsample);
+			options.prior_upsample = options.depth_upsample;
+			options.hierarchy_upsample = options.depth_upsample;
+		}
+		else if (key == "--depth-upsample") {
+			ok = ParseUpsampleMethod(value, options.depth_upsample);
+		}
+		else if (key == "--prior-upsample") {
+			ok = ParseUpsampleMethod(value, options.prior_upsample);
+		}
+		else if (key == "--hierarchy-upsample") {
+			ok = ParseUpsampleMethod(value, options.hierarchy_upsample);
+		}
+		else if (key == "--compare-upsample") {
+			options.compare_upsample = true;
+		}
+		else if (key == "--upsample-tile-rows") {
+			options.upsample_tile_rows = std::atoi(value.c_str());
+			ok = !value.empty() && options.upsample_tile_rows >= 0;
+		}
+		else if (key == "--normal-dmb") {
+			ok = ParseNormalEncoding(value, options.normal_dmb);
+		}
+		else if (key == "--normal-storage") {
+			ok = ParseNormalEncoding(value, options.normal_storage);
+		}
+		else if (key == "--bench-image-layout") {
+			options.bench_image_layout = true;
+		}
+		else if (key == "--memory-report") {
+			options.memory_report = true;
+			options.memory_report_path = value;
+		}
+		else if (key == "--patch-size") {
+			options.patch_size = std::atoi(value.c_str());
+			ok = options.patch_size >= 3 && options.patch_size % 2 == 1;
+		}
+		else if (key == "--radius-increment") {
+			options.radius_increment = std::atoi(value.c_str());
+			ok = options.radius_increment >= 1;
+		}
+		else if (key == "--top-k") {
+			options.top_k = std::atoi(value.c_str());
+			ok = options.top_k >= 1;
+		}
+		else if (key == "--iterations") {
+			options.patchmatch_iterations = std::atoi(value.c_str());
+			ok = options.patchmatch_iterations >= 1;
+		}
+		else if (key == "--geom-iterations") {
+			options.geom_iterations = std::atoi(value.c_str());
+			ok = options.geom_iterations >= 1;
+		}
+		else if (key == "--max-image-size") {
+			options.max_image_size = std::atoi(value.c_str());
+			ok = options.max_image_size >= 16;
+		}
+		else if (key == "--scale-size-bound") {
+			options.scale_size_bound = std::atoi(value.c_str());
+			ok = options.scale_size_bound >= 16;
+		}
+		else if (key == "--cost-cache") {
+			options.cost_cache = true;
+		}
+		else if (key == "--status-file") {
+			options.status_path = value;
+			ok = !value.empty();
+		}
+		else if (key == "--status-interval") {
+			options.status_interval = (float)std::atof(value.c_str());
+			ok = options.status_interval > 0.0f;
+		}
+		else if (key == "--metrics-port") {
+			options.metrics_port = std::atoi(value.c_str());
+			ok = options.metrics_port > 0 && options.metrics_port < 65536;
+		}
+		else if (key == "--stats") {
+			options.stats_path = value;
+			ok = !value.empty();
+		}
+		else if (key == "--trace") {
+			options.trace_path = value;
+			ok = !value.empty();
+#ifndef HPM_ENABLE_TRACE
+			std::cout << "Tracing is not compiled in; reconfigure with -DHPM_ENABLE_TRACE=ON" << std::endl;
+#endif
+		}
+		else {
+			ok = false;
+		}
+
+		if (!ok) {
+			std::cout << "Invalid option: " << arg << std::endl;
+			return -1;
+		}
+	}
+	return 0;
 }
 
 int main(int argc, char** argv)
 {
 	if (argc < 2) {
-		std::cout << "USAGE: HPM-MVS_plusplus dense_folder true/flase(mask defualt: false)" << std::endl;
+		std::cout << "USAGE: HPM-MVS_plusplus dense_folder true/flase(mask defualt: false) [options]" << std::endl;
+		std::cout << "  --upsample=jbu|guided            upsampling method for all stages" << std::endl;
+		std::cout << "  --depth-upsample=jbu|guided      depths and normals between scales" << std::endl;
+		std::cout << "  --prior-upsample=jbu|guided      planar prior depths and normals" << std::endl;
+		std::cout << "  --hierarchy-upsample=jbu|guided  normals not already at full resolution" << std::endl;
+		std::cout << "  --compare-upsample               report JBU vs guided timings and differences" << std::endl;
+		std::cout << "  --upsample-tile-rows=N           JBU output rows per band, 0 for whole image (default: 1024)" << std::endl;
+		std::cout << "  --normal-dmb=float|oct16|oct8    encoding of written normals.dmb (default: float)" << std::endl;
+		std::cout << "  --normal-storage=float|oct16|oct8  normals held in memory by fusion (default: float)" << std::endl;
+		std::cout << "  --bench-image-layout             time host NCC over image layouts on the first problem and exit" << std::endl;
+		std::cout << "  --trace=<path>                   write a Chrome trace of all stages (needs HPM_ENABLE_TRACE)" << std::endl;
+		std::cout << "  --stats=<path>                   write PatchMatch sweep counters as JSON" << std::endl;
+		std::cout << "  --memory-report[=<path>]         print memory use per subsystem and view, optionally as JSON" << std::endl;
+		std::cout << "  --patch-size=N                   NCC window size, odd (default: 11)" << std::endl;
+		std::cout << "  --radius-increment=N             NCC window sampling step (default: 2)" << std::endl;
+		std::cout << "  --top-k=N                        views averaged into the multi-view cost (default: 4)" << std::endl;
+		std::cout << "  --iterations=N                   red/black sweeps per PatchMatch pass (default: 3)" << std::endl;
+		std::cout << "  --geom-iterations=N              geometric passes per scale (default: 3)" << std::endl;
+		std::cout << "  --max-image-size=N               downscale images to this size first (default: 3200)" << std::endl;
+		std::cout << "  --scale-size-bound=N             halve the coarsest scale until below this (default: 1000)" << std::endl;
+		std::cout << "  --cost-cache                     keep each pixel's per-view costs in fp16 between sweeps" << std::endl;
+		std::cout << "  --status-file=<path>             rewrite a JSON progress status periodically" << std::endl;
+		std::cout << "  --status-interval=SECONDS        status file period (default: 5)" << std::endl;
+		std::cout << "  --metrics-port=N                 serve Prometheus text metrics on 127.0.0.1:N" << std::endl;
 		return -1;
 	}
 
 	std::string dense_folder = argv[1];
 
 	bool mask_flag = false;
-	if (argc > 2) {
-		std::string mask = argv[2];
-		if (mask == "true") {
+	std::vector<std::string> option_args;
+	for (int i = 2; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg.rfind("--", 0) == 0) {
+			option_args.push_back(arg);
+		}
+		else if (arg == "true") {
 			mask_flag = true;
 		}
 	}
 
+	PipelineOptions options;
+	if (ParsePipelineOptions(option_args, options) != 0) {
+		return -1;
+	}
+
+	if (!options.trace_path.empty()) {
+		HPM_TRACE_ENABLE(true);
+	}
+
 	std::vector<Problem> problems;
 	GenerateSampleList(dense_folder, problems);
 
@@ -957,7 +1101,26 @@ int main(int argc, char** argv)
 	size_t num_images = problems.size();
 	std::cout << "There are " << num_images << " problems needed to be processed!" << std::endl;
 
-	int max_num_downscale = ComputeMultiScaleSettings(dense_folder, problems);
+	int max_num_downscale = ComputeMultiScaleSettings(dense_folder, problems, options);
+
+	if (options.bench_image_layout) {
+		for (size_t i = 0; i < num_images; ++i) {
+			problems[i].cur_image_size = problems[i].max_image_size;
+		}
+		HPM hpm;
+		hpm.InuputInitialization(dense_folder, problems, 0);
+		hpm.BenchmarkImageLayouts();
+		if (!options.trace_path.empty()) {
+			HPM_TRACE_WRITE(options.trace_path);
+		}
+		return 0;
+	}
+
+	ProgressSetViewsPerPass((int)num_images);
+	ProgressSetTotalUnits(CountProgressUnits(max_num_downscale, options.geom_iterations, num_images));
+	if ((!options.status_path.empty() || options.metrics_port > 0) && ProgressStart(options.status_path, options.status_interval, options.metrics_port) != 0) {
+		return -1;
+	}
 
 	int flag = 0;
 	int geom_iterations;
@@ -968,7 +1131,7 @@ int main(int argc, char** argv)
 	bool mand_consistency = false;
 	int max_hpm_scale = max_num_downscale;
 	while (max_num_downscale >= 0) {
-		geom_iterations = 3;
+		geom_iterations = options.geom_iterations;
 		std::cout << "Scale: " << max_num_downscale << std::endl;
 
 		for (size_t i = 0; i < num_images; ++i) {
@@ -983,16 +1146,16 @@ int main(int argc, char** argv)
 			geom_consistency = false;
 			prior_consistency = false;
 			for (size_t i = 0; i < num_images; ++i) {
-				ProcessProblem(dense_folder, problems, i, geom_consistency, prior_consistency, hierarchy, mand_consistency, max_num_downscale);
+				ProcessProblem(dense_folder, problems, i, options, geom_consistency, prior_consistency, hierarchy, mand_consistency, max_num_downscale);
 			}
 			prior_consistency = true;
 			geom_consistency = false;
 			for (int hpm_scale = max_hpm_scale; hpm_scale >= max_num_downscale; hpm_scale--) {
-				ConfidenceEvaluation(dense_folder, problems, geom_consistency);
+				ConfidenceEvaluation(dense_folder, problems, geom_consistency, options);
 				for (size_t i = 0; i < num_images; ++i) {
 					std::cout << "HPM Scale: " << hpm_scale << std::endl;
 					int hpm_scale_distance = hpm_scale - problems[i].num_downscale - 1;
-					ProcessProblem(dense_folder, problems, i, geom_consistency, prior_consistency, hierarchy, mand_consistency, max_num_downscale, multi_geometry, hpm_scale_distance);
+					ProcessProblem(dense_folder, problems, i, options, geom_consistency, prior_consistency, hierarchy, mand_consistency, max_num_downscale, multi_geometry, hpm_scale_distance);
 				}
 			}
 
@@ -1008,7 +1171,7 @@ int main(int argc, char** argv)
 
 				if (geom_iter > 0) {
 					mand_consistency = true;
-					ConfidenceEvaluation(dense_folder, problems, geom_consistency);
+					ConfidenceEvaluation(dense_folder, problems, geom_consistency, options);
 					geom_consistency = true;
 				}
 				else {
@@ -1017,13 +1180,13 @@ int main(int argc, char** argv)
 				}
 
 				for (size_t i = 0; i < num_images; ++i) {
-					ProcessProblem(dense_folder, problems, i, geom_consistency, prior_consistency, hierarchy, mand_consistency, max_num_downscale, multi_geometry);
+					ProcessProblem(dense_folder, problems, i, options, geom_consistency, prior_consistency, hierarchy, mand_consistency, max_num_downscale, multi_geometry);
 				}
 			}
 		}
 		else {
 			for (size_t i = 0; i < num_images; ++i) {
-				JointBilateralUpsampling(dense_folder, problems[i], problems[i].cur_image_size);
+				JointBilateralUpsampling(dense_folder, problems[i], problems[i].cur_image_size, max_num_downscale, options);
 			}
 
 			hierarchy = true;
@@ -1031,18 +1194,18 @@ int main(int argc, char** argv)
 			geom_consistency = false;
 			prior_consistency = false;
 			for (size_t i = 0; i < num_images; ++i) {
-				ProcessProblem(dense_folder, problems, i, geom_consistency, prior_consistency, hierarchy, mand_consistency, max_num_downscale);
+				ProcessProblem(dense_folder, problems, i, options, geom_consistency, prior_consistency, hierarchy, mand_consistency, max_num_downscale);
 			}
 			hierarchy = false;
 			prior_consistency = true;
 			geom_consistency = false;
 			multi_geometry = false;
 			for (int hpm_scale = max_hpm_scale; hpm_scale >= max_num_downscale; hpm_scale--) {
-				ConfidenceEvaluation(dense_folder, problems, geom_consistency);
+				ConfidenceEvaluation(dense_folder, problems, geom_consistency, options);
 				for (size_t i = 0; i < num_images; ++i) {
 					std::cout << "HPM Scale: " << hpm_scale << std::endl;
 					int hpm_scale_distance = hpm_scale - problems[i].num_downscale - 1;
-					ProcessProblem(dense_folder, problems, i, geom_consistency, prior_consistency, hierarchy, mand_consistency, max_num_downscale, multi_geometry, hpm_scale_distance);
+					ProcessProblem(dense_folder, problems, i, options, geom_consistency, prior_consistency, hierarchy, mand_consistency, max_num_downscale, multi_geometry, hpm_scale_distance);
 				}
 			}
 
@@ -1058,7 +1221,7 @@ int main(int argc, char** argv)
 
 				if (geom_iter > 0) {
 					mand_consistency = true;
-					ConfidenceEvaluation(dense_folder, problems, geom_consistency);
+					ConfidenceEvaluation(dense_folder, problems, geom_consistency, options);
 					geom_consistency = true;
 				}
 				else {
@@ -1067,19 +1230,36 @@ int main(int argc, char** argv)
 				}
 
 				for (size_t i = 0; i < num_images; ++i) {
-					ProcessProblem(dense_folder, problems, i, geom_consistency, prior_consistency, hierarchy, mand_consistency, max_num_downscale, multi_geometry);
+					ProcessProblem(dense_folder, problems, i, options, geom_consistency, prior_consistency, hierarchy, mand_consistency, max_num_downscale, multi_geometry);
 				}
 			}
 		}
 
+		// The next scale has other buffer sizes; drop what this one pooled
+		BufferArena::Instance().Trim();
 		max_num_downscale--;
+		EvictEdgeTextures(max_num_downscale + 2);
 	}
+	ClearEdgeTextureCache();
 	geom_consistency = true;
 	if (mask_flag) {
-		RunFusion_Sky_Strict(dense_folder, problems, geom_consistency);
+		RunFusion_Sky_Strict(dense_folder, problems, geom_consistency, options);
 	}
 	else {
-		RunFusion(dense_folder, problems, geom_consistency);
+		RunFusion(dense_folder, problems, geom_consistency, options);
+	}
+	ProgressStop();
+	if (!options.stats_path.empty()) {
+		WritePatchMatchStatsJson(options.stats_path);
+	}
+	if (options.memory_report) {
+		PrintMemoryReport();
+		if (!options.memory_report_path.empty()) {
+			WriteMemoryReportJson(options.memory_report_path);
+		}
+	}
+	if (!options.trace_path.empty()) {
+		HPM_TRACE_WRITE(options.trace_path);
 	}
 	return 0;
 }
@@ -26,12 +26,15 @@
 #include <memory>
 #include "iomanip"
 
+#include "Trace.h"
+
 #include <sys/stat.h> // mkdir
 #include <sys/types.h> // mkdir
 
 
 #define MAX_IMAGES 256
 #define JBU_NUM 2
+#define JBU_MAX_CHANNELS 8
 
 struct Camera {
     float K[9];
@@ -51,6 +54,46 @@ struct Problem {
     int cur_image_size = 3200;
 };
 
+enum UpsampleMethod {
+    UPSAMPLE_JBU = 0,
+    UPSAMPLE_GUIDED = 1
+};
+
+// Storage of normals on disk (normals.dmb) or in memory, see NormalCodec.h
+enum NormalEncoding {
+    NORMAL_FLOAT = 0,
+    NORMAL_OCT16 = 1,
+    NORMAL_OCT8 = 2
+};
+
+// Command line options that apply to the whole run
+struct PipelineOptions {
+    UpsampleMethod depth_upsample = UPSAMPLE_JBU;     // depths and normals between scales
+    UpsampleMethod prior_upsample = UPSAMPLE_JBU;     // planar prior depths and normals
+    UpsampleMethod hierarchy_upsample = UPSAMPLE_JBU; // normals not already at full resolution
+    bool compare_upsample = false;
+    int upsample_tile_rows = 1024; // JBU output rows per band, 0 for the whole image
+    NormalEncoding normal_dmb = NORMAL_FLOAT;     // encoding of written normals.dmb files
+    NormalEncoding normal_storage = NORMAL_FLOAT; // normals held by fusion and confidence evaluation; oct8 keeps 1/6 of the float size
+    bool bench_image_layout = false; // time host NCC over image layouts and exit
+    std::string trace_path; // Chrome trace JSON, empty to disable; needs HPM_ENABLE_TRACE
+    std::string stats_path; // PatchMatch counters JSON, empty to disable
+    bool memory_report = false; // print per-subsystem memory use at exit
+    std::string memory_report_path; // optional JSON copy of the memory report
+    std::string status_path; // periodically rewritten JSON progress status, empty to disable
+    float status_interval = 5.0f; // seconds between status rewrites
+    int metrics_port = 0; // Prometheus text metrics on 127.0.0.1, 0 to disable
+    // Quality/speed settings; the defaults are the published configuration
+    int patch_size = 11;
+    int radius_increment = 2;
+    int top_k = 4;
+    int patchmatch_iterations = 3; // red/black sweep pairs per PatchMatch pass
+    int geom_iterations = 3;       // geometric passes per scale
+    int max_image_size = 3200;     // images are downscaled to this size first
+    int scale_size_bound = 1000;   // the coarsest scale is halved until below this
+    bool cost_cache = false;       // keep each pixel's per-view costs in fp16 between sweeps
+};
+
 struct Triangle {
     cv::Point pt1, pt2, pt3;
     Triangle (const cv::Point _pt1, const cv::Point _pt2, const cv::Point _pt3) : pt1(_pt1) , pt2(_pt2), pt3(_pt3) {}